@@ -3,6 +3,9 @@
 #include "cybozu/option.hpp"
 #include "cybozu/exception.hpp"
 #include "util.hpp"
+#include "numa.hpp"
+#include "huge_page.hpp"
+#include "wait_policy.hpp"
 #include <string>
 #include <cstdlib>
 
@@ -28,6 +31,13 @@ struct CmdLineOption : cybozu::Option
     bool usesZipf;
     double zipfTheta; // theta parameter for zipf distribution.
     bool verbose; // verbose mode.
+    size_t latSample; // 1 in latSample transactions are measured. 0 means off.
+    std::string tsPath; // throughput time-series output file. empty means off.
+    size_t tsIntervalMs; // sampling interval of the time series [ms].
+    std::string tsFormat; // "csv" or "json".
+    std::string numa; // NUMA memory policy. See cybozu::numa::Policy.
+    std::string hugePage; // page backend of records and local sets. See cybozu::hugepage::Mode.
+    std::string waitPolicy; // how lock waiters wait. See cybozu::wait_policy::Policy.
 
     constexpr static const char *NAME = "CmdLineOption";
 
@@ -55,6 +65,15 @@ struct CmdLineOption : cybozu::Option
         appendBoolOpt(&usesZipf, "zipf", ": uses uniform distribution.");
         appendOpt(&zipfTheta, 0.0, "theta", "[double]: 0.0 <= theta < 1.0");
         appendBoolOpt(&verbose, "v", ": puts verbose messages.");
+        appendOpt(&latSample, 0, "lat", "[N]: measure latency of 1 in N transactions in microseconds (0:off (default), 1:all).");
+        appendOpt(&tsPath, "", "ts", "[path]: append throughput time series to the file. empty means off (default).");
+        appendOpt(&tsIntervalMs, 100, "ts-interval", "[ms]: sampling interval of the time series (default: 100).");
+        appendOpt(&tsFormat, "csv", "ts-format", "[csv or json]: time-series format. json puts a line per run (default: csv).");
+        appendOpt(&numa, "none", "numa", "[policy]: NUMA memory policy of records (none(first-touch, default), interleave, local, replicate). "
+                  "local requires partition build. replicate also replicates read-only tables per node.");
+        appendOpt(&hugePage, "off", "hugepage", "[mode]: page backend of records and local sets (off(malloc, default), thp(madvise), hugetlb(MAP_HUGETLB, falls back to thp)).");
+        appendOpt(&waitPolicy, "spin", "wait-policy", "[policy]: how lock waiters wait (spin(default), yield(spin then sched_yield), "
+                  "mcs(queued spin, record mutexes require MCS_WAIT_QUEUE build), park(spin then futex sleep)). Use yield or park with more threads than cores.");
         appendHelp("h", ": put this message.");
     }
     void parse(int argc, char *argv[]) {
@@ -86,6 +105,15 @@ struct CmdLineOption : cybozu::Option
         if (nrTh4LongTx > nrTh) {
             throw cybozu::Exception(NAME) << "nrTh4LongTx must be <= nrTh.";
         }
+        if (tsIntervalMs == 0) {
+            throw cybozu::Exception(NAME) << "tsIntervalMs must not be 0.";
+        }
+        if (tsFormat != "csv" && tsFormat != "json") {
+            throw cybozu::Exception(NAME) << "tsFormat must be csv or json." << tsFormat;
+        }
+        cybozu::numa::parsePolicy(numa);
+        cybozu::hugepage::parseMode(hugePage);
+        cybozu::wait_policy::parsePolicy(waitPolicy);
         if (usesZipf) {
             if (zipfTheta < 0.0 || zipfTheta >= 1.0) {
                 throw cybozu::Exception(NAME) << "zipfTheta must be >= 0.0 and < 1.0";
@@ -95,6 +123,15 @@ struct CmdLineOption : cybozu::Option
     size_t getNrMuPerTh() const {
         return nrMuPerTh > 0 ? nrMuPerTh : (nrMu / nrTh == 0 ? 1 : nrMu / nrTh);
     }
+    cybozu::numa::Policy numaPolicy() const {
+        return cybozu::numa::parsePolicy(numa);
+    }
+    cybozu::hugepage::Mode hugePageMode() const {
+        return cybozu::hugepage::parseMode(hugePage);
+    }
+    cybozu::wait_policy::Policy getWaitPolicy() const {
+        return cybozu::wait_policy::parsePolicy(waitPolicy);
+    }
     size_t getNrMu() const {
         return nrMuPerTh > 0 ? nrMuPerTh * nrTh : nrMu;
     }
@@ -102,9 +139,10 @@ struct CmdLineOption : cybozu::Option
         return cybozu::util::formatString(
             "concurrency:%zu workload:%s nrMutex:%zu nrMuPerTh:%zu "
             "sec:%zu longTxSize:%zu nrTh4LongTx:%zu nrOp:%zu wrRatio:%.3f nrWr4Long:%zu shortTxMode:%u longTxMode:%u payload:%zu "
-            "amode:%s usesZipf:%d zipfTheta:%f"
+            "amode:%s usesZipf:%d zipfTheta:%f lat:%zu numa:%s hugepage:%s waitPolicy:%s"
             , nrTh, workload.c_str(), getNrMu(), getNrMuPerTh()
             , runSec, longTxSize, nrTh4LongTx, nrOp, wrRatio, nrWr4Long, shortTxMode, longTxMode, payload
-            , amode.c_str(), usesZipf, zipfTheta);
+            , amode.c_str(), usesZipf, zipfTheta, latSample, numa.c_str()
+            , hugePage.c_str(), waitPolicy.c_str());
     }
 };
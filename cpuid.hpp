@@ -255,6 +255,22 @@ std::vector<uint> getCpuIdList(CpuAffinityMode amode)
 }
 
 
+/**
+ * NUMA node of each worker, where worker i runs on cpuIdV[i].
+ */
+std::vector<uint> getNumaNodeVec(const std::vector<uint>& cpuIdV, size_t nrTh)
+{
+    std::map<uint, uint> nodeM; // key: cpu id.
+    for (const CpuTopology& t : getCpuTopologies()) nodeM[t.id] = t.node;
+    std::vector<uint> ret(nrTh);
+    for (size_t i = 0; i < nrTh; i++) {
+        if (cpuIdV.empty()) throw std::runtime_error("getNumaNodeVec: no cpu");
+        ret[i] = nodeM[cpuIdV[i % cpuIdV.size()]];
+    }
+    return ret;
+}
+
+
 void setCpuAffinityModeVec(const std::string& amodeStr, std::vector<uint>& cpuId)
 {
     const CpuAffinityMode amode = parseCpuAffinityMode(amodeStr);
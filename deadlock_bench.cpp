@@ -0,0 +1,218 @@
+#include <memory>
+#include "thread_util.hpp"
+#include "random.hpp"
+#include <unistd.h>
+#include "cpuid.hpp"
+#include "measure_util.hpp"
+#include "arch.hpp"
+#include "vector_payload.hpp"
+#include "cache_line_size.hpp"
+#include "deadlock.hpp"
+#include "zipf.hpp"
+#include "workload_util.hpp"
+#include "tx_util.hpp"
+
+
+#ifdef USE_PARTITION
+#include "partitioned.hpp"
+#endif
+
+
+using Mutex = cybozu::deadlock::Mutex;
+using Mode = cybozu::deadlock::Mode;
+
+std::vector<uint> CpuId_;
+
+
+struct Shared
+{
+#ifdef USE_PARTITION
+    PartitionedVectorWithPayload<Mutex> recV;
+#else
+    VectorWithPayload<Mutex> recV;
+#endif
+    size_t nrMu;
+    size_t nrTh;
+    size_t longTxSize;
+    size_t nrOp;
+    double wrRatio;
+    size_t nrWr4Long;
+    TxMode shortTxMode;
+    TxMode longTxMode;
+    bool usesBackOff;
+    size_t nrTh4LongTx;
+    size_t payload;
+    bool usesRMW;
+    bool usesZipf;
+    double zipfTheta;
+    double zipfZetan;
+
+    std::unique_ptr<cybozu::deadlock::Detector> detector;
+    SimpleTxIdGenerator txIdGen; // used to choose victims by age.
+};
+
+Result1 worker2(size_t idx, uint8_t& ready, const bool& start, const bool& quit, bool& shouldQuit, Shared& shared)
+{
+    unused(shouldQuit);
+    cybozu::thread::setThreadAffinity(::pthread_self(), CpuId_[idx]);
+
+    auto& recV = shared.recV;
+#ifdef USE_PARTITION
+    recV.allocate(idx);
+    recV.checkAndWait();
+#endif
+    const size_t longTxSize = shared.longTxSize;
+    const size_t nrOp = shared.nrOp;
+    const size_t wrRatio = size_t(shared.wrRatio * (double)SIZE_MAX);
+    const TxMode shortTxMode = shared.shortTxMode;
+    const TxMode longTxMode = shared.longTxMode;
+
+    Result1 res;
+    cybozu::util::Xoroshiro128Plus rand(::time(0), idx);
+    FastZipf fastZipf(rand, shared.zipfTheta, recV.size(), shared.zipfZetan);
+    cybozu::deadlock::LockSet lockSet;
+    std::vector<uint8_t> value(shared.payload);
+
+    const bool isLongTx = longTxSize != 0 && idx < shared.nrTh4LongTx; // starvation setting.
+    const size_t realNrOp = isLongTx ? longTxSize : nrOp;
+    const size_t realNrWr = isLongTx ? shared.nrWr4Long : size_t(shared.wrRatio * (double)nrOp);
+    auto getMode = selectGetModeFunc<decltype(rand), Mode>(isLongTx, shortTxMode, longTxMode);
+    auto getRecordIdx = selectGetRecordIdx<decltype(rand)>(isLongTx, shortTxMode, longTxMode, shared.usesZipf);
+    lockSet.init(shared.payload, realNrOp, *shared.detector, idx);
+
+    storeRelease(ready, 1);
+    while (!loadAcquire(start)) _mm_pause();
+    size_t count = 0; unused(count);
+    while (!loadAcquire(quit)) {
+        // The txId is kept in retries so that the transaction will not be the youngest forever.
+        lockSet.setTxId(shared.txIdGen.get());
+        size_t firstRecIdx = 0;
+        uint64_t t0 = -1, t1 = -1;
+        res.beginTx();
+        log_timestamp_if_necessary_on_tx_start(t0, shared.usesBackOff);
+        auto randState = rand.getState();
+        for (size_t retry = 0;; retry++) {
+            if (unlikely(load_acquire(quit))) break; // to quit under starvation.
+            assert(lockSet.empty());
+            rand.setState(randState);
+            log_timestamp_if_necessary_on_trial_start(t0, t1, retry, shared.usesBackOff);
+            for (size_t i = 0; i < realNrOp; i++) {
+                size_t key = getRecordIdx(rand, fastZipf, recV.size(), realNrOp, i, firstRecIdx);
+                Mode mode = getMode(rand, realNrOp, realNrWr, wrRatio, i);
+
+                auto& item = recV[key];
+                Mutex& mutex = item.value;
+
+                if (mode == Mode::S) {
+                    if (unlikely(!lockSet.read(mutex, item.payload, &value[0]))) goto abort;
+                } else {
+                    assert(mode == Mode::X);
+                    if (shared.usesRMW) {
+                        if (unlikely(!lockSet.readForUpdate(mutex, item.payload, &value[0]))) goto abort;
+                        if (unlikely(!lockSet.write(mutex, item.payload, &value[0]))) goto abort;
+                    } else {
+                        if (unlikely(!lockSet.write(mutex, item.payload, &value[0]))) goto abort;
+                    }
+                }
+            }
+            if (unlikely(!lockSet.blindWriteLockAll())) goto abort;
+            lockSet.updateAndUnlock();
+            res.incCommit(isLongTx);
+            res.addRetryCount(isLongTx, retry);
+            break; // retry is not required.
+
+          abort:
+            lockSet.unlock();
+            res.incAbort(isLongTx);
+            if (shared.usesBackOff) backOff(t0, retry, rand);
+            // continue
+        }
+    }
+    return res;
+}
+
+
+struct CmdLineOptionPlus : CmdLineOption
+{
+    using base = CmdLineOption;
+
+    int usesBackOff; // 0 or 1.
+    int usesRMW; // 0 or 1.
+    int victim;
+    size_t detectUs;
+
+    CmdLineOptionPlus(const std::string& description) : CmdLineOption(description) {
+        appendOpt(&usesBackOff, 0, "backoff", "[0 or 1]: backoff 0:off 1:on");
+        appendOpt(&usesRMW, 1, "rmw", "[0 or 1]: use read-modify-write or normal write 0:w 1:rmw (default: 1)");
+        appendOpt(&victim, 0, "victim", "[id]: victim selection (0:youngest(default), 1:least work)");
+        appendOpt(&detectUs, 100, "detect-us", "[usec]: deadlock detection interval (default:100).");
+    }
+    std::string str() const {
+        return cybozu::util::formatString(
+            "mode:deadlock %s backoff:%d rmw:%d victim:%s detectUs:%zu"
+            , base::str().c_str(), usesBackOff ? 1 : 0, usesRMW ? 1 : 0
+            , victim == cybozu::deadlock::LEAST_WORK ? "least-work" : "youngest"
+            , detectUs);
+    }
+};
+
+
+void initShared(Shared& shared, const CmdLineOptionPlus& opt)
+{
+    initRecordVector(shared.recV, opt);
+    shared.longTxSize = opt.longTxSize;
+    shared.nrOp = opt.nrOp;
+    shared.wrRatio = opt.wrRatio;
+    shared.nrWr4Long = opt.nrWr4Long;
+    shared.shortTxMode = TxMode(opt.shortTxMode);
+    shared.longTxMode = TxMode(opt.longTxMode);
+    shared.usesBackOff = opt.usesBackOff ? 1 : 0;
+    shared.nrTh4LongTx = opt.nrTh4LongTx;
+    shared.payload = opt.payload;
+    shared.usesRMW = opt.usesRMW != 0;
+    shared.nrMu = opt.getNrMu();
+    shared.nrTh = opt.nrTh;
+    shared.usesZipf = opt.usesZipf;
+    shared.zipfTheta = opt.zipfTheta;
+    if (shared.usesZipf) {
+        shared.zipfZetan = FastZipf::zeta(opt.getNrMu(), shared.zipfTheta);
+    } else {
+        shared.zipfZetan = 1.0;
+    }
+}
+
+
+int main(int argc, char *argv[]) try
+{
+    CmdLineOptionPlus opt("deadlock_bench: benchmark with blocking 2PL and deadlock detection.");
+    opt.parse(argc, argv);
+    setCpuAffinityModeVec(opt.amode, CpuId_);
+
+#ifdef NO_PAYLOAD
+    if (opt.payload != 0) throw cybozu::Exception("payload not supported");
+#endif
+    if (opt.victim != cybozu::deadlock::YOUNGEST && opt.victim != cybozu::deadlock::LEAST_WORK) {
+        throw cybozu::Exception("bad victim") << opt.victim;
+    }
+
+    if (opt.workload == "custom") {
+        Shared shared;
+        initShared(shared, opt);
+        for (size_t i = 0; i < opt.nrLoop; i++) {
+            shared.detector.reset(new cybozu::deadlock::Detector(
+                opt.nrTh, cybozu::deadlock::VictimPolicy(opt.victim), opt.detectUs));
+            shared.detector->start();
+            Result1 res;
+            runExec(opt, shared, worker2, res);
+            shared.detector->stop();
+            ::printf("deadlock victims:%zu\n", shared.detector->nrVictims());
+            ::fflush(::stdout);
+        }
+    } else {
+        throw cybozu::Exception("bad workload.") << opt.workload;
+    }
+} catch (std::exception& e) {
+    ::fprintf(::stderr, "exeption: %s\n", e.what());
+} catch (...) {
+    ::fprintf(::stderr, "unknown error\n");
+}
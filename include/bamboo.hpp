@@ -0,0 +1,379 @@
+#pragma once
+/**
+ * Bamboo-style early lock retirement for hot records.
+ *
+ * Accesses to a hot record are ordered in its retire chain instead of its lock.
+ * A transaction appends itself to the chain, accesses the record exclusively,
+ * and retires after its last write by publishing the dirty value to the record.
+ * Later transactions in the chain access the dirty value, so they depend on
+ * the earlier ones and can commit only at the head of the chain.
+ * If a transaction aborts, the later ones in the chain abort in a cascade
+ * and the record value is restored.
+ *
+ * A chain is sorted by TxId so that the commit dependencies never make a cycle.
+ * An older transaction wounds the younger ones in the chain to append itself.
+ *
+ * Reads of a hot record retire immediately.
+ * Limitation: a transaction can write a hot record after it retires
+ * only if no one has appended itself to the chain since then.
+ */
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <cstring>
+#include "lock.hpp"
+#include "flat_index.hpp"
+#include "vector_payload.hpp"
+#include "tx_util.hpp"
+#include "inline.hpp"
+#include "arch.hpp"
+#include "atomic_wrapper.hpp"
+
+
+namespace cybozu {
+namespace bamboo {
+
+
+/**
+ * A transaction in retire chains.
+ * Smaller txId means older.
+ */
+struct Tx
+{
+    uint64_t txId;
+    WoundFlag* flag;
+};
+
+
+class RetireChain
+{
+public:
+    enum Result : uint8_t { ACQUIRED = 0, BUSY = 1, WOUNDED = 2 };
+
+private:
+    using Spinlock = cybozu::lock::TtasSpinlockT<false>;
+
+    enum State : uint8_t { OWNER = 0, RETIRED = 1, COMMITTING = 2 };
+    struct Entry {
+        Tx* tx;
+        State state;
+    };
+
+    alignas(CACHE_LINE_SIZE)
+    Spinlock::Mutex latch_;
+    Tx* head_; // tx of the head entry or nullptr. This can be read without the latch.
+    std::vector<Entry> entries_; // The head commits first.
+    std::vector<uint8_t> before_; // before-images of the entries.
+    void *sharedVal_;
+    size_t valueSize_;
+
+public:
+    RetireChain(void *sharedVal, size_t valueSize)
+        : latch_(), head_(nullptr), entries_(), before_()
+        , sharedVal_(sharedVal), valueSize_(valueSize) {
+    }
+    /**
+     * Append tx at the tail and copy the record value to dst.
+     * The younger transactions in the chain are wounded.
+     * Returns BUSY if the tail is older and has not retired yet.
+     */
+    INLINE Result tryAcquire(Tx& tx, void *dst) {
+        Spinlock lk(&latch_);
+        if (unlikely(tx.flag->is_wounded())) return WOUNDED;
+        size_t i = entries_.size();
+        while (i > 0 && entries_[i - 1].tx->txId > tx.txId && entries_[i - 1].state != COMMITTING) i--;
+        if (unlikely(i < entries_.size())) cascade(i);
+        if (!entries_.empty() && entries_.back().state == OWNER) return BUSY;
+
+        entries_.push_back(Entry{&tx, OWNER});
+        before_.resize(entries_.size() * valueSize_);
+        copyValue(&before_[(entries_.size() - 1) * valueSize_], sharedVal_);
+        copyValue(dst, sharedVal_);
+        if (entries_.size() == 1) store_release(head_, &tx);
+        return ACQUIRED;
+    }
+    /**
+     * Publish the dirty value if src is not null, and retire.
+     * Returns false if tx has been removed from the chain by a cascading abort.
+     */
+    INLINE bool retire(Tx& tx, const void *src) {
+        Spinlock lk(&latch_);
+        if (entries_.empty() || entries_.back().tx != &tx) return false;
+        assert(entries_.back().state == OWNER);
+        if (src != nullptr) copyValue(sharedVal_, src);
+        entries_.back().state = RETIRED;
+        return true;
+    }
+    /**
+     * Become the owner again to write the record after retirement.
+     * Returns false if tx is not the tail.
+     */
+    INLINE bool tryReacquire(Tx& tx) {
+        Spinlock lk(&latch_);
+        if (entries_.empty() || entries_.back().tx != &tx) return false;
+        assert(entries_.back().state == RETIRED);
+        entries_.back().state = OWNER;
+        return true;
+    }
+    /**
+     * Wait for all the earlier transactions in the chain to commit.
+     * Returns false if tx is wounded.
+     */
+    INLINE bool waitForHead(const Tx& tx) const {
+        while (load_acquire(head_) != &tx) {
+            if (unlikely(tx.flag->is_wounded())) return false;
+            _mm_pause();
+        }
+        return true;
+    }
+    /**
+     * Call this after tx is at the head of all its chains.
+     * A committing entry is never wounded.
+     */
+    INLINE bool tryMarkCommitting(Tx& tx) {
+        Spinlock lk(&latch_);
+        if (entries_.empty() || entries_[0].tx != &tx) return false;
+        assert(entries_[0].state == RETIRED);
+        entries_[0].state = COMMITTING;
+        return true;
+    }
+    INLINE void commit(Tx& tx) {
+        Spinlock lk(&latch_);
+        assert(!entries_.empty());
+        assert(entries_[0].tx == &tx); unused(tx);
+        assert(entries_[0].state == COMMITTING);
+        entries_.erase(entries_.begin());
+        before_.erase(before_.begin(), before_.begin() + valueSize_);
+        store_release(head_, entries_.empty() ? nullptr : entries_[0].tx);
+    }
+    /**
+     * Remove tx and the later transactions from the chain.
+     * It does nothing if tx has already been removed by a cascading abort.
+     */
+    INLINE void abort(Tx& tx) {
+        Spinlock lk(&latch_);
+        for (size_t i = 0; i < entries_.size(); i++) {
+            if (entries_[i].tx == &tx) {
+                cascade(i, false);
+                return;
+            }
+        }
+    }
+
+private:
+    /**
+     * Restore the record value and remove the i-th and later entries.
+     * The removed transactions are wounded except the i-th one if woundsFirst is false.
+     */
+    INLINE void cascade(size_t i, bool woundsFirst = true) {
+        assert(i < entries_.size());
+        copyValue(sharedVal_, &before_[i * valueSize_]);
+        for (size_t j = woundsFirst ? i : i + 1; j < entries_.size(); j++) {
+            entries_[j].tx->flag->wound();
+        }
+        entries_.resize(i);
+        before_.resize(i * valueSize_);
+        if (i == 0) store_release(head_, nullptr);
+    }
+    INLINE void copyValue(void *dst, const void *src) const {
+#ifndef NO_PAYLOAD
+        ::memcpy(dst, src, valueSize_);
+#else
+        unused(dst); unused(src);
+#endif
+    }
+};
+
+
+/**
+ * Hot records and their retire chains.
+ * This is read-only while workers are running.
+ */
+class RetireTable
+{
+    std::vector<std::unique_ptr<RetireChain> > chainV_;
+    cybozu::FlatIndexT<RetireChain*> index_; // key: mutex address.
+    std::once_flag once_;
+
+public:
+    /**
+     * Make the first nr records hot.
+     * Workers may call this concurrently after their records are allocated.
+     */
+    template <typename RecV>
+    void initOnce(RecV& recV, size_t nr, size_t valueSize) {
+        std::call_once(once_, [&]() {
+            for (size_t i = 0; i < std::min<size_t>(nr, recV.size()); i++) {
+                auto& item = recV[i];
+                chainV_.emplace_back(new RetireChain(item.payload, valueSize));
+                index_[uintptr_t(&item.value)] = chainV_.back().get();
+            }
+        });
+    }
+    size_t size() const { return chainV_.size(); }
+    INLINE RetireChain* find(const void *mutex) const {
+        auto it = index_.find(uintptr_t(mutex));
+        return it == index_.end() ? nullptr : it->second;
+    }
+};
+
+
+/**
+ * Accesses to hot records of a transaction.
+ * Lock sets forward the accesses to this if the record is hot.
+ */
+class RetireSet
+{
+    struct Entry {
+        RetireChain *chain;
+        size_t localValIdx;
+        bool retired;
+    };
+
+    RetireTable *table_;
+    Tx tx_;
+    bool canWait_; // true: wait for an older owner. false: abort.
+    std::vector<Entry> entries_;
+    MemoryVector local_;
+    size_t valueSize_;
+
+public:
+    RetireSet() : table_(nullptr), tx_(), canWait_(false), entries_(), local_(), valueSize_(0) {
+    }
+    void init(RetireTable& table, WoundFlag& flag, size_t valueSize, bool canWait) {
+        table_ = &table;
+        tx_.txId = 0;
+        tx_.flag = &flag;
+        canWait_ = canWait;
+        valueSize_ = valueSize;
+        local_.setSizes(valueSize == 0 ? 1 : valueSize);
+    }
+    bool enabled() const { return table_ != nullptr; }
+    /**
+     * Call this before a transaction starts.
+     * The txId must be kept in retries to avoid starvation.
+     */
+    void setTxId(uint64_t txId) { tx_.txId = txId; }
+
+    /**
+     * Returns nullptr if the record is not hot.
+     */
+    INLINE RetireChain* find(const void *mutex) const { return table_->find(mutex); }
+
+    INLINE bool read(RetireChain& chain, void *dst) {
+        Entry *ent = findEntry(chain);
+        if (ent != nullptr) {
+            copyValue(dst, getLocalValPtr(*ent)); // read local data.
+            return true;
+        }
+        ent = acquire(chain);
+        if (unlikely(ent == nullptr)) return false;
+        if (unlikely(!chain.retire(tx_, nullptr))) return false;
+        ent->retired = true;
+        copyValue(dst, getLocalValPtr(*ent));
+        return true;
+    }
+    INLINE bool readForUpdate(RetireChain& chain, void *dst) {
+        Entry *ent = findEntry(chain);
+        if (ent == nullptr) {
+            ent = acquire(chain);
+            if (unlikely(ent == nullptr)) return false;
+        } else if (unlikely(ent->retired)) {
+            if (!chain.tryReacquire(tx_)) return false;
+            ent->retired = false;
+        }
+        copyValue(dst, getLocalValPtr(*ent)); // read local data.
+        return true;
+    }
+    /**
+     * The write is regarded as the last one to the record so the lock retires.
+     */
+    INLINE bool write(RetireChain& chain, const void *src) {
+        Entry *ent = findEntry(chain);
+        if (ent == nullptr) {
+            ent = acquire(chain); // blind write.
+            if (unlikely(ent == nullptr)) return false;
+        } else if (unlikely(ent->retired)) {
+            if (!chain.tryReacquire(tx_)) return false;
+            ent->retired = false;
+        }
+        copyValue(getLocalValPtr(*ent), src); // write local data.
+        if (unlikely(!chain.retire(tx_, src))) return false;
+        ent->retired = true;
+        return true;
+    }
+    /**
+     * Wait for the earlier transactions in all the chains to commit.
+     * Returns false if the transaction must abort.
+     */
+    INLINE bool preCommit() {
+        for (Entry& ent : entries_) {
+            if (ent.retired) continue;
+            if (unlikely(!ent.chain->retire(tx_, nullptr))) return false;
+            ent.retired = true;
+        }
+        for (Entry& ent : entries_) {
+            if (unlikely(!ent.chain->waitForHead(tx_))) return false;
+        }
+        for (Entry& ent : entries_) {
+            if (unlikely(!ent.chain->tryMarkCommitting(tx_))) return false;
+        }
+        return true;
+    }
+    INLINE void commit() {
+        for (Entry& ent : entries_) ent.chain->commit(tx_);
+        clear();
+    }
+    INLINE void abort() {
+        for (Entry& ent : entries_) ent.chain->abort(tx_);
+        clear();
+    }
+    bool empty() const { return entries_.empty(); }
+
+private:
+    INLINE Entry* findEntry(const RetireChain& chain) {
+        for (Entry& ent : entries_) {
+            if (ent.chain == &chain) return &ent;
+        }
+        return nullptr;
+    }
+    INLINE Entry* acquire(RetireChain& chain) {
+        const size_t idx = local_.size();
+#ifndef NO_PAYLOAD
+        local_.resize(idx + 1);
+#endif
+        for (;;) {
+            const RetireChain::Result res = chain.tryAcquire(tx_, getLocalValPtr(idx));
+            if (likely(res == RetireChain::ACQUIRED)) break;
+            if (res == RetireChain::WOUNDED || !canWait_) return nullptr;
+            // The older owner will retire soon.
+            _mm_pause();
+        }
+        entries_.push_back(Entry{&chain, idx, false});
+        return &entries_.back();
+    }
+    INLINE void clear() {
+        entries_.clear();
+        local_.clear();
+    }
+    void* getLocalValPtr(size_t idx) {
+#ifdef NO_PAYLOAD
+        unused(idx);
+        return nullptr;
+#else
+        return &local_[idx];
+#endif
+    }
+    void* getLocalValPtr(const Entry& ent) { return getLocalValPtr(ent.localValIdx); }
+    void copyValue(void *dst, const void *src) {
+#ifndef NO_PAYLOAD
+        ::memcpy(dst, src, valueSize_);
+#else
+        unused(dst); unused(src);
+#endif
+    }
+};
+
+
+}} // namespace cybozu::bamboo
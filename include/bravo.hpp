@@ -0,0 +1,302 @@
+#pragma once
+/**
+ * @file
+ * @brief BRAVO: biased locking for reader-writer locks (Dice and Kogan, ATC 2019).
+ *
+ * Readers publish the mutex address into a slot of the global visible readers table
+ * instead of changing the reader count of the mutex, while the mutex is read-biased.
+ * Writers revoke the bias and wait for (or give up by) the published readers.
+ * The bias is inhibited for a while proportional to the revocation cost.
+ */
+#include <cassert>
+#include "lock.hpp"
+#include "time.hpp"
+#include "atomic_wrapper.hpp"
+#include "inline.hpp"
+#include "wait_policy.hpp"
+
+
+namespace cybozu {
+namespace lock {
+
+
+namespace bravo_local {
+
+constexpr size_t NR_SLOTS = 4096;
+
+/**
+ * Visible readers table shared by all the BravoMutex objects.
+ */
+alignas(CACHE_LINE_SIZE)
+inline const void* slots_[NR_SLOTS];
+
+inline uint32_t nrThreads_ = 0;
+inline thread_local uint32_t threadId_ = UINT32_MAX;
+
+INLINE const void** getSlot(const void* mutex)
+{
+    if (unlikely(threadId_ == UINT32_MAX)) threadId_ = fetch_add(nrThreads_, 1);
+    const uint64_t h = (uint64_t(uintptr_t(mutex)) ^ (uint64_t(threadId_) << 32)) * 0x9e3779b97f4a7c15ULL;
+    return &slots_[h >> 52];
+}
+
+static_assert(NR_SLOTS == 1 << 12);
+
+} // namespace bravo_local
+
+
+class BravoMutex
+{
+public:
+    using Mode = XSMutex::Mode;
+    using Slot = const void*;
+    /**
+     * The bias is inhibited for the revocation time multiplied by this.
+     */
+    static constexpr uint64_t INHIBIT_MULTIPLIER = 9;
+private:
+    enum : uint32_t {
+        UNBIASED = 0, // no reader is published.
+        BIASED = 1, // readers may take the fast path.
+        REVOKING = 2, // readers take the slow path but published ones may remain.
+    };
+    XSMutex mutex_; // underlying lock for the slow path and writers.
+    uint32_t rbias_;
+    uint64_t inhibitUntil_; // the bias is not re-enabled until this tsc.
+public:
+    INLINE BravoMutex() : mutex_(), rbias_(UNBIASED), inhibitUntil_(0) {} // The first slow reader enables the bias.
+
+    /**
+     * slot: set the published slot, or nullptr if the read lock is on the slow path.
+     * Returns false if the read lock can not be acquired.
+     */
+    INLINE bool read_trylock(Slot*& slot) {
+        slot = tryFastRead();
+        if (likely(slot != nullptr)) return true;
+        if (unlikely(!mutex_.read_trylock())) return false;
+        mayEnableBias();
+        return true;
+    }
+    INLINE void read_lock(Slot*& slot) {
+        slot = tryFastRead();
+        if (likely(slot != nullptr)) return;
+        mutex_.read_lock();
+        mayEnableBias();
+    }
+    INLINE void read_unlock(Slot* slot) noexcept {
+        if (slot != nullptr) {
+            assert(load(*slot) == this);
+            store_release(*slot, Slot(nullptr));
+        } else {
+            mutex_.read_unlock();
+        }
+    }
+    /**
+     * Returns false without waiting if published readers exist.
+     */
+    INLINE bool write_trylock() {
+        if (unlikely(!mutex_.write_trylock())) return false;
+        if (likely(load(rbias_) == UNBIASED)) return true;
+        if (likely(revoke(nullptr, false))) return true;
+        mutex_.write_unlock();
+        return false;
+    }
+    INLINE void write_lock() {
+        mutex_.write_lock();
+        if (unlikely(load(rbias_) != UNBIASED)) revoke(nullptr, true);
+    }
+    INLINE void write_unlock() noexcept {
+        mutex_.write_unlock();
+    }
+    /**
+     * S --> X.
+     * slot: that of the read lock. It is kept if this fails.
+     */
+    INLINE bool tryUpgrade(Slot* slot) {
+        if (slot != nullptr) {
+            if (unlikely(!mutex_.write_trylock())) return false;
+            if (unlikely(!revoke(slot, false))) {
+                mutex_.write_unlock();
+                return false;
+            }
+            store_release(*slot, Slot(nullptr));
+            return true;
+        }
+        if (unlikely(!mutex_.tryUpgrade())) return false;
+        if (likely(load(rbias_) == UNBIASED) || likely(revoke(nullptr, false))) return true;
+        mutex_.downgrade();
+        return false;
+    }
+    INLINE bool isBiased() const { return load(rbias_) == BIASED; }
+    std::string str() const {
+        return cybozu::util::formatString("BravoMutex(%s rbias:%u)", mutex_.str().c_str(), load(rbias_));
+    }
+
+private:
+    INLINE Slot* tryFastRead() {
+        if (load(rbias_) != BIASED) return nullptr;
+        Slot* slot = bravo_local::getSlot(this);
+        Slot expected = nullptr;
+        // The full fence pairs with the one in revoke().
+        if (!compare_exchange(*slot, expected, this, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return nullptr;
+        if (likely(load(rbias_, __ATOMIC_SEQ_CST) == BIASED)) return slot;
+        store_release(*slot, Slot(nullptr));
+        return nullptr;
+    }
+    /**
+     * Call this with the read lock of the underlying mutex,
+     * which excludes writers revoking the bias.
+     */
+    INLINE void mayEnableBias() {
+        if (likely(load(rbias_) != UNBIASED)) return;
+        if (cybozu::time::rdtscp() < load(inhibitUntil_)) return;
+        store(rbias_, BIASED);
+    }
+    /**
+     * Call this with the write lock of the underlying mutex.
+     * own: the slot of the caller itself to skip, or nullptr.
+     * wait: wait for the published readers, or give up.
+     * If this fails, the state is left REVOKING,
+     * so new readers take the slow path and the next writer scans again.
+     */
+    INLINE bool revoke(Slot* own, bool wait) {
+        store(rbias_, REVOKING);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        const uint64_t t0 = cybozu::time::rdtscp();
+        bool ret = true;
+        for (Slot& slot : bravo_local::slots_) {
+            if (&slot == own || load(slot) != this) continue;
+            if (!wait) {
+                ret = false;
+                break;
+            }
+            cybozu::wait_policy::waitUntil(nullptr, [&]() { return load(slot) != this; });
+        }
+        const uint64_t t1 = cybozu::time::rdtscp();
+        store(inhibitUntil_, t1 + (t1 - t0) * INHIBIT_MULTIPLIER);
+        if (!ret) return false;
+        acquire_fence(); // the published readers have gone.
+        store(rbias_, UNBIASED);
+        return true;
+    }
+};
+
+
+/**
+ * The same interface as XSLock.
+ */
+class BravoLock
+{
+public:
+    using Mutex = BravoMutex;
+    using Mode = Mutex::Mode;
+private:
+    Mutex *mutex_;
+    Mode mode_;
+    Mutex::Slot *slot_; // published slot for the fast read path, or nullptr.
+public:
+    INLINE BravoLock() : mutex_(nullptr), mode_(Mode::Invalid), slot_(nullptr) {}
+    INLINE BravoLock(Mutex& mutex, Mode mode) : BravoLock() {
+        lock(mutex, mode);
+    }
+    INLINE ~BravoLock() noexcept { unlock(); }
+
+    BravoLock(const BravoLock&) = delete;
+    BravoLock& operator=(const BravoLock&) = delete;
+    INLINE BravoLock(BravoLock&& rhs) noexcept : BravoLock() { swap(rhs); }
+    INLINE BravoLock& operator=(BravoLock&& rhs) noexcept { swap(rhs); return *this; }
+
+    INLINE void lock(Mutex& mutex, Mode mode) {
+        if (mode == Mode::X) {
+            write_lock(mutex);
+        } else {
+            assert(mode == Mode::S);
+            read_lock(mutex);
+        }
+    }
+    INLINE void write_lock(Mutex& mutex) {
+        assert(!mutex_); assert(mode_ == Mode::Invalid);
+        mutex.write_lock();
+        reset(&mutex, Mode::X);
+    }
+    INLINE void read_lock(Mutex& mutex) {
+        assert(!mutex_); assert(mode_ == Mode::Invalid);
+        mutex.read_lock(slot_);
+        reset(&mutex, Mode::S);
+    }
+    INLINE bool tryLock(Mutex& mutex, Mode mode) {
+        if (mode == Mode::X) return write_trylock(mutex);
+        assert(mode == Mode::S);
+        return read_trylock(mutex);
+    }
+    INLINE bool write_trylock(Mutex& mutex) {
+        assert(!mutex_); assert(mode_ == Mode::Invalid);
+        if (unlikely(!mutex.write_trylock())) return false;
+        reset(&mutex, Mode::X);
+        return true;
+    }
+    INLINE bool read_trylock(Mutex& mutex) {
+        assert(!mutex_); assert(mode_ == Mode::Invalid);
+        if (unlikely(!mutex.read_trylock(slot_))) return false;
+        reset(&mutex, Mode::S);
+        return true;
+    }
+
+    INLINE bool isShared() const { return mode_ == Mode::S; }
+    INLINE bool isFastPath() const { return slot_ != nullptr; }
+
+    INLINE bool tryUpgrade() {
+        assert(mutex_); assert(mode_ == Mode::S);
+        if (unlikely(!mutex_->tryUpgrade(slot_))) return false;
+        mode_ = Mode::X;
+        slot_ = nullptr;
+        return true;
+    }
+    INLINE void unlock() noexcept {
+        if (likely(mode_ == Mode::Invalid)) {
+            mutex_ = nullptr;
+            return;
+        }
+        assert(mutex_);
+        if (mode_ == Mode::X) {
+            write_unlock();
+        } else {
+            read_unlock();
+        }
+    }
+    INLINE void write_unlock() noexcept {
+        assert(mutex_); assert(mode_ == Mode::X);
+        mutex_->write_unlock();
+        reset();
+    }
+    INLINE void read_unlock() noexcept {
+        assert(mutex_); assert(mode_ == Mode::S);
+        mutex_->read_unlock(slot_);
+        reset();
+    }
+
+    INLINE const Mutex* mutex() const { return mutex_; }
+    INLINE Mutex* mutex() { return mutex_; }
+    INLINE uintptr_t getMutexId() const { return uintptr_t(mutex_); }
+    INLINE Mode mode() const { return mode_; }
+
+    /*
+     * This is used for dummy object to comparison.
+     */
+    INLINE void setMutex(Mutex *mutex) { mutex_ = mutex; }
+
+private:
+    INLINE void reset(Mutex* mutexp = nullptr, Mode mode = Mode::Invalid) {
+        mutex_ = mutexp;
+        mode_ = mode;
+        if (mode != Mode::S) slot_ = nullptr;
+    }
+    INLINE void swap(BravoLock& rhs) noexcept {
+        std::swap(mutex_, rhs.mutex_);
+        std::swap(mode_, rhs.mode_);
+        std::swap(slot_, rhs.slot_);
+    }
+};
+
+
+}} //namespace cybozu::lock
@@ -0,0 +1,589 @@
+#pragma once
+/**
+ * Blocking 2PL with deadlock detection.
+ *
+ * A transaction waits for conflicting locks instead of aborting preventively.
+ * While waiting, a worker publishes the mutex it waits for in its slot.
+ * A detector thread builds the waits-for graph from the slots and the holder lists
+ * of the mutexes, and aborts a victim in each cycle found.
+ * Victims are chosen by age (the youngest) or by work done (the fewest locks).
+ */
+#include <vector>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include "lock.hpp"
+#include "write_set.hpp"
+#include "vector_payload.hpp"
+#include "flat_index.hpp"
+#include "tx_util.hpp"
+#include "sleep.hpp"
+#include "arch.hpp"
+#include "atomic_wrapper.hpp"
+#include "cache_line_size.hpp"
+#include "inline.hpp"
+#include "wait_policy.hpp"
+
+
+namespace cybozu {
+namespace deadlock {
+
+
+using Mode = cybozu::lock::XSMutex::Mode;
+
+
+/**
+ * An entry of the holder list of a mutex.
+ */
+struct Holder
+{
+    Holder *prev;
+    Holder *next;
+    uint32_t workerId;
+
+    Holder() : prev(nullptr), next(nullptr), workerId(0) {}
+};
+
+
+/**
+ * Reader-writer mutex with its holder list.
+ * The list is protected by the latch and read by the detector.
+ */
+struct Mutex
+{
+    using Latch = cybozu::lock::TtasSpinlockT<false>;
+
+    Latch::Mutex latch;
+    Mode mode; // mode of the holders. Invalid means free.
+    Holder *head;
+
+    Mutex() : latch(), mode(Mode::Invalid), head(nullptr) {}
+
+    INLINE bool tryLock(Holder& h, Mode m) {
+        if (!mayLock(m)) return false; // without the latch.
+        Latch lk(&latch);
+        if (!canLock(mode, m)) return false;
+        h.prev = nullptr;
+        h.next = head;
+        if (head != nullptr) head->prev = &h;
+        head = &h;
+        mode = m;
+        return true;
+    }
+    /**
+     * S --> X. Succeeds if h is the only holder.
+     */
+    INLINE bool tryUpgrade(Holder& h) {
+        if (load(head) != &h || load(h.next) != nullptr) return false; // without the latch.
+        Latch lk(&latch);
+        assert(mode == Mode::S);
+        if (head != &h || h.next != nullptr) return false;
+        mode = Mode::X;
+        return true;
+    }
+    INLINE void unlock(Holder& h) noexcept {
+        Latch lk(&latch);
+        if (h.prev != nullptr) h.prev->next = h.next; else head = h.next;
+        if (h.next != nullptr) h.next->prev = h.prev;
+        if (head == nullptr) mode = Mode::Invalid;
+    }
+    INLINE bool mayLock(Mode m) const { return canLock(load(mode), m); }
+    template <typename Func>
+    void forEachHolder(Func&& func) {
+        Latch lk(&latch);
+        for (const Holder *h = head; h != nullptr; h = h->next) func(h->workerId);
+    }
+
+private:
+    static INLINE bool canLock(Mode cur, Mode m) {
+        return cur == Mode::Invalid || (cur == Mode::S && m == Mode::S);
+    }
+};
+
+
+class Lock
+{
+    Mutex *mutex_;
+    Mode mode_;
+    Holder *holder_;
+
+public:
+    INLINE Lock() : mutex_(nullptr), mode_(Mode::Invalid), holder_(nullptr) {}
+    INLINE ~Lock() noexcept { unlock(); }
+    Lock(const Lock&) = delete;
+    Lock& operator=(const Lock&) = delete;
+    INLINE Lock(Lock&& rhs) noexcept : Lock() { swap(rhs); }
+    INLINE Lock& operator=(Lock&& rhs) noexcept { swap(rhs); return *this; }
+
+    INLINE bool tryLock(Mutex& mutex, Mode mode, Holder& holder) {
+        assert(mode_ == Mode::Invalid);
+        if (!mutex.tryLock(holder, mode)) return false;
+        mutex_ = &mutex;
+        mode_ = mode;
+        holder_ = &holder;
+        return true;
+    }
+    INLINE bool tryUpgrade() {
+        assert(mutex_ != nullptr); assert(mode_ == Mode::S);
+        if (!mutex_->tryUpgrade(*holder_)) return false;
+        mode_ = Mode::X;
+        return true;
+    }
+    INLINE void unlock() noexcept {
+        if (mode_ != Mode::Invalid) {
+            mutex_->unlock(*holder_);
+            mode_ = Mode::Invalid;
+        }
+        mutex_ = nullptr;
+        holder_ = nullptr;
+    }
+    Mode mode() const { return mode_; }
+    Mutex* mutex() const { return mutex_; }
+    void setMutex(Mutex* mutex) { mutex_ = mutex; } // for search.
+    uintptr_t getMutexId() const { return uintptr_t(mutex_); }
+    INLINE void swap(Lock& rhs) noexcept {
+        std::swap(mutex_, rhs.mutex_);
+        std::swap(mode_, rhs.mode_);
+        std::swap(holder_, rhs.holder_);
+    }
+};
+
+
+enum VictimPolicy : uint8_t
+{
+    YOUNGEST = 0, // the largest txId.
+    LEAST_WORK = 1, // the fewest locks held.
+};
+
+
+/**
+ * A node of the waits-for graph.
+ * Written by its worker and read by the detector.
+ */
+struct Slot
+{
+    alignas(CACHE_LINE_SIZE)
+    uint64_t waitSeq; // odd while waiting.
+    Mutex *waitFor;
+    uint64_t txId;
+    size_t nrLocks;
+
+    WoundFlag victim; // set by the detector.
+
+    Slot() : waitSeq(0), waitFor(nullptr), txId(0), nrLocks(0), victim() {}
+
+    INLINE void beginWait(Mutex& mutex, size_t nrLocks0) {
+        store(waitFor, &mutex);
+        store(nrLocks, nrLocks0);
+        store_release(waitSeq, waitSeq + 1);
+    }
+    INLINE void endWait() {
+        store_release(waitSeq, waitSeq + 1);
+    }
+};
+
+
+class Detector
+{
+    std::vector<Slot> slotV_;
+    VictimPolicy policy_;
+    size_t intervalUs_;
+    std::thread th_;
+    bool quit_;
+    size_t nrVictims_;
+
+    // work memory of the detector.
+    std::vector<uint64_t> seqV_; // snapshot of waitSeq.
+    std::vector<std::vector<uint32_t> > adjV_; // waits-for edges.
+    std::vector<uint8_t> colorV_; // 0: not visited, 1: on the path, 2: done.
+    std::vector<uint32_t> path_;
+
+public:
+    Detector(size_t nrWorkers, VictimPolicy policy = YOUNGEST, size_t intervalUs = 100)
+        : slotV_(nrWorkers), policy_(policy), intervalUs_(intervalUs), th_(), quit_(false), nrVictims_(0)
+        , seqV_(nrWorkers), adjV_(nrWorkers), colorV_(nrWorkers), path_() {
+    }
+    ~Detector() noexcept { stop(); }
+    Slot& slot(size_t workerId) { return slotV_[workerId]; }
+    size_t size() const { return slotV_.size(); }
+    size_t nrVictims() const { return nrVictims_; }
+
+    void start() {
+        quit_ = false;
+        th_ = std::thread([this]() {
+            while (!load_acquire(quit_)) {
+                sleep_us(intervalUs_);
+                detectOnce();
+            }
+        });
+    }
+    void stop() noexcept {
+        if (!th_.joinable()) return;
+        store_release(quit_, true);
+        th_.join();
+    }
+    /**
+     * Returns the number of victims chosen.
+     */
+    size_t detectOnce() {
+        const size_t n = slotV_.size();
+        for (size_t i = 0; i < n; i++) {
+            seqV_[i] = load_acquire(slotV_[i].waitSeq);
+        }
+        for (size_t i = 0; i < n; i++) {
+            adjV_[i].clear();
+            if (!isWaiting(i)) continue;
+            if (slotV_[i].victim.is_wounded()) continue; // It will abort soon.
+            Mutex *mutex = load(slotV_[i].waitFor);
+            if (!isStillWaiting(i)) continue;
+            mutex->forEachHolder([&](uint32_t j) {
+                if (j != i) adjV_[i].push_back(j);
+            });
+        }
+        size_t nr = 0;
+        for (;;) {
+            std::fill(colorV_.begin(), colorV_.end(), 0);
+            bool found = false;
+            for (size_t i = 0; i < n && !found; i++) {
+                if (colorV_[i] != 0 || adjV_[i].empty()) continue;
+                path_.clear();
+                found = findCycle(i);
+            }
+            if (!found) break;
+            if (abortVictim()) nr++;
+        }
+        nrVictims_ += nr;
+        return nr;
+    }
+
+private:
+    bool isWaiting(size_t i) const { return (seqV_[i] & 1) != 0; }
+    bool isStillWaiting(size_t i) const {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return load(slotV_[i].waitSeq) == seqV_[i];
+    }
+    /**
+     * DFS. Returns true if a cycle is found. The cycle is at the tail of path_.
+     */
+    bool findCycle(uint32_t u) {
+        colorV_[u] = 1;
+        path_.push_back(u);
+        for (uint32_t v : adjV_[u]) {
+            if (colorV_[v] == 1) {
+                path_.erase(path_.begin(), std::find(path_.begin(), path_.end(), v));
+                return true;
+            }
+            if (colorV_[v] == 0 && findCycle(v)) return true;
+        }
+        path_.pop_back();
+        colorV_[u] = 2;
+        return false;
+    }
+    /**
+     * Choose a victim in the cycle in path_ and remove it from the graph.
+     * The cycle is a real deadlock if all the members have been waiting
+     * since the snapshot because waiting transactions do not release locks.
+     * Returns false if the cycle was stale.
+     */
+    bool abortVictim() {
+        bool real = true;
+        for (uint32_t u : path_) {
+            if (isStillWaiting(u)) continue;
+            adjV_[u].clear(); // stale edges.
+            real = false;
+        }
+        if (!real) return false;
+        uint32_t victim = path_[0];
+        for (uint32_t u : path_) {
+            if (isBetterVictim(u, victim)) victim = u;
+        }
+        slotV_[victim].victim.wound();
+        adjV_[victim].clear(); // to break the cycle.
+        return true;
+    }
+    bool isBetterVictim(uint32_t u, uint32_t v) const {
+        const Slot& su = slotV_[u];
+        const Slot& sv = slotV_[v];
+        const uint64_t tu = load(su.txId), tv = load(sv.txId);
+        if (policy_ == LEAST_WORK) {
+            const size_t nu = load(su.nrLocks), nv = load(sv.nrLocks);
+            if (nu != nv) return nu < nv;
+        }
+        return tu > tv;
+    }
+};
+
+
+/**
+ * Lock set of a worker.
+ * Conflicting lock requests wait until the locks are granted or the transaction is chosen as a victim.
+ */
+class LockSet
+{
+public:
+    using Mutex = cybozu::deadlock::Mutex;
+
+private:
+    using OpEntryL = OpEntry<Lock>;
+    using Vec = std::vector<OpEntryL>;
+#if 1
+    using Index = cybozu::FlatIndex;
+#else
+    using Index = SingleThreadUnorderedMap<uintptr_t, size_t>;
+#endif
+
+    Vec vec_;
+    Index index_;  // key: mutex pointer, value: index in vec_.
+
+    MemoryVector local_;
+    size_t valueSize_;
+
+    struct BlindWriteInfo {
+        Mutex *mutex;
+        size_t idx; // index of blind-write entry in vec_.
+
+        BlindWriteInfo() {
+        }
+        BlindWriteInfo(Mutex* mutex0, size_t idx0) : mutex(mutex0), idx(idx0) {
+        }
+    };
+    std::vector<BlindWriteInfo> bwV_;
+
+    // Holders are linked in the mutexes so their addresses must be stable.
+    std::vector<std::unique_ptr<Holder> > holderV_;
+    size_t nrHolders_;
+
+    Slot *slot_;
+    uint32_t workerId_;
+
+    // The mutex the victim was waiting for.
+    Mutex *retryWaitFor_;
+    Mode retryMode_;
+
+public:
+    LockSet() : vec_(), index_(), local_(), valueSize_(0), bwV_(), holderV_(), nrHolders_(0)
+              , slot_(nullptr), workerId_(0), retryWaitFor_(nullptr), retryMode_(Mode::Invalid) {
+    }
+    void init(size_t valueSize, size_t nrReserve, Detector& detector, uint32_t workerId) {
+        valueSize_ = valueSize;
+        if (valueSize == 0) valueSize++;
+        local_.setSizes(valueSize);
+
+        // for long transactions.
+        vec_.reserve(nrReserve);
+        local_.reserve(nrReserve);
+        bwV_.reserve(nrReserve);
+
+        slot_ = &detector.slot(workerId);
+        workerId_ = workerId;
+    }
+    /**
+     * The txId is used to choose a victim.
+     * It should be kept in retries to avoid starvation.
+     */
+    void setTxId(uint64_t txId) { store(slot_->txId, txId); }
+
+    INLINE bool read(Mutex& mutex, void* sharedVal, void* dst) {
+        Vec::iterator it = find(uintptr_t(&mutex));
+        if (unlikely(it != vec_.end())) {
+            Lock& lk = it->lock;
+            if (lk.mode() == Mode::S) {
+                copyValue(dst, sharedVal); // read shared data.
+                return true;
+            }
+            assert(lk.mode() == Mode::X || lk.mode() == Mode::Invalid);
+            copyValue(dst, getLocalValPtr(it->info)); // read local data.
+            return true;
+        }
+        OpEntryL& ope = vec_.emplace_back();
+        if (unlikely(!lockWait(ope.lock, mutex, Mode::S))) return false; // victim.
+        copyValue(dst, sharedVal); // read shared data.
+        return true;
+    }
+    INLINE bool write(Mutex& mutex, void* sharedVal, void* src) {
+        Vec::iterator it = find(uintptr_t(&mutex));
+        if (unlikely(it != vec_.end())) {
+            Lock& lk = it->lock;
+            if (lk.mode() == Mode::S) {
+                if (unlikely(!upgradeWait(lk))) return false;
+                it->info.set(allocateLocalVal(), sharedVal);
+            }
+            assert(lk.mode() == Mode::X || lk.mode() == Mode::Invalid);
+            copyValue(getLocalValPtr(it->info), src); // write local data.
+            return true;
+        }
+        // This is blind write.
+        OpEntryL& ope = vec_.emplace_back();
+        // Lock will be acquired later. See blindWriteLockAll().
+        ope.lock.setMutex(&mutex); // for search.
+        bwV_.emplace_back(&mutex, vec_.size() - 1);
+        ope.info.set(allocateLocalVal(), sharedVal);
+        copyValue(getLocalValPtr(ope.info), src); // write local data.
+        return true;
+    }
+    INLINE bool readForUpdate(Mutex& mutex, void* sharedVal, void* dst) {
+        Vec::iterator it = find(uintptr_t(&mutex));
+        if (unlikely(it != vec_.end())) {
+            Lock& lk = it->lock;
+            LocalValInfo& info = it->info;
+            if (lk.mode() == Mode::X) {
+                copyValue(dst, getLocalValPtr(info)); // read local data.
+                return true;
+            }
+            if (lk.mode() == Mode::S) {
+                if (unlikely(!upgradeWait(lk))) return false;
+                info.set(allocateLocalVal(), sharedVal);
+                void *localVal = getLocalValPtr(info);
+                copyValue(localVal, sharedVal); // for next read.
+                copyValue(dst, localVal); // read local data.
+                return true;
+            }
+            assert(lk.mode() == Mode::Invalid);
+            copyValue(dst, getLocalValPtr(info)); // read local data.
+            return true;
+        }
+        OpEntryL& ope = vec_.emplace_back();
+        LocalValInfo& info = ope.info;
+        if (unlikely(!lockWait(ope.lock, mutex, Mode::X))) return false; // victim.
+        info.set(allocateLocalVal(), sharedVal);
+        void* localVal = getLocalValPtr(info);
+        copyValue(localVal, sharedVal); // for next read.
+        copyValue(dst, localVal); // read local data.
+        return true;
+    }
+    INLINE bool blindWriteLockAll() {
+        for (BlindWriteInfo& bwInfo : bwV_) {
+            OpEntryL& ope = vec_[bwInfo.idx];
+            assert(ope.lock.mode() == Mode::Invalid);
+            ope.lock.setMutex(nullptr); // it was set for search.
+            if (unlikely(!lockWait(ope.lock, *bwInfo.mutex, Mode::X))) return false; // victim.
+        }
+        return true;
+    }
+    INLINE void updateAndUnlock() {
+        // serialization point.
+
+        for (OpEntryL& ope : vec_) {
+            Lock& lk = ope.lock;
+            if (lk.mode() == Mode::X) {
+                // update.
+                LocalValInfo& info = ope.info;
+                copyValue(info.sharedVal, getLocalValPtr(info));
+            } else {
+                assert(lk.mode() == Mode::S);
+            }
+            lk.unlock();
+        }
+        clear();
+        // The transaction may have been chosen after the cycle was broken by another victim.
+        slot_->victim.reset();
+    }
+    INLINE void unlock() {
+        clear(); // unlock.
+        // No one chooses the transaction as a victim after all the locks are released.
+        slot_->victim.reset();
+        if (retryWaitFor_ != nullptr) {
+            // Otherwise the victim may take the locks again before the others in the cycle proceed,
+            // and the same deadlock repeats.
+            cybozu::wait_policy::waitUntil(nullptr, [&]() { return retryWaitFor_->mayLock(retryMode_); });
+            retryWaitFor_ = nullptr;
+        }
+    }
+    bool empty() const {
+        return vec_.empty() && index_.empty() && nrHolders_ == 0;
+    }
+
+private:
+    /**
+     * Returns false if the transaction is chosen as a victim.
+     */
+    INLINE bool lockWait(Lock& lk, Mutex& mutex, Mode mode) {
+        Holder& holder = allocateHolder();
+        if (likely(lk.tryLock(mutex, mode, holder))) return true;
+        slot_->beginWait(mutex, vec_.size() - 1);
+        // Holders do not notify on unlock, so the park policy yields here.
+        cybozu::wait_policy::waitUntil(nullptr, [&]() {
+            return slot_->victim.is_wounded() || lk.tryLock(mutex, mode, holder);
+        });
+        slot_->endWait();
+        if (lk.mode() != Mode::Invalid) return true;
+        retryWaitFor_ = &mutex;
+        retryMode_ = mode;
+        return false;
+    }
+    INLINE bool upgradeWait(Lock& lk) {
+        if (likely(lk.tryUpgrade())) return true;
+        slot_->beginWait(*lk.mutex(), vec_.size());
+        cybozu::wait_policy::waitUntil(nullptr, [&]() {
+            return slot_->victim.is_wounded() || lk.tryUpgrade();
+        });
+        slot_->endWait();
+        if (lk.mode() == Mode::X) return true;
+        retryWaitFor_ = lk.mutex();
+        retryMode_ = Mode::X; // until the other readers have gone.
+        return false;
+    }
+    INLINE Holder& allocateHolder() {
+        if (nrHolders_ == holderV_.size()) holderV_.emplace_back(new Holder());
+        Holder& h = *holderV_[nrHolders_++];
+        h.workerId = workerId_;
+        return h;
+    }
+    INLINE void clear() {
+        vec_.clear(); // unlock.
+        index_.clear();
+        local_.clear();
+        bwV_.clear();
+        nrHolders_ = 0;
+    }
+    INLINE Vec::iterator find(uintptr_t key) {
+        // at most 4KiB scan.
+        const size_t threshold = 4096 / sizeof(OpEntryL);
+        if (unlikely(vec_.size() > threshold)) {
+            for (size_t i = index_.size(); i < vec_.size(); i++) {
+                index_[vec_[i].lock.getMutexId()] = i;
+            }
+            Index::iterator it = index_.find(key);
+            if (it == index_.end()) {
+                return vec_.end();
+            } else {
+                size_t idx = it->second;
+                return vec_.begin() + idx;
+            }
+        }
+        return std::find_if(
+            vec_.begin(), vec_.end(),
+            [&](const OpEntryL& ope) {
+                return ope.lock.getMutexId() == key;
+            });
+    }
+    void* getLocalValPtr(const LocalValInfo& info) {
+#ifdef NO_PAYLOAD
+        unused(info);
+        return nullptr;
+#else
+        if (info.localValIdx == UINT64_MAX) {
+            return nullptr;
+        } else {
+            return &local_[info.localValIdx];
+        }
+#endif
+    }
+    void copyValue(void* dst, const void* src) {
+#ifndef NO_PAYLOAD
+        ::memcpy(dst, src, valueSize_);
+#else
+        unused(dst); unused(src);
+#endif
+    }
+    INLINE size_t allocateLocalVal() {
+        const size_t idx = local_.size();
+#ifndef NO_PAYLOAD
+        local_.resize(idx + 1);
+#endif
+        return idx;
+    }
+};
+
+
+}} // namespace cybozu::deadlock
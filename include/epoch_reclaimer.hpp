@@ -0,0 +1,161 @@
+#pragma once
+/**
+ * @file
+ * @brief epoch-based memory reclamation (EBR).
+ *
+ * Each worker enters an epoch before touching shared records
+ * and leaves it after the transaction finished.
+ * Retired objects are tagged with the global epoch at the time.
+ * The global epoch advances only when all the active workers have observed it,
+ * so an object retired at epoch e can be freed when the global epoch reaches e + 2.
+ *
+ * This is independent of EpochGenerator in tx_util.hpp,
+ * which is reset between benchmark loops.
+ */
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <cinttypes>
+#include "atomic_wrapper.hpp"
+#include "cache_line_size.hpp"
+#include "inline.hpp"
+#include "util.hpp"
+#include "cybozu/exception.hpp"
+
+
+namespace cybozu {
+namespace ebr {
+
+
+class EpochReclaimer
+{
+public:
+    using Deleter = void (*)(void *);
+
+private:
+    struct Retired
+    {
+        uint64_t epoch;
+        void *ptr;
+        Deleter deleter;
+
+        void free() { deleter(ptr); }
+    };
+
+    alignas(CACHE_LINE_SIZE)
+    uint64_t global_;
+    /*
+     * slot value: (epoch << 1) | active.
+     * 0 means the worker is not in any epoch.
+     */
+    std::vector<CacheLineAligned<uint64_t> > slots_;
+
+    std::mutex mutex_;
+    std::vector<Retired> orphans_; // left by finished workers.
+
+public:
+    explicit EpochReclaimer(size_t nrWorkers)
+        : global_(1), slots_(nrWorkers), mutex_(), orphans_() {
+        for (CacheLineAligned<uint64_t>& slot : slots_) slot.value = 0;
+    }
+    ~EpochReclaimer() noexcept {
+        for (Retired& r : orphans_) r.free();
+    }
+    EpochReclaimer(const EpochReclaimer&) = delete;
+    EpochReclaimer& operator=(const EpochReclaimer&) = delete;
+
+    uint64_t get() const { return load_acquire(global_); }
+
+    /**
+     * Per-worker context. It must be used by only one thread.
+     */
+    class Local
+    {
+        EpochReclaimer *rec_;
+        size_t idx_;
+        std::vector<Retired> retired_;
+        size_t threshold_;
+
+    public:
+        Local() : rec_(nullptr), idx_(0), retired_(), threshold_(64) {}
+        Local(EpochReclaimer& rec, size_t idx) : Local() { init(rec, idx); }
+        ~Local() noexcept {
+            if (rec_ == nullptr) return;
+            leave();
+            collect();
+            std::lock_guard<std::mutex> lk(rec_->mutex_);
+            for (Retired& r : retired_) rec_->orphans_.push_back(r);
+        }
+        Local(const Local&) = delete;
+        Local& operator=(const Local&) = delete;
+
+        void init(EpochReclaimer& rec, size_t idx) {
+            if (idx >= rec.slots_.size()) {
+                throw cybozu::Exception("EpochReclaimer::Local:too large idx") << idx;
+            }
+            rec_ = &rec;
+            idx_ = idx;
+        }
+        INLINE void enter() {
+            uint64_t& slot = rec_->slots_[idx_].value;
+            // The store must be visible before any access to shared records.
+            exchange(slot, (rec_->get() << 1) | 1, __ATOMIC_SEQ_CST);
+        }
+        INLINE void leave() {
+            store_release(rec_->slots_[idx_].value, 0);
+        }
+        /**
+         * The object must have been unlinked from any shared structure.
+         */
+        INLINE void retire(void *ptr, Deleter deleter) {
+            retired_.push_back({rec_->get(), ptr, deleter});
+            if (unlikely(retired_.size() >= threshold_)) collect();
+        }
+        size_t nrRetired() const { return retired_.size(); }
+        /**
+         * Try to advance the global epoch and free reclaimable objects.
+         */
+        void collect() {
+            const uint64_t global = rec_->tryAdvance();
+            size_t j = 0;
+            for (size_t i = 0; i < retired_.size(); i++) {
+                Retired& r = retired_[i];
+                if (r.epoch + 2 <= global) {
+                    r.free();
+                } else {
+                    retired_[j++] = r;
+                }
+            }
+            retired_.resize(j);
+            // Avoid calling collect() too frequently when others stay in old epochs.
+            threshold_ = std::max<size_t>(64, retired_.size() * 2);
+        }
+    };
+
+    /**
+     * Scoped enter() and leave().
+     */
+    struct Guard
+    {
+        Local& local;
+        explicit Guard(Local& local0) : local(local0) { local.enter(); }
+        ~Guard() noexcept { local.leave(); }
+    };
+
+private:
+    /**
+     * Returns the global epoch after trying.
+     */
+    uint64_t tryAdvance() {
+        uint64_t global = get();
+        for (const CacheLineAligned<uint64_t>& slot : slots_) {
+            const uint64_t s = load_acquire(slot.value);
+            if ((s & 1) != 0 && (s >> 1) != global) return global;
+        }
+        if (compare_exchange(global_, global, global + 1)) return global + 1;
+        return global; // updated by another worker.
+    }
+};
+
+
+}} // namespace cybozu::ebr
@@ -0,0 +1,198 @@
+#pragma once
+/**
+ * Open-addressing hash index keyed by mutex address.
+ * This is used to find entries in read/write sets of long transactions.
+ *
+ * Slots are divided into groups and the control bytes of a group
+ * are probed at once with SSE2/AVX2 or NEON.
+ * clear() is O(1) using generation tags of groups:
+ * a group whose tag is not the current generation is regarded as empty.
+ * Erasing an item is not supported.
+ */
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include "arch.hpp"
+#include "inline.hpp"
+#include "util.hpp"
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+
+namespace cybozu {
+
+
+/**
+ * Interface is a subset of std::unordered_map<uintptr_t, V>.
+ * iterator is invalidated by operator[].
+ */
+template <typename V = size_t>
+class FlatIndexT
+{
+public:
+    struct Slot
+    {
+        uintptr_t first; // key.
+        V second; // value.
+    };
+    using iterator = Slot*;
+    using const_iterator = const Slot*;
+
+private:
+#if defined(__AVX2__)
+    static constexpr size_t GROUP_SIZE = 32;
+#else
+    static constexpr size_t GROUP_SIZE = 16;
+#endif
+#if defined(__aarch64__)
+    static constexpr size_t BITS_PER_SLOT = 4;
+#else
+    static constexpr size_t BITS_PER_SLOT = 1;
+#endif
+    static constexpr size_t INIT_NR_GROUPS = 8;
+    static constexpr uint8_t EMPTY = 0;
+    static constexpr uint8_t FULL = 0x80; // control byte is FULL | 7bit tag.
+
+    std::vector<uint8_t> ctrl_; // GROUP_SIZE control bytes per group.
+    std::vector<Slot> slots_;
+    std::vector<uint32_t> gens_; // generation tag of each group.
+    uint32_t gen_; // current generation. never 0.
+    size_t mask_; // number of groups - 1.
+    size_t size_;
+
+public:
+    FlatIndexT() : ctrl_(), slots_(), gens_(), gen_(1), mask_(0), size_(0) {
+    }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    iterator end() { return nullptr; }
+    const_iterator end() const { return nullptr; }
+    void clear() {
+        if (size_ == 0) return;
+        size_ = 0;
+        if (unlikely(++gen_ == 0)) {
+            std::fill(gens_.begin(), gens_.end(), 0);
+            gen_ = 1;
+        }
+    }
+    INLINE iterator find(uintptr_t key) {
+        return const_cast<iterator>(static_cast<const FlatIndexT&>(*this).find(key));
+    }
+    INLINE const_iterator find(uintptr_t key) const {
+        if (size_ == 0) return end();
+        const uint64_t h = hash(key);
+        const uint8_t tag = toTag(h);
+        size_t g = toGroup(h);
+        for (size_t step = 1;; step++) {
+            if (gens_[g] != gen_) return end();
+            const uint8_t *ctrl = &ctrl_[g * GROUP_SIZE];
+            for (uint64_t m = match(ctrl, tag); m != 0; m &= m - 1) {
+                const Slot& s = slots_[g * GROUP_SIZE + firstIdx(m)];
+                if (likely(s.first == key)) return &s;
+            }
+            if (match(ctrl, EMPTY) != 0) return end();
+            g = nextGroup(g, step);
+        }
+    }
+    /**
+     * A value-initialized item is inserted if key does not exist.
+     */
+    INLINE V& operator[](uintptr_t key) {
+        if (unlikely((size_ + 1) * 8 > capacity() * 7)) grow();
+        const uint64_t h = hash(key);
+        const uint8_t tag = toTag(h);
+        size_t g = toGroup(h);
+        for (size_t step = 1;; step++) {
+            uint8_t *ctrl = &ctrl_[g * GROUP_SIZE];
+            if (gens_[g] != gen_) {
+                // The group is left by an old generation.
+                ::memset(ctrl, EMPTY, GROUP_SIZE);
+                gens_[g] = gen_;
+            }
+            for (uint64_t m = match(ctrl, tag); m != 0; m &= m - 1) {
+                Slot& s = slots_[g * GROUP_SIZE + firstIdx(m)];
+                if (likely(s.first == key)) return s.second;
+            }
+            // Without erasure, a key never exists beyond a group with empty slots.
+            const uint64_t e = match(ctrl, EMPTY);
+            if (e != 0) {
+                const size_t i = firstIdx(e);
+                ctrl[i] = tag;
+                Slot& s = slots_[g * GROUP_SIZE + i];
+                s.first = key;
+                s.second = V();
+                size_++;
+                return s.second;
+            }
+            g = nextGroup(g, step);
+        }
+    }
+
+private:
+    size_t capacity() const { return slots_.size(); }
+    static uint64_t hash(uintptr_t key) {
+        // Fibonacci hashing. Low bits of mutex addresses are almost constant.
+        return uint64_t(key) * 0x9e3779b97f4a7c15ULL;
+    }
+    static uint8_t toTag(uint64_t h) {
+        return FULL | uint8_t(h >> 57);
+    }
+    size_t toGroup(uint64_t h) const {
+        return (h >> 32) & mask_;
+    }
+    size_t nextGroup(size_t g, size_t step) const {
+        // Triangular probing visits all the groups because the number is a power of 2.
+        return (g + step) & mask_;
+    }
+    static size_t firstIdx(uint64_t m) {
+        return __builtin_ctzll(m) / BITS_PER_SLOT;
+    }
+    /**
+     * Returns a bit mask of the slots whose control byte is b.
+     */
+    static INLINE uint64_t match(const uint8_t *ctrl, uint8_t b) {
+#if defined(__AVX2__)
+        const __m256i v = _mm256_loadu_si256((const __m256i *)ctrl);
+        return uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(b))));
+#elif defined(__x86_64__)
+        const __m128i v = _mm_loadu_si128((const __m128i *)ctrl);
+        return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(b))));
+#else
+        // 4 bits per slot. Only the highest bit of each nibble is kept.
+        const uint8x16_t eq = vceqq_u8(vld1q_u8(ctrl), vdupq_n_u8(b));
+        const uint8x8_t nib = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+        return vget_lane_u64(vreinterpret_u64_u8(nib), 0) & 0x8888888888888888ULL;
+#endif
+    }
+    void grow() {
+        std::vector<uint8_t> ctrl;
+        std::vector<Slot> slots;
+        std::vector<uint32_t> gens;
+        ctrl.swap(ctrl_);
+        slots.swap(slots_);
+        gens.swap(gens_);
+        const size_t oldNrGroups = gens.size();
+        const size_t nrGroups = oldNrGroups == 0 ? INIT_NR_GROUPS : oldNrGroups * 2;
+        ctrl_.resize(nrGroups * GROUP_SIZE);
+        slots_.resize(nrGroups * GROUP_SIZE);
+        gens_.resize(nrGroups, 0); // gen_ is never 0 so all the groups are empty.
+        mask_ = nrGroups - 1;
+        size_ = 0;
+        for (size_t g = 0; g < oldNrGroups; g++) {
+            if (gens[g] != gen_) continue;
+            for (size_t i = g * GROUP_SIZE; i < (g + 1) * GROUP_SIZE; i++) {
+                if (ctrl[i] == EMPTY) continue;
+                (*this)[slots[i].first] = slots[i].second;
+            }
+        }
+    }
+};
+
+
+using FlatIndex = FlatIndexT<size_t>;
+
+
+} // namespace cybozu
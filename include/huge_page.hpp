@@ -0,0 +1,174 @@
+#pragma once
+/**
+ * Huge-page backed memory allocation.
+ *
+ * hugetlb: mmap() with MAP_HUGETLB. It requires reserved huge pages
+ *          (/proc/sys/vm/nr_hugepages) and falls back to thp.
+ * thp: mmap() aligned to the huge page size with madvise(MADV_HUGEPAGE).
+ *      It falls back to normal pages if THP is disabled.
+ * off: posix_memalign().
+ */
+#include <string>
+#include <utility>
+#include <cstdint>
+#include <cstdio>
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "cybozu/exception.hpp"
+
+
+namespace cybozu {
+namespace hugepage {
+
+
+// 2MiB for x86_64 and aarch64 with 4KiB base pages.
+constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+
+
+enum class Mode : uint8_t {
+    OFF, THP, HUGETLB,
+};
+
+
+const std::pair<Mode, const char*> modeTable_[] = {
+    {Mode::OFF, "off"},
+    {Mode::THP, "thp"},
+    {Mode::HUGETLB, "hugetlb"},
+};
+
+
+inline Mode parseMode(const std::string& s)
+{
+    for (const auto& p : modeTable_) {
+        if (s == p.second) return p.first;
+    }
+    throw cybozu::Exception("hugepage::parseMode: bad mode") << s;
+}
+
+
+inline const char* modeToStr(Mode mode)
+{
+    for (const auto& p : modeTable_) {
+        if (mode == p.first) return p.second;
+    }
+    throw cybozu::Exception("hugepage::modeToStr: bad mode") << int(mode);
+}
+
+
+/**
+ * Mode of the local sets of transactions (MemoryVector).
+ * Set by runExec().
+ * Only local sets of LOCAL_SET_MIN_SIZE bytes or more use it;
+ * a huge page for each small local set would exhaust the hugetlb pool.
+ */
+inline Mode defaultMode_ = Mode::OFF;
+constexpr size_t LOCAL_SET_MIN_SIZE = HUGE_PAGE_SIZE;
+
+inline size_t basePageSize()
+{
+    static const size_t size = ::sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+
+inline size_t alignUp(size_t size, size_t align)
+{
+    return (size + align - 1) / align * align;
+}
+
+
+/**
+ * Page size actually backing the mapping that contains p.
+ * It is the huge page size if THP has backed a part of the mapping,
+ * otherwise KernelPageSize in /proc/self/smaps.
+ * Call this after the memory is touched. Returns 0 if unknown.
+ */
+inline size_t grantedPageSize(const void *p)
+{
+    FILE *fp = ::fopen("/proc/self/smaps", "r");
+    if (fp == nullptr) return 0;
+    const uintptr_t addr = uintptr_t(p);
+    bool found = false;
+    size_t kernelPageKb = 0, anonHugeKb = 0;
+    char buf[512];
+    while (::fgets(buf, sizeof(buf), fp) != nullptr) {
+        uintptr_t begin, end;
+        size_t kb;
+        if (::sscanf(buf, "%" SCNxPTR "-%" SCNxPTR " ", &begin, &end) == 2) {
+            if (found) break; // the next mapping.
+            found = begin <= addr && addr < end;
+        } else if (!found) {
+            continue;
+        } else if (::sscanf(buf, "KernelPageSize: %zu kB", &kb) == 1) {
+            kernelPageKb = kb;
+        } else if (::sscanf(buf, "AnonHugePages: %zu kB", &kb) == 1) {
+            anonHugeKb = kb;
+        }
+    }
+    ::fclose(fp);
+    if (anonHugeKb > 0) return HUGE_PAGE_SIZE;
+    return kernelPageKb << 10;
+}
+
+
+struct Block
+{
+    void *ptr;
+    size_t mapped; // [bytes]. 0 means allocated by posix_memalign().
+};
+
+
+/**
+ * alignment must be <= the base page size in huge page modes.
+ */
+inline Block allocate(size_t size, size_t alignment, Mode mode)
+{
+    // posix_memalign() may return non-null with size 0.
+    if (size == 0) return {nullptr, 0};
+    if (mode == Mode::HUGETLB) {
+        const size_t mapped = alignUp(size, HUGE_PAGE_SIZE);
+        void *p = ::mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) return {p, mapped};
+        mode = Mode::THP;
+    }
+    if (mode == Mode::THP) {
+        // Over-allocate to align the region to the huge page boundary.
+        const size_t mapped = alignUp(size, HUGE_PAGE_SIZE);
+        void *p = ::mmap(nullptr, mapped + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            const uintptr_t begin = uintptr_t(p);
+            const uintptr_t aligned = alignUp(begin, HUGE_PAGE_SIZE);
+            if (aligned > begin) ::munmap(p, aligned - begin);
+            const size_t tail = begin + mapped + HUGE_PAGE_SIZE - (aligned + mapped);
+            if (tail > 0) ::munmap((void *)(aligned + mapped), tail);
+            // It fails only if THP is not supported; then normal pages are used.
+            ::madvise((void *)aligned, mapped, MADV_HUGEPAGE);
+            return {(void *)aligned, mapped};
+        }
+    }
+    void *p;
+    if (::posix_memalign(&p, alignment, size) != 0) {
+        throw std::bad_alloc();
+    }
+    return {p, 0};
+}
+
+
+inline void deallocate(void *p, size_t mapped) noexcept
+{
+    if (p == nullptr) return;
+    if (mapped == 0) {
+        ::free(p);
+    } else {
+        ::munmap(p, mapped);
+    }
+}
+
+
+}} // namespace cybozu::hugepage
@@ -11,6 +11,7 @@
 #include <vector>
 #include "lock.hpp"
 #include "sxql.hpp"
+#include "bravo.hpp"
 #include "vector_payload.hpp"
 #include "allocator.hpp"
 #include "write_set.hpp"
@@ -21,14 +22,18 @@ namespace cybozu {
 namespace lock {
 
 
-struct MutexWithMcs
+/**
+ * QueueLock: McsSpinlock or CohortMcsSpinlock.
+ */
+template <typename QueueLock>
+struct MutexWithMcsT
 {
     using Mode = XSMutex::Mode;
 
     int obj;
-    McsSpinlock::Mutex mcsMu;
+    typename QueueLock::Mutex mcsMu;
 
-    INLINE MutexWithMcs() : obj(0), mcsMu() {
+    INLINE MutexWithMcsT() : obj(0), mcsMu() {
     }
 
     std::string str() const {
@@ -54,29 +59,30 @@ size_t getThreadId()
 #endif
 
 
-class LockWithMcs
+template <typename QueueLock>
+class LockWithMcsT
 {
 public:
-    using Mutex = MutexWithMcs;
-    using Mode = Mutex::Mode;
+    using Mutex = MutexWithMcsT<QueueLock>;
+    using Mode = typename Mutex::Mode;
 private:
     Mutex *mutexp_;
     Mode mode_;
 public:
-    INLINE LockWithMcs() : mutexp_(nullptr), mode_(Mode::Invalid) {
+    INLINE LockWithMcsT() : mutexp_(nullptr), mode_(Mode::Invalid) {
     }
-    INLINE LockWithMcs(Mutex& mutex, Mode mode) : LockWithMcs() {
+    INLINE LockWithMcsT(Mutex& mutex, Mode mode) : LockWithMcsT() {
         lock(mutex, mode);
         verify();
     }
-    INLINE ~LockWithMcs() noexcept {
+    INLINE ~LockWithMcsT() noexcept {
         unlock();
         verify();
     }
-    LockWithMcs(const LockWithMcs&) = delete;
-    LockWithMcs& operator=(const LockWithMcs&) = delete;
-    INLINE LockWithMcs(LockWithMcs&& rhs) noexcept : LockWithMcs() { swap(rhs); verify(); }
-    INLINE LockWithMcs& operator=(LockWithMcs&& rhs) noexcept { swap(rhs); verify(); return *this; }
+    LockWithMcsT(const LockWithMcsT&) = delete;
+    LockWithMcsT& operator=(const LockWithMcsT&) = delete;
+    INLINE LockWithMcsT(LockWithMcsT&& rhs) noexcept : LockWithMcsT() { swap(rhs); verify(); }
+    INLINE LockWithMcsT& operator=(LockWithMcsT&& rhs) noexcept { swap(rhs); verify(); return *this; }
 
     INLINE void reset(Mutex* mutexp = nullptr, Mode mode = Mode::Invalid) {
         mutexp_ = mutexp;
@@ -217,7 +223,7 @@ public:
 
 private:
     INLINE int waitForWrite(Mutex& mutex) {
-        McsSpinlock lock(mutex.mcsMu);
+        QueueLock lock(mutex.mcsMu);
         // Up to one thread can spin.
         int v0 = mutex.load();
         while (v0 != 0) {
@@ -227,7 +233,7 @@ private:
         return v0;
     }
     INLINE int waitForRead(Mutex& mutex) {
-        McsSpinlock lock(mutex.mcsMu);
+        QueueLock lock(mutex.mcsMu);
         // Up to one thread can spin.
         int v0 = mutex.load();
         while (v0 < 0) {
@@ -236,7 +242,7 @@ private:
         }
         return v0;
     }
-    INLINE void swap(LockWithMcs& rhs) noexcept {
+    INLINE void swap(LockWithMcsT& rhs) noexcept {
         rhs.verify();
         std::swap(mutexp_, rhs.mutexp_);
         std::swap(mode_, rhs.mode_);
@@ -244,6 +250,10 @@ private:
 };
 
 
+using LockWithMcs = LockWithMcsT<McsSpinlock>;
+using LockWithCohort = LockWithMcsT<CohortMcsSpinlock>;
+
+
 /**
  * Usage:
  *   Call lock() to lock a resource.
@@ -256,9 +266,11 @@ private:
  * If 0, std::map will be used.
  * If 1, std::vector and sort will be used.
  *
- * Lock: XSLock, LockWithMcs, or SXQLock (obsolete).
+ * Lock: XSLock, LockWithMcs, LockWithCohort, BravoLock, or SXQLock (obsolete).
  *   XSLock is normal shared-exclusive lock.
  *   LockWithMcs is XSLock with a helper MCS lock.
+ *   LockWithCohort is XSLock with a helper NUMA cohort lock.
+ *   BravoLock is XSLock with reader bias.
  *   SXQLock is a shared eXclusive Queuing lock (original).
  */
 template <bool UseMap, typename Lock>
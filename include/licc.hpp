@@ -10,6 +10,7 @@
 #include "pqlock.hpp"
 #include "arch.hpp"
 #include "vector_payload.hpp"
+#include "flat_index.hpp"
 #include "cache_line_size.hpp"
 #include "write_set.hpp"
 #include "inline.hpp"
@@ -688,9 +689,9 @@ public:
     using Vec = std::vector<OpEntryL>;
 
 #if 1
-    using UMap = SingleThreadUnorderedMap<uintptr_t, size_t>;
+    using UMap = cybozu::FlatIndex;
 #else
-    using UMap = std::unordered_map<uintptr_t, size_t>;
+    using UMap = SingleThreadUnorderedMap<uintptr_t, size_t>;
 #endif
 
     using Mutex = IMutex<PQLock>;
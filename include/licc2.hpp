@@ -21,10 +21,14 @@
 #include "atomic_wrapper.hpp"
 #include "write_set.hpp"
 #include "allocator.hpp"
+#include "flat_index.hpp"
 #include "vector_payload.hpp"
 #include "cache_line_size.hpp"
 #include "list_util.hpp"
 #include "mcslikelock.hpp"
+#include "ordered_index.hpp"
+#include "record_table.hpp"
+#include "epoch_reclaimer.hpp"
 
 
 namespace cybozu {
@@ -58,7 +62,11 @@ struct MutexData
             union {
                 uint32_t state;
                 struct {
-                    uint32_t version:30;
+                    uint32_t version:28;
+                    // record state for insert/remove.
+                    // They are changed with version at unlock.
+                    uint32_t absent:1;
+                    uint32_t dead:1;
                     uint32_t protected_:1;
                     uint32_t is_writer:1;
                 };
@@ -77,8 +85,8 @@ struct MutexData
         state = 0;
     }
     std::string str() const {
-        return fmtstr("MutexData{ord:%x worker:%x epoch:%x ver:%u protected:%u is_writer:%u}"
-                      , ord_id, worker_id, epoch_id, version, protected_, is_writer);
+        return fmtstr("MutexData{ord:%x worker:%x epoch:%x ver:%u absent:%u dead:%u protected:%u is_writer:%u}"
+                      , ord_id, worker_id, epoch_id, version, absent, dead, protected_, is_writer);
     }
 
     template <bool allow_protected = false>
@@ -215,13 +223,21 @@ struct LockData
 {
     LockState state;
     bool updated;
+    /*
+     * absent and dead are the record state at read.
+     * absent will be changed by insert/remove of the transaction.
+     * removed means the record will be dead at unlock.
+     */
+    bool absent;
+    bool dead;
+    bool removed;
     uint32_t ord_id;
     uint32_t version;
 
 #ifdef NDEBUG
     INLINE LockData() = default; // CAUSION: not initialied.
 #else
-    INLINE LockData() : state(LockState::INIT), updated(false), ord_id(MAX_ORD_ID), version(0) {
+    INLINE LockData() : state(LockState::INIT), updated(false), absent(false), dead(false), removed(false), ord_id(MAX_ORD_ID), version(0) {
     }
 #endif
     INLINE explicit LockData(uint32_t ord_id0) : LockData() { init(ord_id0); }
@@ -229,16 +245,23 @@ struct LockData
     INLINE void init(uint32_t ord_id0) {
         state = LockState::INIT;
         updated = false;
+        absent = false;
+        dead = false;
+        removed = false;
         ord_id = ord_id0;
         version = 0;
     }
 
     std::string str() const {
         return cybozu::util::formatString(
-            "LockData{state:%s updated:%u ord:%u ver:%u}"
-            , lock_state_str(state), updated, ord_id, version);
+            "LockData{state:%s updated:%u absent:%u dead:%u removed:%u ord:%u ver:%u}"
+            , lock_state_str(state), updated, absent, dead, removed, ord_id, version);
     }
 
+    INLINE void set_record_state(MutexData md) {
+        absent = md.absent;
+        dead = md.dead;
+    }
     INLINE bool is_state(LockState st) const {
         return st == state;
     }
@@ -306,6 +329,7 @@ struct MutexOpCreator
         assert(ld.state == LockState::INIT);
         ld.state = LockState::READ;
         ld.version = md.version;
+        ld.set_record_state(md);
         return moc;
     }
 #endif
@@ -347,6 +371,9 @@ struct MutexOpCreator
         }
         ld.state = to_state;
         ld.version = md.version;
+        // With checks_version, the record state is unchanged.
+        // Blind writes do not care the record state.
+        if (!checks_version && to_state != LockState::BLIND_WRITE) ld.set_record_state(md);
         return moc;
     }
     template <bool checks_version>
@@ -384,7 +411,11 @@ struct MutexOpCreator
             break;
         case LockState::PROTECTED:
             md.protected_ = 0;
-            if (likely(ld.updated)) md.version++;
+            if (likely(ld.updated)) {
+                md.version++;
+                md.absent = ld.absent;
+                md.dead = ld.removed;
+            }
             break;
         case LockState::INIT:
         case LockState::PRE_BLIND_WRITE:
@@ -441,6 +472,7 @@ INLINE void invisible_read(Mutex& mutex, LockData& ld, const void* shared, void*
             continue;
         }
         ld.version = md0.version;
+        ld.set_record_state(md0);
         ld.state = LockState::READ;
         return;
     }
@@ -747,6 +779,19 @@ public:
         assert(ld_.state == LockState::PROTECTED);
         ld_.updated = true;
     }
+    /**
+     * Record state in the view of the transaction.
+     */
+    INLINE bool is_absent() const { return ld_.absent; }
+    INLINE bool is_dead() const { return ld_.dead; }
+    INLINE void mark_present() {
+        ld_.absent = false;
+        ld_.removed = false;
+    }
+    INLINE void mark_removed() {
+        ld_.absent = true;
+        ld_.removed = true;
+    }
 
     INLINE uintptr_t get_mutex_id() const { return uintptr_t(mutex_); }
 
@@ -1102,6 +1147,7 @@ public:
                 // fast path.
                 ld_.state = LockState::READ;
                 ld_.version = md0.version;
+                ld_.set_record_state(md0);
             } else {
                 // slow path.
                 bool ret = do_request(req_type, false);
@@ -1206,6 +1252,19 @@ public:
         assert(ld_.state == LockState::PROTECTED);
         ld_.updated = true;
     }
+    /**
+     * Record state in the view of the transaction.
+     */
+    INLINE bool is_absent() const { return ld_.absent; }
+    INLINE bool is_dead() const { return ld_.dead; }
+    INLINE void mark_present() {
+        ld_.absent = false;
+        ld_.removed = false;
+    }
+    INLINE void mark_removed() {
+        ld_.absent = true;
+        ld_.removed = true;
+    }
 
     INLINE uintptr_t get_mutex_id() const { return uintptr_t(mutex_); }
 
@@ -1234,11 +1293,18 @@ class LockSet
 public:
     using OpEntryL = OpEntry<Lock>;
     using Vec = std::vector<OpEntryL>;
-    using UMap = SingleThreadUnorderedMap<uintptr_t, size_t>;
+    using UMap = cybozu::FlatIndex;
+    using OrderedIndex = cybozu::index::BTree<DataWithPayload<Mutex> >;
+    using Table = cybozu::record::RecordTable<Mutex>;
+    using Reclaimer = cybozu::ebr::EpochReclaimer::Local;
 
 private:
     Vec vec_;
     MemoryVector local_;
+    cybozu::index::NodeSet node_set_; // leaves visited by scans.
+    typename OrderedIndex::ScanBuffer scan_buf_;
+    cybozu::record::RemovedRecords<Table> removed_;
+    Reclaimer *reclaimer_ = nullptr; // required by remove().
 
     // key: mutex pointer. value: index in vec_.
     UMap index_;
@@ -1263,6 +1329,9 @@ public:
     INLINE void set_ord_id(uint32_t ord_id) {
         ord_id_ = ord_id;
     }
+    INLINE void set_reclaimer(Reclaimer& reclaimer) {
+        reclaimer_ = &reclaimer;
+    }
 
     enum ReadType : uint8_t {
         OPTIMISTIC = 0,
@@ -1317,6 +1386,27 @@ public:
     INLINE bool read_for_update(Mutex& mutex, const void* shared_val, void* dst) {
         return read_detail<WRITE_RESERVE>(mutex, shared_val, dst);
     }
+    /**
+     * Read at most nr records whose keys are >= lo through the index.
+     * read_type: OPTIMISTIC or READ_RESERVE.
+     * func: void(uint64_t key, const void* dst) will be called for each record.
+     * Visited leaves are validated in verify_and_unlock() to detect phantoms.
+     */
+    template <ReadType read_type, typename Func>
+    INLINE bool scan(const OrderedIndex& index, uint64_t lo, size_t nr, void* dst, Func&& func) {
+        scan_buf_.clear();
+        index.scan(lo, nr, scan_buf_, &node_set_);
+        for (typename OrderedIndex::KeyValue& kv : scan_buf_) {
+            DataWithPayload<Mutex>& rec = *kv.second;
+            if (unlikely(!read_detail<read_type>(rec.value, rec.payload, dst))) return false;
+            func(kv.first, dst);
+        }
+        return true;
+    }
+    template <ReadType read_type>
+    INLINE bool scan(const OrderedIndex& index, uint64_t lo, size_t nr, void* dst) {
+        return scan<read_type>(index, lo, nr, dst, [](uint64_t, const void*) {});
+    }
     INLINE bool write(Mutex& mutex, void *shared_val, const void *src) {
         unused(shared_val, src);
         const uintptr_t key = uintptr_t(&mutex);
@@ -1332,10 +1422,44 @@ public:
         }
         Lock& lk = it->lock;
         if (unlikely(lk.is_state(LockState::READ) && !lk.upgrade())) return false;
+        lk.mark_present(); // writing a removed record means re-insertion.
         copy_value(get_local_val_ptr(it->info), src);
         is_read_only_ = false;
         return true;
     }
+    /**
+     * Insert a record.
+     * Both insert() and remove() write-reserve the record
+     * so the absence of the key is verified by its version at pre-commit.
+     * RETURN:
+     *   false if the key exists or the record has been removed by others.
+     */
+    INLINE bool insert(Table& table, uint64_t key, const void *src) {
+        DataWithPayload<Mutex>& rec = get_record(table, key);
+        OpEntryL* ope = write_entry(rec.value, rec.payload);
+        if (unlikely(ope == nullptr)) return false;
+        Lock& lk = ope->lock;
+        if (unlikely(lk.is_dead() || !lk.is_absent())) return false;
+        lk.mark_present();
+        copy_value(get_local_val_ptr(ope->info), src);
+        return true;
+    }
+    /**
+     * Remove a record.
+     * The record will be unlinked from the index after the transaction committed.
+     * RETURN:
+     *   false if the key does not exist.
+     */
+    INLINE bool remove(Table& table, uint64_t key) {
+        DataWithPayload<Mutex>& rec = get_record(table, key);
+        OpEntryL* ope = write_entry(rec.value, rec.payload);
+        if (unlikely(ope == nullptr)) return false;
+        Lock& lk = ope->lock;
+        if (unlikely(lk.is_dead() || lk.is_absent())) return false;
+        lk.mark_removed();
+        removed_.add(table, key, rec);
+        return true;
+    }
 
     /*
      * Pre-commit phase:
@@ -1406,7 +1530,8 @@ public:
                 lk.template unlock_special<LockState::READ>();
             }
         }
-        return true;
+        // Phantom detection.
+        return node_set_.validate();
     }
     INLINE void update_and_unlock() {
         for (OpEntryL& ope : vec_) {
@@ -1418,17 +1543,58 @@ public:
                 lk.template unlock_special<LockState::PROTECTED>();
             }
         }
+        if (unlikely(!removed_.empty())) unlink_removed();
         clear();
     }
     INLINE void clear() {
         index_.clear();
         vec_.clear();
         local_.clear();
+        node_set_.clear();
+        removed_.clear();
         is_read_only_ = true;
     }
     INLINE bool is_empty() const { return vec_.empty(); }
 
 private:
+    INLINE DataWithPayload<Mutex>& get_record(Table& table, uint64_t key) {
+        return table.get_or_insert(key, [](Mutex& mutex) {
+                MutexData md = mutex.load();
+                md.absent = 1;
+                mutex.store(md);
+            });
+    }
+    /**
+     * Get a write-reserved entry whose record state is valid.
+     * RETURN:
+     *   nullptr if the transaction must abort.
+     */
+    INLINE OpEntryL* write_entry(Mutex& mutex, void *shared_val) {
+        typename Vec::iterator it = find_entry(uintptr_t(&mutex));
+        if (likely(it == vec_.end())) {
+            OpEntryL& ope = vec_.emplace_back(Lock(mutex, ord_id_));
+            ope.info.set(allocate_local_val(), shared_val);
+            ope.lock.read_for_update(shared_val, get_local_val_ptr(ope.info), value_size_);
+            is_read_only_ = false;
+            return &ope;
+        }
+        Lock& lk = it->lock;
+        if (lk.is_state(LockState::READ)) {
+            if (unlikely(!lk.upgrade())) return nullptr;
+        } else if (lk.is_state(LockState::READ_MODIFY_WRITE)) {
+            if (unlikely(!lk.template try_keep_reservation<LockState::READ_MODIFY_WRITE>())) return nullptr;
+        } else {
+            // Blind writes do not know the record state.
+            return nullptr;
+        }
+        is_read_only_ = false;
+        return &*it;
+    }
+    INLINE void unlink_removed() {
+        assert(reclaimer_ != nullptr);
+        removed_.unlink(*reclaimer_, [](const DataWithPayload<Mutex>& rec) {
+                return bool(rec.value.load().dead); });
+    }
     INLINE typename Vec::iterator find_entry(uintptr_t key) {
         // at most 4KiB scan.
         constexpr size_t threshold = 4096 / sizeof(OpEntryL);
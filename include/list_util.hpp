@@ -152,6 +152,31 @@ public:
         head_ = newhead;
         if (head_ == nullptr) tail_ = nullptr;
     }
+    /**
+     * Remove the node from the list.
+     * Returns false if the node is not found.
+     */
+    bool remove(Node* node) {
+        assert(node != nullptr);
+        Node* prev = nullptr;
+        Node* curr = head_;
+        while (curr != nullptr && curr != node) {
+            prev = curr;
+            curr = curr->next;
+        }
+        if (curr == nullptr) return false;
+#ifdef USE_NODE_LIST_SIZE_FIELD
+        assert(size_ > 0);
+        size_--;
+#endif
+        if (prev == nullptr) {
+            head_ = curr->next;
+        } else {
+            prev->next = curr->next;
+        }
+        if (tail_ == curr) tail_ = prev;
+        return true;
+    }
     void push_back_list(NodeListT&& node_list) {
         if (node_list.empty()) return;
         if (tail_ == nullptr) {
@@ -22,6 +22,7 @@
 #include "arch.hpp"
 #include "atomic_wrapper.hpp"
 #include "inline.hpp"
+#include "wait_policy.hpp"
 
 
 namespace cybozu {
@@ -203,6 +204,136 @@ public:
 };
 
 
+namespace cohort_local {
+
+/**
+ * NUMA node of the current thread.
+ * runExec() sets it for each worker. 0 if not set.
+ */
+inline thread_local uint32_t nodeId_ = 0;
+
+} // namespace cohort_local
+
+
+INLINE void setNumaNode(uint32_t nodeId) { cohort_local::nodeId_ = nodeId; }
+
+
+/**
+ * NUMA-aware cohort lock (Dice et al., PPoPP 2012).
+ * Each NUMA node has its MCS queue and the head of each queue competes for the global lock.
+ * The lock holder hands over the global lock to its successor in the same node
+ * up to MAX_LOCAL_HANDOFF times in a row, so the protected data stays in the node.
+ * Nodes beyond MAX_NODES share the queues by modulo.
+ */
+class CohortMcsSpinlock
+{
+public:
+    static constexpr size_t MAX_NODES = 4;
+    static constexpr uint32_t MAX_LOCAL_HANDOFF = 64;
+private:
+    enum : uint32_t {
+        WAIT = 0,
+        LOCAL = 1, // the global lock is handed over by the predecessor.
+        GLOBAL = 2, // the successor must acquire the global lock.
+    };
+    struct Node {
+        uint32_t state;
+        uint32_t nrHandoff; // number of local handoffs in a row.
+        Node *next;
+        INLINE Node() { reset(); }
+        INLINE void reset() { state = WAIT; nrHandoff = 0; next = nullptr; }
+    };
+public:
+    struct Mutex {
+        uint32_t global; // 0 or 1. The holder may be a thread other than the acquirer.
+        Node *tail[MAX_NODES];
+        INLINE Mutex() : global(0) {
+            for (Node*& t : tail) t = nullptr;
+        }
+    };
+private:
+    Mutex *mutexp_;
+    Node **tailp_; // queue of the node.
+    Node node_;
+
+public:
+    INLINE CohortMcsSpinlock() : mutexp_(nullptr), tailp_(nullptr), node_() {
+    }
+    INLINE explicit CohortMcsSpinlock(Mutex& mutex) : CohortMcsSpinlock() {
+        lock(mutex);
+    }
+    INLINE ~CohortMcsSpinlock() noexcept { if (mutexp_) unlock(); }
+
+    INLINE bool try_lock(Mutex& mutex) {
+        assert(mutexp_ == nullptr);
+        Node **tailp = &mutex.tail[cohort_local::nodeId_ % MAX_NODES];
+        Node *tail = nullptr;
+        if (!compare_exchange_acquire(*tailp, tail, &node_)) return false;
+        mutexp_ = &mutex;
+        tailp_ = tailp;
+        uint32_t g = 0;
+        if (compare_exchange_acquire(mutex.global, g, 1)) return true;
+        // The successor, if any, must acquire the global lock.
+        releaseLocal(GLOBAL);
+        return false;
+    }
+    INLINE void lock(Mutex& mutex) {
+        assert(mutexp_ == nullptr);
+        mutexp_ = &mutex;
+        tailp_ = &mutex.tail[cohort_local::nodeId_ % MAX_NODES];
+        Node *prev = exchange_acquire(*tailp_, &node_);
+        if (prev != nullptr) {
+            store_release(prev->next, &node_);
+            uint32_t state;
+            while ((state = load_acquire(node_.state)) == WAIT) _mm_pause();
+            if (state == LOCAL) return;
+            assert(state == GLOBAL);
+        }
+        while (load(mutex.global) != 0 || exchange_acquire(mutex.global, 1) != 0) _mm_pause();
+    }
+    INLINE void unlock() {
+        assert(mutexp_ != nullptr);
+        Node *next = load_acquire(node_.next);
+        if (next != nullptr && node_.nrHandoff < MAX_LOCAL_HANDOFF) {
+            next->nrHandoff = node_.nrHandoff + 1;
+            store_release(next->state, LOCAL);
+            mutexp_ = nullptr;
+            node_.reset();
+            return;
+        }
+        store_release(mutexp_->global, 0);
+        releaseLocal(GLOBAL);
+    }
+private:
+    INLINE void releaseLocal(uint32_t state) {
+        Node *next = load(node_.next);
+        if (next == nullptr) {
+            Node *node = &node_;
+            if (compare_exchange_release(*tailp_, node, nullptr)) {
+                mutexp_ = nullptr;
+                node_.reset();
+                return;
+            }
+            while ((next = load(node_.next)) == nullptr) _mm_pause();
+        }
+        store_release(next->state, state);
+        mutexp_ = nullptr;
+        node_.reset();
+    }
+};
+
+
+/**
+ * Queue lock of the mcs wait policy.
+ * The cohort lock makes the mutexes larger so it is chosen at build time (COHORT_MCS).
+ */
+#ifdef USE_COHORT_MCS
+using QueueSpinlock = CohortMcsSpinlock;
+#else
+using QueueSpinlock = McsSpinlock;
+#endif
+
+
 /**
  * Simple writer-reader mutex.
  */
@@ -247,16 +378,20 @@ public:
     INLINE void upgrade() {
         int v0 = load(v_);
         for (;;) {
-            _mm_pause();
-            while (unlikely(v0 != 1)) {
-                v0 = load(v_);
-                continue;
-            }
+            if (unlikely(v0 != 1)) waitUntil(v0, [&]() { return v0 == 1; });
             if (likely(compare_exchange_acquire(v_, v0, -1))) {
                 return;
             }
         }
     }
+    /**
+     * X --> S
+     */
+    INLINE void downgrade() noexcept {
+        assert(load(v_) == -1);
+        store_release(v_, 1);
+        cybozu::wait_policy::notify(word());
+    }
     INLINE void unlock(Mode mode) noexcept {
         switch(mode) {
         case Mode::Invalid:
@@ -274,11 +409,7 @@ public:
     INLINE void write_lock() {
         int v0 = load(v_);
         for (;;) {
-            _mm_pause();
-            if (unlikely(v0 != 0)) {
-                v0 = load(v_);
-                continue;
-            }
+            if (unlikely(v0 != 0)) waitUntil(v0, [&]() { return v0 == 0; });
             if (likely(compare_exchange_acquire(v_, v0, -1))) {
                 return;
             }
@@ -297,6 +428,7 @@ public:
     INLINE void write_unlock() noexcept {
         int ret = fetch_add_rel(v_, 1);
         assert(ret == -1); unused(ret);
+        cybozu::wait_policy::notify(word());
     }
     INLINE bool read_trylock() {
         // We should retry CAS.
@@ -311,11 +443,7 @@ public:
     INLINE void read_lock() {
         int v0 = load(v_);
         for (;;) {
-            _mm_pause();
-            if (unlikely(v0 < 0)) {
-                v0 = load(v_);
-                continue;
-            }
+            if (unlikely(v0 < 0)) waitUntil(v0, [&]() { return v0 >= 0; });
             if (likely(compare_exchange_acquire(v_, v0, v0 + 1))) {
                 return;
             }
@@ -324,6 +452,20 @@ public:
     INLINE void read_unlock() noexcept {
         int ret = fetch_sub_rel(v_, 1);
         assert(ret > 0); unused(ret);
+        // Writers wait for 0 and upgraders wait for 1.
+        if (ret <= 2) cybozu::wait_policy::notify(word());
+    }
+private:
+    INLINE const uint32_t* word() const { return reinterpret_cast<const uint32_t*>(&v_); }
+    /**
+     * v0 is updated with the current value.
+     */
+    template <typename Pred>
+    INLINE void waitUntil(int& v0, Pred&& pred) const {
+        cybozu::wait_policy::waitUntil(word(), [&]() {
+            v0 = load(v_);
+            return pred();
+        });
     }
 };
 
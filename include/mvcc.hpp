@@ -0,0 +1,588 @@
+#pragma once
+/**
+ * @file
+ * @brief a multi-version concurrency control (MVCC) method with snapshot reads.
+ *
+ * Each record keeps its latest version in place and older versions in a chain.
+ * Read-write transactions access the latest versions and are validated at commit
+ * like Silo OCC, so they are serializable.
+ * Read-only transactions read a snapshot through the chains.
+ * They never abort and never block writers.
+ *
+ * Timestamps are epochs given by TimestampAllocator built on EpochGenerator.
+ * A writer gets its commit epoch after it has locked its write set,
+ * so all the writers of epochs < e have locked their records before the epoch becomes e.
+ * A snapshot of epoch e - 1 is consistent once their installs have finished.
+ *
+ * Versions that no snapshot can read are unlinked by writers and freed by EpochReclaimer.
+ */
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include "atomic_wrapper.hpp"
+#include "arch.hpp"
+#include "cache_line_size.hpp"
+#include "vector_payload.hpp"
+#include "allocator.hpp"
+#include "flat_index.hpp"
+#include "inline.hpp"
+#include "util.hpp"
+#include "tx_util.hpp"
+#include "epoch_reclaimer.hpp"
+
+
+namespace cybozu {
+namespace mvcc {
+
+
+struct TsWord
+{
+    union {
+        uint64_t obj;
+        struct {
+            // This layout is for little endian.
+            uint64_t lock:1;
+            uint64_t seq:23; // to distinguish versions in the same epoch.
+            uint64_t epoch:40;
+        };
+    };
+
+    INLINE TsWord() = default;
+    INLINE TsWord(uint64_t v) : obj(v) {}
+    INLINE operator uint64_t() const { return obj; }
+
+    INLINE void init() { obj = 0; }
+};
+
+
+static_assert(sizeof(TsWord) == sizeof(uint64_t));
+
+
+/**
+ * An old version. It is immutable except next.
+ */
+struct Version
+{
+    TsWord tsw; // lock bit is always 0.
+    Version *next; // older one.
+    alignas(sizeof(uintptr_t)) uint8_t payload[0];
+
+    static Version* allocate(size_t valueSize) {
+        void *p = ::malloc(sizeof(Version) + valueSize);
+        if (p == nullptr) throw std::bad_alloc();
+        return new(p) Version();
+    }
+    /**
+     * This can be used as a deleter for EpochReclaimer.
+     */
+    static void free(void *p) {
+        ::free(p);
+    }
+    /**
+     * Free the chain. Any other thread must not touch it.
+     */
+    static void freeChain(Version *v) {
+        while (v != nullptr) {
+            Version *next = v->next;
+            free(v);
+            v = next;
+        }
+    }
+};
+
+
+struct Mutex
+{
+    TsWord tsw; // of the latest version.
+    Version *older; // the newest old version.
+
+    INLINE Mutex() : tsw(), older(nullptr) { tsw.init(); }
+    ~Mutex() noexcept { Version::freeChain(older); }
+
+    Mutex(const Mutex&) = delete;
+    Mutex& operator=(const Mutex&) = delete;
+    // For VectorWithPayload::reserve().
+    INLINE Mutex(Mutex&& rhs) noexcept : Mutex() {
+        std::swap(tsw.obj, rhs.tsw.obj);
+        std::swap(older, rhs.older);
+    }
+
+    INLINE TsWord load() const { return ::load(tsw); }
+    INLINE TsWord load_acquire() const { return ::load_acquire(tsw); }
+    INLINE void store_release(TsWord tsw0) { ::store_release(tsw, tsw0); }
+    INLINE bool cas_acq(TsWord& tsw0, TsWord tsw1) {
+        return ::compare_exchange_acquire(tsw, tsw0, tsw1);
+    }
+};
+
+
+/**
+ * Timestamp allocator and registry of active snapshots.
+ */
+class TimestampAllocator
+{
+    EpochGenerator& epochGen_;
+    // snapshot epoch of each worker. Inactive if UINT64_MAX.
+    std::vector<CacheLineAligned<uint64_t> > snapshots_;
+    size_t snapshotInterval_; // [epochs].
+
+public:
+    /**
+     * snapshotInterval: snapshot epochs advance every snapshotInterval epochs.
+     * 1 means the latest consistent one.
+     */
+    TimestampAllocator(EpochGenerator& epochGen, size_t nrWorkers, size_t snapshotInterval = 1)
+        : epochGen_(epochGen), snapshots_(nrWorkers), snapshotInterval_(snapshotInterval) {
+        if (snapshotInterval == 0) {
+            throw cybozu::Exception("TimestampAllocator: snapshotInterval must not be 0.");
+        }
+        for (CacheLineAligned<uint64_t>& s : snapshots_) s.value = UINT64_MAX;
+    }
+    TimestampAllocator(const TimestampAllocator&) = delete;
+    TimestampAllocator& operator=(const TimestampAllocator&) = delete;
+
+    /**
+     * Current epoch. It starts with 1
+     * so that initial records (epoch 0) are visible to any snapshot.
+     */
+    INLINE uint64_t get() const { return epochGen_.get() + 1; }
+
+    /**
+     * Snapshot epoch while the current epoch is the given one.
+     * It is < epoch.
+     */
+    INLINE uint64_t snapshotOf(uint64_t epoch) const {
+        if (snapshotInterval_ == 1) return epoch - 1;
+        return (epoch - 1) / snapshotInterval_ * snapshotInterval_;
+    }
+
+    /**
+     * Returns snapshot epoch.
+     * The epoch must be unchanged after registration,
+     * otherwise a concurrent minSnapshot() may miss it.
+     */
+    INLINE uint64_t beginSnapshot(size_t idx) {
+        uint64_t& slot = snapshots_[idx].value;
+        uint64_t epoch = get();
+        for (;;) {
+            const uint64_t snapshot = snapshotOf(epoch);
+            exchange(slot, snapshot, __ATOMIC_SEQ_CST);
+            const uint64_t epoch1 = get();
+            if (likely(epoch == epoch1)) return snapshot;
+            epoch = epoch1;
+        }
+    }
+    INLINE void endSnapshot(size_t idx) {
+        store_release(snapshots_[idx].value, UINT64_MAX);
+    }
+    /**
+     * No snapshot, including ones to begin later, is older than the returned epoch.
+     */
+    uint64_t minSnapshot() const {
+        uint64_t ret = snapshotOf(get()); // this must be read before scan.
+        for (const CacheLineAligned<uint64_t>& s : snapshots_) {
+            ret = std::min(ret, load_acquire(s.value));
+        }
+        return ret;
+    }
+};
+
+
+struct Reader
+{
+    Mutex *mutex;
+    TsWord tsw; // read version.
+    size_t localValIdx;
+
+    INLINE uintptr_t getId() const { return uintptr_t(mutex); }
+};
+
+
+struct Writer
+{
+    Mutex *mutex;
+    void *sharedVal;
+    size_t localValIdx;
+    TsWord tsw; // the locked word. set at commit.
+
+    INLINE uintptr_t getId() const { return uintptr_t(mutex); }
+    INLINE bool operator<(const Writer& rhs) const { return getId() < rhs.getId(); }
+};
+
+
+using ReadSet = std::vector<Reader>;
+using WriteSet = std::vector<Writer>;
+
+
+class LocalSet
+{
+public:
+    using Reclaimer = cybozu::ebr::EpochReclaimer::Local;
+
+private:
+    ReadSet rs_;
+    WriteSet ws_;
+
+#if 1
+    using Index = cybozu::FlatIndex;
+#else
+    using Index = SingleThreadUnorderedMap<uintptr_t, size_t>;
+#endif
+    Index ridx_;
+    Index widx_;
+
+    MemoryVector local_; // stores local values of read/write set.
+    size_t valueSize_;
+    bool nowait_;
+
+    TimestampAllocator *tsAlloc_;
+    Reclaimer *reclaimer_;
+    size_t workerId_;
+
+    bool readOnly_;
+    uint64_t snapshot_; // valid in read-only transactions.
+
+    // Cache of TimestampAllocator::minSnapshot().
+    uint64_t gcEpoch_;
+    uint64_t gcCheckedEpoch_;
+
+public:
+    INLINE LocalSet()
+        : rs_(), ws_(), ridx_(), widx_(), local_()
+        , valueSize_(), nowait_(false)
+        , tsAlloc_(nullptr), reclaimer_(nullptr), workerId_(0)
+        , readOnly_(false), snapshot_(0)
+        , gcEpoch_(0), gcCheckedEpoch_(0) {}
+    /**
+     * reclaimer frees unlinked old versions.
+     * workerId is used to register snapshots.
+     */
+    void init(size_t valueSize, size_t nrReserve,
+              TimestampAllocator& tsAlloc, Reclaimer& reclaimer, size_t workerId) {
+        valueSize_ = valueSize;
+
+        // MemoryVector does not allow zero-size element.
+        if (valueSize == 0) valueSize++;
+        local_.setSizes(valueSize);
+
+        // for long transactions.
+        rs_.reserve(nrReserve);
+        ws_.reserve(nrReserve);
+        local_.reserve(nrReserve);
+
+        tsAlloc_ = &tsAlloc;
+        reclaimer_ = &reclaimer;
+        workerId_ = workerId;
+    }
+    INLINE void setNowait(bool nowait) { nowait_ = nowait; }
+
+    /**
+     * Call this at the beginning of each trial.
+     * A read-only transaction reads the snapshot and can not write.
+     */
+    INLINE void begin(bool readOnly) {
+        assert(rs_.empty() && ws_.empty());
+        readOnly_ = readOnly;
+        if (readOnly) {
+            // Old versions must not be freed while the snapshot is read.
+            reclaimer_->enter();
+            snapshot_ = tsAlloc_->beginSnapshot(workerId_);
+        }
+    }
+    INLINE void read(Mutex& mutex, void *sharedVal, void *dst) {
+        if (readOnly_) {
+            readSnapshot(mutex, sharedVal, dst);
+            return;
+        }
+        size_t lvidx; // local value index.
+        ReadSet::iterator itR = findInReadSet(uintptr_t(&mutex));
+        if (unlikely(itR != rs_.end())) {
+            lvidx = itR->localValIdx;
+        } else {
+            WriteSet::iterator itW = findInWriteSet(uintptr_t(&mutex));
+            if (unlikely(itW != ws_.end())) {
+                // This is blind-written entry.
+                lvidx = itW->localValIdx;
+            } else {
+                lvidx = addReader(mutex, sharedVal).localValIdx;
+            }
+        }
+        copyValue(dst, &local_[lvidx]); // read local
+    }
+    INLINE void write(Mutex& mutex, void *sharedVal, const void *src) {
+        assert(!readOnly_);
+        size_t lvidx;
+        WriteSet::iterator itW = findInWriteSet(uintptr_t(&mutex));
+        if (unlikely(itW != ws_.end())) {
+            lvidx = itW->localValIdx;
+        } else {
+            ReadSet::iterator itR = findInReadSet(uintptr_t(&mutex));
+            if (likely(itR == rs_.end())) {
+                lvidx = allocateLocalVal();
+            } else {
+                lvidx = itR->localValIdx;
+            }
+            Writer& w = ws_.emplace_back();
+            w.mutex = &mutex;
+            w.sharedVal = sharedVal;
+            w.localValIdx = lvidx;
+        }
+        copyValue(&local_[lvidx], src); // write local
+    }
+    /**
+     * Returns:
+     *   true: committed.
+     *   false: you must abort (call clear()).
+     * Read-only transactions always commit.
+     */
+    INLINE bool commit() {
+        return commit([]() {});
+    }
+    /**
+     * beforeInstall() is called at the serialization point,
+     * that is, after the validation while all the write locks are held.
+     * It is also called for read-only transactions.
+     */
+    template <typename BeforeInstall>
+    INLINE bool commit(BeforeInstall&& beforeInstall) {
+        if (readOnly_) {
+            beforeInstall();
+            clear();
+            return true;
+        }
+        // Sorting avoids deadlock.
+        std::sort(ws_.begin(), ws_.end());
+        for (size_t i = 0; i < ws_.size(); i++) {
+            if (unlikely(!lock(ws_[i]))) {
+                unlockWriteSet(i);
+                return false;
+            }
+        }
+
+        // store-load fence is required here in design.
+        // 'lock cmpxchg' on x86_64 is a full fence.
+        const uint64_t epoch = tsAlloc_->get();
+
+        for (const Reader& r : rs_) {
+            TsWord tsw = r.mutex->load_acquire();
+            if (tsw.lock) {
+                if (!std::binary_search(ws_.begin(), ws_.end(), Writer{r.mutex, nullptr, 0, 0})) {
+                    unlockWriteSet(ws_.size());
+                    return false;
+                }
+                tsw.lock = 0;
+            }
+            if (unlikely(tsw != r.tsw)) {
+                unlockWriteSet(ws_.size());
+                return false;
+            }
+        }
+
+        beforeInstall();
+
+        // Write phase.
+        const uint64_t gcEpoch = getGcEpoch(epoch);
+        for (Writer& w : ws_) {
+            install(w, epoch, gcEpoch);
+        }
+        clear();
+        return true;
+    }
+    INLINE void clear() {
+        if (readOnly_) {
+            tsAlloc_->endSnapshot(workerId_);
+            reclaimer_->leave();
+            readOnly_ = false;
+        }
+        rs_.clear();
+        ws_.clear();
+        ridx_.clear();
+        widx_.clear();
+        local_.clear();
+    }
+    bool empty() const { return rs_.empty() && ws_.empty(); }
+
+private:
+    INLINE TsWord waitForUnlocked(const Mutex& mutex) const {
+        TsWord tsw = mutex.load_acquire();
+        while (unlikely(tsw.lock)) {
+            _mm_pause();
+            tsw = mutex.load_acquire();
+        }
+        return tsw;
+    }
+    INLINE Reader& addReader(Mutex& mutex, void *sharedVal) {
+        const size_t lvidx = allocateLocalVal();
+        Reader& r = rs_.emplace_back();
+        r.mutex = &mutex;
+        r.localValIdx = lvidx;
+        for (;;) {
+            r.tsw = waitForUnlocked(mutex);
+            copyValue(&local_[lvidx], sharedVal); // read shared
+            acquire_fence();
+            if (likely(mutex.load() == r.tsw)) break;
+        }
+        return r;
+    }
+    /**
+     * Read the newest version of epoch <= snapshot_.
+     * Writers are installing versions while the record is locked,
+     * so wait for them. It is short.
+     */
+    INLINE void readSnapshot(Mutex& mutex, void *sharedVal, void *dst) {
+        for (;;) {
+            const TsWord tsw = waitForUnlocked(mutex);
+            if (likely(tsw.epoch <= snapshot_)) {
+                copyValue(dst, sharedVal); // read shared
+                acquire_fence();
+                if (likely(mutex.load() == tsw)) return;
+                continue;
+            }
+            const Version *v = ::load_acquire(mutex.older);
+            while (v->tsw.epoch > snapshot_) {
+                v = ::load_acquire(v->next);
+                // Versions readable by active snapshots are never unlinked.
+                assert(v != nullptr);
+            }
+            copyValue(dst, v->payload);
+            return;
+        }
+    }
+    INLINE bool lock(Writer& w) {
+        Mutex& mutex = *w.mutex;
+        TsWord tsw0 = mutex.load();
+        for (;;) {
+            if (unlikely(tsw0.lock)) {
+                if (nowait_) return false;
+                _mm_pause();
+                tsw0 = mutex.load();
+                continue;
+            }
+            TsWord tsw1 = tsw0;
+            tsw1.lock = 1;
+            if (likely(mutex.cas_acq(tsw0, tsw1))) {
+                w.tsw = tsw1;
+                return true;
+            }
+        }
+    }
+    INLINE void unlockWriteSet(size_t nr) {
+        for (size_t i = 0; i < nr; i++) {
+            TsWord tsw = ws_[i].tsw;
+            tsw.lock = 0;
+            ws_[i].mutex->store_release(tsw);
+        }
+    }
+    /**
+     * Keep the current version in the chain if some snapshot may read it,
+     * overwrite it, and unlock the record.
+     */
+    INLINE void install(Writer& w, uint64_t epoch, uint64_t gcEpoch) {
+        Mutex& mutex = *w.mutex;
+        TsWord tsw0 = w.tsw;
+        tsw0.lock = 0;
+        assert(tsw0.epoch <= epoch);
+
+        // The current version is readable from snapshots of [tsw0.epoch, epoch).
+        if (tsw0.epoch != epoch && gcEpoch < epoch) {
+            Version *v = Version::allocate(valueSize_);
+            v->tsw = tsw0;
+            v->next = mutex.older;
+            copyValue(v->payload, w.sharedVal);
+            ::store_release(mutex.older, v);
+        }
+        unlinkUnreadable(mutex, epoch, gcEpoch);
+
+        copyValue(w.sharedVal, &local_[w.localValIdx]); // write shared
+        TsWord tsw1 = tsw0;
+        tsw1.seq = tsw0.epoch == epoch ? tsw0.seq + 1 : 0;
+        tsw1.epoch = epoch;
+        mutex.store_release(tsw1);
+    }
+    /**
+     * Every snapshot reads the newest version of epoch <= gcEpoch or newer ones,
+     * so the versions older than it are retired.
+     */
+    INLINE void unlinkUnreadable(Mutex& mutex, uint64_t epoch, uint64_t gcEpoch) {
+        Version *v = mutex.older;
+        Version *garbage;
+        if (gcEpoch >= epoch) {
+            // The new version is the one.
+            garbage = v;
+            ::store(mutex.older, nullptr);
+        } else {
+            while (v != nullptr && v->tsw.epoch > gcEpoch) v = v->next;
+            if (likely(v == nullptr)) return;
+            garbage = v->next;
+            ::store(v->next, nullptr);
+        }
+        while (garbage != nullptr) {
+            Version *next = garbage->next;
+            reclaimer_->retire(garbage, Version::free);
+            garbage = next;
+        }
+    }
+    INLINE uint64_t getGcEpoch(uint64_t epoch) {
+        // Scanning all the snapshots once per epoch is enough.
+        if (unlikely(gcCheckedEpoch_ != epoch)) {
+            gcEpoch_ = tsAlloc_->minSnapshot();
+            gcCheckedEpoch_ = epoch;
+        }
+        return gcEpoch_;
+    }
+    INLINE ReadSet::iterator findInReadSet(uintptr_t key) {
+        return findInSet(
+            key, rs_, ridx_,
+            [](const Reader& r) { return r.getId(); });
+    }
+    INLINE WriteSet::iterator findInWriteSet(uintptr_t key) {
+        // Do not use this after the write set is sorted in commit().
+        return findInSet(
+            key, ws_, widx_,
+            [](const Writer& w) { return w.getId(); });
+    }
+    template <typename Vector, typename Map, typename Func>
+    INLINE typename Vector::iterator findInSet(uintptr_t key, Vector& vec, Map& map, Func&& func) {
+        if (unlikely(shouldUseIndex(vec))) {
+            for (size_t i = map.size(); i < vec.size(); i++) {
+                map[func(vec[i])] = i;
+            }
+            typename Map::iterator it = map.find(key);
+            if (unlikely(it == map.end())) {
+                return vec.end();
+            } else {
+                size_t idx = it->second;
+                return vec.begin() + idx;
+            }
+        }
+        return std::find_if(
+            vec.begin(), vec.end(),
+            [&](const typename Vector::value_type& v) {
+                return func(v) == key;
+            });
+    }
+    template <typename Vector>
+    INLINE bool shouldUseIndex(const Vector& vec) const {
+        constexpr size_t threshold = 4096 / sizeof(typename Vector::value_type);
+        return vec.size() > threshold;
+    }
+    INLINE void copyValue(void* dst, const void* src) {
+#ifndef NO_PAYLOAD
+        ::memcpy(dst, src, valueSize_);
+#else
+        unused(dst); unused(src);
+#endif
+    }
+    INLINE size_t allocateLocalVal() {
+        const size_t idx = local_.size();
+#ifndef NO_PAYLOAD
+        local_.resize(idx + 1);
+#endif
+        return idx;
+    }
+};
+
+
+}} // namespace cybozu::mvcc
@@ -3,25 +3,41 @@
 #include "write_set.hpp"
 #include "vector_payload.hpp"
 #include "allocator.hpp"
+#include "flat_index.hpp"
 #include "inline.hpp"
+#include "record_table.hpp"
+#include "epoch_reclaimer.hpp"
+#include "tx_util.hpp"
+#include "bamboo.hpp"
+#include "time.hpp"
+#include "bravo.hpp"
 
 
 namespace cybozu {
 namespace lock {
 
 
-class NoWaitLockSet
+/**
+ * Lock: XSLock or BravoLock.
+ */
+template <typename Lock>
+class NoWaitLockSetT
 {
-    using Mutex = cybozu::lock::XSMutex;
-    using Lock = cybozu::lock::XSLock;
-    using Mode = Mutex::Mode;
+public:
+    using Mutex = typename Lock::Mutex;
+    using StateSet = cybozu::record::RecordStateSet<Mutex>;
+    using Table = typename StateSet::Table;
+    using Reclaimer = cybozu::ebr::EpochReclaimer::Local;
+
+private:
+    using Mode = typename Mutex::Mode;
     using OpEntryL = OpEntry<Lock>;
 
     using Vec = std::vector<OpEntryL>;
 #if 1
-    using Index = SingleThreadUnorderedMap<uintptr_t, size_t>;
+    using Index = cybozu::FlatIndex;
 #else
-    using Index = std::unordered_map<uintptr_t, size_t>;
+    using Index = SingleThreadUnorderedMap<uintptr_t, size_t>;
 #endif
 
     Vec vec_;
@@ -41,6 +57,18 @@ class NoWaitLockSet
     };
     std::vector<BlindWriteInfo> bwV_;
 
+    StateSet states_; // record state changes by insert/remove.
+    Reclaimer *reclaimer_ = nullptr;
+
+    WoundFlag abortFlag_; // set by cascading aborts of retire chains.
+    cybozu::bamboo::RetireSet retire_;
+
+    // Bounded wait. See setWaitBudget().
+    uint64_t waitCycles_ = 0;
+    size_t adaptivePct_ = 0;
+    uint64_t avgTxCycles_ = 0; // moving average of committed transactions.
+    uint64_t txBeginTsc_ = 0;
+
 public:
     void init(size_t valueSize, size_t nrReserve) {
         valueSize_ = valueSize;
@@ -53,8 +81,38 @@ public:
         bwV_.reserve(nrReserve);
     }
 
+    /**
+     * Accesses to the hot records in the table bypass their locks
+     * and retire early. See bamboo.hpp.
+     * Call setTxId() before each transaction.
+     */
+    void setRetireTable(cybozu::bamboo::RetireTable& table) {
+        retire_.init(table, abortFlag_, valueSize_, false);
+    }
+    void setTxId(uint64_t txId) { retire_.setTxId(txId); }
+    /**
+     * Bounded wait.
+     * A conflicting lock request spins up to the budget and then the transaction should abort.
+     * cycles: budget in TSC cycles. 0 means no-wait (default).
+     * adaptivePct: if not 0, the budget is the percentage of the recent average duration
+     *   of committed transactions. cycles is used until the first commit.
+     */
+    void setWaitBudget(uint64_t cycles, size_t adaptivePct = 0) {
+        waitCycles_ = cycles;
+        adaptivePct_ = adaptivePct;
+        avgTxCycles_ = 0;
+    }
+    uint64_t getWaitBudget() const {
+        if (adaptivePct_ == 0 || avgTxCycles_ == 0) return waitCycles_;
+        return avgTxCycles_ * adaptivePct_ / 100;
+    }
+
     INLINE bool read(Mutex& mutex, void* sharedVal, void* dst) {
-        Vec::iterator it = find(uintptr_t(&mutex));
+        if (unlikely(retire_.enabled())) {
+            if (abortFlag_.is_wounded()) return false;
+            if (auto *chain = retire_.find(&mutex)) return retire_.read(*chain, dst);
+        }
+        typename Vec::iterator it = find(uintptr_t(&mutex));
         if (unlikely(it != vec_.end())) {
             Lock& lk = it->lock;
             if (lk.mode() == Mode::S) {
@@ -66,20 +124,24 @@ public:
             return true;
         }
         // Try to read lock.
-        OpEntryL& ope = vec_.emplace_back();
+        OpEntryL& ope = addEntry();
         Lock& lk = ope.lock;
-        if (unlikely(!lk.read_trylock(mutex))) {
+        if (unlikely(!tryWait([&]() { return lk.read_trylock(mutex); }))) {
             return false; // should die.
         }
         copyValue(dst, sharedVal); // read shared data.
         return true;
     }
     INLINE bool write(Mutex& mutex, void* sharedVal, void* src) {
-        Vec::iterator it = find(uintptr_t(&mutex));
+        if (unlikely(retire_.enabled())) {
+            if (abortFlag_.is_wounded()) return false;
+            if (auto *chain = retire_.find(&mutex)) return retire_.write(*chain, src);
+        }
+        typename Vec::iterator it = find(uintptr_t(&mutex));
         if (unlikely(it != vec_.end())) {
             Lock& lk = it->lock;
             if (lk.mode() == Mode::S) {
-                if (unlikely(!lk.tryUpgrade())) return false;
+                if (unlikely(!tryWait([&]() { return lk.tryUpgrade(); }))) return false;
                 it->info.set(allocateLocalVal(), sharedVal);
             }
             assert(lk.mode() == Mode::X || lk.mode() == Mode::Invalid);
@@ -87,7 +149,7 @@ public:
             return true;
         }
         // This is blind write.
-        OpEntryL& ope = vec_.emplace_back();
+        OpEntryL& ope = addEntry();
         // Lock will be tried later. See blindWriteLockAll().
         ope.lock.setMutex(&mutex); // for search.
         bwV_.emplace_back(&mutex, vec_.size() - 1);
@@ -96,7 +158,11 @@ public:
         return true;
     }
     INLINE bool readForUpdate(Mutex& mutex, void* sharedVal, void* dst) {
-        Vec::iterator it = find(uintptr_t(&mutex));
+        if (unlikely(retire_.enabled())) {
+            if (abortFlag_.is_wounded()) return false;
+            if (auto *chain = retire_.find(&mutex)) return retire_.readForUpdate(*chain, dst);
+        }
+        typename Vec::iterator it = find(uintptr_t(&mutex));
         if (unlikely(it != vec_.end())) {
             Lock& lk = it->lock;
             LocalValInfo& info = it->info;
@@ -105,7 +171,7 @@ public:
                 return true;
             }
             if (lk.mode() == Mode::S) {
-                if (!lk.tryUpgrade()) return false;
+                if (!tryWait([&]() { return lk.tryUpgrade(); })) return false;
                 info.set(allocateLocalVal(), sharedVal);
                 void *localVal = getLocalValPtr(info);
                 copyValue(localVal, sharedVal); // for next read.
@@ -117,10 +183,10 @@ public:
             return true;
         }
         // Try to write lock.
-        OpEntryL& ope = vec_.emplace_back();
+        OpEntryL& ope = addEntry();
         Lock& lk = ope.lock;
         LocalValInfo& info = ope.info;
-        if (unlikely(!lk.write_trylock(mutex))) {
+        if (unlikely(!tryWait([&]() { return lk.write_trylock(mutex); }))) {
             return false; // should die.
         }
         info.set(allocateLocalVal(), sharedVal);
@@ -130,19 +196,62 @@ public:
         return true;
     }
 
+    /**
+     * Removed records must be reclaimed after any other worker does not touch them.
+     * Call this before remove().
+     */
+    INLINE void setReclaimer(Reclaimer& reclaimer) { reclaimer_ = &reclaimer; }
+    /**
+     * Insert a record with the key.
+     * Returns false if the key exists or the lock can not be acquired.
+     * The caller should abort the transaction.
+     */
+    INLINE bool insert(Table& table, uint64_t key, const void* src) {
+        typename Table::Record& rec = getRecord(table, key);
+        OpEntryL* ope = writeLock(rec.value, rec.payload);
+        if (unlikely(ope == nullptr)) return false; // should die.
+        if (states_.get(rec) != cybozu::record::RecordState::ABSENT) return false;
+        states_.insert(rec);
+        copyValue(getLocalValPtr(ope->info), src); // write local data.
+        return true;
+    }
+    /**
+     * Remove the record with the key.
+     * Returns false if the key does not exist or the lock can not be acquired.
+     */
+    INLINE bool remove(Table& table, uint64_t key) {
+        assert(reclaimer_ != nullptr);
+        typename Table::Record& rec = getRecord(table, key);
+        if (unlikely(writeLock(rec.value, rec.payload) == nullptr)) return false; // should die.
+        if (states_.get(rec) != cybozu::record::RecordState::PRESENT) return false;
+        states_.remove(table, key, rec);
+        return true;
+    }
+
     INLINE bool blindWriteLockAll() {
         for (BlindWriteInfo& bwInfo : bwV_) {
             OpEntryL& ope = vec_[bwInfo.idx];
+            if (unlikely(ope.lock.mode() == Mode::X)) continue; // locked by insert/remove.
             assert(ope.lock.mode() == Mode::Invalid);
-            if (unlikely(!ope.lock.write_trylock(*bwInfo.mutex))) {
+            ope.lock.setMutex(nullptr); // it was set for search.
+            if (unlikely(!tryWait([&]() { return ope.lock.write_trylock(*bwInfo.mutex); }))) {
                 return false; // should die
             }
         }
+        if (unlikely(retire_.enabled())) {
+            // Wait for the transactions this depends on.
+            return retire_.preCommit();
+        }
         return true;
     }
     INLINE void updateAndUnlock() {
         // serialization point.
+        if (unlikely(adaptivePct_ != 0) && !vec_.empty()) {
+            const uint64_t d = cybozu::time::rdtscp() - txBeginTsc_;
+            avgTxCycles_ = avgTxCycles_ == 0 ? d : avgTxCycles_ - avgTxCycles_ / 8 + d / 8;
+        }
 
+        states_.apply();
         for (OpEntryL& ope : vec_) {
             Lock& lk = ope.lock;
             if (lk.mode() == Mode::X) {
@@ -159,18 +268,78 @@ public:
         index_.clear();
         local_.clear();
         bwV_.clear();
+        if (unlikely(!states_.empty())) states_.unlink(*reclaimer_);
+        if (unlikely(retire_.enabled())) {
+            retire_.commit();
+            abortFlag_.reset();
+        }
     }
     INLINE void unlock() {
+        if (unlikely(retire_.enabled())) {
+            retire_.abort();
+            abortFlag_.reset();
+        }
         vec_.clear(); // unlock.
         index_.clear();
         local_.clear();
         bwV_.clear();
+        states_.clear();
     }
     bool empty() const {
-        return vec_.empty() && index_.empty();
+        return vec_.empty() && index_.empty() && states_.empty() && retire_.empty();
     }
 private:
-    INLINE Vec::iterator find(uintptr_t key) {
+    INLINE OpEntryL& addEntry() {
+        if (unlikely(adaptivePct_ != 0) && vec_.empty()) txBeginTsc_ = cybozu::time::rdtscp();
+        return vec_.emplace_back();
+    }
+    /**
+     * Returns false if the lock can not be acquired in the wait budget.
+     */
+    template <typename TryLock>
+    INLINE bool tryWait(TryLock&& tryLock) {
+        if (likely(tryLock())) return true;
+        const uint64_t budget = getWaitBudget();
+        if (budget == 0) return false; // no-wait.
+        const uint64_t t0 = cybozu::time::rdtscp();
+        size_t i = 0;
+        do {
+            cybozu::wait_policy::pause(i++);
+            if (tryLock()) return true;
+        } while (cybozu::time::rdtscp() - t0 < budget);
+        return false;
+    }
+    INLINE typename Table::Record& getRecord(Table& table, uint64_t key) {
+        return table.get_or_insert(key, [](cybozu::record::RecordMutex<Mutex>& mutex) {
+                mutex.state = cybozu::record::RecordState::ABSENT; });
+    }
+    /**
+     * Write-lock the record immediately because the record state must be checked.
+     * Returns nullptr if the lock can not be acquired.
+     */
+    INLINE OpEntryL* writeLock(Mutex& mutex, void* sharedVal) {
+        typename Vec::iterator it = find(uintptr_t(&mutex));
+        if (unlikely(it != vec_.end())) {
+            Lock& lk = it->lock;
+            LocalValInfo& info = it->info;
+            if (lk.mode() == Mode::S) {
+                if (!tryWait([&]() { return lk.tryUpgrade(); })) return nullptr;
+                info.set(allocateLocalVal(), sharedVal);
+                copyValue(getLocalValPtr(info), sharedVal);
+            } else if (lk.mode() == Mode::Invalid) {
+                // This is blind-written entry that has not been locked yet.
+                lk.setMutex(nullptr); // it was set for search.
+                if (!tryWait([&]() { return lk.write_trylock(mutex); })) return nullptr;
+            }
+            return &*it;
+        }
+        OpEntryL& ope = addEntry();
+        if (unlikely(!tryWait([&]() { return ope.lock.write_trylock(mutex); }))) return nullptr;
+        ope.info.set(allocateLocalVal(), sharedVal);
+        copyValue(getLocalValPtr(ope.info), sharedVal);
+        return &ope;
+    }
+    INLINE typename Vec::iterator find(uintptr_t key) {
         // at most 4KiB scan.
         const size_t threshold = 4096 / sizeof(OpEntryL);
         if (unlikely(vec_.size() > threshold)) {
@@ -219,4 +388,8 @@ private:
     }
 };
 
+
+using NoWaitLockSet = NoWaitLockSetT<XSLock>;
+using BravoNoWaitLockSet = NoWaitLockSetT<BravoLock>;
+
 }} //namespace cybozu::lock
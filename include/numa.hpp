@@ -0,0 +1,173 @@
+#pragma once
+/**
+ * NUMA memory placement policies.
+ *
+ * set_mempolicy() and get_mempolicy() are called via raw syscalls
+ * so that libnuma is not required.
+ */
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "cybozu/exception.hpp"
+
+
+namespace cybozu {
+namespace numa {
+
+
+// The same values as <numaif.h>.
+constexpr int MPOL_DEFAULT = 0;
+constexpr int MPOL_BIND = 2;
+constexpr int MPOL_INTERLEAVE = 3;
+
+
+/**
+ * none: first touch (the kernel default).
+ * interleave: pages are interleaved among the nodes of all the workers.
+ * local: each partition is bound to the node of its worker.
+ * replicate: the same as local, and read-only tables are replicated per node.
+ */
+enum class Policy : uint8_t {
+    NONE, INTERLEAVE, LOCAL, REPLICATE,
+};
+
+
+const std::pair<Policy, const char*> policyTable_[] = {
+    {Policy::NONE, "none"},
+    {Policy::INTERLEAVE, "interleave"},
+    {Policy::LOCAL, "local"},
+    {Policy::REPLICATE, "replicate"},
+};
+
+
+inline Policy parsePolicy(const std::string& s)
+{
+    for (const auto& p : policyTable_) {
+        if (s == p.second) return p.first;
+    }
+    throw cybozu::Exception("numa::parsePolicy: bad policy") << s;
+}
+
+
+inline const char* policyToStr(Policy policy)
+{
+    for (const auto& p : policyTable_) {
+        if (policy == p.first) return p.second;
+    }
+    throw cybozu::Exception("numa::policyToStr: bad policy") << int(policy);
+}
+
+
+/**
+ * Bitmask of NUMA nodes for the syscalls.
+ */
+class NodeMask
+{
+public:
+    static constexpr size_t BITS = sizeof(unsigned long) * 8;
+private:
+    std::vector<unsigned long> v_;
+public:
+    NodeMask() : v_() {
+    }
+    explicit NodeMask(const std::vector<uint>& nodes) : NodeMask() {
+        for (uint node : nodes) set(node);
+    }
+    /**
+     * words: a mask got from the kernel. Trailing zero words are removed.
+     */
+    static NodeMask fromWords(std::vector<unsigned long>&& words) {
+        NodeMask mask;
+        mask.v_ = std::move(words);
+        while (!mask.v_.empty() && mask.v_.back() == 0) mask.v_.pop_back();
+        return mask;
+    }
+    void set(uint node) {
+        if (node / BITS >= v_.size()) v_.resize(node / BITS + 1);
+        v_[node / BITS] |= 1UL << (node % BITS);
+    }
+    bool empty() const { return v_.empty(); }
+    const unsigned long* data() const { return v_.data(); }
+    /**
+     * The kernel ignores the last bit of maxnode.
+     */
+    unsigned long maxNode() const { return v_.size() * BITS + 1; }
+};
+
+
+inline void setMemPolicy(int mode, const NodeMask& mask)
+{
+    const long ret = ::syscall(SYS_set_mempolicy, mode,
+                               mask.empty() ? nullptr : mask.data(),
+                               mask.empty() ? 0 : mask.maxNode());
+    if (ret != 0) {
+        throw cybozu::Exception("numa::setMemPolicy: failed") << mode << ::strerror(errno);
+    }
+}
+
+
+/**
+ * Policy of the current thread including the mode flags.
+ */
+inline void getMemPolicy(int& mode, NodeMask& mask)
+{
+    // The kernel requires room for all the possible nodes.
+    for (size_t nrWords = 16; nrWords <= 1024; nrWords *= 2) {
+        std::vector<unsigned long> v(nrWords);
+        const long ret = ::syscall(SYS_get_mempolicy, &mode, v.data(), nrWords * NodeMask::BITS, nullptr, 0);
+        if (ret == 0) {
+            mask = NodeMask::fromWords(std::move(v));
+            return;
+        }
+        if (errno != EINVAL) break;
+    }
+    throw cybozu::Exception("numa::getMemPolicy: failed") << ::strerror(errno);
+}
+
+
+/**
+ * Memory policy of the current thread during the scope.
+ * Pages first touched in the scope follow the policy.
+ * The previous policy (e.g. given by numactl) is restored at the end.
+ */
+class MemPolicyScope
+{
+    int prevMode_;
+    NodeMask prevMask_;
+public:
+    MemPolicyScope(int mode, const NodeMask& mask) : prevMode_(MPOL_DEFAULT), prevMask_() {
+        getMemPolicy(prevMode_, prevMask_);
+        setMemPolicy(mode, mask);
+    }
+    /**
+     * Bind to a single node.
+     */
+    explicit MemPolicyScope(uint node) : MemPolicyScope(MPOL_BIND, NodeMask({node})) {
+    }
+    ~MemPolicyScope() noexcept {
+        try {
+            setMemPolicy(prevMode_, prevMask_);
+        } catch (...) {
+        }
+    }
+    MemPolicyScope(const MemPolicyScope&) = delete;
+    MemPolicyScope& operator=(const MemPolicyScope&) = delete;
+};
+
+
+/**
+ * Distinct nodes in ascending order.
+ */
+inline std::vector<uint> uniqueNodes(std::vector<uint> nodes)
+{
+    std::sort(nodes.begin(), nodes.end());
+    nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+    return nodes;
+}
+
+
+}} // namespace cybozu::numa
@@ -12,14 +12,16 @@
 #include "arch.hpp"
 #include "vector_payload.hpp"
 #include "allocator.hpp"
+#include "flat_index.hpp"
 #include "inline.hpp"
-
-
-#if 0
-#define USE_OCC_MCS
-#else
-#undef USE_OCC_MCS
-#endif
+#include "ordered_index.hpp"
+#include "record_table.hpp"
+#include "epoch_reclaimer.hpp"
+#include "mvcc.hpp"
+#include "time.hpp"
+#include "tx_repair.hpp"
+#include "soa_read_set.hpp"
+#include "wait_policy.hpp"
 
 
 namespace cybozu {
@@ -32,10 +34,14 @@ struct OccMutexData
         uint32_t obj;
         struct {
             // layout for little endian architecture.
-            uint32_t version:31;
+            uint32_t version:29;
+            uint32_t absent:1; // the record does not exist.
+            uint32_t dead:1; // the record has been removed and will be unlinked from the index.
             uint32_t locked:1;
         };
     };
+    static constexpr uint32_t VERSION_MASK = (1U << 29) - 1;
+    static constexpr uint32_t LOCKED_MASK = 1U << 31;
 
     INLINE OccMutexData() = default;
     INLINE OccMutexData(uint32_t obj0): obj(obj0) {}
@@ -43,18 +49,53 @@ struct OccMutexData
 };
 
 
+/**
+ * Temperature of a record for MOCC.
+ * It is incremented when the verification of the record fails,
+ * and halved every 2^DECAY_SHIFT clocks.
+ */
+struct Temperature
+{
+    union {
+        uint32_t obj;
+        struct {
+            uint32_t value:16;
+            uint32_t stamp:16; // clock >> DECAY_SHIFT.
+        };
+    };
+    static constexpr size_t DECAY_SHIFT = 28; // about 0.1 sec with a 2.5GHz tsc.
+
+    INLINE Temperature() = default;
+    INLINE Temperature(uint32_t obj0): obj(obj0) {}
+    INLINE operator uint32_t() const { return obj; }
+
+    static uint32_t now() {
+        return uint32_t(cybozu::time::rdtscp() >> DECAY_SHIFT) & 0xffff;
+    }
+    INLINE uint32_t get(uint32_t now) const {
+        const uint32_t elapsed = (now - stamp) & 0xffff;
+        return elapsed >= 16 ? 0 : value >> elapsed;
+    }
+    INLINE Temperature incremented(uint32_t now) const {
+        Temperature t;
+        t.value = std::min<uint32_t>(get(now) + 1, 0xffff);
+        t.stamp = now;
+        return t;
+    }
+};
+
+
 struct OccMutex
 {
     alignas(sizeof(uintptr_t))
     OccMutexData md;
-#ifdef USE_OCC_MCS
-    cybozu::lock::McsSpinlock::Mutex mcsMutex;
-#endif
+    Temperature temp; // in the padding.
+#ifdef USE_MCS_WAIT_QUEUE
+    cybozu::lock::QueueSpinlock::Mutex mcsMutex; // used by the mcs wait policy.
 
-#ifdef USE_OCC_MCS
-    INLINE OccMutex() : md(0), mcsMutex() {}
+    INLINE OccMutex() : md(0), temp(0), mcsMutex() {}
 #else
-    INLINE OccMutex() : md(0) {}
+    INLINE OccMutex() : md(0), temp(0) {}
 #endif
 
     INLINE OccMutexData load() const { return ::load(md); }
@@ -66,9 +107,20 @@ struct OccMutex
     INLINE bool cas_acq(OccMutexData& md0, OccMutexData md1) {
         return ::compare_exchange_acquire(md, md0, md1);
     }
+
+    INLINE uint32_t temperature(uint32_t now) const { return ::load(temp).get(now); }
+    /**
+     * Lost updates are allowed.
+     */
+    INLINE void heatUp(uint32_t now) { ::store(temp, ::load(temp).incremented(now)); }
 };
 
 
+#ifndef USE_MCS_WAIT_QUEUE
+static_assert(sizeof(OccMutex) == sizeof(uint64_t));
+#endif
+
+
 class OccLock
 {
 public:
@@ -120,16 +172,25 @@ public:
             }
         }
     }
-    INLINE void unlock(bool updated = false) {
+    /**
+     * removed: the record will be absent and dead. Effective only if updated is true.
+     */
+    INLINE void unlock(bool updated = false, bool removed = false) {
         if (unlikely(!mutex_)) return;
         MutexData md0 = md_;
         assert(md0.locked);
-        if (likely(updated)) md0.version++;
+        if (likely(updated)) {
+            md0.version++;
+            md0.absent = removed;
+            md0.dead = removed;
+        }
         md0.locked = 0;
         mutex_->store_release(md0);
+        cybozu::wait_policy::notify(&mutex_->md.obj);
         mutex_ = nullptr;
     }
     INLINE uintptr_t getMutexId() const { return uintptr_t(mutex_); }
+    INLINE MutexData getMutexData() const { return md_; }
 private:
     INLINE void swap(OccLock& rhs) noexcept {
         std::swap(mutex_, rhs.mutex_);
@@ -137,15 +198,18 @@ private:
     }
     INLINE MutexData waitFor() {
         assert(mutex_ != nullptr);
-#ifdef USE_OCC_MCS
-        // In order so many threads not to spin on md value.
-        cybozu::lock::McsSpinlock lk(mutex_->mcsMutex);
-#endif
-        MutexData md0 = mutex_->load();
-        while (md0.locked) {
-            _mm_pause();
+        MutexData md0;
+        auto pred = [&]() {
             md0 = mutex_->load();
-        }
+            return !md0.locked;
+        };
+#ifdef USE_MCS_WAIT_QUEUE
+        // The mcs policy queues waiters in order so many threads not to spin on md value.
+        cybozu::wait_policy::waitUntilQueued<cybozu::lock::QueueSpinlock>(
+            mutex_->mcsMutex, &mutex_->md.obj, pred);
+#else
+        cybozu::wait_policy::waitUntil(&mutex_->md.obj, pred);
+#endif
         return md0;
     }
 };
@@ -186,11 +250,11 @@ public:
      */
     INLINE void prepare() {
         assert(mutex_);
-        MutexData md0 = mutex_->load_acquire();
-        while (md0.locked) {
-            _mm_pause();
+        MutexData md0;
+        cybozu::wait_policy::waitUntil(&mutex_->md.obj, [&]() {
             md0 = mutex_->load_acquire();
-        }
+            return !md0.locked;
+        });
         md_ = md0;
     }
     INLINE bool tryPrepare() {
@@ -198,6 +262,14 @@ public:
         md_ = mutex_->load_acquire();
         return !md_.locked;
     }
+    /**
+     * Use this instead of prepare() if the caller holds the lock.
+     * md0 is the value got by the lock.
+     */
+    INLINE void prepareLocked(MutexData md0) {
+        md0.locked = 0;
+        md_ = md0;
+    }
     /**
      * Call this just after read the resource.
      */
@@ -216,6 +288,13 @@ public:
         return md_.version == md0.version;
     }
     INLINE uintptr_t getMutexId() const { return uintptr_t(mutex_); }
+    INLINE const uint32_t* getMutexWord() const { return &mutex_->md.obj; }
+    INLINE MutexData getMutexData() const { return md_; }
+    /**
+     * Record state at the time of the read.
+     */
+    INLINE bool isAbsent() const { return md_.absent; }
+    INLINE bool isDead() const { return md_.dead; }
 
     INLINE void swap(OccReader& rhs) noexcept {
         std::swap(mutex_, rhs.mutex_);
@@ -232,6 +311,8 @@ struct WriteEntry
     Mutex *mutex;
     void *sharedVal;
     size_t localValIdx;  // index in the local data area.
+    bool removed; // the record will be absent after commit.
+    uint32_t srcIdx; // index of the read the local value is derived from, for repair.
 
     /**
      * Call set() to fill values.
@@ -250,6 +331,8 @@ struct WriteEntry
         mutex = mutex0;
         sharedVal = sharedVal0;
         localValIdx = localValIdx0;
+        removed = false;
+        srcIdx = TxRepair::NO_SRC;
     }
     INLINE uintptr_t getMutexId() const { return uintptr_t(mutex); }
 private:
@@ -257,6 +340,8 @@ private:
         std::swap(mutex, rhs.mutex);
         std::swap(sharedVal, rhs.sharedVal);
         std::swap(localValIdx, rhs.localValIdx);
+        std::swap(removed, rhs.removed);
+        std::swap(srcIdx, rhs.srcIdx);
     }
 };
 
@@ -265,6 +350,9 @@ class LockSet
 {
 public:
     using Mutex = OccMutex;
+    using OrderedIndex = cybozu::index::BTree<DataWithPayload<Mutex> >;
+    using Table = cybozu::record::RecordTable<Mutex>;
+    using Reclaimer = cybozu::ebr::EpochReclaimer::Local;
 
 private:
     using LockV = std::vector<OccLock>;
@@ -273,9 +361,9 @@ private:
 
     // key is mutex pointer, value is index in vector.
 #if 1
-    using IndexM = SingleThreadUnorderedMap<uintptr_t, size_t>;
+    using IndexM = cybozu::FlatIndex;
 #else
-    using IndexM = std::unordered_map<uintptr_t, size_t>;
+    using IndexM = SingleThreadUnorderedMap<uintptr_t, size_t>;
 #endif
 
     WriteV writeV_; // write set.
@@ -283,10 +371,29 @@ private:
     ReadV readV_; // read set.
     IndexM readM_; // read set index.
     LockV lockV_;
+    cybozu::index::NodeSet nodeSet_; // leaves visited by scans.
+    OrderedIndex::ScanBuffer scanV_;
+
+    cybozu::record::RemovedRecords<Table> removed_;
+    Reclaimer *reclaimer_ = nullptr;
 
     MemoryVector local_; // stores local values of read/write set.
     size_t valueSize_;
 
+    /*
+     * MOCC: hot records are locked in the read phase.
+     * 0 means disabled.
+     */
+    uint32_t hotThreshold_ = 0;
+    uint32_t now_ = 0; // Temperature::now() at the beginning of the transaction.
+    LockV hotLockV_; // locks taken in the read phase.
+    uintptr_t maxHotLockId_ = 0;
+    std::vector<Mutex*> rll_; // retrospective lock list in the address order.
+    size_t rllIdx_ = 0; // rll_[0, rllIdx_) have been locked.
+
+    TxRepair repair_; // used by verifyWithRepair().
+    SoaReadSet<uint32_t> soa_; // used by verify() for large read sets.
+
 public:
     INLINE void init(size_t valueSize, size_t nrReserve) {
         valueSize_ = valueSize;  // 0 can be allowed.
@@ -301,6 +408,21 @@ public:
         lockV_.reserve(nrReserve);
         local_.reserve(nrReserve);
     }
+    /**
+     * MOCC: records whose temperature is >= threshold are locked in the read phase.
+     * 0 means pure OCC (default).
+     */
+    void setHotThreshold(uint32_t threshold) {
+        hotThreshold_ = threshold;
+        now_ = Temperature::now();
+    }
+    /**
+     * Enable transaction repair with verifyWithRepair().
+     * derive: nullptr means disabled.
+     */
+    void setRepair(TxRepair::Derive derive) {
+        repair_.init(derive, valueSize_);
+    }
     INLINE void read(Mutex& mutex, void *sharedVal, void *localVal) {
         unused(sharedVal); unused(localVal);
         size_t localValIdx;
@@ -314,14 +436,7 @@ public:
                 // This is blind write, so we just read from local write set.
                 localValIdx = itW->localValIdx;
             } else {
-                // allocate new local value area.
-                localValIdx = local_.size();
-#ifndef NO_PAYLOAD
-                local_.resize(localValIdx + 1);
-#endif
-                OccReader& r = readV_.emplace_back();
-                r.set(&mutex, sharedVal, localValIdx);
-                readToLocal(r);
+                localValIdx = addReader(mutex, sharedVal).localValIdx;
             }
         }
         // read local data.
@@ -329,6 +444,70 @@ public:
         ::memcpy(localVal, &local_[localValIdx], valueSize_);
 #endif
     }
+    /**
+     * Read at most nr records whose keys are >= lo through the index.
+     * func: void(uint64_t key, const void *localVal) will be called for each record.
+     * Visited leaves are validated in verify() to detect phantoms.
+     */
+    template <typename Func>
+    INLINE void scan(const OrderedIndex& index, uint64_t lo, size_t nr, void *localVal, Func&& func) {
+        scanV_.clear();
+        index.scan(lo, nr, scanV_, &nodeSet_);
+        for (OrderedIndex::KeyValue& kv : scanV_) {
+            DataWithPayload<Mutex>& rec = *kv.second;
+            read(rec.value, rec.payload, localVal);
+            func(kv.first, localVal);
+        }
+    }
+    INLINE void scan(const OrderedIndex& index, uint64_t lo, size_t nr, void *localVal) {
+        scan(index, lo, nr, localVal, [](uint64_t, const void*) {});
+    }
+    /**
+     * Removed records must be reclaimed after any other worker does not touch them.
+     * Call this before remove().
+     */
+    INLINE void setReclaimer(Reclaimer& reclaimer) { reclaimer_ = &reclaimer; }
+    /**
+     * Insert a record with the key.
+     * Returns false if the key exists or the record is being removed by another worker.
+     * The caller should abort the transaction in the latter case.
+     */
+    INLINE bool insert(Table& table, uint64_t key, void *localVal) {
+        DataWithPayload<Mutex>& rec = getRecord(table, key);
+        Mutex& mutex = rec.value;
+        WriteV::iterator itW = findInWriteSet(uintptr_t(&mutex));
+        if (unlikely(itW != writeV_.end())) {
+            if (!itW->removed) return false;
+            write(mutex, rec.payload, localVal);
+            return true;
+        }
+        OccReader& r = getReader(mutex, rec.payload);
+        if (!r.isAbsent() || r.isDead()) return false;
+        write(mutex, rec.payload, localVal);
+        return true;
+    }
+    /**
+     * Remove the record with the key.
+     * Returns false if the key does not exist (or the record is being removed).
+     */
+    INLINE bool remove(Table& table, uint64_t key) {
+        assert(reclaimer_ != nullptr);
+        DataWithPayload<Mutex>& rec = getRecord(table, key);
+        Mutex& mutex = rec.value;
+        WriteV::iterator itW = findInWriteSet(uintptr_t(&mutex));
+        if (unlikely(itW != writeV_.end())) {
+            if (itW->removed) return false;
+            itW->removed = true;
+        } else {
+            OccReader& r = getReader(mutex, rec.payload);
+            if (r.isAbsent()) return false;
+            WriteEntry& w = writeV_.emplace_back();
+            w.set(&mutex, rec.payload, r.localValIdx);
+            w.removed = true;
+        }
+        removed_.add(table, key, rec);
+        return true;
+    }
     INLINE void readToLocal(OccReader& r) {
         for (;;) {
             r.prepare();
@@ -340,20 +519,36 @@ public:
             if (r.verifyAll()) break;
         }
     }
-    INLINE bool tryReadToLocal(OccReader& r, bool inWriteSet) {
-        if (unlikely(!r.tryPrepare())) return false;
+    /**
+     * The caller must hold the lock if inWriteSet is true.
+     */
+    INLINE bool tryReadTo(OccReader& r, void *dst, bool inWriteSet) {
+        if (inWriteSet) {
+            r.prepareLocked(((const Mutex *)r.getMutexId())->load());
+        } else if (unlikely(!r.tryPrepare())) {
+            return false;
+        }
 #ifndef NO_PAYLOAD
-        ::memcpy(&local_[r.localValIdx], r.sharedVal, valueSize_);
+        ::memcpy(dst, r.sharedVal, valueSize_);
+#else
+        unused(dst);
 #endif
         r.readFence();
-        return inWriteSet ? r.verifyVersion() : r.verifyAll();
+        return inWriteSet || r.verifyAll();
     }
-    INLINE void write(Mutex& mutex, void *sharedVal, void *localVal) {
+    /**
+     * src: the record whose read the local value is derived from.
+     *      It is used by verifyWithRepair(). nullptr means no dependency.
+     */
+    INLINE void write(Mutex& mutex, void *sharedVal, void *localVal, const Mutex *src = nullptr) {
         unused(sharedVal); unused(localVal);
         size_t localValIdx;
         WriteV::iterator itW = findInWriteSet(uintptr_t(&mutex));
         if (unlikely(itW != writeV_.end())) {
             localValIdx = itW->localValIdx;
+            // Writing a removed record means re-insertion.
+            itW->removed = false;
+            if (unlikely(repair_.enabled())) itW->srcIdx = getSrcIdx(src);
         } else {
             ReadV::iterator itR = findInReadSet(uintptr_t(&mutex));
             if (likely(itR == readV_.end())) {
@@ -367,6 +562,7 @@ public:
             }
             WriteEntry& w = writeV_.emplace_back();
             w.set(&mutex, sharedVal, localValIdx);
+            if (unlikely(repair_.enabled())) w.srcIdx = getSrcIdx(src);
         }
         // write local data.
 #ifndef NO_PAYLOAD
@@ -375,17 +571,25 @@ public:
     }
     INLINE void lock() {
         std::sort(writeV_.begin(), writeV_.end());
-        for (WriteEntry& w : writeV_) {
-            lockV_.emplace_back(w.mutex);
+        if (unlikely(!hotLockV_.empty())) {
+            lockWithHotLocks(false);
+        } else {
+            for (WriteEntry& w : writeV_) {
+                lockV_.emplace_back(w.mutex);
+            }
         }
         // Serialization point.
         SERIALIZATION_POINT_BARRIER();
     }
     INLINE bool tryLock() {
         std::sort(writeV_.begin(), writeV_.end());
-        for (WriteEntry& w : writeV_) {
-            OccLock& lk = lockV_.emplace_back();
-            if (unlikely(!lk.tryLock(w.mutex))) return false;
+        if (unlikely(!hotLockV_.empty())) {
+            if (unlikely(!lockWithHotLocks(true))) return false;
+        } else {
+            for (WriteEntry& w : writeV_) {
+                OccLock& lk = lockV_.emplace_back();
+                if (unlikely(!lk.tryLock(w.mutex))) return false;
+            }
         }
         // Serialization point.
         SERIALIZATION_POINT_BARRIER();
@@ -396,49 +600,70 @@ public:
         if (likely(!useIndex)) {
             std::sort(writeV_.begin(), writeV_.end());
         }
+        if (unlikely(shouldUseBatch(readV_))) return verifyBatch(useIndex);
         for (OccReader& r : readV_) {
-            bool inWriteSet;
-            if (unlikely(useIndex)) {
-                inWriteSet = findInWriteSet(r.getMutexId()) != writeV_.end();
-            } else {
-                WriteEntry w;
-                w.set((Mutex *)r.getMutexId(), nullptr, 0);
-                inWriteSet = std::binary_search(writeV_.begin(), writeV_.end(), w);
-            }
+            const bool inWriteSet = isLockedBySelf(r, useIndex);
             const bool valid = inWriteSet ? r.verifyVersion() : r.verifyAll();
-            if (unlikely(!valid)) return false;
+            if (unlikely(!valid)) {
+                if (hotThreshold_ != 0) heatUp(r);
+                return false;
+            }
         }
-        return true;
+        return nodeSet_.validate();
+    }
+    /**
+     * verify() with the structure-of-arrays read set.
+     * The mutex words are loaded in batches to overlap cache misses.
+     */
+    INLINE bool verifyBatch(bool useIndex) {
+        soa_.clear();
+        for (const OccReader& r : readV_) {
+            const bool inWriteSet = isLockedBySelf(r, useIndex);
+            // Same as verifyVersion() and verifyAll().
+            constexpr uint32_t mask0 = OccMutexData::VERSION_MASK;
+            constexpr uint32_t mask1 = OccMutexData::VERSION_MASK | OccMutexData::LOCKED_MASK;
+            soa_.add(r.getMutexWord(), r.getMutexData(), inWriteSet ? mask0 : mask1);
+        }
+        const size_t i = soa_.findMismatch();
+        if (unlikely(i != soa_.size())) {
+            if (hotThreshold_ != 0) heatUp(readV_[i]);
+            return false;
+        }
+        return nodeSet_.validate();
     }
     /**
-     * This is very limited healing.
+     * Transaction repair.
+     * Stale reads are read again instead of aborting, and the writes derived from them
+     * (see src of write()) are computed again. Call this after lock() or tryLock().
+     * Returns false if a stale record is locked by another worker
+     * (we can not wait for it to avoid deadlock) or a phantom is detected.
      */
-    INLINE bool verifyWithHealing() {
+    INLINE bool verifyWithRepair() {
+        assert(repair_.enabled());
         const bool useIndex = shouldUseIndex(writeV_);
         if (likely(!useIndex)) {
             std::sort(writeV_.begin(), writeV_.end());
         }
-        bool isHealed = true;
-        while (isHealed) {
-            isHealed = false;
-            for (OccReader& r : readV_) {
-                bool inWriteSet;
-                if (unlikely(useIndex)) {
-                    inWriteSet = findInWriteSet(r.getMutexId()) != writeV_.end();
-                } else {
-                    WriteEntry w;
-                    w.set((Mutex *)r.getMutexId(), nullptr, 0);
-                    inWriteSet = std::binary_search(writeV_.begin(), writeV_.end(), w);
-                }
+        bool isRepaired = true;
+        while (isRepaired) {
+            isRepaired = false;
+            for (size_t i = 0; i < readV_.size(); i++) {
+                OccReader& r = readV_[i];
+                const bool inWriteSet = isLockedBySelf(r, useIndex);
                 const bool valid = inWriteSet ? r.verifyVersion() : r.verifyAll();
-                if (!valid) {
-                    // do healing
-                    if (unlikely(!tryReadToLocal(r, inWriteSet))) {
-                        // try read failed. (We can not wait for lock to avoid deadlock.)
-                        return false;
-                    }
-                    isHealed = true;
+                if (likely(valid)) continue;
+                if (hotThreshold_ != 0) heatUp(r);
+                if (unlikely(!tryReadTo(r, repair_.getBuffer(i, readV_.size()), inWriteSet))) {
+                    return false;
                 }
+                isRepaired = true;
+            }
+        }
+        // Phantoms can not be repaired.
+        if (unlikely(!nodeSet_.validate())) return false;
+        if (unlikely(!repair_.empty())) {
+            for (WriteEntry& w : writeV_) {
+                repair_.rederive(&local_[w.localValIdx], w.srcIdx);
             }
         }
         return true;
@@ -453,29 +678,245 @@ public:
             // writeback
             ::memcpy(itW->sharedVal, &local_[itW->localValIdx], valueSize_);
 #endif
-            itLk->unlock(true);
+            itLk->unlock(true, itW->removed);
             ++itLk;
             ++itW;
         }
+        unlinkRemoved();
+        rll_.clear();
         clear();
     }
     INLINE void clear() {
         lockV_.clear();
+        repair_.clear();
+        if (unlikely(hotThreshold_ != 0)) {
+            hotLockV_.clear();
+            maxHotLockId_ = 0;
+            rllIdx_ = 0;
+            now_ = Temperature::now();
+        }
         readV_.clear();
         readM_.clear();
         writeV_.clear();
         writeM_.clear();
+        nodeSet_.clear();
+        removed_.clear();
         local_.clear();
     }
     INLINE bool empty() const {
         return lockV_.empty() &&
+            hotLockV_.empty() &&
             readV_.empty() &&
             readM_.empty() &&
             writeV_.empty() &&
             writeM_.empty() &&
+            nodeSet_.empty() &&
+            removed_.empty() &&
             local_.empty();
     }
 private:
+    /**
+     * The record is in the write set or locked in the read phase (MOCC),
+     * so only its version can be verified.
+     */
+    INLINE bool isLockedBySelf(const OccReader& r, bool useIndex) {
+        const uintptr_t id = r.getMutexId();
+        if (unlikely(!hotLockV_.empty()) && findHotLock(id) != nullptr) return true;
+        if (unlikely(useIndex)) return findInWriteSet(id) != writeV_.end();
+        WriteEntry w;
+        w.set((Mutex *)id, nullptr, 0);
+        return std::binary_search(writeV_.begin(), writeV_.end(), w);
+    }
+    INLINE DataWithPayload<Mutex>& getRecord(Table& table, uint64_t key) {
+        return table.get_or_insert(key, [](Mutex& mutex) { mutex.md.absent = 1; });
+    }
+    INLINE OccReader& addReader(Mutex& mutex, void *sharedVal) {
+        // allocate new local value area.
+        const size_t localValIdx = local_.size();
+#ifndef NO_PAYLOAD
+        local_.resize(localValIdx + 1);
+#endif
+        OccReader& r = readV_.emplace_back();
+        r.set(&mutex, sharedVal, localValIdx);
+        if (unlikely(hotThreshold_ != 0)) {
+            const OccLock *lk = lockHot(mutex);
+            if (lk != nullptr) {
+                r.prepareLocked(lk->getMutexData());
+#ifndef NO_PAYLOAD
+                ::memcpy(&local_[r.localValIdx], r.sharedVal, valueSize_);
+#endif
+                return r;
+            }
+            readToLocalHolding(r);
+            return r;
+        }
+        readToLocal(r);
+        return r;
+    }
+    /**
+     * readToLocal() while holding locks of the read phase.
+     * Waiting for a record while holding locks of larger addresses may cause deadlock,
+     * so they are released before waiting.
+     */
+    INLINE void readToLocalHolding(OccReader& r) {
+        const uintptr_t id = r.getMutexId();
+        for (;;) {
+            if (likely(r.tryPrepare())) {
+#ifndef NO_PAYLOAD
+                ::memcpy(&local_[r.localValIdx], r.sharedVal, valueSize_);
+#endif
+                r.readFence();
+                if (likely(r.verifyAll())) return;
+                continue;
+            }
+            if (id > maxHotLockId_) {
+                readToLocal(r);
+                return;
+            }
+            releaseHotLocksAfter(id);
+        }
+    }
+    INLINE void releaseHotLocksAfter(uintptr_t id) {
+        size_t n = 0;
+        maxHotLockId_ = 0;
+        for (size_t i = 0; i < hotLockV_.size(); i++) {
+            OccLock& lk = hotLockV_[i];
+            if (lk.getMutexId() > id) continue;
+            maxHotLockId_ = std::max(maxHotLockId_, lk.getMutexId());
+            if (n != i) hotLockV_[n] = std::move(lk); // swap with a lock to be released.
+            n++;
+        }
+        hotLockV_.erase(hotLockV_.begin() + n, hotLockV_.end());
+    }
+    /**
+     * MOCC: lock the record if it is hot or in the retrospective lock list.
+     * Returns the lock or nullptr.
+     */
+    INLINE const OccLock* lockHot(Mutex& mutex) {
+        const uintptr_t id = uintptr_t(&mutex);
+        lockRetrospective(id);
+        const OccLock *held = findHotLock(id);
+        if (held != nullptr) return held;
+        if (mutex.temperature(now_) < hotThreshold_) return nullptr;
+        return addHotLock(mutex);
+    }
+    /**
+     * Locks are taken in the address order to avoid deadlock.
+     * Out-of-order ones are tried only, and the record is read optimistically on failure.
+     */
+    INLINE const OccLock* addHotLock(Mutex& mutex) {
+        const uintptr_t id = uintptr_t(&mutex);
+        OccLock& lk = hotLockV_.emplace_back();
+        if (id > maxHotLockId_) {
+            lk.lock(&mutex);
+        } else if (!lk.tryLock(&mutex)) {
+            hotLockV_.pop_back();
+            return nullptr;
+        }
+        maxHotLockId_ = std::max(maxHotLockId_, id);
+        return &lk;
+    }
+    /**
+     * Lock the records in the retrospective lock list up to id.
+     */
+    INLINE void lockRetrospective(uintptr_t id) {
+        while (rllIdx_ < rll_.size() && uintptr_t(rll_[rllIdx_]) <= id) {
+            Mutex& mutex = *rll_[rllIdx_++];
+            if (findHotLock(uintptr_t(&mutex)) == nullptr) addHotLock(mutex);
+        }
+    }
+    INLINE const OccLock* findHotLock(uintptr_t id) const {
+        for (const OccLock& lk : hotLockV_) {
+            if (lk.getMutexId() == id) return &lk;
+        }
+        return nullptr;
+    }
+    /**
+     * Lock the write set taking over the locks of the read phase.
+     * The other locks of the read phase are kept until updateAndUnlock() or clear(),
+     * so writers can not invalidate the hot reads before verify().
+     * Before waiting for a lock out of the address order,
+     * the held locks of larger addresses are released to avoid deadlock.
+     * The write set is locked again in order, and the released reads are verified with verifyAll().
+     */
+    INLINE bool lockWithHotLocks(bool nowait) {
+        std::sort(hotLockV_.begin(), hotLockV_.end());
+        size_t h = 0;
+        for (WriteEntry& w : writeV_) {
+            // Skip the locks of records only read. Taken over and released locks have id 0.
+            while (h < hotLockV_.size() && hotLockV_[h].getMutexId() < w.getMutexId()) h++;
+            OccLock& lk = lockV_.emplace_back();
+            if (h < hotLockV_.size() && hotLockV_[h].getMutexId() == w.getMutexId()) {
+                lk = std::move(hotLockV_[h++]);
+                continue;
+            }
+            if (h == hotLockV_.size()) {
+                // No lock of a larger address is held.
+                if (nowait) {
+                    if (unlikely(!lk.tryLock(w.mutex))) return false;
+                } else {
+                    lk.lock(w.mutex);
+                }
+                continue;
+            }
+            if (likely(lk.tryLock(w.mutex))) continue;
+            if (nowait) return false;
+            for (size_t i = h; i < hotLockV_.size(); i++) hotLockV_[i].unlock();
+            lk.lock(w.mutex);
+        }
+        // Keep only the locks of records only read.
+        size_t n = 0;
+        maxHotLockId_ = 0;
+        for (size_t i = 0; i < hotLockV_.size(); i++) {
+            if (hotLockV_[i].getMutexId() == 0) continue;
+            maxHotLockId_ = std::max(maxHotLockId_, hotLockV_[i].getMutexId());
+            if (n != i) hotLockV_[n] = std::move(hotLockV_[i]);
+            n++;
+        }
+        hotLockV_.erase(hotLockV_.begin() + n, hotLockV_.end());
+        return true;
+    }
+    /**
+     * MOCC: the record gets hotter, and the hot records of the transaction
+     * will be locked in the retry (retrospective lock list).
+     */
+    INLINE void heatUp(const OccReader& failed) {
+        Mutex *mutex = (Mutex *)failed.getMutexId();
+        mutex->heatUp(now_);
+        rll_.clear();
+        rll_.push_back(mutex);
+        for (const OccReader& r : readV_) {
+            Mutex *m = (Mutex *)r.getMutexId();
+            if (m->temperature(now_) >= hotThreshold_) rll_.push_back(m);
+        }
+        for (const WriteEntry& w : writeV_) {
+            if (w.mutex->temperature(now_) >= hotThreshold_) rll_.push_back(w.mutex);
+        }
+        std::sort(rll_.begin(), rll_.end());
+        rll_.erase(std::unique(rll_.begin(), rll_.end()), rll_.end());
+    }
+    INLINE uint32_t getSrcIdx(const Mutex *src) {
+        if (src == nullptr) return TxRepair::NO_SRC;
+        ReadV::iterator itR = findInReadSet(uintptr_t(src));
+        if (itR == readV_.end()) return TxRepair::NO_SRC;
+        return uint32_t(itR - readV_.begin());
+    }
+    /**
+     * The record state must be validated, so the record must be in the read set.
+     */
+    INLINE OccReader& getReader(Mutex& mutex, void *sharedVal) {
+        ReadV::iterator itR = findInReadSet(uintptr_t(&mutex));
+        if (likely(itR == readV_.end())) return addReader(mutex, sharedVal);
+        return *itR;
+    }
+    /**
+     * Removed records are dead now. No one can make them alive again.
+     */
+    INLINE void unlinkRemoved() {
+        if (likely(removed_.empty())) return;
+        removed_.unlink(*reclaimer_, [](const DataWithPayload<Mutex>& rec) {
+                return bool(rec.value.load().dead); });
+    }
     INLINE ReadV::iterator findInReadSet(uintptr_t key) {
         return findInSet(
             key, readV_, readM_,
@@ -516,6 +957,429 @@ private:
         constexpr size_t threshold = 4096 / sizeof(typename Vector::value_type);
         return vec.size() > threshold;
     }
+    bool shouldUseBatch(const ReadV& vec) const {
+        // Short read sets are verified one by one to avoid filling the arrays.
+        constexpr size_t threshold = 64;
+        return vec.size() >= threshold;
+    }
+};
+
+
+/**
+ * Silo: epoch-based OCC.
+ *
+ * A TID word (cybozu::mvcc::TsWord) of each record consists of
+ * an epoch, a sequence number in the epoch and a lock bit.
+ * The commit TID of a transaction is the smallest one that is
+ * (a) larger than the TIDs of the records it read or wrote,
+ * (b) larger than the last TID of the worker, and
+ * (c) in the epoch read after its write set was locked.
+ *
+ * Read-only transactions read a snapshot without validation.
+ * Snapshot epochs advance every snapshot interval of TimestampAllocator,
+ * and a writer keeps the overwritten version in the chain
+ * only if a snapshot epoch lies between the two versions.
+ */
+class SiloLockSet
+{
+public:
+    using Mutex = cybozu::mvcc::Mutex;
+    using TidWord = cybozu::mvcc::TsWord;
+    using Version = cybozu::mvcc::Version;
+    using TimestampAllocator = cybozu::mvcc::TimestampAllocator;
+    using Reclaimer = cybozu::ebr::EpochReclaimer::Local;
+
+private:
+    struct Reader
+    {
+        Mutex *mutex;
+        TidWord tid; // read TID.
+        size_t localValIdx;
+
+        INLINE uintptr_t getMutexId() const { return uintptr_t(mutex); }
+    };
+    struct Writer
+    {
+        Mutex *mutex;
+        void *sharedVal;
+        size_t localValIdx;
+        TidWord tid; // the locked word. set at lock.
+
+        INLINE uintptr_t getMutexId() const { return uintptr_t(mutex); }
+        INLINE bool operator<(const Writer& rhs) const { return getMutexId() < rhs.getMutexId(); }
+    };
+    using ReadV = std::vector<Reader>;
+    using WriteV = std::vector<Writer>;
+#if 1
+    using IndexM = cybozu::FlatIndex;
+#else
+    using IndexM = SingleThreadUnorderedMap<uintptr_t, size_t>;
+#endif
+
+    WriteV writeV_; // write set.
+    IndexM writeM_; // write set index.
+    ReadV readV_; // read set.
+    IndexM readM_; // read set index.
+    size_t nrLocked_; // the first nrLocked_ items of writeV_ are locked.
+
+    MemoryVector local_; // stores local values of read/write set.
+    size_t valueSize_;
+
+    TimestampAllocator *tsAlloc_;
+    Reclaimer *reclaimer_;
+    size_t workerId_;
+
+    bool readOnly_;
+    uint64_t snapshot_; // valid in read-only transactions.
+    uint64_t epoch_; // read after the write set is locked.
+    TidWord lastTid_; // the last commit TID of the worker.
+
+    // Cache of TimestampAllocator::minSnapshot().
+    uint64_t gcEpoch_;
+    uint64_t gcCheckedEpoch_;
+
+public:
+    INLINE SiloLockSet()
+        : writeV_(), writeM_(), readV_(), readM_(), nrLocked_(0)
+        , local_(), valueSize_()
+        , tsAlloc_(nullptr), reclaimer_(nullptr), workerId_(0)
+        , readOnly_(false), snapshot_(0), epoch_(0), lastTid_(0)
+        , gcEpoch_(0), gcCheckedEpoch_(0) {
+    }
+    /**
+     * reclaimer frees unlinked old versions.
+     * workerId is used to register snapshots.
+     */
+    INLINE void init(size_t valueSize, size_t nrReserve,
+                     TimestampAllocator& tsAlloc, Reclaimer& reclaimer, size_t workerId) {
+        valueSize_ = valueSize;  // 0 can be allowed.
+
+        // MemoryVector does not allow zero-size element.
+        if (valueSize == 0) valueSize++;
+        local_.setSizes(valueSize);
+
+        // For long transactions.
+        writeV_.reserve(nrReserve);
+        readV_.reserve(nrReserve);
+        local_.reserve(nrReserve);
+
+        tsAlloc_ = &tsAlloc;
+        reclaimer_ = &reclaimer;
+        workerId_ = workerId;
+    }
+    /**
+     * Call this at the beginning of each trial.
+     * A read-only transaction reads the snapshot and can not write.
+     */
+    INLINE void begin(bool readOnly) {
+        assert(empty());
+        readOnly_ = readOnly;
+        if (readOnly) {
+            // Old versions must not be freed while the snapshot is read.
+            reclaimer_->enter();
+            snapshot_ = tsAlloc_->beginSnapshot(workerId_);
+        }
+    }
+    INLINE void read(Mutex& mutex, void *sharedVal, void *localVal) {
+        if (readOnly_) {
+            readSnapshot(mutex, sharedVal, localVal);
+            return;
+        }
+        size_t localValIdx;
+        ReadV::iterator itR = findInReadSet(uintptr_t(&mutex));
+        if (unlikely(itR != readV_.end())) {
+            localValIdx = itR->localValIdx;
+        } else {
+            // For blind-write, you must check write set also.
+            WriteV::iterator itW = findInWriteSet(uintptr_t(&mutex));
+            if (unlikely(itW != writeV_.end())) {
+                localValIdx = itW->localValIdx;
+            } else {
+                localValIdx = addReader(mutex, sharedVal).localValIdx;
+            }
+        }
+        copyValue(localVal, &local_[localValIdx]); // read local
+    }
+    INLINE void write(Mutex& mutex, void *sharedVal, const void *localVal) {
+        assert(!readOnly_);
+        size_t localValIdx;
+        WriteV::iterator itW = findInWriteSet(uintptr_t(&mutex));
+        if (unlikely(itW != writeV_.end())) {
+            localValIdx = itW->localValIdx;
+        } else {
+            ReadV::iterator itR = findInReadSet(uintptr_t(&mutex));
+            if (likely(itR == readV_.end())) {
+                localValIdx = allocateLocalVal();
+            } else {
+                localValIdx = itR->localValIdx;
+            }
+            Writer& w = writeV_.emplace_back();
+            w.mutex = &mutex;
+            w.sharedVal = sharedVal;
+            w.localValIdx = localValIdx;
+        }
+        copyValue(&local_[localValIdx], localVal); // write local
+    }
+    INLINE void lock() {
+        std::sort(writeV_.begin(), writeV_.end());
+        for (Writer& w : writeV_) {
+            lockWriter(w, false);
+            nrLocked_++;
+        }
+        // Serialization point.
+        readEpoch();
+    }
+    INLINE bool tryLock() {
+        std::sort(writeV_.begin(), writeV_.end());
+        for (Writer& w : writeV_) {
+            if (unlikely(!lockWriter(w, true))) return false;
+            nrLocked_++;
+        }
+        // Serialization point.
+        readEpoch();
+        return true;
+    }
+    /**
+     * Read-only transactions need not be validated.
+     */
+    INLINE bool verify() {
+        if (readOnly_) return true;
+        for (const Reader& r : readV_) {
+            TidWord tid = r.mutex->load_acquire();
+            if (unlikely(tid.lock)) {
+                if (!std::binary_search(writeV_.begin(), writeV_.end(), Writer{r.mutex, nullptr, 0, 0})) {
+                    return false;
+                }
+                tid.lock = 0;
+            }
+            if (unlikely(tid != r.tid)) return false;
+        }
+        return true;
+    }
+    INLINE void updateAndUnlock() {
+        if (readOnly_) {
+            clear();
+            return;
+        }
+        assert(nrLocked_ == writeV_.size());
+        const TidWord tid = getCommitTid();
+        const uint64_t gcEpoch = getGcEpoch(epoch_);
+        for (Writer& w : writeV_) {
+            install(w, tid, gcEpoch);
+        }
+        nrLocked_ = 0;
+        lastTid_ = tid;
+        clear();
+    }
+    INLINE void clear() {
+        unlockWriteSet();
+        if (readOnly_) {
+            tsAlloc_->endSnapshot(workerId_);
+            reclaimer_->leave();
+            readOnly_ = false;
+        }
+        readV_.clear();
+        readM_.clear();
+        writeV_.clear();
+        writeM_.clear();
+        local_.clear();
+    }
+    INLINE bool empty() const {
+        return readV_.empty() &&
+            readM_.empty() &&
+            writeV_.empty() &&
+            writeM_.empty() &&
+            nrLocked_ == 0 &&
+            local_.empty();
+    }
+private:
+    INLINE TidWord waitForUnlocked(const Mutex& mutex) const {
+        TidWord tid = mutex.load_acquire();
+        while (unlikely(tid.lock)) {
+            _mm_pause();
+            tid = mutex.load_acquire();
+        }
+        return tid;
+    }
+    INLINE Reader& addReader(Mutex& mutex, void *sharedVal) {
+        const size_t localValIdx = allocateLocalVal();
+        Reader& r = readV_.emplace_back();
+        r.mutex = &mutex;
+        r.localValIdx = localValIdx;
+        for (;;) {
+            r.tid = waitForUnlocked(mutex);
+            copyValue(&local_[localValIdx], sharedVal); // read shared
+            acquire_fence();
+            if (likely(mutex.load() == r.tid)) break;
+        }
+        return r;
+    }
+    /**
+     * Read the newest version of epoch <= snapshot_.
+     */
+    INLINE void readSnapshot(Mutex& mutex, void *sharedVal, void *localVal) {
+        for (;;) {
+            const TidWord tid = waitForUnlocked(mutex);
+            if (likely(tid.epoch <= snapshot_)) {
+                copyValue(localVal, sharedVal); // read shared
+                acquire_fence();
+                if (likely(mutex.load() == tid)) return;
+                continue;
+            }
+            const Version *v = ::load_acquire(mutex.older);
+            while (v->tsw.epoch > snapshot_) {
+                v = ::load_acquire(v->next);
+                // Versions readable by active snapshots are never unlinked.
+                assert(v != nullptr);
+            }
+            copyValue(localVal, v->payload);
+            return;
+        }
+    }
+    INLINE bool lockWriter(Writer& w, bool nowait) {
+        Mutex& mutex = *w.mutex;
+        TidWord tid0 = mutex.load();
+        for (;;) {
+            if (unlikely(tid0.lock)) {
+                if (nowait) return false;
+                _mm_pause();
+                tid0 = mutex.load();
+                continue;
+            }
+            TidWord tid1 = tid0;
+            tid1.lock = 1;
+            if (likely(mutex.cas_acq(tid0, tid1))) {
+                w.tid = tid1;
+                return true;
+            }
+        }
+    }
+    INLINE void unlockWriteSet() {
+        for (size_t i = 0; i < nrLocked_; i++) {
+            TidWord tid = writeV_[i].tid;
+            tid.lock = 0;
+            writeV_[i].mutex->store_release(tid);
+        }
+        nrLocked_ = 0;
+    }
+    INLINE void readEpoch() {
+        // store-load fence is required here in design.
+        // 'lock cmpxchg' on x86_64 is a full fence.
+        SERIALIZATION_POINT_BARRIER();
+        epoch_ = tsAlloc_->get();
+    }
+    INLINE TidWord getCommitTid() const {
+        // The lock bit is the lowest, so comparing words compares (epoch, seq).
+        uint64_t maxTid = lastTid_;
+        for (const Reader& r : readV_) maxTid = std::max<uint64_t>(maxTid, r.tid);
+        for (const Writer& w : writeV_) {
+            TidWord tid = w.tid;
+            tid.lock = 0;
+            maxTid = std::max<uint64_t>(maxTid, tid);
+        }
+        TidWord tid = maxTid;
+        if (tid.epoch < epoch_) {
+            tid.epoch = epoch_;
+            tid.seq = 0;
+        } else {
+            tid.seq++;
+        }
+        return tid;
+    }
+    /**
+     * Keep the current version in the chain if some snapshot may read it,
+     * overwrite it, and unlock the record.
+     */
+    INLINE void install(Writer& w, TidWord tid, uint64_t gcEpoch) {
+        Mutex& mutex = *w.mutex;
+        TidWord tid0 = w.tid;
+        tid0.lock = 0;
+        assert(tid0.epoch <= tid.epoch);
+
+        // The current version is readable from snapshots of [tid0.epoch, tid.epoch).
+        if (tsAlloc_->snapshotOf(tid.epoch) >= tid0.epoch && gcEpoch < tid.epoch) {
+            Version *v = Version::allocate(valueSize_);
+            v->tsw = tid0;
+            v->next = mutex.older;
+            copyValue(v->payload, w.sharedVal);
+            ::store_release(mutex.older, v);
+        }
+        unlinkUnreadable(mutex, tid.epoch, gcEpoch);
+
+        copyValue(w.sharedVal, &local_[w.localValIdx]); // write shared
+        mutex.store_release(tid);
+    }
+    /**
+     * Every snapshot reads the newest version of epoch <= gcEpoch or newer ones,
+     * so the versions older than it are retired.
+     */
+    INLINE void unlinkUnreadable(Mutex& mutex, uint64_t epoch, uint64_t gcEpoch) {
+        Version *v = mutex.older;
+        Version *garbage;
+        if (gcEpoch >= epoch) {
+            garbage = v;
+            ::store(mutex.older, nullptr);
+        } else {
+            while (v != nullptr && v->tsw.epoch > gcEpoch) v = v->next;
+            if (likely(v == nullptr)) return;
+            garbage = v->next;
+            ::store(v->next, nullptr);
+        }
+        while (garbage != nullptr) {
+            Version *next = garbage->next;
+            reclaimer_->retire(garbage, Version::free);
+            garbage = next;
+        }
+    }
+    INLINE uint64_t getGcEpoch(uint64_t epoch) {
+        // Scanning all the snapshots once per epoch is enough.
+        if (unlikely(gcCheckedEpoch_ != epoch)) {
+            gcEpoch_ = tsAlloc_->minSnapshot();
+            gcCheckedEpoch_ = epoch;
+        }
+        return gcEpoch_;
+    }
+    INLINE ReadV::iterator findInReadSet(uintptr_t key) {
+        return findInSet(
+            key, readV_, readM_,
+            [](const Reader& r) { return r.getMutexId(); });
+    }
+    INLINE WriteV::iterator findInWriteSet(uintptr_t key) {
+        // Do not use this after the write set is sorted in lock().
+        return findInSet(
+            key, writeV_, writeM_,
+            [](const Writer& w) { return w.getMutexId(); });
+    }
+    template <typename Vector, typename Map, typename Func>
+    INLINE typename Vector::iterator findInSet(uintptr_t key, Vector& vec, Map& map, Func&& func) {
+        if (unlikely(vec.size() > 4096 / sizeof(typename Vector::value_type))) {
+            for (size_t i = map.size(); i < vec.size(); i++) {
+                map[func(vec[i])] = i;
+            }
+            typename Map::iterator it = map.find(key);
+            if (unlikely(it == map.end())) return vec.end();
+            return vec.begin() + it->second;
+        }
+        return std::find_if(
+            vec.begin(), vec.end(),
+            [&](const typename Vector::value_type& v) {
+                return func(v) == key;
+            });
+    }
+    INLINE void copyValue(void *dst, const void *src) {
+#ifndef NO_PAYLOAD
+        ::memcpy(dst, src, valueSize_);
+#else
+        unused(dst); unused(src);
+#endif
+    }
+    INLINE size_t allocateLocalVal() {
+        const size_t idx = local_.size();
+#ifndef NO_PAYLOAD
+        local_.resize(idx + 1);
+#endif
+        return idx;
+    }
 };
 
 
@@ -0,0 +1,552 @@
+#pragma once
+/**
+ * @file
+ * @brief an ordered index (B+tree) with optimistic lock coupling.
+ *
+ * Each node has a version word. Readers do not write shared memory;
+ * they remember the version before reading a node and check it after that.
+ * Writers lock nodes by setting a bit in the version word.
+ * Leaves are linked to their right siblings (B-link),
+ * so range scans walk on the leaf level only.
+ *
+ * Scans record (leaf, version) pairs to a NodeSet.
+ * Concurrency control protocols validate the node set at commit time
+ * to detect phantoms (Silo-style node-set validation).
+ *
+ * Entries can be removed but nodes are never merged nor freed
+ * until the tree is destroyed.
+ */
+#include <vector>
+#include <utility>
+#include <cstring>
+#include <cinttypes>
+#include <cassert>
+#include <algorithm>
+#include <stdexcept>
+#include "atomic_wrapper.hpp"
+#include "arch.hpp"
+#include "inline.hpp"
+#include "util.hpp"
+
+
+namespace cybozu {
+namespace index {
+
+
+/**
+ * Version word layout:
+ *   bit 0: obsolete (not used currently)
+ *   bit 1: locked
+ *   bit 2-63: version counter
+ */
+struct NodeVersion
+{
+    uint64_t obj;
+
+    static constexpr uint64_t OBSOLETE = 0x1;
+    static constexpr uint64_t LOCKED = 0x2;
+
+    INLINE NodeVersion() : obj(0x4) {}
+
+    INLINE static bool is_locked(uint64_t v) { return (v & LOCKED) != 0; }
+    INLINE static bool is_obsolete(uint64_t v) { return (v & OBSOLETE) != 0; }
+
+    INLINE uint64_t load() const { return ::load(obj); }
+
+    /**
+     * Wait for the node to be unlocked and returns the version.
+     */
+    INLINE uint64_t read_lock_or_restart(bool& restart) const {
+        uint64_t v = ::load_acquire(obj);
+        while (is_locked(v)) {
+            _mm_pause();
+            v = ::load_acquire(obj);
+        }
+        if (unlikely(is_obsolete(v))) restart = true;
+        return v;
+    }
+    /**
+     * Call this after reading the node contents.
+     */
+    INLINE void check_or_restart(uint64_t v, bool& restart) const {
+        acquire_fence();
+        if (unlikely(v != ::load(obj))) restart = true;
+    }
+    INLINE void upgrade_to_write_lock_or_restart(uint64_t& v, bool& restart) {
+        if (likely(::compare_exchange_acquire(obj, v, v + LOCKED))) {
+            v += LOCKED;
+        } else {
+            restart = true;
+        }
+    }
+    INLINE void write_lock_or_restart(bool& restart) {
+        uint64_t v = read_lock_or_restart(restart);
+        if (restart) return;
+        upgrade_to_write_lock_or_restart(v, restart);
+    }
+    /**
+     * Unlock and increment the version counter.
+     */
+    INLINE void write_unlock() {
+        ::fetch_add_rel(obj, LOCKED);
+    }
+};
+
+
+/**
+ * Leaf versions observed by range scans.
+ */
+class NodeSet
+{
+    struct Entry
+    {
+        const NodeVersion *node;
+        uint64_t version;
+    };
+    std::vector<Entry> vec_;
+
+public:
+    INLINE void add(const NodeVersion& node, uint64_t version) {
+        vec_.push_back({&node, version});
+    }
+    /**
+     * Returns false if any leaf has been changed (or being changed)
+     * since it was scanned.
+     */
+    INLINE bool validate() const {
+        for (const Entry& e : vec_) {
+            if (unlikely(e.node->load() != e.version)) return false;
+        }
+        return true;
+    }
+    INLINE void reserve(size_t nr) { vec_.reserve(nr); }
+    INLINE void clear() { vec_.clear(); }
+    INLINE bool empty() const { return vec_.empty(); }
+    INLINE size_t size() const { return vec_.size(); }
+};
+
+
+enum class NodeType : uint8_t { INNER = 0, LEAF = 1, };
+
+
+struct NodeBase
+{
+    NodeVersion version;
+    NodeType type;
+    uint16_t count;
+
+    INLINE explicit NodeBase(NodeType type0) : version(), type(type0), count(0) {}
+
+    /**
+     * count may be read while the node is being changed.
+     * The result must be validated by the version, but it must not overrun arrays.
+     */
+    INLINE uint16_t load_count(uint16_t max) const {
+        return std::min<uint16_t>(::load(count), max);
+    }
+};
+
+
+/**
+ * Key must be an unsigned integer type.
+ * Value is the record type. The tree stores Value pointers.
+ *
+ * NodeSize: bytes of a node (approximately).
+ */
+template <typename Value, typename Key = uint64_t, size_t NodeSize = 512>
+class BTree
+{
+public:
+    using KeyValue = std::pair<Key, Value*>;
+    using ScanBuffer = std::vector<KeyValue>;
+
+private:
+    static constexpr size_t MAX_LEAF_ENTRIES =
+        (NodeSize - sizeof(NodeBase) - sizeof(uintptr_t)) / (sizeof(Key) + sizeof(Value*));
+    static constexpr size_t MAX_INNER_ENTRIES =
+        (NodeSize - sizeof(NodeBase)) / (sizeof(Key) + sizeof(NodeBase*));
+    static_assert(MAX_LEAF_ENTRIES >= 4, "NodeSize is too small.");
+    static_assert(MAX_INNER_ENTRIES >= 4, "NodeSize is too small.");
+
+    struct Leaf : NodeBase
+    {
+        Leaf *next; // right sibling.
+        Key keys[MAX_LEAF_ENTRIES];
+        Value *values[MAX_LEAF_ENTRIES];
+
+        INLINE Leaf() : NodeBase(NodeType::LEAF), next(nullptr) {}
+
+        INLINE bool is_full() const { return this->count == MAX_LEAF_ENTRIES; }
+        INLINE uint16_t lower_bound(Key key) const {
+            const uint16_t n = this->load_count(MAX_LEAF_ENTRIES);
+            return std::lower_bound(&keys[0], &keys[n], key) - &keys[0];
+        }
+        /**
+         * Returns false if the key exists already.
+         */
+        bool insert(Key key, Value *value) {
+            assert(!is_full());
+            const uint16_t pos = lower_bound(key);
+            if (pos < this->count && keys[pos] == key) return false;
+            const size_t nr = this->count - pos;
+            ::memmove(&keys[pos + 1], &keys[pos], sizeof(Key) * nr);
+            ::memmove(&values[pos + 1], &values[pos], sizeof(Value*) * nr);
+            keys[pos] = key;
+            values[pos] = value;
+            this->count++;
+            return true;
+        }
+        /**
+         * Returns false if the key does not exist or it points another value.
+         */
+        bool remove(Key key, const Value *value) {
+            const uint16_t pos = lower_bound(key);
+            if (pos == this->count || keys[pos] != key || values[pos] != value) return false;
+            const size_t nr = this->count - pos - 1;
+            ::memmove(&keys[pos], &keys[pos + 1], sizeof(Key) * nr);
+            ::memmove(&values[pos], &values[pos + 1], sizeof(Value*) * nr);
+            this->count--;
+            return true;
+        }
+        /**
+         * The upper half will be moved to the new leaf.
+         * sep will be the largest key in this leaf.
+         */
+        Leaf* split(Key& sep) {
+            Leaf *leaf = new Leaf();
+            const uint16_t nr = this->count - this->count / 2;
+            const uint16_t remain = this->count - nr;
+            ::memcpy(&leaf->keys[0], &keys[remain], sizeof(Key) * nr);
+            ::memcpy(&leaf->values[0], &values[remain], sizeof(Value*) * nr);
+            leaf->count = nr;
+            leaf->next = next;
+            this->count = remain;
+            store_release(next, leaf);
+            sep = keys[remain - 1];
+            return leaf;
+        }
+    };
+
+    /**
+     * children[i] contains keys that are <= keys[i].
+     * children[count] contains keys that are > keys[count - 1].
+     */
+    struct Inner : NodeBase
+    {
+        Key keys[MAX_INNER_ENTRIES];
+        NodeBase *children[MAX_INNER_ENTRIES + 1];
+
+        INLINE Inner() : NodeBase(NodeType::INNER) {}
+
+        INLINE bool is_full() const { return this->count == MAX_INNER_ENTRIES - 1; }
+        INLINE uint16_t lower_bound(Key key) const {
+            const uint16_t n = this->load_count(MAX_INNER_ENTRIES - 1);
+            return std::lower_bound(&keys[0], &keys[n], key) - &keys[0];
+        }
+        void insert(Key key, NodeBase *child) {
+            assert(!is_full());
+            const uint16_t pos = lower_bound(key);
+            const size_t nr = this->count - pos;
+            ::memmove(&keys[pos + 1], &keys[pos], sizeof(Key) * nr);
+            ::memmove(&children[pos + 1], &children[pos], sizeof(NodeBase*) * (nr + 1));
+            keys[pos] = key;
+            children[pos] = child;
+            std::swap(children[pos], children[pos + 1]);
+            this->count++;
+        }
+        Inner* split(Key& sep) {
+            Inner *inner = new Inner();
+            const uint16_t nr = this->count - this->count / 2 - 1;
+            const uint16_t remain = this->count - nr - 1;
+            ::memcpy(&inner->keys[0], &keys[remain + 1], sizeof(Key) * nr);
+            ::memcpy(&inner->children[0], &children[remain + 1], sizeof(NodeBase*) * (nr + 1));
+            inner->count = nr;
+            sep = keys[remain];
+            this->count = remain;
+            return inner;
+        }
+    };
+
+    NodeBase *root_;
+
+public:
+    BTree() : root_(new Leaf()) {
+    }
+    ~BTree() noexcept {
+        destroy(root_);
+    }
+    BTree(const BTree&) = delete;
+    BTree& operator=(const BTree&) = delete;
+
+    /**
+     * Returns false if the key exists already.
+     */
+    bool insert(Key key, Value *value) {
+        for (;;) {
+            bool restart = false;
+            const bool ret = try_insert(key, value, restart);
+            if (likely(!restart)) return ret;
+        }
+    }
+    /**
+     * Remove the entry only if the key points the value.
+     * Returns false if not removed.
+     */
+    bool remove(Key key, const Value *value) {
+        for (;;) {
+            bool restart = false;
+            const bool ret = try_remove(key, value, restart);
+            if (likely(!restart)) return ret;
+        }
+    }
+    /**
+     * Returns nullptr if not found.
+     */
+    INLINE Value* lookup(Key key) const {
+        for (;;) {
+            bool restart = false;
+            uint64_t v;
+            const Leaf *leaf = find_leaf(key, v, restart);
+            if (unlikely(restart)) continue;
+            const uint16_t pos = leaf->lower_bound(key);
+            Value *value = nullptr;
+            if (pos < leaf->load_count(MAX_LEAF_ENTRIES) && leaf->keys[pos] == key) {
+                value = leaf->values[pos];
+            }
+            leaf->version.check_or_restart(v, restart);
+            if (likely(!restart)) return value;
+        }
+    }
+    /**
+     * Scan at most nr entries whose keys are >= lo.
+     * The entries will be appended to out.
+     * Visited leaves will be added to ns if it is not null.
+     *
+     * Each leaf is read consistently.
+     * The whole result is consistent only if ns is validated later.
+     */
+    INLINE void scan(Key lo, size_t nr, ScanBuffer& out, NodeSet *ns = nullptr) const {
+        const size_t target = out.size() + nr;
+        const Leaf *leaf;
+        uint64_t v;
+        for (;;) {
+            bool restart = false;
+            leaf = find_leaf(lo, v, restart);
+            if (likely(!restart)) break;
+        }
+        while (out.size() < target) {
+            const size_t size0 = out.size();
+            const Leaf *next;
+            for (;;) {
+                const uint16_t n = leaf->load_count(MAX_LEAF_ENTRIES);
+                for (uint16_t i = leaf->lower_bound(lo); i < n && out.size() < target; i++) {
+                    out.emplace_back(leaf->keys[i], leaf->values[i]);
+                }
+                next = load(leaf->next);
+                bool restart = false;
+                leaf->version.check_or_restart(v, restart);
+                if (likely(!restart)) break;
+                // A leaf split keeps the lower half in the same leaf, so just retry it.
+                out.resize(size0);
+                restart = false;
+                v = leaf->version.read_lock_or_restart(restart);
+            }
+            if (ns != nullptr) ns->add(leaf->version, v);
+            if (next == nullptr) break;
+            leaf = next;
+            bool restart = false;
+            v = leaf->version.read_lock_or_restart(restart);
+        }
+    }
+
+private:
+    /**
+     * Returns a leaf that may contain the key with its version.
+     */
+    INLINE const Leaf* find_leaf(Key key, uint64_t& v, bool& restart) const {
+        const NodeBase *node = load_acquire(root_);
+        v = node->version.read_lock_or_restart(restart);
+        if (unlikely(restart || node != load(root_))) {
+            restart = true;
+            return nullptr;
+        }
+        while (node->type == NodeType::INNER) {
+            const Inner *inner = static_cast<const Inner*>(node);
+            const NodeBase *child = inner->children[inner->lower_bound(key)];
+            // Read the child version before validating the parent,
+            // otherwise a split of the child in between goes unnoticed.
+            const uint64_t vChild = child->version.read_lock_or_restart(restart);
+            if (unlikely(restart)) return nullptr;
+            inner->version.check_or_restart(v, restart);
+            if (unlikely(restart)) return nullptr;
+            node = child;
+            v = vChild;
+        }
+        return static_cast<const Leaf*>(node);
+    }
+    void make_root(Key sep, NodeBase *left, NodeBase *right) {
+        Inner *inner = new Inner();
+        inner->count = 1;
+        inner->keys[0] = sep;
+        inner->children[0] = left;
+        inner->children[1] = right;
+        store_release(root_, inner);
+    }
+    /**
+     * Full nodes are split eagerly on the way from the root.
+     * After a split, the insertion restarts from the root.
+     */
+    bool try_insert(Key key, Value *value, bool& restart) {
+        NodeBase *node = load_acquire(root_);
+        uint64_t v = node->version.read_lock_or_restart(restart);
+        if (unlikely(restart || node != load(root_))) {
+            restart = true;
+            return false;
+        }
+        Inner *parent = nullptr;
+        uint64_t vParent = 0;
+
+        for (;;) {
+            const bool isFull = node->type == NodeType::INNER
+                ? static_cast<Inner*>(node)->is_full()
+                : static_cast<Leaf*>(node)->is_full();
+            if (unlikely(isFull)) {
+                split_node(node, v, parent, vParent, restart);
+                restart = true; // restart anyway.
+                return false;
+            }
+            if (node->type == NodeType::LEAF) break;
+            if (parent != nullptr) {
+                parent->version.check_or_restart(vParent, restart);
+                if (unlikely(restart)) return false;
+            }
+            Inner *inner = static_cast<Inner*>(node);
+            NodeBase *child = inner->children[inner->lower_bound(key)];
+            const uint64_t vChild = child->version.read_lock_or_restart(restart);
+            if (unlikely(restart)) return false;
+            inner->version.check_or_restart(v, restart);
+            if (unlikely(restart)) return false;
+            parent = inner;
+            vParent = v;
+            node = child;
+            v = vChild;
+        }
+
+        Leaf *leaf = static_cast<Leaf*>(node);
+        leaf->version.upgrade_to_write_lock_or_restart(v, restart);
+        if (unlikely(restart)) return false;
+        if (parent != nullptr) {
+            parent->version.check_or_restart(vParent, restart);
+            if (unlikely(restart)) {
+                leaf->version.write_unlock();
+                return false;
+            }
+        }
+        const bool ret = leaf->insert(key, value);
+        leaf->version.write_unlock();
+        return ret;
+    }
+    /**
+     * Removal never splits nor merges nodes.
+     * The leaf is locked with the version read on the way,
+     * and its parent is validated after that like try_insert().
+     */
+    bool try_remove(Key key, const Value *value, bool& restart) {
+        NodeBase *node = load_acquire(root_);
+        uint64_t v = node->version.read_lock_or_restart(restart);
+        if (unlikely(restart || node != load(root_))) {
+            restart = true;
+            return false;
+        }
+        Inner *parent = nullptr;
+        uint64_t vParent = 0;
+        while (node->type == NodeType::INNER) {
+            Inner *inner = static_cast<Inner*>(node);
+            NodeBase *child = inner->children[inner->lower_bound(key)];
+            const uint64_t vChild = child->version.read_lock_or_restart(restart);
+            if (unlikely(restart)) return false;
+            inner->version.check_or_restart(v, restart);
+            if (unlikely(restart)) return false;
+            parent = inner;
+            vParent = v;
+            node = child;
+            v = vChild;
+        }
+        Leaf *leaf = static_cast<Leaf*>(node);
+        // Do not lock the leaf if not found, which would invalidate scans.
+        const uint16_t pos = leaf->lower_bound(key);
+        if (pos >= leaf->load_count(MAX_LEAF_ENTRIES) || leaf->keys[pos] != key || leaf->values[pos] != value) {
+            leaf->version.check_or_restart(v, restart);
+            return false;
+        }
+        leaf->version.upgrade_to_write_lock_or_restart(v, restart);
+        if (unlikely(restart)) return false;
+        if (parent != nullptr) {
+            parent->version.check_or_restart(vParent, restart);
+            if (unlikely(restart)) {
+                leaf->version.write_unlock();
+                return false;
+            }
+        }
+        const bool ret = leaf->remove(key, value);
+        leaf->version.write_unlock();
+        return ret;
+    }
+    void split_node(NodeBase *node, uint64_t& v, Inner *parent, uint64_t& vParent, bool& restart) {
+        if (parent != nullptr) {
+            parent->version.upgrade_to_write_lock_or_restart(vParent, restart);
+            if (unlikely(restart)) return;
+        }
+        node->version.upgrade_to_write_lock_or_restart(v, restart);
+        if (unlikely(restart)) {
+            if (parent != nullptr) parent->version.write_unlock();
+            return;
+        }
+        if (parent == nullptr && node != load(root_)) {
+            // Another thread has made a new root.
+            node->version.write_unlock();
+            return;
+        }
+        Key sep;
+        NodeBase *right;
+        if (node->type == NodeType::INNER) {
+            right = static_cast<Inner*>(node)->split(sep);
+        } else {
+            right = static_cast<Leaf*>(node)->split(sep);
+        }
+        if (parent != nullptr) {
+            parent->insert(sep, right);
+        } else {
+            make_root(sep, node, right);
+        }
+        node->version.write_unlock();
+        if (parent != nullptr) parent->version.write_unlock();
+    }
+    void destroy(NodeBase *node) noexcept {
+        if (node->type == NodeType::INNER) {
+            Inner *inner = static_cast<Inner*>(node);
+            for (size_t i = 0; i <= inner->count; i++) destroy(inner->children[i]);
+            delete inner;
+        } else {
+            delete static_cast<Leaf*>(node);
+        }
+    }
+};
+
+
+/**
+ * Index all the records of a record vector.
+ * The record index is used as the key.
+ */
+template <typename Index, typename Vec>
+void build_index_from_vector(Index& index, Vec& recV)
+{
+    for (size_t i = 0; i < recV.size(); i++) {
+        if (!index.insert(i, &recV[i])) {
+            throw std::runtime_error("build_index_from_vector: duplicated key.");
+        }
+    }
+}
+
+
+}} // namespace cybozu::index
@@ -729,6 +729,177 @@ private:
 
 
 
+/**
+ * Priority-queuing lock with a bucketed priority array.
+ * Requesters are pushed to the bucket of their priority epoch (pri >> EPOCH_BITS)
+ * and a bitmap of non-empty buckets is kept in the lock word,
+ * so enqueue and handoff do not depend on the number of waiters.
+ *
+ * The buckets are cyclic by epoch. The lock holder looks for the first non-empty bucket
+ * from NR_BUCKETS / 2 epochs before its own, so the order is exact among waiters
+ * within the window, and FIFO in the same bucket.
+ * This is not exact priority queuing in exchange for the bounded reorder cost.
+ */
+class PQBucketLock
+{
+public:
+    static constexpr uint32_t NR_BUCKETS = 16;
+    static constexpr uint32_t EPOCH_BITS = 12;
+private:
+    struct Node {
+        Node *next;
+        uint32_t pri; // smaller is prior.
+        bool wait;
+        Node() : next(nullptr), pri(UINT32_MAX), wait(false) {
+        }
+        void init() {
+            next = nullptr;
+            pri = UINT32_MAX;
+            wait = false;
+        }
+    };
+    static constexpr uint32_t BUCKET_MASK = (1U << NR_BUCKETS) - 1;
+    static constexpr uint32_t LOCKED = 1U << NR_BUCKETS;
+
+    static_assert(NR_BUCKETS <= 31);
+    static_assert((NR_BUCKETS & (NR_BUCKETS - 1)) == 0);
+public:
+    struct Mutex {
+        struct Bucket {
+            Node *in; // LIFO list pushed by requesters.
+            Node *out; // FIFO list accessed by the lock holder only.
+            Bucket() : in(nullptr), out(nullptr) {}
+        };
+        // bit i: bucket i may not be empty.
+        // LOCKED bit: the lock is held.
+        // It is 0 or LOCKED | bits.
+        uint32_t state;
+        Bucket buckets[NR_BUCKETS];
+
+        Mutex() : state(0), buckets() {
+        }
+    };
+private:
+    Mutex *mutex_; /* shared by all threads. */
+    Node node_; /* list node. */
+
+public:
+    INLINE PQBucketLock() : mutex_(nullptr), node_() {
+    }
+    INLINE PQBucketLock(Mutex *mutex, uint32_t pri) : PQBucketLock() {
+        lock(mutex, pri);
+    }
+    INLINE ~PQBucketLock() noexcept {
+        if (mutex_) unlock();
+    }
+    PQBucketLock(const PQBucketLock& rhs) = delete;
+    PQBucketLock& operator=(const PQBucketLock& rhs) = delete;
+    /**
+     * The same as PQMcsLock3, node_ is not shared after the lock is held.
+     */
+    PQBucketLock(PQBucketLock&& rhs) noexcept : PQBucketLock() { swap(rhs); }
+    PQBucketLock& operator=(PQBucketLock&& rhs) noexcept { swap(rhs); return *this; }
+
+    INLINE void lock(Mutex *mutex, uint32_t pri) {
+        assert(mutex);
+        assert(!mutex_);
+        mutex_ = mutex;
+        node_.init();
+        node_.pri = pri;
+
+        uint32_t st = 0;
+        if (compareExchange(mutex_->state, st, LOCKED, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        store(node_.wait, true);
+        const uint32_t b = getBucketId(pri);
+        Node *head = load(mutex_->buckets[b].in);
+        do {
+            node_.next = head;
+        } while (!compareExchange(mutex_->buckets[b].in, head, &node_, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+        st = __atomic_fetch_or(&mutex_->state, (1U << b) | LOCKED, __ATOMIC_SEQ_CST);
+        if ((st & LOCKED) == 0) {
+            // I hold the lock while I am in the queue.
+            Node *node = getTop(pri, true);
+            assert(node);
+            if (node == &node_) return;
+            storeRelease(node->wait, false); // notify.
+        }
+        while (loadAcquire(node_.wait)) _mm_pause(); // local spin wait.
+        // Now I hold the lock.
+    }
+    INLINE void unlock() {
+        assert(mutex_);
+        for (;;) {
+            Node *node = getTop(node_.pri, true);
+            if (node) {
+                storeRelease(node->wait, false); // notify.
+                break;
+            }
+            uint32_t st = LOCKED;
+            if (compareExchange(mutex_->state, st, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) break;
+        }
+        mutex_ = nullptr;
+        node_.init();
+    }
+    /**
+     * Only the thread that hold the lock can call this method.
+     */
+    INLINE uint32_t getTopPriorityInWaitQueue() {
+        assert(mutex_);
+        const Node *node = getTop(node_.pri, false);
+        if (!node) return UINT32_MAX;
+        return load(node->pri);
+    }
+
+private:
+    void swap(PQBucketLock& rhs) noexcept {
+        std::swap(mutex_, rhs.mutex_);
+        std::swap(node_, rhs.node_);
+    }
+    static INLINE uint32_t getBucketId(uint32_t pri) {
+        return (pri >> EPOCH_BITS) & (NR_BUCKETS - 1);
+    }
+    /**
+     * Only the lock holder can call this.
+     * origin: priority of the lock holder.
+     * pop: remove the returned node from the bucket.
+     * Returns nullptr if there is no waiter.
+     */
+    INLINE Node* getTop(uint32_t origin, bool pop) {
+        const uint32_t o = (getBucketId(origin) - NR_BUCKETS / 2) & (NR_BUCKETS - 1);
+        for (;;) {
+            const uint32_t bits = load(mutex_->state, __ATOMIC_SEQ_CST) & BUCKET_MASK;
+            if (bits == 0) return nullptr;
+            const uint32_t rotated = ((bits >> o) | (bits << (NR_BUCKETS - o))) & BUCKET_MASK;
+            const uint32_t b = (__builtin_ctz(rotated) + o) & (NR_BUCKETS - 1);
+            Mutex::Bucket& bucket = mutex_->buckets[b];
+            if (!bucket.out) bucket.out = reverse(exchange(bucket.in, nullptr, __ATOMIC_ACQUIRE));
+            Node *node = bucket.out;
+            if (node) {
+                if (pop) bucket.out = node->next;
+                return node;
+            }
+            // The bucket is empty. Requesters set the bit after pushing.
+            __atomic_fetch_and(&mutex_->state, ~(1U << b), __ATOMIC_SEQ_CST);
+            if (load(bucket.in, __ATOMIC_SEQ_CST) != nullptr) {
+                __atomic_fetch_or(&mutex_->state, 1U << b, __ATOMIC_SEQ_CST);
+            }
+        }
+    }
+    static INLINE Node* reverse(Node *node) {
+        Node *prev = nullptr;
+        while (node) {
+            Node *next = node->next;
+            node->next = prev;
+            prev = node;
+            node = next;
+        }
+        return prev;
+    }
+};
+
+
 /**
  * Priority-queuing lock using posix mutex lock.
  * Waiting threads will sleep while ones with a spinlock will execute busy loop.
@@ -0,0 +1,261 @@
+#pragma once
+/**
+ * @file
+ * @brief a table of heap-allocated records indexed by an ordered index.
+ *
+ * Records of VectorWithPayload can not be inserted nor deleted.
+ * RecordTable allocates each record separately so that it can be
+ * unlinked from the index and reclaimed by EpochReclaimer.
+ *
+ * A key that is not found is materialized as an absent record
+ * so that concurrency control protocols can protect the key by the record.
+ * How to mark a record absent depends on the protocol, so the caller gives a function.
+ */
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+#include "ordered_index.hpp"
+#include "epoch_reclaimer.hpp"
+#include "vector_payload.hpp"
+#include "cache_line_size.hpp"
+#include "inline.hpp"
+#include "util.hpp"
+
+
+namespace cybozu {
+namespace record {
+
+
+template <typename Mutex>
+class RecordTable
+{
+public:
+    using Record = DataWithPayload<Mutex>;
+    using Index = cybozu::index::BTree<Record>;
+
+private:
+    Index index_;
+    size_t payload_;
+    size_t alignment_;
+
+public:
+    RecordTable() : index_(), payload_(0), alignment_(sizeof(uintptr_t)) {
+    }
+    ~RecordTable() noexcept {
+        typename Index::ScanBuffer buf;
+        index_.scan(0, SIZE_MAX, buf);
+        for (typename Index::KeyValue& kv : buf) free_record(kv.second);
+    }
+    RecordTable(const RecordTable&) = delete;
+    RecordTable& operator=(const RecordTable&) = delete;
+
+    void setPayloadSize(size_t payload, size_t alignment = sizeof(uintptr_t)) {
+        payload_ = payload;
+        alignment_ = alignment;
+    }
+    size_t payload() const { return payload_; }
+    Index& index() { return index_; }
+    const Index& index() const { return index_; }
+
+    /**
+     * Insert present records with keys [0, nr).
+     */
+    void load(size_t nr) {
+        for (size_t i = 0; i < nr; i++) {
+            if (!index_.insert(i, allocate())) {
+                throw std::runtime_error("RecordTable::load: duplicated key.");
+            }
+        }
+    }
+    /**
+     * Get the record of the key.
+     * If not found, a new record initialized by initAbsent will be inserted.
+     * initAbsent: void(Mutex&)
+     */
+    template <typename Func>
+    INLINE Record& get_or_insert(uint64_t key, Func&& initAbsent) {
+        for (;;) {
+            Record *rec = index_.lookup(key);
+            if (likely(rec != nullptr)) return *rec;
+            rec = allocate();
+            initAbsent(rec->value);
+            if (likely(index_.insert(key, rec))) return *rec;
+            // Another thread has inserted it. The record has not been published.
+            free_record(rec);
+        }
+    }
+    /**
+     * Allocate a record with zero-cleared payload.
+     */
+    Record* allocate() {
+        const size_t size = sizeof(Record) + payload_;
+        void *p;
+        if (::posix_memalign(&p, alignment_, size) != 0) throw std::bad_alloc();
+        ::memset(p, 0, size);
+        return new(p) Record();
+    }
+    /**
+     * This can be used as a deleter for EpochReclaimer.
+     */
+    static void free_record(void *p) {
+        static_cast<Record*>(p)->~Record();
+        ::free(p);
+    }
+};
+
+
+/**
+ * Records removed by a transaction.
+ * They are unlinked from the index after the removal committed,
+ * and retired to the reclaimer.
+ */
+template <typename Table>
+class RemovedRecords
+{
+    using Record = typename Table::Record;
+    struct Entry
+    {
+        Table *table;
+        uint64_t key;
+        Record *rec;
+    };
+    std::vector<Entry> vec_;
+
+public:
+    INLINE void add(Table& table, uint64_t key, Record& rec) {
+        for (const Entry& e : vec_) {
+            if (e.rec == &rec) return;
+        }
+        vec_.push_back({&table, key, &rec});
+    }
+    /**
+     * isDead: bool(const Record&)
+     * Records which are not dead have been re-inserted by the transaction.
+     */
+    template <typename Func>
+    INLINE void unlink(cybozu::ebr::EpochReclaimer::Local& reclaimer, Func&& isDead) {
+        for (Entry& e : vec_) {
+            if (!isDead(*e.rec)) continue;
+            if (e.table->index().remove(e.key, e.rec)) {
+                reclaimer.retire(e.rec, Table::free_record);
+            }
+        }
+        vec_.clear();
+    }
+    INLINE void clear() { vec_.clear(); }
+    INLINE bool empty() const { return vec_.empty(); }
+};
+
+
+enum class RecordState : uint8_t { PRESENT = 0, ABSENT = 1, DEAD = 2, };
+
+
+/**
+ * For pessimistic protocols.
+ * Their lock words do not have room for the record state
+ * (some of them overwrite the whole word at unlock),
+ * so the state is put next to the lock word.
+ * It must be accessed while the mutex is locked.
+ */
+template <typename Mutex>
+struct RecordMutex : Mutex
+{
+    RecordState state;
+
+    INLINE RecordMutex() : Mutex(), state(RecordState::PRESENT) {}
+};
+
+
+/**
+ * Record state changes of a transaction with a pessimistic protocol.
+ * The state is changed at commit while the record is locked.
+ * A removed record will be dead, not absent, because it will be unlinked.
+ */
+template <typename Mutex>
+class RecordStateSet
+{
+public:
+    using Table = RecordTable<RecordMutex<Mutex> >;
+    using Record = typename Table::Record;
+
+private:
+    struct Entry
+    {
+        Record *rec;
+        RecordState state;
+    };
+    std::vector<Entry> vec_;
+    RemovedRecords<Table> removed_;
+
+public:
+    /**
+     * Record state in the view of the transaction.
+     * The record must have been locked.
+     */
+    INLINE RecordState get(const Record& rec) const {
+        for (const Entry& e : vec_) {
+            if (e.rec == &rec) return e.state;
+        }
+        return ::load(rec.value.state);
+    }
+    INLINE void insert(Record& rec) {
+        set(rec, RecordState::PRESENT);
+    }
+    INLINE void remove(Table& table, uint64_t key, Record& rec) {
+        set(rec, RecordState::ABSENT);
+        removed_.add(table, key, rec);
+    }
+    /**
+     * Call this while all the records are locked.
+     */
+    INLINE void apply() {
+        for (Entry& e : vec_) {
+            const RecordState state =
+                e.state == RecordState::ABSENT ? RecordState::DEAD : e.state;
+            ::store(e.rec->value.state, state);
+        }
+    }
+    /**
+     * Call this after unlock.
+     */
+    INLINE void unlink(cybozu::ebr::EpochReclaimer::Local& reclaimer) {
+        removed_.unlink(reclaimer, [](const Record& rec) {
+                return ::load(rec.value.state) == RecordState::DEAD; });
+        vec_.clear();
+    }
+    INLINE void clear() {
+        vec_.clear();
+        removed_.clear();
+    }
+    INLINE bool empty() const { return vec_.empty() && removed_.empty(); }
+
+private:
+    INLINE void set(Record& rec, RecordState state) {
+        for (Entry& e : vec_) {
+            if (e.rec == &rec) {
+                e.state = state;
+                return;
+            }
+        }
+        vec_.push_back({&rec, state});
+    }
+};
+
+
+/**
+ * Helper to create a table for the benchmark option.
+ */
+template <typename Table, typename Opt>
+void initRecordTable(Table& table, const Opt& opt)
+{
+#ifdef MUTEX_ON_CACHELINE
+    table.setPayloadSize(opt.payload, CACHE_LINE_SIZE);
+#else
+    table.setPayloadSize(opt.payload);
+#endif
+    table.load(opt.getNrMu());
+}
+
+
+}} // namespace cybozu::record
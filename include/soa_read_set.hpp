@@ -0,0 +1,118 @@
+#pragma once
+/**
+ * Structure-of-arrays view of a read set for batch validation.
+ *
+ * Validating a large read set reader by reader is a chain of cache misses
+ * on the mutex objects. Here the addresses of the mutex words, the expected words
+ * and the masks of bits to compare are kept in separate arrays.
+ * The words are loaded four at a time with AVX2 gather and compared at once,
+ * and the mutexes of upcoming entries are prefetched.
+ * Without AVX2, the same is done with scalar loads.
+ */
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include "arch.hpp"
+#include "inline.hpp"
+#include "util.hpp"
+#include "atomic_wrapper.hpp"
+
+
+namespace cybozu {
+
+
+template <typename Word>
+class SoaReadSet
+{
+    static_assert(std::is_same_v<Word, uint32_t> || std::is_same_v<Word, uint64_t>);
+
+    std::vector<const Word*> addrV_; // addresses of the mutex words.
+    std::vector<Word> expV_; // expected words.
+    std::vector<Word> maskV_; // bits to compare. 0 means the entry is always valid.
+
+public:
+    // [entries]. Prefetch distance ahead of the current entry.
+    static constexpr size_t PREFETCH_DISTANCE = 16;
+
+    void reserve(size_t n) {
+        addrV_.reserve(n);
+        expV_.reserve(n);
+        maskV_.reserve(n);
+    }
+    size_t size() const { return addrV_.size(); }
+    bool empty() const { return addrV_.empty(); }
+    void clear() {
+        addrV_.clear();
+        expV_.clear();
+        maskV_.clear();
+    }
+    INLINE void add(const Word *addr, Word expected, Word mask) {
+        addrV_.push_back(addr);
+        expV_.push_back(expected);
+        maskV_.push_back(mask);
+    }
+    /**
+     * Returns the index of the first entry i >= begin such that
+     * (*addr[i] ^ expected[i]) & mask[i] is not zero, or size() if all the entries match.
+     */
+    INLINE size_t findMismatch(size_t begin = 0) const {
+        const size_t n = size();
+        size_t i = begin;
+        for (size_t j = i; j < std::min(i + PREFETCH_DISTANCE, n); j++) {
+            prefetch(j);
+        }
+#if defined(__AVX2__)
+        for (; i + 4 <= n; i += 4) {
+            for (size_t j = i + PREFETCH_DISTANCE; j < std::min(i + PREFETCH_DISTANCE + 4, n); j++) {
+                prefetch(j);
+            }
+            const uint32_t bits = mismatch4(i);
+            if (unlikely(bits != 0)) return i + __builtin_ctz(bits);
+        }
+#endif
+        for (; i < n; i++) {
+            if (i + PREFETCH_DISTANCE < n) prefetch(i + PREFETCH_DISTANCE);
+            if (unlikely(((::load(*addrV_[i]) ^ expV_[i]) & maskV_[i]) != 0)) return i;
+        }
+        return n;
+    }
+
+private:
+    INLINE void prefetch(size_t i) const {
+        if (maskV_[i] != 0) __builtin_prefetch(addrV_[i]);
+    }
+#if defined(__AVX2__)
+    /**
+     * Returns a bit mask of the mismatched entries in [i, i + 4).
+     */
+    INLINE uint32_t mismatch4(size_t i) const {
+        const __m256i addr = _mm256_loadu_si256((const __m256i *)&addrV_[i]);
+        if constexpr (std::is_same_v<Word, uint32_t>) {
+            const __m128i mask = _mm_loadu_si128((const __m128i *)&maskV_[i]);
+            // Entries whose mask is 0 are not loaded.
+            const __m128i active = _mm_xor_si128(
+                _mm_cmpeq_epi32(mask, _mm_setzero_si128()), _mm_set1_epi32(-1));
+            const __m128i cur = _mm256_mask_i64gather_epi32(
+                _mm_setzero_si128(), (const int *)nullptr, addr, active, 1);
+            const __m128i exp = _mm_loadu_si128((const __m128i *)&expV_[i]);
+            const __m128i diff = _mm_and_si128(_mm_xor_si128(cur, exp), mask);
+            const __m128i eq = _mm_cmpeq_epi32(diff, _mm_setzero_si128());
+            return ~uint32_t(_mm_movemask_ps(_mm_castsi128_ps(eq))) & 0xf;
+        } else {
+            const __m256i mask = _mm256_loadu_si256((const __m256i *)&maskV_[i]);
+            const __m256i active = _mm256_xor_si256(
+                _mm256_cmpeq_epi64(mask, _mm256_setzero_si256()), _mm256_set1_epi64x(-1));
+            const __m256i cur = _mm256_mask_i64gather_epi64(
+                _mm256_setzero_si256(), (const long long *)nullptr, addr, active, 1);
+            const __m256i exp = _mm256_loadu_si256((const __m256i *)&expV_[i]);
+            const __m256i diff = _mm256_and_si256(_mm256_xor_si256(cur, exp), mask);
+            const __m256i eq = _mm256_cmpeq_epi64(diff, _mm256_setzero_si256());
+            return ~uint32_t(_mm256_movemask_pd(_mm256_castsi256_pd(eq))) & 0xf;
+        }
+    }
+#endif
+};
+
+
+} // namespace cybozu
@@ -17,15 +17,15 @@
 #include "arch.hpp"
 #include "vector_payload.hpp"
 #include "allocator.hpp"
+#include "flat_index.hpp"
 #include "inline.hpp"
 #include "sleep.hpp"
-
-
-#if 0
-#define USE_TICTOC_MCS
-#else
-#undef USE_TICTOC_MCS
-#endif
+#include "ordered_index.hpp"
+#include "record_table.hpp"
+#include "epoch_reclaimer.hpp"
+#include "tx_repair.hpp"
+#include "soa_read_set.hpp"
+#include "wait_policy.hpp"
 
 
 namespace cybozu {
@@ -40,10 +40,13 @@ struct TsWord
             // This layout is for little endian.
             uint64_t lock:1;
             uint64_t delta:15;
-            uint64_t wts:48;
+            uint64_t absent:1; // the record does not exist.
+            uint64_t dead:1; // the record has been removed and will be unlinked from the index.
+            uint64_t wts:46;
         };
     };
     static constexpr uint64_t Shift_mask = (1U << 16) - 1;
+    static constexpr uint64_t Wts_mask = ~((uint64_t(1) << 18) - 1);
 
     INLINE TsWord() = default;
 
@@ -61,17 +64,19 @@ static_assert(sizeof(TsWord) == sizeof(uint64_t));
 struct Mutex
 {
     TsWord tsw;
-#ifdef USE_TICTOC_MCS
-    cybozu::lock::McsSpinlock::Mutex mcs_mutex;
-#endif
+#ifdef USE_MCS_WAIT_QUEUE
+    cybozu::lock::QueueSpinlock::Mutex mcs_mutex; // used by the mcs wait policy.
 
-#ifdef USE_TICTOC_MCS
     INLINE Mutex() : tsw(), mcs_mutex() { tsw.init(); }
 #else
     INLINE Mutex() : tsw() { tsw.init(); }
 #endif
 
     INLINE TsWord load() const { return ::load(tsw); }
+    /**
+     * The lower half including the lock bit (little endian), for the park wait policy.
+     */
+    INLINE const uint32_t* word() const { return reinterpret_cast<const uint32_t*>(&tsw.obj); }
     INLINE TsWord load_acquire() const { return ::load_acquire(tsw); }
     INLINE void store_release(TsWord tsw0) { ::store_release(tsw, tsw0); }
 
@@ -90,6 +95,11 @@ struct Mutex
 };
 
 
+#ifndef USE_MCS_WAIT_QUEUE
+static_assert(sizeof(Mutex) == sizeof(uint64_t));
+#endif
+
+
 #if 0
 #define USE_TICTOC_RTS_COUNT
 #else
@@ -108,6 +118,7 @@ private:
     Mutex *mutex_;
     TsWord tsw_; // This is uninitialized at beginning and will be set in read success.
 public:
+    const void *sharedVal; // used to read again for repair.
     size_t localValIdx;
 
     /**
@@ -121,13 +132,24 @@ public:
     INLINE Reader(Reader&& rhs) noexcept : Reader() { swap(rhs); }
     INLINE Reader& operator=(Reader&& rhs) noexcept { swap(rhs); return *this; }
 
-    INLINE void set(Mutex *mutex, size_t localValIdx0) {
+    INLINE void set(Mutex *mutex, const void *sharedVal0, size_t localValIdx0) {
         mutex_ = mutex;
+        sharedVal = sharedVal0;
         localValIdx = localValIdx0;
     }
 
     INLINE uintptr_t getId() const { return uintptr_t(mutex_); }
     INLINE const TsWord& local_tsw() const { return tsw_; }
+    INLINE const uint64_t* tsw_addr() const { return &mutex_->tsw.obj; }
+    /**
+     * validate() may update the mutex.
+     */
+    INLINE void prefetch() const { __builtin_prefetch(mutex_, 1); }
+    /**
+     * Record state at the time of the read.
+     */
+    INLINE bool isAbsent() const { return tsw_.absent; }
+    INLINE bool isDead() const { return tsw_.dead; }
 
     INLINE void prepare() {
         assert(mutex_);
@@ -226,18 +248,45 @@ public:
         }
 #endif
     }
+    /**
+     * Read the record again to dst for transaction repair.
+     * The caller must hold the lock if isInWriteSet is true.
+     * Returns false if the record is locked by another worker.
+     */
+    INLINE bool tryReadTo(void *dst, size_t size, bool isInWriteSet) {
+        assert(mutex_);
+        for (;;) {
+            TsWord tsw = mutex_->load_acquire();
+            if (tsw.lock) {
+                if (!isInWriteSet) return false;
+                tsw.lock = 0;
+            }
+#ifndef NO_PAYLOAD
+            ::memcpy(dst, sharedVal, size);
+#else
+            unused(dst); unused(size);
+#endif
+            readFence();
+            // The rts may be extended by other workers concurrently.
+            if (isInWriteSet || mutex_->load() == tsw) {
+                tsw_ = tsw;
+                return true;
+            }
+        }
+    }
 private:
     INLINE void spinForUnlocked() {
-        TsWord tsw = mutex_->load_acquire();
-        while (tsw.lock) {
-            _mm_pause();
+        TsWord tsw;
+        cybozu::wait_policy::waitUntil(mutex_->word(), [&]() {
             tsw = mutex_->load_acquire();
-        }
+            return !tsw.lock;
+        });
         tsw_ = tsw;
     }
     INLINE void swap(Reader& rhs) noexcept {
         std::swap(mutex_, rhs.mutex_);
         std::swap(tsw_, rhs.tsw_);
+        std::swap(sharedVal, rhs.sharedVal);
         std::swap(localValIdx, rhs.localValIdx);
     }
 };
@@ -250,6 +299,8 @@ public:
     // written data.
     void *sharedVal;
     size_t localValIdx;
+    bool removed; // the record will be absent after commit.
+    uint32_t srcIdx; // index of the read the local value is derived from, for repair.
 
 private:
     TsWord tsw_; // used for preemptive verify.
@@ -270,6 +321,8 @@ public:
         mutex = mutex0;
         sharedVal = sharedVal0;
         localValIdx = localValIdx0;
+        removed = false;
+        srcIdx = TxRepair::NO_SRC;
         tsw_.init();
     }
 
@@ -296,6 +349,8 @@ private:
         std::swap(mutex, rhs.mutex);
         std::swap(localValIdx, rhs.localValIdx);
         std::swap(sharedVal, rhs.sharedVal);
+        std::swap(removed, rhs.removed);
+        std::swap(srcIdx, rhs.srcIdx);
         std::swap(tsw_, rhs.tsw_);
     }
 };
@@ -349,14 +404,20 @@ public:
         tsw_ = tsw1;
         mutexp_ = &mutex;
     }
-    INLINE void updateAndUnlock(uint64_t commitTs) {
+    /**
+     * removed: the record will be absent and dead.
+     */
+    INLINE void updateAndUnlock(uint64_t commitTs, bool removed = false) {
         if (unlikely(!mutexp_)) return;
         TsWord tsw0 = tsw_;
         assert(tsw0.lock);
         tsw0.lock = 0;
         tsw0.wts = commitTs;
         tsw0.delta = 0;
+        tsw0.absent = removed;
+        tsw0.dead = removed;
         mutexp_->store_release(tsw0);
+        cybozu::wait_policy::notify(mutexp_->word());
         mutexp_ = nullptr;
     }
     INLINE void unlock() {
@@ -365,6 +426,7 @@ public:
         assert(tsw0.lock);
         tsw0.lock = 0;
         mutexp_->store_release(tsw0);
+        cybozu::wait_policy::notify(mutexp_->word());
         mutexp_ = nullptr;
     }
 private:
@@ -373,14 +435,16 @@ private:
         std::swap(tsw_, rhs.tsw_);
     }
     INLINE TsWord waitFor(Mutex& mutex) {
-#ifdef USE_TICTOC_MCS
-        cybozu::lock::McsSpinlock lk(mutex.mcs_mutex);
-#endif
-        TsWord tsw0 = mutex.load();
-        while (tsw0.lock) {
-            _mm_pause();
+        TsWord tsw0;
+        auto pred = [&]() {
             tsw0 = mutex.load();
-        }
+            return !tsw0.lock;
+        };
+#ifdef USE_MCS_WAIT_QUEUE
+        cybozu::wait_policy::waitUntilQueued<cybozu::lock::QueueSpinlock>(mutex.mcs_mutex, mutex.word(), pred);
+#else
+        cybozu::wait_policy::waitUntil(mutex.word(), pred);
+#endif
         return tsw0;
     }
 };
@@ -442,18 +506,29 @@ INLINE MonitorData& get_thread_local_monitor_data()
 }
 
 
+// [entries].
+constexpr size_t BATCH_VALIDATION_THRESHOLD = 64;
+constexpr size_t PREFETCH_DISTANCE = 16;
+
+
 /**
  * Args:
  *   ls and flags are temporary data.
+ *   ns is node set of range scans. It can be nullptr.
+ *   repair is used to repair stale reads instead of aborting. It can be nullptr.
+ *   soa is temporary data to check large read sets in batch. It can be nullptr.
+ *   beforeWriteBack() is called after the validation while all the write locks are held.
  *
  * Returns:
  *   true: you must commit.
  *   false: you must abort.
  */
+template <typename BeforeWriteBack>
 INLINE bool preCommit(
     ReadSet& rs, WriteSet& ws, LockSet& ls, Flags& flags,
     MemoryVector& local, size_t valueSize, NoWaitMode nowait_mode,
-    bool do_preemptive_verify)
+    bool do_preemptive_verify, const cybozu::index::NodeSet* ns,
+    TxRepair* repair, SoaReadSet<uint64_t>* soa, BeforeWriteBack&& beforeWriteBack)
 {
     bool ret = false;
     uint64_t commitTs = 0;
@@ -515,11 +590,40 @@ INLINE bool preCommit(
         commitTs = std::max(commitTs, rs[i].local_tsw().wts);
     }
 
+    // Find a read whose wts has been changed in batch before extending rts of the others.
+    // Reads whose rts >= commitTs are valid regardless of the current word.
+    if (soa != nullptr && repair == nullptr && rs.size() >= BATCH_VALIDATION_THRESHOLD) {
+        soa->clear();
+        for (const Reader& r : rs) {
+            const TsWord tsw = r.local_tsw();
+            soa->add(r.tsw_addr(), tsw, tsw.rts() >= commitTs ? 0 : TsWord::Wts_mask);
+        }
+        if (unlikely(soa->findMismatch() != soa->size())) goto fin;
+    }
+
     // Validate the Read Set.
+  retry_validate:
     for (size_t i = 0; i < rs.size(); i++) {
-        if (unlikely(!rs[i].validate(commitTs, flags[i]))) goto fin;
+        if (i + PREFETCH_DISTANCE < rs.size()) rs[i + PREFETCH_DISTANCE].prefetch();
+        if (likely(rs[i].validate(commitTs, flags[i]))) continue;
+        if (repair == nullptr) goto fin;
+        // Read the record again. We can not wait for the lock to avoid deadlock.
+        if (unlikely(!rs[i].tryReadTo(repair->getBuffer(i, rs.size()), valueSize, flags[i]))) goto fin;
+        if (!flags[i]) commitTs = std::max(commitTs, rs[i].local_tsw().wts);
+        // The reads validated so far must be valid at the new commitTs also.
+        goto retry_validate;
+    }
+    // Validate the Node Set to detect phantoms.
+    if (ns != nullptr && unlikely(!ns->validate())) goto fin;
+    // Compute the writes derived from the stale reads again.
+    if (repair != nullptr && unlikely(!repair->empty())) {
+        for (Writer& w : ws) {
+            repair->rederive(&local[w.localValIdx], w.srcIdx);
+        }
     }
 
+    beforeWriteBack();
+
     // Write phase.
     {
         auto itLk = ls.begin();
@@ -532,7 +636,7 @@ INLINE bool preCommit(
 #else
             unused(valueSize);
 #endif
-            itLk->updateAndUnlock(commitTs);
+            itLk->updateAndUnlock(commitTs, itW->removed);
             ++itLk;
             ++itW;
         }
@@ -545,21 +649,33 @@ INLINE bool preCommit(
     ls.clear();
     flags.clear();
     local.clear();
+    if (repair != nullptr) repair->clear();
     return ret;
 }
 
 
 class LocalSet
 {
+public:
+    using OrderedIndex = cybozu::index::BTree<DataWithPayload<Mutex> >;
+    using Table = cybozu::record::RecordTable<Mutex>;
+    using Reclaimer = cybozu::ebr::EpochReclaimer::Local;
+
+private:
     ReadSet rs_;
     WriteSet ws_;
     LockSet ls_;
     Flags flags_;
+    cybozu::index::NodeSet ns_; // leaves visited by scans.
+    OrderedIndex::ScanBuffer scanV_;
+
+    cybozu::record::RemovedRecords<Table> removed_;
+    Reclaimer *reclaimer_;
 
 #if 1
-    using Index = SingleThreadUnorderedMap<uintptr_t, size_t>;
+    using Index = cybozu::FlatIndex;
 #else
-    using Index = std::unordered_map<uintptr_t, size_t>;
+    using Index = SingleThreadUnorderedMap<uintptr_t, size_t>;
 #endif
     Index ridx_;
     Index widx_;
@@ -568,12 +684,15 @@ class LocalSet
     size_t valueSize_;
     NoWaitMode nowait_mode_;
     bool do_preemptive_verify_;
+    TxRepair repair_;
+    SoaReadSet<uint64_t> soa_;
 
 public:
     INLINE LocalSet()
-        : rs_(), ws_(), ls_(), flags_(), ridx_(), widx_(), local_()
+        : rs_(), ws_(), ls_(), flags_(), ns_(), scanV_(), removed_(), reclaimer_(nullptr)
+        , ridx_(), widx_(), local_()
         , valueSize_(), nowait_mode_(NoWaitMode::Wait)
-        , do_preemptive_verify_(false) {}
+        , do_preemptive_verify_(false), repair_(), soa_() {}
     INLINE void init(size_t valueSize, size_t nrReserve) {
         valueSize_ = valueSize;
 
@@ -592,6 +711,13 @@ public:
     INLINE void set_do_preemptive_verify(bool do_preemptive_verify) {
         do_preemptive_verify_ = do_preemptive_verify;
     }
+    /**
+     * Enable transaction repair in preCommit().
+     * derive: nullptr means disabled.
+     */
+    INLINE void setRepair(TxRepair::Derive derive) {
+        repair_.init(derive, valueSize_);
+    }
 
     INLINE void read(Mutex& mutex, void *sharedVal, void *dst) {
         unused(sharedVal); unused(dst);
@@ -605,27 +731,88 @@ public:
                 // This is blind-written entry.
                 lvidx = itW->localValIdx;
             } else {
-                // allocate new local value area.
-                lvidx = allocateLocalVal();
-                Reader& r = rs_.emplace_back();
-                r.set(&mutex, lvidx);
-                r.prepare();
-                for (;;) {
-                    copyValue(&local_[lvidx], sharedVal); // read shared
-                    r.readFence();
-                    if (likely(r.isReadSucceeded())) break;
-                    r.prepareRetry();
-                }
+                lvidx = addReader(mutex, sharedVal).localValIdx;
             }
         }
         copyValue(dst, &local_[lvidx]); // read local
     }
-    INLINE void write(Mutex& mutex, void *sharedVal, const void *src) {
+    /**
+     * Read at most nr records whose keys are >= lo through the index.
+     * func: void(uint64_t key, const void *dst) will be called for each record.
+     * Visited leaves are validated in preCommit() to detect phantoms.
+     */
+    template <typename Func>
+    INLINE void scan(const OrderedIndex& index, uint64_t lo, size_t nr, void *dst, Func&& func) {
+        scanV_.clear();
+        index.scan(lo, nr, scanV_, &ns_);
+        for (OrderedIndex::KeyValue& kv : scanV_) {
+            DataWithPayload<Mutex>& rec = *kv.second;
+            read(rec.value, rec.payload, dst);
+            func(kv.first, dst);
+        }
+    }
+    INLINE void scan(const OrderedIndex& index, uint64_t lo, size_t nr, void *dst) {
+        scan(index, lo, nr, dst, [](uint64_t, const void*) {});
+    }
+    /**
+     * Removed records must be reclaimed after any other worker does not touch them.
+     * Call this before remove().
+     */
+    INLINE void setReclaimer(Reclaimer& reclaimer) { reclaimer_ = &reclaimer; }
+    /**
+     * Insert a record with the key.
+     * Returns false if the key exists or the record is being removed by another worker.
+     * The caller should abort the transaction in the latter case.
+     */
+    INLINE bool insert(Table& table, uint64_t key, const void *src) {
+        DataWithPayload<Mutex>& rec = getRecord(table, key);
+        Mutex& mutex = rec.value;
+        WriteSet::iterator itW = findInWriteSet(uintptr_t(&mutex));
+        if (unlikely(itW != ws_.end())) {
+            if (!itW->removed) return false;
+        } else {
+            const Reader& r = getReader(mutex, rec.payload);
+            if (!r.isAbsent() || r.isDead()) return false;
+        }
+        write(mutex, rec.payload, src);
+        return true;
+    }
+    /**
+     * Remove the record with the key.
+     * Returns false if the key does not exist (or the record is being removed).
+     */
+    INLINE bool remove(Table& table, uint64_t key) {
+        assert(reclaimer_ != nullptr);
+        DataWithPayload<Mutex>& rec = getRecord(table, key);
+        Mutex& mutex = rec.value;
+        WriteSet::iterator itW = findInWriteSet(uintptr_t(&mutex));
+        if (unlikely(itW != ws_.end())) {
+            if (itW->removed) return false;
+            itW->removed = true;
+        } else {
+            const Reader& r = getReader(mutex, rec.payload);
+            if (r.isAbsent()) return false;
+            const size_t lvidx = r.localValIdx;
+            Writer& w = ws_.emplace_back();
+            w.set(&mutex, rec.payload, lvidx);
+            w.removed = true;
+        }
+        removed_.add(table, key, rec);
+        return true;
+    }
+    /**
+     * srcMutex: the record whose read the local value is derived from.
+     *           It is used for transaction repair. nullptr means no dependency.
+     */
+    INLINE void write(Mutex& mutex, void *sharedVal, const void *src, const Mutex *srcMutex = nullptr) {
         unused(sharedVal); unused(src);
         size_t lvidx;
         WriteSet::iterator itW = findInWriteSet(uintptr_t(&mutex));
         if (unlikely(itW != ws_.end())) {
             lvidx = itW->localValIdx;
+            // Writing a removed record means re-insertion.
+            itW->removed = false;
+            if (unlikely(repair_.enabled())) itW->srcIdx = getSrcIdx(srcMutex);
         } else {
             ReadSet::iterator itR = findInReadSet(uintptr_t(&mutex));
             if (likely(itR == rs_.end())) {
@@ -635,13 +822,27 @@ public:
             }
             Writer& w = ws_.emplace_back();
             w.set(&mutex, sharedVal, lvidx);
+            if (unlikely(repair_.enabled())) w.srcIdx = getSrcIdx(srcMutex);
         }
         copyValue(&local_[lvidx], src); // write local
     }
     INLINE bool preCommit() {
+        return preCommit([]() {});
+    }
+    /**
+     * beforeWriteBack() is called at the serialization point,
+     * that is, after the validation while all the write locks are held.
+     */
+    template <typename BeforeWriteBack>
+    INLINE bool preCommit(BeforeWriteBack&& beforeWriteBack) {
         bool ret = cybozu::tictoc::preCommit(
             rs_, ws_, ls_, flags_, local_, valueSize_,
-            nowait_mode_, do_preemptive_verify_);
+            nowait_mode_, do_preemptive_verify_, ns_.empty() ? nullptr : &ns_,
+            repair_.enabled() ? &repair_ : nullptr, &soa_,
+            std::forward<BeforeWriteBack>(beforeWriteBack));
+        if (ret) unlinkRemoved();
+        removed_.clear();
+        ns_.clear();
         ridx_.clear();
         widx_.clear();
         local_.clear();
@@ -652,11 +853,53 @@ public:
         rs_.clear();
         ls_.clear();
         flags_.clear();
+        ns_.clear();
+        removed_.clear();
         ridx_.clear();
         widx_.clear();
         local_.clear();
+        repair_.clear();
     }
 private:
+    INLINE DataWithPayload<Mutex>& getRecord(Table& table, uint64_t key) {
+        return table.get_or_insert(key, [](Mutex& mutex) { mutex.tsw.absent = 1; });
+    }
+    INLINE Reader& addReader(Mutex& mutex, void *sharedVal) {
+        // allocate new local value area.
+        const size_t lvidx = allocateLocalVal();
+        Reader& r = rs_.emplace_back();
+        r.set(&mutex, sharedVal, lvidx);
+        r.prepare();
+        for (;;) {
+            copyValue(&local_[lvidx], sharedVal); // read shared
+            r.readFence();
+            if (likely(r.isReadSucceeded())) break;
+            r.prepareRetry();
+        }
+        return r;
+    }
+    INLINE uint32_t getSrcIdx(const Mutex *srcMutex) {
+        if (srcMutex == nullptr) return TxRepair::NO_SRC;
+        ReadSet::iterator itR = findInReadSet(uintptr_t(srcMutex));
+        if (itR == rs_.end()) return TxRepair::NO_SRC;
+        return uint32_t(itR - rs_.begin());
+    }
+    /**
+     * The record state must be validated, so the record must be in the read set.
+     */
+    INLINE Reader& getReader(Mutex& mutex, void *sharedVal) {
+        ReadSet::iterator itR = findInReadSet(uintptr_t(&mutex));
+        if (likely(itR == rs_.end())) return addReader(mutex, sharedVal);
+        return *itR;
+    }
+    /**
+     * Removed records are dead now. No one can make them alive again.
+     */
+    INLINE void unlinkRemoved() {
+        if (likely(removed_.empty())) return;
+        removed_.unlink(*reclaimer_, [](const DataWithPayload<Mutex>& rec) {
+                return bool(rec.value.load().dead); });
+    }
     INLINE ReadSet::iterator findInReadSet(uintptr_t key) {
         return findInSet(
             key, rs_, ridx_,
@@ -0,0 +1,87 @@
+#pragma once
+/**
+ * Transaction repair for OCC-style protocols.
+ *
+ * A write may declare the read its local value is derived from.
+ * When validation finds stale reads while the write set is locked,
+ * they are read again and only the writes derived from them are computed again
+ * instead of aborting the whole transaction.
+ *
+ * Limitation: the read and write sets (the control flow of the transaction)
+ * must not depend on the values read, and each write derives from one read at most.
+ */
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "vector_payload.hpp"
+#include "inline.hpp"
+#include "util.hpp"
+
+
+namespace cybozu {
+
+
+class TxRepair
+{
+public:
+    /**
+     * Compute the local value of a write from the value of its source read.
+     */
+    using Derive = void (*)(void *dst, const void *src, size_t size);
+    static constexpr uint32_t NO_SRC = UINT32_MAX;
+
+    static void copy(void *dst, const void *src, size_t size) { ::memcpy(dst, src, size); }
+
+private:
+    Derive derive_;
+    size_t valueSize_;
+    MemoryVector buf_; // fresh values of stale reads.
+    std::vector<uint32_t> bufIdx_; // read index --> buf_ index + 1. 0 means not stale.
+
+public:
+    TxRepair() : derive_(nullptr), valueSize_(0), buf_(), bufIdx_() {
+    }
+    /**
+     * derive: nullptr means disabled.
+     */
+    void init(Derive derive, size_t valueSize) {
+        derive_ = derive;
+        valueSize_ = valueSize;
+        // MemoryVector does not allow zero-size element.
+        buf_.setSizes(valueSize == 0 ? 1 : valueSize);
+    }
+    bool enabled() const { return derive_ != nullptr; }
+    /**
+     * Returns the buffer to read the record of the stale read again.
+     */
+    INLINE void *getBuffer(size_t readIdx, size_t nrReads) {
+        if (bufIdx_.size() < nrReads) bufIdx_.resize(nrReads, 0);
+        uint32_t& i = bufIdx_[readIdx];
+        if (i == 0) {
+            buf_.resize(buf_.size() + 1);
+            i = buf_.size();
+        }
+        return &buf_[i - 1];
+    }
+    bool empty() const { return buf_.empty(); }
+    /**
+     * Compute the local value of the write again if its source read was stale.
+     */
+    INLINE void rederive(void *dst, uint32_t srcIdx) const {
+        if (srcIdx == NO_SRC || srcIdx >= bufIdx_.size() || bufIdx_[srcIdx] == 0) return;
+#ifndef NO_PAYLOAD
+        derive_(dst, &buf_[bufIdx_[srcIdx] - 1], valueSize_);
+#else
+        unused(dst);
+#endif
+    }
+    void clear() {
+        if (buf_.empty()) return;
+        buf_.clear();
+        std::fill(bufIdx_.begin(), bufIdx_.end(), 0);
+    }
+};
+
+
+} // namespace cybozu
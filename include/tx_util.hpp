@@ -12,6 +12,14 @@
 #include "thread_util.hpp"
 #include "atomic_wrapper.hpp"
 #include "cache_line_size.hpp"
+#include "inline.hpp"
+#include "arch.hpp"
+#include "time.hpp"
+#include "counting_network.hpp"
+
+#ifdef __x86_64__
+#include <cpuid.h>
+#endif
 
 
 enum TxIdGenType : uint8_t
@@ -352,3 +360,228 @@ public:
         orderId_ = orderId;
     }
 };
+
+
+/**
+ * Returns true if the time stamp counter ticks at a constant rate in all the power states.
+ */
+inline bool hasInvariantTsc()
+{
+#if defined(__x86_64__)
+    uint32_t eax, ebx, ecx, edx;
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0) return false;
+    return (edx & (1U << 8)) != 0;
+#elif defined(__aarch64__)
+    return true; // The generic timer is synchronized by the architecture.
+#else
+    return false;
+#endif
+}
+
+
+/**
+ * Measure the skew of the time stamp counters between cpuIdV[0] and each of the other cpus.
+ * The two threads exchange rdtscp() values as t0 (cpuIdV[0]) --> t1 (other) --> t2 (cpuIdV[0]).
+ * t0 <= t1 <= t2 must hold if the counters are synchronized,
+ * so the violation is a lower bound of the skew.
+ * Returns the maximum violation [clocks].
+ */
+inline uint64_t measureTscSkew(const std::vector<uint>& cpuIdV, size_t nrLoop = 1000)
+{
+    struct Slot {
+        alignas(CACHE_LINE_SIZE)
+        uint64_t value;
+    };
+    uint64_t skew = 0;
+    for (size_t i = 1; i < cpuIdV.size(); i++) {
+        Slot ping{0}, pong{0};
+        cybozu::thread::ThreadRunner th0([&]() {
+            cybozu::thread::setThreadAffinity(::pthread_self(), cpuIdV[0]);
+            uint64_t prev = 0;
+            for (size_t j = 0; j < nrLoop; j++) {
+                const uint64_t t0 = cybozu::time::rdtscp();
+                store_release(ping.value, t0);
+                uint64_t t1;
+                while ((t1 = load_acquire(pong.value)) == prev) _mm_pause();
+                prev = t1;
+                const uint64_t t2 = cybozu::time::rdtscp();
+                if (t0 > t1) skew = std::max(skew, t0 - t1);
+                if (t1 > t2) skew = std::max(skew, t1 - t2);
+            }
+        });
+        cybozu::thread::ThreadRunner th1([&,i]() {
+            cybozu::thread::setThreadAffinity(::pthread_self(), cpuIdV[i]);
+            uint64_t prev = 0;
+            for (size_t j = 0; j < nrLoop; j++) {
+                uint64_t t0;
+                while ((t0 = load_acquire(ping.value)) == prev) _mm_pause();
+                prev = t0;
+                store_release(pong.value, cybozu::time::rdtscp());
+            }
+        });
+        th0.start();
+        th1.start();
+        th0.join();
+        th1.join();
+    }
+    return skew;
+}
+
+
+/**
+ * TxId generator using the time stamp counter.
+ *
+ * No shared variable is accessed, while the counters must be synchronized among cpus.
+ * Call checkTsc() once at startup.
+ * The layout is time | seq | workerId from the upper bits.
+ * time is the clocks since base >> TscShift and always follows the counter.
+ * seq distinguishes TxIds of a worker in the same tick.
+ * If seq is exhausted, get() waits for the next tick instead of running ahead of the clock.
+ * Older transactions have smaller TxIds among workers
+ * if their begin times differ more than the skew and the resolution (1 << TscShift clocks).
+ * Id is uint64_t for TxId with USE_64BIT_TXID. See TscTxIdGenerator32 for 32bit TxIds.
+ */
+template <typename IdT = uint64_t, size_t WorkerIdBits = 10, size_t SeqBits = 6, size_t TscShift = 6>
+class TscTxIdGenerator
+{
+public:
+    using Id = IdT;
+
+private:
+    static constexpr size_t TotalBits = sizeof(Id) * 8;
+    static_assert(WorkerIdBits + SeqBits + 20 <= TotalBits);
+
+    union U {
+        Id txId;
+        struct {
+            // lower bits (assuming little endian)
+            Id workerId:WorkerIdBits;
+            Id seq:SeqBits;
+            Id time:(TotalBits - WorkerIdBits - SeqBits);
+        };
+    };
+
+    uint64_t base_; // tsc shared by all the workers.
+    size_t workerId_;
+    uint64_t prevTime_; // the last time part.
+    uint64_t seq_; // the last seq part.
+
+public:
+    static constexpr size_t TimeShift = WorkerIdBits + SeqBits;
+
+    /**
+     * Skews smaller than this are negligible compared with transaction execution time.
+     */
+    static constexpr uint64_t ACCEPTABLE_SKEW = uint64_t(1) << std::max<size_t>(TscShift, 10);
+
+    /**
+     * base: the same rdtscp() value must be given to all the workers.
+     * The max workerId is reserved not to generate MaxTxId.
+     */
+    TscTxIdGenerator(size_t workerId, uint64_t base)
+        : base_(base), workerId_(workerId), prevTime_(0), seq_(0) {
+        if (workerId >= (1UL << WorkerIdBits) - 1) {
+            throw cybozu::Exception("TscTxIdGenerator:too large workerId") << workerId;
+        }
+    }
+
+    Id get() {
+        uint64_t t;
+        for (;;) {
+            t = tick();
+            if (t > prevTime_) {
+                seq_ = 0;
+                break;
+            }
+            // t < prevTime_ occurs only after migration to a cpu behind by the skew.
+            if (t == prevTime_ && seq_ + 1 < (uint64_t(1) << SeqBits)) {
+                seq_++;
+                break;
+            }
+            _mm_pause();
+        }
+        prevTime_ = t;
+        U u;
+        u.workerId = workerId_;
+        u.seq = seq_;
+        u.time = t;
+        return u.txId;
+    }
+
+    /**
+     * Current time part.
+     */
+    uint64_t tick() const {
+        return (cybozu::time::rdtscp() - base_) >> TscShift;
+    }
+
+    /**
+     * Check the counters of the cpus of the workers.
+     * Returns the measured skew [clocks].
+     */
+    static uint64_t checkTsc(const std::vector<uint>& cpuIdV) {
+        if (!hasInvariantTsc()) {
+            throw cybozu::Exception("TscTxIdGenerator:invariant tsc is not supported");
+        }
+        const uint64_t skew = measureTscSkew(cpuIdV);
+        if (skew > ACCEPTABLE_SKEW) {
+            throw cybozu::Exception("TscTxIdGenerator:too large tsc skew") << skew << ACCEPTABLE_SKEW;
+        }
+        return skew;
+    }
+};
+
+
+/**
+ * Layout for 32bit TxIds such as cybozu::wait_die::TxId.
+ * The time part has 22 bits of 1 << 14 clocks (about 5us at 3GHz),
+ * so it wraps around every 1 << 36 clocks (about 23 seconds at 3GHz).
+ * After a wraparound, new transactions have higher priority than older ones for a while;
+ * wait-die is still deadlock-free because TxIds are unique and not changed in retries.
+ * A worker gets up to 4 TxIds in a tick.
+ */
+template <size_t WorkerIdBits = 8>
+using TscTxIdGenerator32 = TscTxIdGenerator<uint32_t, WorkerIdBits, 2, 14>;
+
+
+/**
+ * TxId generator using a counting network shared by the workers.
+ * Contention is distributed to the balancers and the output counters.
+ * TxIds are unique, and sequential in quiescent states.
+ */
+template <typename CountingNetwork = cybozu::util::CountingNetwork8>
+class CountingNetworkTxIdGenerator
+{
+    CountingNetwork& cn_;
+    size_t workerId_;
+public:
+    CountingNetworkTxIdGenerator(CountingNetwork& cn, size_t workerId)
+        : cn_(cn), workerId_(workerId) {
+    }
+    /**
+     * MaxTxId will not returned because it is special value.
+     */
+    TxId get() {
+        TxId x = TxId(cn_.get(workerId_));
+        if (x == MaxTxId) x = TxId(cn_.get(workerId_));
+        return x;
+    }
+};
+
+
+/**
+ * Abort flag of a running transaction.
+ * Another transaction sets it to wound the owner (wound-wait)
+ * or to abort it in a cascade (early lock retirement).
+ * The owner polls it while running and waiting.
+ */
+struct WoundFlag
+{
+    alignas(CACHE_LINE_SIZE)
+    uint8_t wounded;
+
+    INLINE WoundFlag() noexcept : wounded(0) {}
+    INLINE void wound() noexcept { store_release(wounded, 1); }
+    INLINE bool is_wounded() const noexcept { return load_acquire(wounded) != 0; }
+    INLINE void reset() noexcept { store_release(wounded, 0); }
+};
@@ -9,6 +9,7 @@
 #include <cstddef>
 #include "allocator.hpp"
 #include "inline.hpp"
+#include "huge_page.hpp"
 
 
 struct MemoryElement
@@ -31,14 +32,17 @@ protected:
     size_t nrElem_; // [nr]
     size_t nrReserved_; // [nr]
     uint8_t *data_;
+    size_t mapped_; // [bytes]. see cybozu::hugepage::Block.
+    cybozu::hugepage::Mode hugePageMode_;
 
 public:
     explicit MemoryVector(size_t elemSize = 1)
         : elemSize_(elemSize), alignmentSize_(sizeof(uintptr_t))
-        , nrElem_(0), nrReserved_(0), data_(nullptr) {
+        , nrElem_(0), nrReserved_(0), data_(nullptr), mapped_(0)
+        , hugePageMode_(cybozu::hugepage::defaultMode_) {
     }
     virtual ~MemoryVector() noexcept {
-        if (data_) ::free(data_);
+        cybozu::hugepage::deallocate(data_, mapped_);
     }
     /*
      * Set element size.
@@ -83,13 +87,15 @@ public:
     }
     INLINE void reserve(size_t nrReserved) {
         if (data_ == nullptr) {
-            data_ = allocateNewArray(nrReserved);
+            data_ = allocateNewArray(nrReserved, mapped_);
             nrReserved_ = nrReserved;
         } else if (nrReserved > nrReserved_) {
-            uint8_t *data = allocateNewArray(nrReserved);
+            size_t mapped;
+            uint8_t *data = allocateNewArray(nrReserved, mapped);
             ::memcpy(data, data_, elemSize_ * nrElem_);
             std::swap(data_, data);
-            ::free(data);
+            std::swap(mapped_, mapped);
+            cybozu::hugepage::deallocate(data, mapped);
             nrReserved_ = nrReserved;
         } else {
             // do nothing.
@@ -249,14 +255,13 @@ public:
     }
 
 protected:
-    uint8_t* allocateNewArray(size_t nrElem) const {
-        void *p;
-        // posix_memalign() may return non-null with size 0.
-        if (nrElem == 0) return nullptr;
-        if (::posix_memalign(&p, alignmentSize_, elemSize_ * nrElem) != 0) {
-            throw std::bad_alloc();
-        }
-        return (uint8_t *)p;
+    uint8_t* allocateNewArray(size_t nrElem, size_t& mapped) const {
+        const size_t size = elemSize_ * nrElem;
+        const cybozu::hugepage::Mode mode = size >= cybozu::hugepage::LOCAL_SET_MIN_SIZE
+            ? hugePageMode_ : cybozu::hugepage::Mode::OFF;
+        const cybozu::hugepage::Block b = cybozu::hugepage::allocate(size, alignmentSize_, mode);
+        mapped = b.mapped;
+        return (uint8_t *)b.ptr;
     }
     uintptr_t getAddress(size_t i, uintptr_t base = 0) const {
         if (base == 0) base = uintptr_t(data_);
@@ -310,13 +315,15 @@ public:
     }
     INLINE void reserve(size_t nrReserved) {
         if (data_ == nullptr) {
-            data_ = allocateNewArray(nrReserved);
+            data_ = allocateNewArray(nrReserved, mapped_);
             nrReserved_ = nrReserved;
         } else if (nrReserved > nrReserved_) {
-            uint8_t *data = allocateNewArray(nrReserved);
+            size_t mapped;
+            uint8_t *data = allocateNewArray(nrReserved, mapped);
             moveToNewArray(data_, data, nrElem_);
             std::swap(data_, data);
-            ::free(data);
+            std::swap(mapped_, mapped);
+            cybozu::hugepage::deallocate(data, mapped);
             nrReserved_ = nrReserved;
         } else {
             // do nothing.
@@ -542,15 +549,33 @@ private:
     size_t size_;  // number of current items [nr].
     size_t reservedSize_; // allocated memory size [nr].
     size_t alignmentSize_; // alignment [bytes].
+    size_t mapped_; // [bytes]. see cybozu::hugepage::Block.
+    cybozu::hugepage::Mode hugePageMode_;
+    size_t pageSize_; // [bytes] granted to the blocks. 0 means unknown.
 
 public:
     VectorWithPayload()
         : payloadSize_(0), data_(nullptr), size_(0)
-        , reservedSize_(0), alignmentSize_(sizeof(uintptr_t)) {
+        , reservedSize_(0), alignmentSize_(sizeof(uintptr_t))
+        , mapped_(0), hugePageMode_(cybozu::hugepage::Mode::OFF), pageSize_(0) {
     }
     ~VectorWithPayload() noexcept {
         callDstrRange(0, size_);
-        if (data_) ::free(data_);
+        cybozu::hugepage::deallocate(data_, mapped_);
+    }
+
+    /*
+     * This is used for records.
+     * It affects allocations after this call.
+     */
+    void setHugePageMode(cybozu::hugepage::Mode mode) {
+        hugePageMode_ = mode;
+    }
+    /*
+     * Smallest page size granted to the blocks allocated by resize().
+     */
+    size_t pageSize() const {
+        return pageSize_ == 0 ? cybozu::hugepage::basePageSize() : pageSize_;
     }
 
     void setPayloadSize(size_t payloadSize, size_t alignmentSize = sizeof(uintptr_t)) {
@@ -583,10 +608,16 @@ public:
             callDstrRange(size, size_);
             size_ = size;
         } else if (size > size_) {
+            const bool allocates = data_ == nullptr || size > reservedSize_;
             reserve(size);
             assert(size <= reservedSize_);
             callCstrRange(size_, size);
             size_ = size;
+            // The new block has been touched by the constructors.
+            if (allocates && hugePageMode_ != cybozu::hugepage::Mode::OFF) {
+                const size_t granted = cybozu::hugepage::grantedPageSize(data_);
+                if (granted != 0 && (pageSize_ == 0 || granted < pageSize_)) pageSize_ = granted;
+            }
         } else {
             // do nothing.
         }
@@ -594,17 +625,19 @@ public:
 
     INLINE void reserve(size_t size) {
         if (data_ == nullptr) {
-            data_ = allocateNewArray(size);
+            data_ = allocateNewArray(size, mapped_);
 #if 0
             // zero-clear
             ::memset(data_, 0, elemSize() * size);
 #endif
             reservedSize_ = size;
         } else if (size > reservedSize_) {
-            uint8_t *data = allocateNewArray(size);
+            size_t mapped;
+            uint8_t *data = allocateNewArray(size, mapped);
             moveToNewArray(data_, data, size_);
             std::swap(data_, data);
-            ::free(data);
+            std::swap(mapped_, mapped);
+            cybozu::hugepage::deallocate(data, mapped);
 #if 0
             // zero-clear
             size_t start = reservedSize_ * elemSize();
@@ -945,13 +978,11 @@ private:
         if (base == 0) base = uintptr_t(data_);
         return base + (elemSize() * i);
     }
-    uint8_t* allocateNewArray(size_t size) const {
-        void *p;
-        if (size == 0) return nullptr;
-        if (::posix_memalign(&p, alignmentSize_, elemSize() * size) != 0) {
-            throw std::bad_alloc();
-        }
-        return (uint8_t *)p;
+    uint8_t* allocateNewArray(size_t size, size_t& mapped) const {
+        const cybozu::hugepage::Block b =
+            cybozu::hugepage::allocate(elemSize() * size, alignmentSize_, hugePageMode_);
+        mapped = b.mapped;
+        return (uint8_t *)b.ptr;
     }
     void moveToNewArray(void *src, void *dst, size_t nr) const {
 #if 0
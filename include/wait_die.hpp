@@ -1,16 +1,24 @@
 #pragma once
 /**
  * 2PL wait and die for deadlock prevension.
+ * Wound-wait is also available.
  */
 #include <vector>
+#include <type_traits>
 #include "lock_data.hpp"
 #include "arch.hpp"
 #include "vector_payload.hpp"
+#include "flat_index.hpp"
 #include "write_set.hpp"
 #include "atomic_wrapper.hpp"
 #include "inline.hpp"
 #include "list_util.hpp"
 #include "mcslikelock.hpp"
+#include "record_table.hpp"
+#include "epoch_reclaimer.hpp"
+#include "tx_util.hpp"
+#include "bamboo.hpp"
+#include "wait_policy.hpp"
 
 /*
  * Currently three variants of wait-die are avaialble.
@@ -29,6 +37,12 @@
  *   All operations must stand in the request queue with atomic exchange.
  *   Mutex object is a bit large (32-48bytes) to have several pointers.
  *   Additional heap allocation is not required at all (requests can use stack).
+ *
+ * WoundWaitLock4:
+ *   Wound-wait version of WaitDieLock4 with the same request queue.
+ *   An older requester never dies but wounds younger holders,
+ *   which abort by polling their abort flags.
+ *   The mutex object keeps the abort flags of the holders in a heap-allocated vector.
  */
 
 namespace cybozu {
@@ -644,6 +658,7 @@ struct RequestType
      *   Y is the optional information of lock and unlock type only.
      *     Y=0: read
      *     Y=1: write
+     *   0b111 is cancel of a waiting lock request (used by wound-wait only).
      */
     static constexpr uint8_t INVALID      = 0b000;
     static constexpr uint8_t READ_LOCK    = 0b001;
@@ -651,6 +666,7 @@ struct RequestType
     static constexpr uint8_t WRITE_LOCK   = 0b101;
     static constexpr uint8_t WRITE_UNLOCK = 0b110;
     static constexpr uint8_t UPGRADE      = 0b011;
+    static constexpr uint8_t CANCEL       = 0b111;
 
     RequestType(uint8_t value0 = INVALID) noexcept : value(value0) {}
     operator uint8_t() const noexcept { return value; }
@@ -661,6 +677,7 @@ struct RequestType
     bool is_write_lock() const noexcept   { return value == WRITE_LOCK; }
     bool is_write_unlock() const noexcept { return value == WRITE_UNLOCK; }
     bool is_upgrade() const noexcept      { return value == UPGRADE; }
+    bool is_cancel() const noexcept       { return value == CANCEL; }
 
     bool is_lock() const noexcept   { return (value & 0b011) == 0b001; }
     bool is_unlock() const noexcept { return (value & 0b011) == 0b010; }
@@ -772,13 +789,18 @@ struct WaitDieData4
         RequestType req_type; // read only.
         Message receiver; // The owner will set the variable.
 
+        // These fields are used by wound-wait only.
+        WoundFlag* wound_flag; // read-only.
+        Request* target; // the request to cancel. read-only.
+
         INLINE Request() { reset(); }
-        INLINE Request(TxId tx_id0, RequestType req_type0) {
+        INLINE Request(TxId tx_id0, RequestType req_type0, WoundFlag* wound_flag0 = nullptr) {
             assert(!req_type0.is_invalid());
-            reset(tx_id0, req_type0);
+            reset(tx_id0, req_type0, wound_flag0);
         }
         INLINE void reset(TxId tx_id0 = MAX_TXID,
-                          RequestType req_type0 = RequestType::INVALID) {
+                          RequestType req_type0 = RequestType::INVALID,
+                          WoundFlag* wound_flag0 = nullptr) {
             next = nullptr;
             tx_id = tx_id0;
             write_tx_id = MAX_TXID;
@@ -786,11 +808,31 @@ struct WaitDieData4
             reserved0 = 0;
             req_type = req_type0;
             receiver = WAITING;
+            wound_flag = wound_flag0;
+            target = nullptr;
         }
 
+        /**
+         * The receiver is not a futex word, so the park wait policy yields here.
+         */
         INLINE Message local_spin_wait() {
             Message msg;
-            while ((msg = load_acquire(receiver)) == WAITING) _mm_pause();
+            cybozu::wait_policy::waitUntil(nullptr, [&]() {
+                return (msg = load_acquire(receiver)) != WAITING;
+            });
+            store(receiver, WAITING);
+            return msg;
+        }
+        /**
+         * Returns WAITING if the requester is wounded before the reply.
+         */
+        INLINE Message local_spin_wait_unless_wounded() {
+            assert(wound_flag != nullptr);
+            Message msg;
+            cybozu::wait_policy::waitUntil(nullptr, [&]() {
+                return (msg = load_acquire(receiver)) != WAITING || wound_flag->is_wounded();
+            });
+            if (unlikely(msg == WAITING)) return WAITING;
             store(receiver, WAITING);
             return msg;
         }
@@ -1214,7 +1256,345 @@ private:
 
 
 /**
- * Lock can be one of WaitDieLock2, WaitDieLock3, and WaitDieLock4.
+ * Wound-wait version of WaitDieData4.
+ * The MCS-like request queue is the same but lock requests never fail due to their priority.
+ * The waiting queue is sorted by tx_id and a lock request wounds
+ * the conflicting holders younger than itself.
+ * Wounded waiters leave the waiting queue with cancel requests.
+ */
+struct WoundWaitData4
+{
+    using Header = WaitDieData4::Header;
+    using Message = WaitDieData4::Message;
+    using Request = WaitDieData4::Request;
+
+    struct Holder {
+        TxId tx_id;
+        WoundFlag* wound_flag;
+    };
+
+private:
+    Header header_; // This variable must be accessed by atomic load/store only.
+
+    uintptr_t tail_; // normal pointer or UNOWNED or OWNED.
+    Request* head_; // normal pointer or nullptr.
+
+    using ReqList = NodeListT<Request>;
+
+    ReqList wq_; // waiting queue. This is sorted by tx_id (FIFO for the same tx_id).
+    std::vector<Holder> holders_; // accessed by the owner only.
+
+    struct TxIdLess {
+        bool operator()(const Request& lhs, const Request& rhs) const {
+            return load(lhs.tx_id) < load(rhs.tx_id);
+        }
+    };
+
+public:
+    INLINE WoundWaitData4() : header_(), tail_(mcslike::UNOWNED), head_(nullptr), wq_(), holders_() {}
+
+    INLINE bool do_request(Request& req) {
+        assert(!req.req_type.is_invalid());
+        const Message msg = mcslike::do_request_sync(
+            req, tail_, head_, [&](Request& tail) { owner_task(req, tail); });
+        assert(msg == Message::SUCCEEDED || msg == Message::FAILED);
+        return msg == Message::SUCCEEDED;
+    }
+    /**
+     * The caller must call req.local_spin_wait() or
+     * req.local_spin_wait_unless_wounded() later.
+     */
+    INLINE void do_request_async(Request& req) {
+        assert(!req.req_type.is_invalid());
+        mcslike::do_request_async(
+            req, tail_, head_, [&](Request& tail) { owner_task(req, tail); });
+    }
+
+    INLINE Header load_header() const { return load_acquire(header_.obj); }
+
+private:
+    INLINE void store_header(Header h0) { store_release(header_.obj, h0.obj); }
+
+    INLINE void owner_task(Request& head, Request& tail) {
+        ReqList done_list, lock_list;
+        Header h1 = load_header();
+
+        // Dispatch new requests.
+        Request* req = &head;
+        while (req != nullptr) {
+            // req->next will be destroyed so we obtain its value at first.
+            Request* next = (req == &tail ? nullptr : req->get_non_empty_next());
+            const RequestType req_type = load(req->req_type);
+            if (likely(req_type.is_lock())) {
+                add_lock_req_to_wait_queue(h1, req);
+            } else if (unlikely(req_type.is_upgrade())) {
+                if (try_upgrade(h1, req)) {
+                    done_list.push_back(req);
+                } else {
+                    req->notify(Message::FAILED);
+                }
+            } else if (unlikely(req_type.is_cancel())) {
+                cancel(h1, load(req->target));
+                done_list.push_back(req);
+            } else {
+                assert(req_type.is_unlock());
+                prepare_unlock_request(h1, req);
+                done_list.push_back(req);
+            }
+            req = next;
+        }
+        prepare_lock_requests(h1, lock_list);
+#ifndef NDEBUG
+        if (h1.is_unlocked()) {
+            assert(h1.tx_id == MAX_TXID);
+            assert(holders_.empty());
+        }
+#endif
+        store_header(h1);
+        notify_success_to_all(done_list);
+        notify_success_to_all(lock_list);
+    }
+    INLINE void add_lock_req_to_wait_queue(Header& h0, Request* req) {
+        const RequestType req_type = load(req->req_type);
+        assert(req_type.is_lock());
+        if (req_type.is_write()) {
+            if (unlikely(h0.write_requests >= Header::Max_write_requests)) {
+                // The counter is full so the request fails like readers overflow.
+                req->notify(Message::FAILED);
+                return;
+            }
+            h0.write_requests++;
+            if (h0.is_locked()) wound_younger_holders(req);
+        } else {
+            if (h0.is_write_locked()) wound_younger_holders(req);
+        }
+        /*
+         * Conflicting holders older than the request are not wounded.
+         * Waiters before the request in the queue are older than it
+         * and they have already wounded the other holders.
+         */
+        wq_.insert_sort<TxIdLess>(req);
+    }
+    INLINE void wound_younger_holders(const Request* req) {
+        const TxId tx_id = load(req->tx_id);
+        const WoundFlag* wound_flag = load(req->wound_flag);
+        for (const Holder& holder : holders_) {
+            if (holder.tx_id > tx_id && holder.wound_flag != wound_flag) {
+                holder.wound_flag->wound();
+            }
+        }
+    }
+    INLINE bool try_upgrade(Header& h0, Request* req) {
+        if (h0.readers != 1 || !wq_.empty()) return false;
+        assert(h0.is_read_locked());
+        assert(holders_.size() == 1);
+        assert(holders_[0].wound_flag == load(req->wound_flag));
+        h0.tx_id = load(req->tx_id);
+        h0.write_locked = 1;
+        h0.readers = 0;
+        return true;
+    }
+    INLINE void cancel(Header& h0, Request* target) {
+        assert(target != nullptr);
+        // The target may have been granted before.
+        if (!wq_.remove(target)) return;
+        if (load(target->req_type).is_write()) {
+            assert(h0.write_requests > 0);
+            h0.write_requests--;
+        }
+        target->notify(Message::FAILED);
+    }
+    INLINE void prepare_unlock_request(Header& h0, Request* req) {
+        remove_holder(load(req->wound_flag));
+        if (load(req->req_type).is_write()) {
+            assert(h0.is_write_locked());
+            h0.write_locked = 0;
+            h0.tx_id = MAX_TXID;
+            return;
+        }
+        assert(h0.readers > 0);
+        h0.readers--;
+        h0.tx_id = MAX_TXID;
+        for (const Holder& holder : holders_) {
+            h0.tx_id = std::min(h0.tx_id, holder.tx_id);
+        }
+    }
+    INLINE void remove_holder(const WoundFlag* wound_flag) {
+        for (Holder& holder : holders_) {
+            if (holder.wound_flag == wound_flag) {
+                holder = holders_.back();
+                holders_.pop_back();
+                return;
+            }
+        }
+        assert(false);
+    }
+    INLINE void prepare_lock_requests(Header& h0, ReqList& lock_list) {
+        if (wq_.empty()) return;
+        assert(lock_list.empty());
+
+        Request* req = wq_.front();
+        if (load(req->req_type).is_write()) {
+            if (h0.is_locked()) return; // still waiting.
+            h0.tx_id = load(req->tx_id);
+            h0.write_locked = 1;
+            assert(h0.write_requests > 0);
+            h0.write_requests--;
+            grant(req, lock_list);
+            return;
+        }
+        if (h0.is_write_locked()) return; // still waiting.
+        while (req != nullptr) {
+            if (unlikely(h0.readers >= Max_readers)) {
+                wq_.pop_front();
+                req->notify(Message::FAILED);
+            } else {
+                h0.readers++;
+                h0.tx_id = std::min(h0.tx_id, load(req->tx_id));
+                grant(req, lock_list);
+            }
+            // next request.
+            req = wq_.empty() ? nullptr : wq_.front();
+            if (req != nullptr && load(req->req_type).is_write()) req = nullptr;
+        }
+    }
+    INLINE void grant(Request* req, ReqList& lock_list) {
+        assert(req == wq_.front());
+        holders_.push_back(Holder{load(req->tx_id), load(req->wound_flag)});
+        wq_.pop_front();
+        lock_list.push_back(req);
+    }
+    INLINE void notify_success_to_all(ReqList& req_list) noexcept {
+        while (!req_list.empty()) {
+            Request& req = *req_list.front();
+            req_list.pop_front();
+            // pop_front must be called before notification.
+            req.notify(Message::SUCCEEDED);
+        }
+    }
+};
+
+
+struct WoundWaitLock4
+{
+    using Mode = cybozu::lock::LockStateXS::Mode;
+    using Mutex = WoundWaitData4;
+    using Header = Mutex::Header;
+    using Message = Mutex::Message;
+    using Request = Mutex::Request;
+
+private:
+    Mutex *mutexp_;
+    Mode mode_;
+    TxId tx_id_;
+    WoundFlag *wound_flag_;
+
+public:
+    INLINE WoundWaitLock4() noexcept
+        : mutexp_(nullptr), mode_(Mode::INVALID), tx_id_(MAX_TXID), wound_flag_(nullptr) {}
+    INLINE ~WoundWaitLock4() noexcept { unlock(); }
+    INLINE WoundWaitLock4(const WoundWaitLock4& ) = delete;
+    INLINE WoundWaitLock4(WoundWaitLock4&& rhs) noexcept : WoundWaitLock4() { swap(rhs); }
+    INLINE WoundWaitLock4& operator=(const WoundWaitLock4& rhs) = delete;
+    INLINE WoundWaitLock4& operator=(WoundWaitLock4&& rhs) noexcept { swap(rhs); return *this; }
+
+    /**
+     * This is for blind-write.
+     */
+    INLINE void setMutex(Mutex& mutex) noexcept { mutexp_ = &mutex; }
+
+    /**
+     * If true, locked.
+     * If false, you must abort your running transaction.
+     * It returns false also when the transaction is wounded while waiting.
+     * The lock may be held in the case and it will be released by unlock().
+     */
+    INLINE bool readLock(Mutex& mutex, TxId tx_id, WoundFlag& wound_flag) noexcept {
+        return lock(mutex, tx_id, wound_flag, Mode::S);
+    }
+    INLINE bool writeLock(Mutex& mutex, TxId tx_id, WoundFlag& wound_flag) noexcept {
+        return lock(mutex, tx_id, wound_flag, Mode::X);
+    }
+    INLINE void unlock() noexcept {
+        // mutexp_ may not be nullptr due to setMutex().
+        switch (mode_) {
+        case Mode::INVALID: return;
+        case Mode::S: unlock(RequestType::READ_UNLOCK); return;
+        case Mode::X: unlock(RequestType::WRITE_UNLOCK); return;
+        default: assert(false);
+        }
+    }
+    INLINE bool upgrade() noexcept {
+        assert_locked(Mode::S);
+        Mutex& mutex = *mutexp_;
+        Header h0 = mutex.load_header();
+        if (unlikely(h0.readers != 1 || h0.write_requests != 0)) return false;
+
+        Request req(tx_id_, RequestType::UPGRADE, wound_flag_);
+        if (unlikely(!mutex.do_request(req))) return false;
+
+        mode_ = Mode::X;
+        return true;
+    }
+    INLINE Mode mode() const noexcept {
+        return mode_;
+    }
+    INLINE uintptr_t getMutexId() const noexcept {
+        return uintptr_t(mutexp_);
+    }
+private:
+    INLINE bool lock(Mutex& mutex, TxId tx_id, WoundFlag& wound_flag, Mode mode) noexcept {
+        assert(tx_id != MAX_TXID);
+        Request req(tx_id, mode == Mode::S ? RequestType::READ_LOCK : RequestType::WRITE_LOCK, &wound_flag);
+        mutex.do_request_async(req);
+        Message msg = req.local_spin_wait_unless_wounded();
+        if (unlikely(msg == Message::WAITING)) {
+            // Wounded while waiting. The request must leave the waiting queue.
+            Request cancel_req(tx_id, RequestType::CANCEL, &wound_flag);
+            cancel_req.target = &req;
+            mutex.do_request(cancel_req);
+            msg = req.local_spin_wait();
+        }
+        if (unlikely(msg != Message::SUCCEEDED)) return false;
+        mutexp_ = &mutex;
+        mode_ = mode;
+        tx_id_ = tx_id;
+        wound_flag_ = &wound_flag;
+        return !wound_flag.is_wounded();
+    }
+    INLINE void unlock(RequestType req_type) noexcept {
+        Mutex& mutex = *mutexp_;
+        Request req(tx_id_, req_type, wound_flag_);
+        bool ret = mutex.do_request(req);
+        assert(ret); unused(ret);
+        init();
+    }
+    INLINE void init() noexcept {
+        mutexp_ = nullptr;
+        mode_ = Mode::INVALID;
+        tx_id_ = MAX_TXID;
+        wound_flag_ = nullptr;
+    }
+    INLINE void swap(WoundWaitLock4& rhs) noexcept {
+        std::swap(mutexp_, rhs.mutexp_);
+        std::swap(mode_, rhs.mode_);
+        std::swap(tx_id_, rhs.tx_id_);
+        std::swap(wound_flag_, rhs.wound_flag_);
+    }
+    INLINE void assert_locked(Mode mode) const noexcept {
+        unused(mode);
+#ifndef NDEBUG
+        assert(mode_ == mode);
+        assert(mutexp_ != nullptr);
+        assert(tx_id_ != MAX_TXID);
+        assert(wound_flag_ != nullptr);
+#endif
+    }
+};
+
+
+/**
+ * Lock can be one of WaitDieLock2, WaitDieLock3, WaitDieLock4, and WoundWaitLock4.
  */
 template <typename Lock>
 class LockSet
@@ -1222,6 +1602,10 @@ class LockSet
 public:
     using Mode = typename Lock::Mode;
     using Mutex = typename Lock::Mutex;
+    using StateSet = cybozu::record::RecordStateSet<Mutex>;
+    using Table = typename StateSet::Table;
+    using Record = typename Table::Record;
+    using Reclaimer = cybozu::ebr::EpochReclaimer::Local;
 private:
     using OpEntryL = OpEntry<Lock>;
     using Vec = std::vector<OpEntryL>;
@@ -1229,9 +1613,9 @@ private:
 
     // key: mutex addr, value: index in the vector.
 #if 1
-    using Index = SingleThreadUnorderedMap<uintptr_t, size_t>;
+    using Index = cybozu::FlatIndex;
 #else
-    using Index = std::unordered_map<uintptr_t, size_t>;
+    using Index = SingleThreadUnorderedMap<uintptr_t, size_t>;
 #endif
 
     Vec vec_;
@@ -1253,6 +1637,13 @@ private:
     };
     std::vector<BlindWriteInfo> bwV_;
 
+    StateSet states_; // record state changes by insert/remove.
+    Reclaimer *reclaimer_ = nullptr;
+
+    static constexpr bool usesWound_ = std::is_same_v<Lock, WoundWaitLock4>;
+    WoundFlag woundFlag_; // used by wound-wait and cascading aborts of retire chains.
+    cybozu::bamboo::RetireSet retire_;
+
 public:
     // Call this at first once.
     void init(size_t valueSize, size_t nrReserve) {
@@ -1265,9 +1656,26 @@ public:
         bwV_.reserve(nrReserve); // This may be too conservative and memory eater.
     }
     /* call this before read/write just after a transaction trial starts. */
-    void setTxId(TxId txId) { txId_ = txId; }
+    void setTxId(TxId txId) {
+        txId_ = txId;
+        retire_.setTxId(txId);
+    }
+    /**
+     * Accesses to the hot records in the table bypass their locks
+     * and retire early. See bamboo.hpp.
+     * Wound-wait is required because a transaction waits for the earlier ones
+     * in the retire chains to commit.
+     */
+    void setRetireTable(cybozu::bamboo::RetireTable& table) {
+        if (!usesWound_) throw cybozu::Exception("LockSet:setRetireTable:wound-wait is required");
+        retire_.init(table, woundFlag_, valueSize_, true);
+    }
 
     INLINE bool read(Mutex& mutex, void *sharedVal, void *dst) {
+        if (unlikely(isWounded())) return false;
+        if (unlikely(retire_.enabled())) {
+            if (auto *chain = retire_.find(&mutex)) return retire_.read(*chain, dst);
+        }
         VecIter it = find(uintptr_t(&mutex));
         if (it != vec_.end()) {
             Lock& lk = it->lock;
@@ -1282,7 +1690,7 @@ public:
         // Try to read lock.
         OpEntryL &ope = vec_.emplace_back();
         Lock& lk = ope.lock;
-        if (!lk.readLock(mutex, txId_)) {
+        if (!tryReadLock(lk, mutex)) {
             // should die.
             return false;
         }
@@ -1290,6 +1698,10 @@ public:
         return true;
     }
     INLINE bool write(Mutex& mutex, void *sharedVal, void *src) {
+        if (unlikely(isWounded())) return false;
+        if (unlikely(retire_.enabled())) {
+            if (auto *chain = retire_.find(&mutex)) return retire_.write(*chain, src);
+        }
         VecIter it = find(uintptr_t(&mutex));
         if (it != vec_.end()) {
             Lock& lk = it->lock;
@@ -1311,6 +1723,10 @@ public:
         return true;
     }
     INLINE bool readForUpdate(Mutex& mutex, void *sharedVal, void *dst) {
+        if (unlikely(isWounded())) return false;
+        if (unlikely(retire_.enabled())) {
+            if (auto *chain = retire_.find(&mutex)) return retire_.readForUpdate(*chain, dst);
+        }
         VecIter it = find(uintptr_t(&mutex));
         if (it != vec_.end()) {
             // Found.
@@ -1336,7 +1752,7 @@ public:
         OpEntryL &ope = vec_.emplace_back();
         Lock& lk = ope.lock;
         LocalValInfo& info = ope.info;
-        if (!lk.writeLock(mutex, txId_)) {
+        if (!tryWriteLock(lk, mutex)) {
             // should die.
             return false;
         }
@@ -1347,20 +1763,60 @@ public:
         return true;
     }
 
+    /**
+     * Removed records must be reclaimed after any other worker does not touch them.
+     * Call this before remove().
+     */
+    INLINE void setReclaimer(Reclaimer& reclaimer) { reclaimer_ = &reclaimer; }
+    /**
+     * Insert a record with the key.
+     * Returns false if the key exists or the transaction should die.
+     * The caller should abort the transaction.
+     */
+    INLINE bool insert(Table& table, uint64_t key, const void *src) {
+        Record& rec = getRecord(table, key);
+        OpEntryL *ope = writeLock(rec.value, rec.payload);
+        if (ope == nullptr) return false; // should die.
+        if (states_.get(rec) != cybozu::record::RecordState::ABSENT) return false;
+        states_.insert(rec);
+        copyValue(getLocalValPtr(ope->info), src); // write local data.
+        return true;
+    }
+    /**
+     * Remove the record with the key.
+     * Returns false if the key does not exist or the transaction should die.
+     */
+    INLINE bool remove(Table& table, uint64_t key) {
+        assert(reclaimer_ != nullptr);
+        Record& rec = getRecord(table, key);
+        if (writeLock(rec.value, rec.payload) == nullptr) return false; // should die.
+        if (states_.get(rec) != cybozu::record::RecordState::PRESENT) return false;
+        states_.remove(table, key, rec);
+        return true;
+    }
+
     INLINE bool blindWriteLockAll() {
         for (BlindWriteInfo& bwInfo : bwV_) {
             OpEntryL& ope = vec_[bwInfo.idx];
+            if (ope.lock.mode() == Mode::X) continue; // locked by insert/remove.
             assert(ope.lock.mode() == Mode::INVALID);
-            if (!ope.lock.writeLock(*bwInfo.mutex, txId_)) {
+            if (!tryWriteLock(ope.lock, *bwInfo.mutex)) {
                 // should die.
                 return false;
             }
         }
+        if (unlikely(isWounded())) return false;
+        if (unlikely(retire_.enabled())) {
+            // Wait for the transactions this depends on.
+            if (!retire_.preCommit()) return false;
+        }
+        // Wounds after this point are ignored because the transaction will not wait any more.
         return true;
     }
     INLINE void updateAndUnlock() {
         // serialization point.
 
+        states_.apply();
         for (OpEntryL& ope : vec_) {
             Lock& lk = ope.lock;
             if (lk.mode() == Mode::X) {
@@ -1378,17 +1834,75 @@ public:
         index_.clear();
         local_.clear();
         bwV_.clear();
+        if (!states_.empty()) states_.unlink(*reclaimer_);
+        if (unlikely(retire_.enabled())) retire_.commit();
+        if (usesWound_) woundFlag_.reset();
     }
     INLINE void unlock() {
+        if (unlikely(retire_.enabled())) retire_.abort();
         vec_.clear(); // unlock.
         index_.clear();
         local_.clear();
         bwV_.clear();
+        states_.clear();
+        // No one can wound the transaction after all the locks are released.
+        if (usesWound_) woundFlag_.reset();
     }
     bool empty() const {
-        return vec_.empty() && index_.empty();
+        return vec_.empty() && index_.empty() && states_.empty() && retire_.empty();
     }
 private:
+    INLINE bool isWounded() const {
+        if constexpr (usesWound_) {
+            return woundFlag_.is_wounded();
+        } else {
+            return false;
+        }
+    }
+    INLINE bool tryReadLock(Lock& lk, Mutex& mutex) {
+        if constexpr (usesWound_) {
+            return lk.readLock(mutex, txId_, woundFlag_);
+        } else {
+            return lk.readLock(mutex, txId_);
+        }
+    }
+    INLINE bool tryWriteLock(Lock& lk, Mutex& mutex) {
+        if constexpr (usesWound_) {
+            return lk.writeLock(mutex, txId_, woundFlag_);
+        } else {
+            return lk.writeLock(mutex, txId_);
+        }
+    }
+    INLINE Record& getRecord(Table& table, uint64_t key) {
+        return table.get_or_insert(key, [](cybozu::record::RecordMutex<Mutex>& mutex) {
+                mutex.state = cybozu::record::RecordState::ABSENT; });
+    }
+    /**
+     * Write-lock the record immediately because the record state must be checked.
+     * Returns nullptr if the transaction should die.
+     */
+    INLINE OpEntryL* writeLock(Mutex& mutex, void *sharedVal) {
+        if (unlikely(isWounded())) return nullptr;
+        VecIter it = find(uintptr_t(&mutex));
+        if (it != vec_.end()) {
+            Lock& lk = it->lock;
+            LocalValInfo& info = it->info;
+            if (lk.mode() == Mode::S) {
+                if (!lk.upgrade()) return nullptr;
+                info.set(allocateLocalVal(), sharedVal);
+                copyValue(getLocalValPtr(info), sharedVal);
+            } else if (lk.mode() == Mode::INVALID) {
+                // This is blind-written entry that has not been locked yet.
+                if (!tryWriteLock(lk, mutex)) return nullptr;
+            }
+            return &*it;
+        }
+        OpEntryL &ope = vec_.emplace_back();
+        if (!tryWriteLock(ope.lock, mutex)) return nullptr;
+        ope.info.set(allocateLocalVal(), sharedVal);
+        copyValue(getLocalValPtr(ope.info), sharedVal);
+        return &ope;
+    }
     INLINE VecIter find(uintptr_t key) {
         // at most 4KiB scan.
         const size_t threshold = 4096 / sizeof(OpEntryL);
@@ -0,0 +1,231 @@
+#pragma once
+/**
+ * Wait policies of lock primitives, selectable at runtime.
+ *
+ * spin: spin with pause instructions (default).
+ * yield: spin a while, and then call sched_yield() in the loop.
+ * mcs: waiters are queued in the MCS lock of the mutex and only the head spins.
+ *      The OCC and TicToc record mutexes have the queue only if built with MCS_WAIT_QUEUE,
+ *      which makes them larger than 8 bytes.
+ *      The queue is the NUMA cohort lock if built with COHORT_MCS.
+ *      It is the same as spin for mutexes without the queue.
+ * park: spin a while, and then sleep with futex until the waited word changes.
+ *       Unlockers wake up the parked threads with notify().
+ *       It is the same as yield for waits without a futex word.
+ *
+ * yield and park are for oversubscription, where spinning waiters
+ * steal cpu time from lock holders.
+ */
+#include <string>
+#include <thread>
+#include <climits>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "util.hpp"
+#include "arch.hpp"
+#include "inline.hpp"
+#include "atomic_wrapper.hpp"
+#include "cache_line_size.hpp"
+#include "cybozu/exception.hpp"
+
+
+namespace cybozu {
+namespace wait_policy {
+
+
+enum class Policy : uint8_t {
+    SPIN, YIELD, MCS, PARK,
+};
+
+
+const std::pair<Policy, const char*> policyTable_[] = {
+    {Policy::SPIN, "spin"},
+    {Policy::YIELD, "yield"},
+    {Policy::MCS, "mcs"},
+    {Policy::PARK, "park"},
+};
+
+
+inline Policy parsePolicy(const std::string& s)
+{
+    for (const auto& p : policyTable_) {
+        if (s == p.second) return p.first;
+    }
+    throw cybozu::Exception("wait_policy::parsePolicy: bad policy") << s;
+}
+
+
+inline const char* policyToStr(Policy policy)
+{
+    for (const auto& p : policyTable_) {
+        if (policy == p.first) return p.second;
+    }
+    throw cybozu::Exception("wait_policy::policyToStr: bad policy") << int(policy);
+}
+
+
+/**
+ * Set by runExec().
+ */
+inline Policy policy_ = Policy::SPIN;
+
+
+/**
+ * Number of pause loops before yield or park.
+ */
+constexpr size_t SPIN_LIMIT = 256;
+
+
+struct SpinWait
+{
+    template <typename Pred>
+    static INLINE void wait(const uint32_t*, Pred&& pred) {
+        while (!pred()) _mm_pause();
+    }
+};
+
+
+struct YieldWait
+{
+    template <typename Pred>
+    static INLINE void wait(const uint32_t*, Pred&& pred) {
+        for (size_t i = 0; i < SPIN_LIMIT; i++) {
+            if (pred()) return;
+            _mm_pause();
+        }
+        while (!pred()) std::this_thread::yield();
+    }
+};
+
+
+/**
+ * Parked threads are counted in buckets indexed by the futex word address,
+ * so unlockers do not call futex wake syscall when no one is parked.
+ */
+struct ParkWait
+{
+    struct Bucket
+    {
+        alignas(CACHE_LINE_SIZE)
+        uint32_t nrParked;
+    };
+    static constexpr size_t NR_BUCKETS = 256;
+    static inline Bucket buckets_[NR_BUCKETS];
+
+    static INLINE Bucket& getBucket(const uint32_t* word) {
+        const uint64_t h = uint64_t(uintptr_t(word)) * 0x9e3779b97f4a7c15ULL;
+        return buckets_[h >> 56];
+    }
+
+    template <typename Pred>
+    static INLINE void wait(const uint32_t* word, Pred&& pred) {
+        for (size_t i = 0; i < SPIN_LIMIT; i++) {
+            if (pred()) return;
+            _mm_pause();
+        }
+        Bucket& b = getBucket(word);
+        for (;;) {
+            // The full fence pairs with the one in notify().
+            __atomic_fetch_add(&b.nrParked, 1, __ATOMIC_SEQ_CST);
+            const uint32_t v = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+            const bool ok = pred();
+            // The kernel does not sleep if the word has changed from v.
+            if (!ok) ::syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, v, nullptr, nullptr, 0);
+            __atomic_fetch_sub(&b.nrParked, 1, __ATOMIC_RELEASE);
+            if (ok || pred()) return;
+        }
+    }
+    /**
+     * Call this after changing the word.
+     */
+    static INLINE void notify(const uint32_t* word) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (likely(load(getBucket(word).nrParked) == 0)) return;
+        ::syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+};
+
+
+/**
+ * QueueLock: a lock type like McsSpinlock constructible with QueueLock::Mutex.
+ */
+template <typename QueueLock>
+struct McsWait
+{
+    template <typename Pred>
+    static INLINE void wait(typename QueueLock::Mutex& queue, Pred&& pred) {
+        if (pred()) return;
+        QueueLock lk(queue);
+        SpinWait::wait(nullptr, pred);
+    }
+};
+
+
+/**
+ * Wait until pred() returns true with the current policy.
+ * word: the 32bit word which changes when pred() may become true,
+ *       or nullptr if there is no such word.
+ */
+template <typename Pred>
+INLINE void waitUntil(const uint32_t* word, Pred&& pred)
+{
+    switch (policy_) {
+    case Policy::YIELD:
+        YieldWait::wait(word, pred);
+        return;
+    case Policy::PARK:
+        if (word != nullptr) {
+            ParkWait::wait(word, pred);
+        } else {
+            YieldWait::wait(word, pred);
+        }
+        return;
+    default:
+        SpinWait::wait(word, pred);
+    }
+}
+
+
+/**
+ * The same as waitUntil() but waiters are queued if the policy is mcs.
+ */
+template <typename QueueLock, typename Pred>
+INLINE void waitUntilQueued(typename QueueLock::Mutex& queue, const uint32_t* word, Pred&& pred)
+{
+    if (policy_ == Policy::MCS) {
+        McsWait<QueueLock>::wait(queue, pred);
+    } else {
+        waitUntil(word, pred);
+    }
+}
+
+
+/**
+ * One step of a wait loop that polls by itself, such as a wait with a time budget.
+ * i: the number of the steps taken before.
+ * park is the same as yield because the loop must check its deadline.
+ */
+INLINE void pause(size_t i)
+{
+    if (policy_ == Policy::YIELD || policy_ == Policy::PARK) {
+        if (i >= SPIN_LIMIT) {
+            std::this_thread::yield();
+            return;
+        }
+    }
+    _mm_pause();
+}
+
+
+/**
+ * Call this after changing the word waited by waitUntil().
+ */
+INLINE void notify(const uint32_t* word)
+{
+    if (unlikely(policy_ == Policy::PARK)) ParkWait::notify(word);
+}
+
+
+} // namespace wait_policy
+} // namespace cybozu
@@ -0,0 +1,444 @@
+#pragma once
+/**
+ * @file
+ * @brief redo logging with group commit.
+ *
+ * A worker stages after-images of its writes during a transaction,
+ * takes an epoch at the serialization point of the commit,
+ * and appends a log record to its own LogBuffer.
+ * The logger thread takes all the buffers periodically,
+ * writes them to a file and calls fdatasync().
+ * Then all the transactions of the epochs before the flush are durable (group commit).
+ * Workers do not wait for the flush.
+ * They acknowledge their commits later when they see the durable epoch.
+ *
+ * Log file format:
+ *   block: BlockHeader, log records, and zero padding for O_DIRECT.
+ *   log record: RecordHeader, and (WriteHeader, after-image padded to 8 bytes) * nrWrites.
+ * The benchmarks use record indexes as write ids.
+ */
+#include <vector>
+#include <deque>
+#include <memory>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cinttypes>
+#include <cstdio>
+#include <fcntl.h>
+#include "fileio.hpp"
+#include "lock.hpp"
+#include "tx_util.hpp"
+#include "thread_util.hpp"
+#include "atomic_wrapper.hpp"
+#include "cache_line_size.hpp"
+#include "sleep.hpp"
+#include "inline.hpp"
+#include "util.hpp"
+#include "cybozu/exception.hpp"
+
+
+namespace cybozu {
+namespace wal {
+
+
+struct BlockHeader
+{
+    static constexpr uint32_t Magic = 0x4c415721; // "!WAL"
+
+    uint32_t magic;
+    uint32_t size; // total size of the log records [bytes].
+    uint64_t durableEpoch; // epochs up to this are durable after the block is written.
+};
+
+
+struct RecordHeader
+{
+    uint64_t epoch;
+    uint32_t nrWrites;
+    uint32_t size; // [bytes] excluding this header.
+};
+
+
+struct WriteHeader
+{
+    uint64_t id;
+    uint32_t size; // after-image size [bytes] excluding padding.
+    uint32_t reserved;
+};
+
+
+INLINE size_t alignUp(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+
+class Logger;
+
+
+/**
+ * Per-worker log buffer.
+ * The staging functions must be called by the owner worker only.
+ */
+class LogBuffer
+{
+    using Spinlock = cybozu::lock::TtasSpinlockT<false>;
+    using Clock = std::chrono::steady_clock;
+
+    Logger& logger_;
+
+    // Epoch of the transaction in the commit phase. UINT64_MAX means nothing.
+    alignas(CACHE_LINE_SIZE)
+    uint64_t committing_;
+
+    // Log records that will be taken by the logger.
+    alignas(CACHE_LINE_SIZE)
+    Spinlock::Mutex mutex_;
+    std::vector<uint8_t> buf_;
+    size_t capacity_;
+
+    // Local data of the worker.
+    alignas(CACHE_LINE_SIZE)
+    std::vector<uint8_t> staged_;
+    uint32_t nrStaged_;
+
+    // Commits not acknowledged yet.
+    struct Pending
+    {
+        uint64_t epoch;
+        size_t nr;
+        Clock::duration sum; // sum of commit time since epoch of the clock.
+        Clock::time_point first;
+    };
+    std::deque<Pending> pending_;
+
+    size_t nrAcked_;
+    Clock::duration latencySum_;
+    Clock::duration latencyMax_;
+
+public:
+    LogBuffer(Logger& logger, size_t capacity)
+        : logger_(logger), committing_(UINT64_MAX), mutex_(), buf_(), capacity_(capacity)
+        , staged_(), nrStaged_(0), pending_()
+        , nrAcked_(0), latencySum_(), latencyMax_() {
+        buf_.reserve(capacity);
+    }
+    LogBuffer(const LogBuffer&) = delete;
+    LogBuffer& operator=(const LogBuffer&) = delete;
+
+    /**
+     * Stage an after-image of a write.
+     */
+    INLINE void stage(uint64_t id, const void *data, size_t size) {
+        const size_t pos = staged_.size();
+        staged_.resize(pos + sizeof(WriteHeader) + alignUp(size, 8));
+        WriteHeader *wh = (WriteHeader *)&staged_[pos];
+        wh->id = id;
+        wh->size = size;
+        wh->reserved = 0;
+#ifndef NO_PAYLOAD
+        ::memcpy(&staged_[pos + sizeof(WriteHeader)], data, size);
+#else
+        unused(data);
+#endif
+        nrStaged_++;
+    }
+    /**
+     * Call this at the serialization point of the commit,
+     * that is, while all the write locks are held.
+     * Returns the epoch of the transaction.
+     */
+    INLINE uint64_t enterCommit();
+    /**
+     * Append the staged writes as a log record.
+     * Call this after enterCommit() even if the transaction is read-only.
+     * This may wait for the logger when the buffer is full.
+     */
+    INLINE void commit(uint64_t epoch);
+    /**
+     * Discard the staged writes. Call this at abort.
+     */
+    INLINE void discard() {
+        staged_.clear();
+        nrStaged_ = 0;
+        store_release(committing_, UINT64_MAX);
+    }
+    /**
+     * Acknowledge commits of epochs <= durableEpoch.
+     */
+    INLINE void ack(uint64_t durableEpoch) {
+        if (likely(pending_.empty() || pending_.front().epoch > durableEpoch)) return;
+        const Clock::time_point now = Clock::now();
+        while (!pending_.empty() && pending_.front().epoch <= durableEpoch) {
+            const Pending& p = pending_.front();
+            nrAcked_ += p.nr;
+            latencySum_ += now.time_since_epoch() * int64_t(p.nr) - p.sum;
+            latencyMax_ = std::max(latencyMax_, now - p.first);
+            pending_.pop_front();
+        }
+    }
+    uint64_t committingEpoch() const { return load_acquire(committing_); }
+    /**
+     * Called by the logger. Log records are appended to out.
+     * tmp is used to swap the buffer.
+     */
+    void takeTo(std::vector<uint8_t>& out, std::vector<uint8_t>& tmp) {
+        assert(tmp.empty());
+        {
+            Spinlock lk(&mutex_);
+            buf_.swap(tmp);
+        }
+        out.insert(out.end(), tmp.begin(), tmp.end());
+        tmp.clear();
+    }
+
+    size_t nrAcked() const { return nrAcked_; }
+    size_t nrPending() const {
+        size_t nr = 0;
+        for (const Pending& p : pending_) nr += p.nr;
+        return nr;
+    }
+    Clock::duration latencySum() const { return latencySum_; }
+    Clock::duration latencyMax() const { return latencyMax_; }
+    void resetStat() {
+        pending_.clear();
+        nrAcked_ = 0;
+        latencySum_ = Clock::duration();
+        latencyMax_ = Clock::duration();
+    }
+};
+
+
+/**
+ * Logger thread and the log buffers of all the workers.
+ */
+class Logger
+{
+    static constexpr size_t BufferCapacity = 4 << 20; // per worker.
+    static constexpr size_t DirectIoAlignment = 4096;
+
+    EpochGenerator epochGen_; // independent from ones of the protocols.
+    std::vector<std::unique_ptr<LogBuffer> > bufV_;
+    cybozu::util::File file_;
+    bool odirect_;
+
+    alignas(CACHE_LINE_SIZE)
+    uint64_t durable_; // all the transactions of epochs <= durable_ are durable.
+
+    bool quit_;
+    cybozu::thread::ThreadRunner runner_;
+
+    // Used by the logger thread only.
+    std::vector<uint8_t> block_;
+    std::vector<uint8_t> tmp_;
+    uint8_t *aligned_; // for O_DIRECT.
+    size_t alignedSize_;
+
+    size_t nrBytes_;
+    size_t nrFlushes_;
+
+public:
+    Logger()
+        : epochGen_(), bufV_(), file_(), odirect_(false), durable_(0)
+        , quit_(false), runner_(), block_(), tmp_(), aligned_(nullptr), alignedSize_(0)
+        , nrBytes_(0), nrFlushes_(0) {
+    }
+    ~Logger() noexcept {
+        stop();
+        if (aligned_ != nullptr) ::free(aligned_);
+    }
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    /**
+     * Create the log file and start the logger thread.
+     */
+    void open(const std::string& path, size_t nrWorkers, bool odirect) {
+        if (enabled()) throw cybozu::Exception("Logger:already opened") << path;
+        int flags = O_CREAT | O_TRUNC | O_WRONLY;
+        if (odirect) flags |= O_DIRECT;
+        file_ = cybozu::util::File(path, flags, 0644);
+        odirect_ = odirect;
+        for (size_t i = 0; i < nrWorkers; i++) {
+            bufV_.emplace_back(new LogBuffer(*this, BufferCapacity));
+        }
+        runner_.set([this]() { worker(); });
+        runner_.start();
+    }
+    /**
+     * Flush all the logs and stop the logger thread.
+     */
+    void stop() {
+        if (!enabled()) return;
+        store_release(quit_, true);
+        runner_.joinNoThrow();
+        flush();
+        file_.close();
+        bufV_.clear();
+    }
+    bool enabled() const { return !bufV_.empty(); }
+    LogBuffer& buffer(size_t idx) { return *bufV_.at(idx); }
+
+    /**
+     * Epochs start with 1 so that 0 means nothing is durable.
+     */
+    INLINE uint64_t getEpoch() const { return epochGen_.get() + 1; }
+    INLINE uint64_t durableEpoch() const { return load_acquire(durable_); }
+
+    /**
+     * Statistics since the last resetStat().
+     * Call them while the workers are not running.
+     */
+    std::string str() const {
+        size_t nrAcked = 0, nrPending = 0;
+        std::chrono::steady_clock::duration sum(0), max(0);
+        for (const std::unique_ptr<LogBuffer>& b : bufV_) {
+            nrAcked += b->nrAcked();
+            nrPending += b->nrPending();
+            sum += b->latencySum();
+            max = std::max(max, b->latencyMax());
+        }
+        using Us = std::chrono::duration<double, std::micro>;
+        return cybozu::util::formatString(
+            "logBytes:%zu logFlushes:%zu acked:%zu unacked:%zu ackLatencyAvgUs:%.3f ackLatencyMaxUs:%.3f"
+            , load_acquire(nrBytes_), load_acquire(nrFlushes_), nrAcked, nrPending
+            , nrAcked == 0 ? 0.0 : Us(sum).count() / nrAcked, Us(max).count());
+    }
+    void resetStat() {
+        for (std::unique_ptr<LogBuffer>& b : bufV_) b->resetStat();
+        store_release(nrBytes_, 0);
+        store_release(nrFlushes_, 0);
+    }
+
+private:
+    void worker() {
+        uint64_t epoch = 0;
+        while (!load_acquire(quit_)) {
+            const uint64_t epoch1 = getEpoch();
+            if (epoch1 == epoch) {
+                sleep_us(100);
+                continue;
+            }
+            epoch = epoch1;
+            flush();
+        }
+    }
+    /**
+     * Write all the log records in the buffers and make them durable.
+     */
+    void flush() {
+        // The epoch must be read before checking the workers.
+        // See LogBuffer::enterCommit().
+        uint64_t minEpoch = getEpoch();
+        for (const std::unique_ptr<LogBuffer>& b : bufV_) {
+            minEpoch = std::min(minEpoch, b->committingEpoch());
+        }
+        const uint64_t durable = minEpoch - 1;
+
+        block_.resize(sizeof(BlockHeader));
+        for (std::unique_ptr<LogBuffer>& b : bufV_) {
+            b->takeTo(block_, tmp_);
+        }
+        if (block_.size() > sizeof(BlockHeader)) {
+            BlockHeader *bh = (BlockHeader *)&block_[0];
+            bh->magic = BlockHeader::Magic;
+            bh->size = block_.size() - sizeof(BlockHeader);
+            bh->durableEpoch = durable;
+            writeBlock();
+            file_.fdatasync();
+            store_release(nrFlushes_, nrFlushes_ + 1);
+        }
+        store_release(durable_, durable);
+    }
+    void writeBlock() {
+        if (!odirect_) {
+            file_.write(&block_[0], block_.size());
+            store_release(nrBytes_, nrBytes_ + block_.size());
+            return;
+        }
+        const size_t size = alignUp(block_.size(), DirectIoAlignment);
+        if (size > alignedSize_) {
+            if (aligned_ != nullptr) ::free(aligned_);
+            aligned_ = nullptr;
+            void *p;
+            if (::posix_memalign(&p, DirectIoAlignment, size) != 0) throw std::bad_alloc();
+            aligned_ = (uint8_t *)p;
+            alignedSize_ = size;
+        }
+        ::memcpy(aligned_, &block_[0], block_.size());
+        ::memset(aligned_ + block_.size(), 0, size - block_.size());
+        file_.write(aligned_, size);
+        store_release(nrBytes_, nrBytes_ + size);
+    }
+};
+
+
+INLINE uint64_t LogBuffer::enterCommit()
+{
+    // The logger reads the global epoch and then our epoch.
+    // If it misses our epoch, it must have read an epoch not newer than ours,
+    // so it will not decide our epoch durable before our log record is taken.
+    uint64_t epoch = logger_.getEpoch();
+    for (;;) {
+        exchange(committing_, epoch, __ATOMIC_SEQ_CST);
+        const uint64_t epoch1 = logger_.getEpoch();
+        if (likely(epoch == epoch1)) return epoch;
+        epoch = epoch1;
+    }
+}
+
+
+INLINE void LogBuffer::commit(uint64_t epoch)
+{
+    if (nrStaged_ > 0) {
+        const size_t size = sizeof(RecordHeader) + staged_.size();
+        for (;;) {
+            {
+                Spinlock lk(&mutex_);
+                // A large record is allowed if the buffer is empty.
+                if (buf_.size() + size <= capacity_ || buf_.empty()) {
+                    const size_t pos = buf_.size();
+                    buf_.resize(pos + size);
+                    RecordHeader *rh = (RecordHeader *)&buf_[pos];
+                    rh->epoch = epoch;
+                    rh->nrWrites = nrStaged_;
+                    rh->size = staged_.size();
+                    ::memcpy(&buf_[pos + sizeof(RecordHeader)], &staged_[0], staged_.size());
+                    break;
+                }
+            }
+            // Wait for the logger to take the buffer.
+            _mm_pause();
+        }
+        const Clock::time_point now = Clock::now();
+        if (pending_.empty() || pending_.back().epoch != epoch) {
+            pending_.push_back({epoch, 0, Clock::duration(), now});
+        }
+        Pending& p = pending_.back();
+        p.nr++;
+        p.sum += now.time_since_epoch();
+    }
+    staged_.clear();
+    nrStaged_ = 0;
+    store_release(committing_, UINT64_MAX);
+    ack(logger_.durableEpoch());
+}
+
+
+/**
+ * Put the statistics of a benchmark run and reset them.
+ * Nothing is put if logging is disabled.
+ */
+inline void putLogStat(Logger& logger)
+{
+    if (!logger.enabled()) return;
+    ::printf("%s\n", logger.str().c_str());
+    ::fflush(::stdout);
+    logger.resetStat();
+}
+
+
+}} // namespace cybozu::wal
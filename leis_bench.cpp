@@ -85,6 +85,7 @@ Result1 worker(size_t idx, uint8_t& ready, const bool& start, const bool& quit,
         size_t firstRecIdx;
         assert(llSet.empty());
         auto randState = rand.getState();
+        res.beginTx();
         for (size_t retry = 0;; retry++) {
             if (unlikely(load_acquire(quit))) break; // to quit under starvation.
             rand.setState(randState); // Retries will reproduce the same access pattern.
@@ -203,7 +204,7 @@ struct CmdLineOptionPlus : CmdLineOption
 
     CmdLineOptionPlus(const std::string& description) : CmdLineOption(description) {
         appendOpt(&useVector, 0, "vector", "[0 or 1]: use vector instead of map. (default:0)");
-        appendOpt(&leisLockType, 0, "lock", "[id]: leis lock type (0:spin, 1:withmcs, default:0)");
+        appendOpt(&leisLockType, 0, "lock", "[id]: leis lock type (0:spin, 1:withmcs, 2:bravo(reader-biased), 3:withcohort(NUMA-aware mcs), default:0)");
         appendOpt(&usesRMW, 1, "rmw", "[0 or 1]: use read-modify-write or normal write 0:w 1:rmw (default: 1)");
     }
     std::string str() const {
@@ -218,8 +219,10 @@ enum LockLockTypeType
 {
     USE_LEIS_SPIN = 0,
     USE_LEIS_WITHMCS = 1,
+    USE_LEIS_BRAVO = 2,
+    USE_LEIS_WITHCOHORT = 3,
 #if 0
-    USE_LEIS_SXQL = 2,
+    USE_LEIS_SXQL = 4,
 #endif
 };
 
@@ -266,6 +269,12 @@ void dispatch0(const CmdLineOptionPlus& opt)
     case USE_LEIS_WITHMCS:
         dispatch1<cybozu::lock::LockWithMcs>(opt);
         break;
+    case USE_LEIS_BRAVO:
+        dispatch1<cybozu::lock::BravoLock>(opt);
+        break;
+    case USE_LEIS_WITHCOHORT:
+        dispatch1<cybozu::lock::LockWithCohort>(opt);
+        break;
 #if 0
     case USE_LEIS_SXQL:
         dispatch1<cybozu::lock::SXQLock>(opt);
@@ -5,6 +5,7 @@
 #include "licc.hpp"
 #endif
 #include <algorithm>
+#include <memory>
 #include "pqlock.hpp"
 #include "cmdline_option.hpp"
 #include "measure_util.hpp"
@@ -13,6 +14,8 @@
 #include "tx_util.hpp"
 #include "zipf.hpp"
 #include "workload_util.hpp"
+#include "tpcc_util.hpp"
+#include "wal.hpp"
 
 
 #ifdef USE_PARTITION
@@ -30,6 +33,10 @@ struct CmdLineOptionPlus : CmdLineOption
     size_t writePct; // 0 to 100.
     int usesRMW; // 0 or 1.
     bool preverify;
+    size_t scanLen;
+    size_t insertWindow;
+    std::string logPath;
+    int odirect; // 0 or 1.
 
     CmdLineOptionPlus(const std::string& description) : CmdLineOption(description) {
         appendOpt(&modeStr, "licc-hybrid", "mode", "[mode]: specify mode in licc-pcc, licc-occ, licc-hybrid (default).");
@@ -38,12 +45,19 @@ struct CmdLineOptionPlus : CmdLineOption
         appendOpt(&usesRMW, 1, "rmw", "[0 or 1]: use read-modify-write or normal write 0:w 1:rmw (default: 1)");
         appendOpt(&writePct, 50, "writepct", "[pct]: write percentage (0 to 100) for custom3 workload (default: 50)");
         appendOpt(&preverify, 0, "preverify", "[0 or 1]: preemptive verify 0:off 1:on (defaut: 0)");
+        appendOpt(&scanLen, 10, "scan", "[num]: number of records of a range scan for scan workload (default: 10)");
+        appendOpt(&insertWindow, 1000, "iwin", "[num]: number of live inserted records per worker for insert workload (default: 1000)");
+        appendOpt(&logPath, "", "log", "[path]: redo log file for custom and scan workloads. empty means no logging (default)");
+        appendOpt(&odirect, 0, "odirect", "[0 or 1]: write the redo log with O_DIRECT (default: 0)");
     }
     std::string str() const {
         return cybozu::util::formatString(
-            "mode:%s %s pqLockType:%d backoff:%d writePct:%zu rmw:%d preverify:%d"
+            "mode:%s %s pqLockType:%d backoff:%d writePct:%zu rmw:%d preverify:%d scanLen:%zu insertWindow:%zu log:%d odirect:%d"
             , modeStr.c_str(), base::str().c_str(), pqLockType
-            , usesBackOff ? 1 : 0, writePct, usesRMW ? 1 : 0, preverify ? 1 : 0);
+            , usesBackOff ? 1 : 0, writePct, usesRMW ? 1 : 0, preverify ? 1 : 0
+            , workload == "scan" ? scanLen : 0
+            , workload == "insert" ? insertWindow : 0
+            , logPath.empty() ? 0 : 1, odirect ? 1 : 0);
     }
 };
 
@@ -127,6 +141,17 @@ struct ILockShared
 #else
     VectorWithPayload<IMutex> recV;
 #endif
+#ifdef USE_LICC2
+    typename ILockTypes<PQLock>::ILockSet::OrderedIndex index; // used by scan workload.
+    typename ILockTypes<PQLock>::ILockSet::Table table; // used by insert workload.
+    std::unique_ptr<cybozu::ebr::EpochReclaimer> reclaimer;
+#endif
+    size_t scanLen; // 0 means point read.
+    size_t insertWindow;
+    tpcc::Db<IMutex> tpcc; // used by tpcc workload.
+    cybozu::wal::Logger logger; // used if -log is specified.
+    size_t nrMu;
+    size_t nrTh;
     ReadMode rmode;
     size_t longTxSize;
     size_t nrOp;
@@ -204,9 +229,11 @@ LiccResult worker0(size_t idx, uint8_t& ready, const bool& start, const bool& qu
 
     EpochTxIdGenerator<9, 2> epochTxIdGen(idx + 1, epochGen_);
 
+    const size_t scanLen = shared.scanLen;
     ILockSet lockSet;
-    lockSet.init(shared.payload, realNrOp);
+    lockSet.init(shared.payload, realNrOp * std::max<size_t>(scanLen, 1));
     std::vector<uint8_t> value(shared.payload);
+    cybozu::wal::LogBuffer *logBuf = shared.logger.enabled() ? &shared.logger.buffer(idx) : nullptr;
 
     store_release(ready, 1);
     while (!load_acquire(start)) _mm_pause();
@@ -218,6 +245,7 @@ LiccResult worker0(size_t idx, uint8_t& ready, const bool& start, const bool& qu
         uint64_t t0;
         if (shared.usesBackOff) t0 = cybozu::time::rdtscp();
         auto randState = rand.getState();
+        res.beginTx();
         for (size_t retry = 0;; retry++) {
             if (load_acquire(quit)) break; // to quit under starvation.
             assert(lockSet.is_empty());
@@ -226,6 +254,7 @@ LiccResult worker0(size_t idx, uint8_t& ready, const bool& start, const bool& qu
             uint64_t ts[6];
             ts[0] = cybozu::time::rdtscp();
 #endif
+            uint64_t logEpoch = 0;
             for (size_t i = 0; i < realNrOp; i++) {
                 size_t key = getRecordIdx(rand, fastZipf, recV.size(), realNrOp, i, firstRecIdx);
                 IMode mode = getMode(rand, realNrOp, realNrWr, wrRatio, i);
@@ -237,6 +266,18 @@ LiccResult worker0(size_t idx, uint8_t& ready, const bool& start, const bool& qu
                     const bool tryInvisibleRead =
                         (rmode == ReadMode::OCC) ||
                         (rmode == ReadMode::HYBRID && !isLongTx && retry == 0);
+#ifdef USE_LICC2
+                    if (scanLen > 0) {
+                        if (tryInvisibleRead) {
+                            if (unlikely(!lockSet.template scan<ILockSet::OPTIMISTIC>(
+                                             shared.index, key, scanLen, &value[0]))) goto abort;
+                        } else {
+                            if (unlikely(!lockSet.template scan<ILockSet::READ_RESERVE>(
+                                             shared.index, key, scanLen, &value[0]))) goto abort;
+                        }
+                        continue;
+                    }
+#endif
                     if (tryInvisibleRead) {
                         if (unlikely(!lockSet.optimistic_read(mutex, sharedValue, &value[0]))) goto abort;
                     } else {
@@ -250,6 +291,7 @@ LiccResult worker0(size_t idx, uint8_t& ready, const bool& start, const bool& qu
                     } else {
                         if (unlikely(!lockSet.write(mutex, sharedValue, &value[0]))) goto abort;
                     }
+                    if (logBuf) logBuf->stage(key, &value[0], shared.payload);
                 }
             }
 #ifdef MONITOR_LATENCY
@@ -271,7 +313,9 @@ LiccResult worker0(size_t idx, uint8_t& ready, const bool& start, const bool& qu
 #ifdef MONITOR_LATENCY
             ts[4] = cybozu::time::rdtscp();
 #endif
+            if (logBuf) logEpoch = logBuf->enterCommit();
             lockSet.update_and_unlock();
+            if (logBuf) logBuf->commit(logEpoch);
 #ifdef MONITOR_LATENCY
             ts[5] = cybozu::time::rdtscp();
 #endif
@@ -297,6 +341,7 @@ LiccResult worker0(size_t idx, uint8_t& ready, const bool& start, const bool& qu
           abort:
             res.incAbort(isLongTx);
             lockSet.clear();
+            if (logBuf) logBuf->discard();
             if (shared.usesBackOff) backOff(t0, retry, rand);
         }
     }
@@ -355,6 +400,7 @@ Result2 worker1(size_t idx, uint8_t& ready, const bool& start, const bool& quit,
         const uint32_t ordId = epochTxIdGen.get();
 
         lockSet.set_ord_id(ordId);
+        res.beginTx();
         uint64_t t0;
         if (shared.usesBackOff) t0 = cybozu::time::rdtscp();
         auto randState = rand.getState();
@@ -405,10 +451,220 @@ Result2 worker1(size_t idx, uint8_t& ready, const bool& start, const bool& quit,
 }
 
 
+#ifdef USE_LICC2
+/**
+ * Insert workload.
+ * Each transaction accesses preloaded records through the index,
+ * inserts a new record, and removes an old record inserted by itself.
+ */
+template <typename PQLock>
+LiccResult worker2(size_t idx, uint8_t& ready, const bool& start, const bool& quit, bool& shouldQuit, ILockShared<PQLock>& shared)
+{
+    using IMutex = typename ILockTypes<PQLock>::IMutex;
+    using ILockSet = typename ILockTypes<PQLock>::ILockSet;
+
+    unused(shouldQuit);
+    cybozu::thread::setThreadAffinity(::pthread_self(), CpuId_[idx]);
+
+    auto& table = shared.table;
+    const size_t nrMu = shared.nrMu;
+    const ReadMode rmode = shared.rmode;
+    const size_t nrOp = shared.nrOp;
+    const size_t wrRatio = size_t(shared.wrRatio * (double)SIZE_MAX);
+    const TxMode shortTxMode = shared.shortTxMode;
+    const bool usesRMW = shared.usesRMW;
+
+    LiccResult res;
+    cybozu::util::Xoroshiro128Plus rand(::time(0), idx);
+    FastZipf fastZipf(rand, shared.zipfTheta, nrMu, shared.zipfZetan);
+    const size_t realNrWr = size_t((double)nrOp * shared.wrRatio);
+    auto getMode = selectGetModeFunc<decltype(rand), IMode>(false, shortTxMode, shortTxMode);
+    auto getRecordIdx = selectGetRecordIdx<decltype(rand)>(false, shortTxMode, shortTxMode, shared.usesZipf);
+
+    EpochTxIdGenerator<9, 2> epochTxIdGen(idx + 1, epochGen_);
+
+    ILockSet lockSet;
+    lockSet.init(shared.payload, nrOp + 2);
+    cybozu::ebr::EpochReclaimer::Local reclaimer(*shared.reclaimer, idx);
+    lockSet.set_reclaimer(reclaimer);
+    InsertKeyGen keyGen(nrMu, shared.nrTh, idx, shared.insertWindow);
+    std::vector<uint8_t> value(shared.payload);
+
+    store_release(ready, 1);
+    while (!load_acquire(start)) _mm_pause();
+    while (!load_acquire(quit)) {
+        const uint32_t ordId = epochTxIdGen.get();
+        lockSet.set_ord_id(ordId);
+        size_t firstRecIdx;
+
+        uint64_t t0;
+        if (shared.usesBackOff) t0 = cybozu::time::rdtscp();
+        auto randState = rand.getState();
+        res.beginTx();
+        for (size_t retry = 0;; retry++) {
+            if (load_acquire(quit)) break; // to quit under starvation.
+            cybozu::ebr::EpochReclaimer::Guard guard(reclaimer);
+            assert(lockSet.is_empty());
+            rand.setState(randState);
+            for (size_t i = 0; i < nrOp; i++) {
+                size_t key = getRecordIdx(rand, fastZipf, nrMu, nrOp, i, firstRecIdx);
+                IMode mode = getMode(rand, nrOp, realNrWr, wrRatio, i);
+
+                auto& rec = *table.index().lookup(key);
+                IMutex& mutex = rec.value;
+                void *sharedValue = rec.payload;
+                if (mode == IMode::S) {
+                    const bool tryInvisibleRead =
+                        (rmode == ReadMode::OCC) ||
+                        (rmode == ReadMode::HYBRID && retry == 0);
+                    if (tryInvisibleRead) {
+                        if (unlikely(!lockSet.optimistic_read(mutex, sharedValue, &value[0]))) goto abort;
+                    } else {
+                        if (unlikely(!lockSet.pessimistic_read(mutex, sharedValue, &value[0]))) goto abort;
+                    }
+                } else {
+                    assert(mode == IMode::X);
+                    if (usesRMW) {
+                        if (unlikely(!lockSet.read_for_update(mutex, sharedValue, &value[0]))) goto abort;
+                    }
+                    if (unlikely(!lockSet.write(mutex, sharedValue, &value[0]))) goto abort;
+                }
+            }
+            if (unlikely(!lockSet.insert(table, keyGen.newKey(), &value[0]))) goto abort;
+            if (keyGen.shouldRemove()) {
+                if (unlikely(!lockSet.remove(table, keyGen.oldKey()))) goto abort;
+            }
+            lockSet.reserve_all_blind_writes();
+            if (shared.preverify && unlikely(!lockSet.preemptive_verify())) {
+                res.nr_preemptive_aborts++;
+                goto abort;
+            }
+            if (unlikely(!lockSet.protect_all())) goto abort;
+            if (unlikely(!lockSet.verify_and_unlock())) goto abort;
+            lockSet.update_and_unlock();
+            keyGen.commit();
+            res.incCommit(false);
+            res.addRetryCount(false, retry);
+            break;
+          abort:
+            res.incAbort(false);
+            lockSet.clear();
+            if (shared.usesBackOff) backOff(t0, retry, rand);
+        }
+    }
+    return res;
+}
+#endif // USE_LICC2
+
+
+template <typename PQLock>
+struct TpccAccessor
+{
+    using IMutex = typename ILockTypes<PQLock>::IMutex;
+    using ILockSet = typename ILockTypes<PQLock>::ILockSet;
+
+    ILockSet& lockSet;
+    bool tryInvisibleRead;
+
+    INLINE bool read(DataWithPayload<IMutex>& rec, void *dst) {
+        if (tryInvisibleRead) {
+            return lockSet.optimistic_read(rec.value, rec.payload, dst);
+        } else {
+            return lockSet.pessimistic_read(rec.value, rec.payload, dst);
+        }
+    }
+    INLINE bool readForUpdate(DataWithPayload<IMutex>& rec, void *dst) {
+        return lockSet.read_for_update(rec.value, rec.payload, dst);
+    }
+    INLINE bool write(DataWithPayload<IMutex>& rec, void *src) {
+        return lockSet.write(rec.value, rec.payload, src);
+    }
+};
+
+
+/**
+ * TPC-C subset workload.
+ * The home warehouse of each worker is determined by its index.
+ */
+template <typename PQLock>
+LiccResult worker3(size_t idx, uint8_t& ready, const bool& start, const bool& quit, bool& shouldQuit, ILockShared<PQLock>& shared)
+{
+    using ILockSet = typename ILockTypes<PQLock>::ILockSet;
+
+    unused(shouldQuit);
+    cybozu::thread::setThreadAffinity(::pthread_self(), CpuId_[idx]);
+
+    auto& db = shared.tpcc;
+    const ReadMode rmode = shared.rmode;
+
+    LiccResult res;
+    cybozu::util::Xoroshiro128Plus rand(::time(0), idx);
+    tpcc::InputGenerator<decltype(rand)> inputGen(rand, db.nrWh(), idx % db.nrWh());
+    tpcc::Input input;
+
+    EpochTxIdGenerator<9, 2> epochTxIdGen(idx + 1, epochGen_);
+
+    ILockSet lockSet;
+    lockSet.init(tpcc::ROW_SIZE, tpcc::MAX_OL_CNT * 3 + 5);
+    TpccAccessor<PQLock> acc{lockSet, false};
+
+    store_release(ready, 1);
+    while (!load_acquire(start)) _mm_pause();
+    while (!load_acquire(quit)) {
+        const uint32_t ordId = epochTxIdGen.get();
+        lockSet.set_ord_id(ordId);
+        inputGen.generate(input);
+
+        uint64_t t0;
+        if (shared.usesBackOff) t0 = cybozu::time::rdtscp();
+        res.beginTx();
+        for (size_t retry = 0;; retry++) {
+            if (load_acquire(quit)) break; // to quit under starvation.
+            assert(lockSet.is_empty());
+            acc.tryInvisibleRead =
+                (rmode == ReadMode::OCC) ||
+                (rmode == ReadMode::HYBRID && retry == 0);
+            if (unlikely(!tpcc::run(db, acc, input))) goto abort;
+            lockSet.reserve_all_blind_writes();
+            if (shared.preverify && unlikely(!lockSet.preemptive_verify())) {
+                res.nr_preemptive_aborts++;
+                goto abort;
+            }
+            if (unlikely(!lockSet.protect_all())) goto abort;
+            if (unlikely(!lockSet.verify_and_unlock())) goto abort;
+            lockSet.update_and_unlock();
+            res.incCommit(false);
+            res.addRetryCount(false, retry);
+            break;
+          abort:
+            res.incAbort(false);
+            lockSet.clear();
+            if (shared.usesBackOff) backOff(t0, retry, rand);
+        }
+    }
+    return res;
+}
+
+
 template <typename PQLock>
 void setShared(const CmdLineOptionPlus& opt, ILockShared<PQLock>& shared)
 {
     initRecordVector(shared.recV, opt);
+    shared.scanLen = 0;
+    shared.insertWindow = 0;
+    shared.nrMu = opt.getNrMu();
+    shared.nrTh = opt.nrTh;
+    if (opt.workload == "scan") {
+#ifdef USE_LICC2
+#ifdef USE_PARTITION
+        throw cybozu::Exception("scan workload does not support partition.");
+#endif
+        cybozu::index::build_index_from_vector(shared.index, shared.recV);
+        shared.scanLen = opt.scanLen;
+#else
+        throw cybozu::Exception("scan workload requires licc2.");
+#endif
+    }
     shared.rmode = strToReadMode(opt.modeStr.c_str());
     shared.longTxSize = opt.longTxSize;
     shared.nrOp = opt.nrOp;
@@ -429,22 +685,61 @@ void setShared(const CmdLineOptionPlus& opt, ILockShared<PQLock>& shared)
         shared.zipfZetan = 1.0;
     }
     shared.preverify = opt.preverify;
+    if (!opt.logPath.empty()) {
+        if (opt.workload != "custom" && opt.workload != "scan") {
+            throw cybozu::Exception("log is not supported by the workload.") << opt.workload;
+        }
+        shared.logger.open(opt.logPath, opt.nrTh, opt.odirect != 0);
+    }
 }
 
 
 template <typename PQLock>
 void dispatch1(CmdLineOptionPlus& opt)
 {
+    if (opt.workload == "insert") {
+#ifdef USE_LICC2
+#ifdef USE_PARTITION
+        throw cybozu::Exception("insert workload does not support partition.");
+#endif
+        for (size_t i = 0; i < opt.nrLoop; i++) {
+            // Inserted keys must not remain in the next loop.
+            ILockShared<PQLock> shared;
+            setShared<PQLock>(opt, shared);
+            cybozu::record::initRecordTable(shared.table, opt);
+            shared.reclaimer.reset(new cybozu::ebr::EpochReclaimer(opt.nrTh));
+            shared.insertWindow = opt.insertWindow;
+            LiccResult res;
+            runExec(opt, shared, worker2<PQLock>, res);
+            epochGen_.reset();
+        }
+        return;
+#else
+        throw cybozu::Exception("insert workload requires licc2.");
+#endif
+    }
+
     ILockShared<PQLock> shared;
     setShared<PQLock>(opt, shared);
+    if (opt.workload == "tpcc") {
+#ifdef NO_PAYLOAD
+        throw cybozu::Exception("tpcc workload requires payload.");
+#endif
+        cybozu::util::Xoroshiro128Plus rand(::time(0));
+        shared.tpcc.init(opt.nrTh, rand, getReplicaNumaNodes(opt)); // a warehouse per worker.
+    }
 
     for (size_t i = 0; i < opt.nrLoop; i++) {
-        if (opt.workload == "custom") {
+        if (opt.workload == "custom" || opt.workload == "scan") {
             LiccResult res;
             runExec(opt, shared, worker0<PQLock>, res);
+            cybozu::wal::putLogStat(shared.logger);
         } else if (opt.workload == "custom3") {
             Result2 res;
             runExec(opt, shared, worker1<PQLock>, res);
+        } else if (opt.workload == "tpcc") {
+            LiccResult res;
+            runExec(opt, shared, worker3<PQLock>, res);
         } else {
             throw cybozu::Exception("dispatch1 unknown workload") << opt.workload;
         }
@@ -11,6 +11,8 @@
 #include <type_traits>
 #include <thread>
 #include <array>
+#include <chrono>
+#include <cinttypes>
 #include "util.hpp"
 #include "random.hpp"
 #include "cmdline_option.hpp"
@@ -23,37 +25,35 @@
 #include "zipf.hpp"
 #include "atomic_wrapper.hpp"
 #include "sleep.hpp"
+#include "cpuid.hpp"
+#include "numa.hpp"
+#include "lock.hpp"
 
 
 /**
- * To enable retry counting.
- * This takes a bit overhead.
+ * 1 in N transactions are sampled to measure latency. 0 means off.
+ * runExec() sets it with -lat option before starting workers.
  */
-#if 0
-#define USE_RETRY_COUNT
-#else
-#undef USE_RETRY_COUNT
-#endif
+inline size_t latencySampleInterval_ = 0;
+
 
 /**
- * To enable tx latency histogram.
- * This takes a bit overhead.
+ * Counters published by a worker for time-series sampling.
+ * Only the owner thread writes them and the main thread reads them while running.
  */
-#if 0
-#define USE_TX_LATENCY_HISTOGRAM
-#else
-#undef USE_TX_LATENCY_HISTOGRAM
-#endif
+struct alignas(CACHE_LINE_SIZE) PublishedCounters
+{
+    size_t value[4]; // commitS, commitL, abortS, abortL.
+
+    PublishedCounters() : value() {
+    }
+};
+
 
 /**
- * To enable tx trial latency histogram.
- * This takes a bit overhead.
+ * runExec() sets it for each worker thread if time-series sampling is enabled.
  */
-#if 0
-#define USE_TRIAL_LATENCY_HISTOGRAM
-#else
-#undef USE_TRIAL_LATENCY_HISTOGRAM
-#endif
+inline thread_local PublishedCounters *publishedCounters_ = nullptr;
 
 
 template <typename Random>
@@ -219,64 +219,94 @@ public:
 
 
 /**
- * Histogram of size_t values.
+ * HDR-style log-linear histogram of uint64_t values.
+ * Values less than 2^SUB_BITS are counted exactly and larger values are counted
+ * with relative error less than 2^-(SUB_BITS - 1).
+ * Counters are allocated at the first add() so an unused histogram costs almost nothing.
  */
 struct Histogram
 {
-    static constexpr size_t HISTOGRAM_SIZE = sizeof(size_t) * 8;
-    std::array<size_t, HISTOGRAM_SIZE + 1> data;
+    static constexpr size_t SUB_BITS = 7;
+    static constexpr size_t HALF = size_t(1) << (SUB_BITS - 1);
+    static constexpr size_t HISTOGRAM_SIZE = (sizeof(uint64_t) * 8 - SUB_BITS + 2) * HALF;
+
+    std::vector<uint64_t> data;
+    uint64_t count;
+    uint64_t max;
 
-    Histogram() : data() {
-        for (auto& e : data) e = 0;
+    Histogram() : data(), count(0), max(0) {
     }
-    void add(size_t value) {
-        if (value == 0) {
-            data[0]++;
-            return;
-        }
-        static_assert(sizeof(unsigned long) == sizeof(size_t));
-        const size_t b = __builtin_clzl(value);
-        assert(b >= 0);
-        assert(b < HISTOGRAM_SIZE);
-        data[HISTOGRAM_SIZE - b]++;  // HISTOGRAM_SIZE - b is in range [1, 64].
+    static size_t toIdx(uint64_t value) {
+        static_assert(sizeof(unsigned long) == sizeof(uint64_t));
+        const size_t msb = (value == 0) ? 0 : 63 - __builtin_clzl(value);
+        const size_t shift = msb < SUB_BITS ? 0 : msb - (SUB_BITS - 1);
+        return (shift * HALF) + (value >> shift);
+    }
+    /**
+     * The smallest value counted at data[idx].
+     */
+    static uint64_t lowest(size_t idx) {
+        if (idx < HALF * 2) return idx;
+        const size_t shift = idx / HALF - 1;
+        return uint64_t(idx - shift * HALF) << shift;
+    }
+    /**
+     * The largest value counted at data[idx].
+     */
+    static uint64_t highest(size_t idx) {
+        if (idx < HALF * 2) return idx;
+        const size_t shift = idx / HALF - 1;
+        return lowest(idx) + ((uint64_t(1) << shift) - 1);
+    }
+    void add(uint64_t value) {
+        if (unlikely(data.empty())) data.resize(HISTOGRAM_SIZE);
+        const size_t idx = toIdx(value);
+        assert(idx < HISTOGRAM_SIZE);
+        data[idx]++;
+        count++;
+        if (value > max) max = value;
     }
     void merge(const Histogram& rhs) {
-        for (size_t i = 0; i <= HISTOGRAM_SIZE; i++) {
-            this->data[i] += rhs.data[i];
+        if (rhs.data.empty()) return;
+        if (data.empty()) data.resize(HISTOGRAM_SIZE);
+        for (size_t i = 0; i < HISTOGRAM_SIZE; i++) {
+            data[i] += rhs.data[i];
         }
+        count += rhs.count;
+        if (rhs.max > max) max = rhs.max;
     }
-    const size_t& operator[](size_t i) const {
+    bool empty() const { return count == 0; }
+    const uint64_t& operator[](size_t i) const {
 #ifndef NDEBUG
-        if (i > HISTOGRAM_SIZE) {
+        if (i >= HISTOGRAM_SIZE || data.empty()) {
             throw cybozu::Exception("Histogram::operator[] error") << i;
         }
 #endif
         return data[i];
     }
+    /**
+     * q: quantile in [0.0, 1.0].
+     * Returns the largest value of the bucket where the quantile is.
+     */
+    uint64_t percentile(double q) const {
+        if (count == 0) return 0;
+        const uint64_t target = std::max<uint64_t>(uint64_t(q * (double)count + 0.5), 1);
+        uint64_t total = 0;
+        for (size_t i = 0; i < HISTOGRAM_SIZE; i++) {
+            total += data[i];
+            if (total >= target) return std::min(highest(i), max);
+        }
+        return max;
+    }
 
     /**
-     * 0: xxx
-     * 1: xxx
-     * 2: xxx 2, 3
-     * 2^2: xxx [4, 8)
-     * 2^3: xxx [8, 16)
-     * 2^4: xxx [16, 32)
-     * ...
-     * 2^63: xxx [2^63, 2^64)
+     * Each line is "lowest count" of a non-empty bucket.
      */
     void put_to(std::ostream& os) const {
-        size_t max = HISTOGRAM_SIZE + 1;
-        while (max > 0) {
-            if (data[max - 1] != 0) break;
-            --max;
+        for (size_t i = 0; i < data.size(); i++) {
+            if (data[i] == 0) continue;
+            os << lowest(i) << " " << data[i] << "\n";
         }
-        for (size_t i = 0; i <= 2; i++) {
-            os << i << " " << data[i] << "\n";
-        }
-        for (size_t i = 3; i < max; i++) {
-            os << "2^{" << (i - 1) << "} " << data[i] << "\n";
-        }
-        // Gnuplot can parse the format like "2^{13}" well.
     }
 };
 
@@ -290,45 +320,77 @@ std::ostream& operator<<(std::ostream& os, const Histogram& h)
 
 struct Result1
 {
-    Histogram retryCountH;
-    Histogram txLatencyH;
-    Histogram trialLatencyH;
+    // index 0 for short tx and 1 for long tx.
+    Histogram retryCountH[2];
+    Histogram txLatencyH[2];
+    Histogram trialLatencyH[2]; // including backoff before the trial.
 
     size_t value[6];
 
-    Result1() : retryCountH(), txLatencyH(), trialLatencyH(), value() {
+    PublishedCounters *pub; // nullptr if time-series sampling is disabled.
+
+    // Latency sampling state.
+    size_t latInterval;
+    size_t latCountdown;
+    bool sampled;
+    uint64_t txStartTs;
+    uint64_t trialStartTs;
+
+    Result1()
+        : retryCountH(), txLatencyH(), trialLatencyH(), value()
+        , pub(publishedCounters_)
+        , latInterval(latencySampleInterval_), latCountdown(latencySampleInterval_)
+        , sampled(false), txStartTs(0), trialStartTs(0) {
     }
     void operator+=(const Result1& rhs) {
-        retryCountH.merge(rhs.retryCountH);
-        txLatencyH.merge(rhs.txLatencyH);
-        trialLatencyH.merge(rhs.trialLatencyH);
+        for (size_t i = 0; i < 2; i++) {
+            retryCountH[i].merge(rhs.retryCountH[i]);
+            txLatencyH[i].merge(rhs.txLatencyH[i]);
+            trialLatencyH[i].merge(rhs.trialLatencyH[i]);
+        }
         for (size_t i = 0; i < 6; i++) {
             value[i] += rhs.value[i];
         }
     }
     size_t nrCommit() const { return value[0] + value[1]; }
-    void incCommit(bool isLongTx) { value[isLongTx ? 1 : 0]++; }
-    void addCommit(bool isLongTx, size_t v) { value[isLongTx ? 1 : 0] += v; }
-    void incAbort(bool isLongTx) { value[isLongTx ? 3 : 2]++; }
-    void incIntercepted(bool isLongTx) { value[isLongTx ? 5 : 4]++; }
-    void addRetryCount(bool isLongTx, size_t nrRetry) {
-        unused(isLongTx, nrRetry);
-#ifdef USE_RETRY_COUNT
-        // TODO: distinguish short/long tx.
-        retryCountH.add(nrRetry);
-#endif
+    /**
+     * Call this at the beginning of each transaction (not each trial).
+     * Only sampled transactions call rdtscp().
+     */
+    void beginTx() {
+        if (likely(latInterval == 0)) return;
+        if (--latCountdown != 0) return;
+        latCountdown = latInterval;
+        sampled = true;
+        txStartTs = cybozu::time::rdtscp();
+        trialStartTs = txStartTs;
+    }
+    void incCommit(bool isLongTx) {
+        value[isLongTx ? 1 : 0]++;
+        if (pub) publish(isLongTx ? 1 : 0);
+        if (unlikely(sampled)) {
+            const uint64_t ts = cybozu::time::rdtscp();
+            txLatencyH[isLongTx].add(ts - txStartTs);
+            trialLatencyH[isLongTx].add(ts - trialStartTs);
+            sampled = false;
+        }
     }
-    void addTxLatency(size_t latency) {
-        unused(latency);
-#ifdef USE_TX_LATENCY_HISTOGRAM
-        txLatencyH.add(latency);
-#endif
+    void addCommit(bool isLongTx, size_t v) {
+        value[isLongTx ? 1 : 0] += v;
+        if (pub) publish(isLongTx ? 1 : 0);
+    }
+    void incAbort(bool isLongTx) {
+        value[isLongTx ? 3 : 2]++;
+        if (pub) publish(isLongTx ? 3 : 2);
+        if (unlikely(sampled)) {
+            const uint64_t ts = cybozu::time::rdtscp();
+            trialLatencyH[isLongTx].add(ts - trialStartTs);
+            trialStartTs = ts;
+        }
     }
-    void addTrialLatency(size_t latency) {
-        unused(latency);
-#ifdef USE_TRIAL_LATENCY_HISTOGRAM
-        trialLatencyH.add(latency);
-#endif
+    void incIntercepted(bool isLongTx) { value[isLongTx ? 5 : 4]++; }
+    void addRetryCount(bool isLongTx, size_t nrRetry) {
+        if (latInterval != 0) retryCountH[isLongTx].add(nrRetry);
     }
     friend std::ostream& operator<<(std::ostream& os, const Result1& res) {
         os << cybozu::util::formatString(
@@ -336,15 +398,6 @@ struct Result1
             , res.value[0], res.value[1]
             , res.value[2], res.value[3]
             , res.value[4], res.value[5]);
-#ifdef USE_RETRY_COUNT
-        os << "\nRETRY_COUNT_HISTOGRAM\n" << res.retryCountH;
-#endif
-#ifdef USE_TX_LATENCY_HISTOGRAM
-        os << "\nTX_LATENCY_HISTOGRAM\n" << res.txLatencyH;
-#endif
-#ifdef USE_TRIAL_LATENCY_HISTOGRAM
-        os << "\nTRIAL_LATENCY_HISTOGRAM\n" << res.trialLatencyH;
-#endif
         return os;
     }
     std::string str() const {
@@ -352,6 +405,38 @@ struct Result1
         ss << *this;
         return ss.str();
     }
+    /**
+     * clkPerUs: rdtscp clocks per microsecond.
+     * Classes without samples are omitted.
+     */
+    std::string latencyStr(double clkPerUs) const {
+        std::string s;
+        const char *cls[] = {"S", "L"};
+        for (size_t i = 0; i < 2; i++) {
+            const Histogram& h = txLatencyH[i];
+            if (h.empty()) continue;
+            s += cybozu::util::formatString(
+                " lat%s_samples:%" PRIu64 " lat%s_p50:%.2f lat%s_p99:%.2f lat%s_p999:%.2f lat%s_max:%.2f"
+                , cls[i], h.count
+                , cls[i], h.percentile(0.50) / clkPerUs
+                , cls[i], h.percentile(0.99) / clkPerUs
+                , cls[i], h.percentile(0.999) / clkPerUs
+                , cls[i], h.max / clkPerUs);
+        }
+        return s;
+    }
+    void publish(size_t i) {
+        store(pub->value[i], value[i]);
+    }
+    void putHistograms(std::ostream& os) const {
+        const char *cls[] = {"SHORT", "LONG"};
+        for (size_t i = 0; i < 2; i++) {
+            if (txLatencyH[i].empty()) continue;
+            os << "RETRY_COUNT_HISTOGRAM_" << cls[i] << "\n" << retryCountH[i];
+            os << "TX_LATENCY_HISTOGRAM_" << cls[i] << "\n" << txLatencyH[i];
+            os << "TRIAL_LATENCY_HISTOGRAM_" << cls[i] << "\n" << trialLatencyH[i];
+        }
+    }
 };
 
 
@@ -361,12 +446,7 @@ struct Result1
  */
 void log_timestamp_if_necessary_on_tx_start(uint64_t& tx_start_ts, bool uses_backoff)
 {
-    unused(uses_backoff);
-#if defined(USE_TX_LATENCY_HISTOGRAM)
-    tx_start_ts = cybozu::time::rdtscp();
-#else
     if (uses_backoff) tx_start_ts = cybozu::time::rdtscp();
-#endif
 }
 
 
@@ -374,60 +454,12 @@ void log_timestamp_if_necessary_on_tx_start(uint64_t& tx_start_ts, bool uses_bac
  * Helper function.
  */
 void log_timestamp_if_necessary_on_trial_start(
-    const uint64_t& tx_start_ts, uint64_t& trial_start_ts, const uint64_t& trial_end_ts,
-    size_t retry, bool uses_backoff)
+    const uint64_t& tx_start_ts, uint64_t& trial_start_ts, size_t retry, bool uses_backoff)
 {
-    unused(tx_start_ts, trial_start_ts, trial_end_ts, retry, uses_backoff);
-#if defined(USE_TRIAL_LATENCY_HISTOGRAM)
-    if (retry == 0) {
-#if defined(USE_TX_LATENCY_HISTOGRAM)
-        trial_start_ts = tx_start_ts;
-#else
-        trial_start_ts = cybozu::time::rdtscp();
-#endif
-    } else if (!uses_backoff) {
-        trial_start_ts = trial_end_ts;
-    } else {
-        // backoff() function has already set trial_start_ts.
-    }
-#else
+    // backoff() function sets trial_start_ts in the other trials.
     if (retry == 0 && uses_backoff) {
         trial_start_ts = tx_start_ts;
     }
-#endif
-}
-
-
-/**
- * Helper function.
- */
-void log_timestamp_if_necessary_on_commit(
-    Result1& res, const uint64_t& tx_start_ts, const uint64_t& trial_start_ts, uint64_t& trial_end_ts)
-{
-    unused(res, tx_start_ts, trial_start_ts, trial_end_ts);
-#if defined(USE_TX_LATENCY_HISTOGRAM) || defined(USE_TRIAL_LATENCY_HISTOGRAM)
-    trial_end_ts = cybozu::time::rdtscp();
-#endif
-#if defined(USE_TX_LATENCY_HISTOGRAM)
-    res.addTxLatency(trial_end_ts - tx_start_ts);
-#endif
-#if defined(USE_TRIAL_LATENCY_HISTOGRAM)
-    res.addTrialLatency(trial_end_ts - trial_start_ts);
-#endif
-}
-
-
-/**
- * Helper function.
- */
-void log_timestamp_if_necessary_on_abort(
-    Result1& res, const uint64_t& trial_start_ts, uint64_t& trial_end_ts)
-{
-    unused(res, trial_start_ts, trial_end_ts);
-#if defined(USE_TRIAL_LATENCY_HISTOGRAM)
-    trial_end_ts = cybozu::time::rdtscp();
-    res.addTrialLatency(trial_end_ts - trial_start_ts);
-#endif
 }
 
 
@@ -441,25 +473,61 @@ struct Result2
 
         size_t nrCommit;
         size_t nrAbort;
+        Histogram txLatencyH;
 
-        Data() : nrCommit(0), nrAbort(0) {
+        Data() : nrCommit(0), nrAbort(0), txLatencyH() {
         }
 
         void operator+=(const Data& rhs) {
             nrCommit += rhs.nrCommit;
             nrAbort += rhs.nrAbort;
+            txLatencyH.merge(rhs.txLatencyH);
         }
     };
 
     using Umap = std::unordered_map<size_t, Data>;
     Umap umap_;  // key: txSize
 
+    // Totals of all the tx sizes published as commitS and abortS. See Result1.
+    PublishedCounters *pub; // nullptr if time-series sampling is disabled.
+    size_t totalCommit;
+    size_t totalAbort;
+
+    // Latency sampling state. See Result1.
+    size_t latInterval;
+    size_t latCountdown;
+    bool sampled;
+    uint64_t txStartTs;
+
+    Result2()
+        : umap_()
+        , pub(publishedCounters_), totalCommit(0), totalAbort(0)
+        , latInterval(latencySampleInterval_), latCountdown(latencySampleInterval_)
+        , sampled(false), txStartTs(0) {
+    }
+    /**
+     * Call this at the beginning of each transaction (not each trial).
+     */
+    void beginTx() {
+        if (likely(latInterval == 0)) return;
+        if (--latCountdown != 0) return;
+        latCountdown = latInterval;
+        sampled = true;
+        txStartTs = cybozu::time::rdtscp();
+    }
     void incCommit(size_t txSize) {
-        umap_[txSize].nrCommit++;
+        Data& d = umap_[txSize];
+        d.nrCommit++;
+        if (pub) store(pub->value[0], ++totalCommit);
+        if (unlikely(sampled)) {
+            d.txLatencyH.add(cybozu::time::rdtscp() - txStartTs);
+            sampled = false;
+        }
     }
 
     void incAbort(size_t txSize) {
         umap_[txSize].nrAbort++;
+        if (pub) store(pub->value[2], ++totalAbort);
     }
 
     void addRetryCount(size_t txSize, size_t nrRetry) {
@@ -500,6 +568,93 @@ struct Result2
         }
         return ss.str();
     }
+    /**
+     * clkPerUs: rdtscp clocks per microsecond.
+     * Transaction sizes without samples are omitted.
+     */
+    std::string latencyStr(double clkPerUs) const {
+        std::string s;
+        for (size_t txSize : sortedTxSizes()) {
+            const Histogram& h = umap_.at(txSize).txLatencyH;
+            if (h.empty()) continue;
+            s += cybozu::util::formatString(
+                " lat_%zu_samples:%" PRIu64 " lat_%zu_p50:%.2f lat_%zu_p99:%.2f lat_%zu_p999:%.2f lat_%zu_max:%.2f"
+                , txSize, h.count
+                , txSize, h.percentile(0.50) / clkPerUs
+                , txSize, h.percentile(0.99) / clkPerUs
+                , txSize, h.percentile(0.999) / clkPerUs
+                , txSize, h.max / clkPerUs);
+        }
+        return s;
+    }
+    void putHistograms(std::ostream& os) const {
+        for (size_t txSize : sortedTxSizes()) {
+            const Histogram& h = umap_.at(txSize).txLatencyH;
+            if (h.empty()) continue;
+            os << "TX_LATENCY_HISTOGRAM_" << txSize << "\n" << h;
+        }
+    }
+private:
+    std::vector<size_t> sortedTxSizes() const {
+        std::vector<size_t> v;
+        for (const Umap::value_type &p : umap_) v.push_back(p.first);
+        std::sort(v.begin(), v.end());
+        return v;
+    }
+};
+
+
+/**
+ * Time series of commit/abort counts sampled by runExec().
+ */
+class ThroughputSeries
+{
+    struct Sample
+    {
+        size_t ms; // elapsed time from the start.
+        size_t value[4]; // the same as PublishedCounters.
+    };
+    std::vector<Sample> v_;
+
+public:
+    void sample(size_t ms, const std::vector<PublishedCounters>& pubV) {
+        Sample& s = v_.emplace_back();
+        s.ms = ms;
+        for (size_t i = 0; i < 4; i++) {
+            s.value[i] = 0;
+            for (const PublishedCounters& pub : pubV) s.value[i] += load(pub.value[i]);
+        }
+    }
+    /**
+     * Each sample is converted to the counts in the interval.
+     * CSV rows or a JSON line per run are appended to the file.
+     */
+    void write(const std::string& path, const std::string& format, size_t runId, const std::string& desc) const {
+        FILE *fp = ::fopen(path.c_str(), "a");
+        if (fp == nullptr) throw cybozu::Exception("ThroughputSeries:fopen failed") << path;
+        const bool isJson = format == "json";
+        if (isJson) {
+            ::fprintf(fp, "{\"run\":%zu,\"desc\":\"%s\",\"samples\":[", runId, desc.c_str());
+        } else if (::fseek(fp, 0, SEEK_END) == 0 && ::ftell(fp) == 0) {
+            ::fprintf(fp, "run,ms,commitS,commitL,abortS,abortL,tps\n");
+        }
+        Sample prev{0, {0, 0, 0, 0}};
+        for (size_t i = 0; i < v_.size(); i++) {
+            const Sample& s = v_[i];
+            size_t d[4];
+            for (size_t j = 0; j < 4; j++) d[j] = s.value[j] - prev.value[j];
+            const double tps = (d[0] + d[1]) * 1000.0 / std::max<size_t>(s.ms - prev.ms, 1);
+            if (isJson) {
+                ::fprintf(fp, "%s{\"ms\":%zu,\"commitS\":%zu,\"commitL\":%zu,\"abortS\":%zu,\"abortL\":%zu,\"tps\":%.03f}"
+                          , i == 0 ? "" : ",", s.ms, d[0], d[1], d[2], d[3], tps);
+            } else {
+                ::fprintf(fp, "%zu,%zu,%zu,%zu,%zu,%zu,%.03f\n", runId, s.ms, d[0], d[1], d[2], d[3], tps);
+            }
+            prev = s;
+        }
+        if (isJson) ::fprintf(fp, "]}\n");
+        ::fclose(fp);
+    }
 };
 
 
@@ -514,6 +669,25 @@ void waitForAllTrue(const std::vector<uint8_t>& v)
 }
 
 
+/**
+ * NUMA node of each worker in the affinity mode.
+ */
+inline std::vector<uint> getWorkerNumaNodes(const CmdLineOption& opt)
+{
+    return getNumaNodeVec(getCpuIdList(parseCpuAffinityMode(opt.amode)), opt.nrTh);
+}
+
+
+/**
+ * True if SharedData has a record vector initialized by initRecordVector().
+ */
+template <typename SharedData, typename = void>
+struct HasRecordVector : std::false_type {};
+template <typename SharedData>
+struct HasRecordVector<SharedData, std::void_t<decltype(std::declval<SharedData&>().recV.pageSize())> >
+    : std::true_type {};
+
+
 /**
  * Result:
  *   default constructible, copyable,
@@ -523,6 +697,10 @@ template <typename SharedData, typename Worker, typename Result>
 void runExec(const CmdLineOption& opt, SharedData& shared, Worker&& worker, Result& res)
 {
     const size_t nrTh = opt.nrTh;
+    latencySampleInterval_ = opt.latSample;
+    cybozu::hugepage::defaultMode_ = opt.hugePageMode(); // for local sets created by workers.
+    cybozu::wait_policy::policy_ = opt.getWaitPolicy();
+    const std::vector<uint> nodeV = getWorkerNumaNodes(opt); // for cohort locks.
 
     bool start = false;
     bool quit = false;
@@ -530,8 +708,14 @@ void runExec(const CmdLineOption& opt, SharedData& shared, Worker&& worker, Resu
     std::vector<uint8_t> readyV(nrTh, 0);
     cybozu::thread::ThreadRunnerSet thS;
     std::vector<Result> resV(nrTh);
+    const bool usesTimeSeries = !opt.tsPath.empty();
+    std::vector<PublishedCounters> pubV(usesTimeSeries ? nrTh : 0);
+    ThroughputSeries series;
+    static size_t runId = 0;
     for (size_t i = 0; i < nrTh; i++) {
         thS.add([&,i]() {
+            if (usesTimeSeries) publishedCounters_ = &pubV[i];
+            cybozu::lock::setNumaNode(nodeV[i]);
             try {
                 resV[i] = worker(i, readyV[i], start, quit, shouldQuit, shared);
             } catch (std::exception& e) {
@@ -543,17 +727,23 @@ void runExec(const CmdLineOption& opt, SharedData& shared, Worker&& worker, Resu
     }
     thS.start();
     waitForAllTrue(readyV);
+    const uint64_t beginClk = cybozu::time::rdtscp();
+    const auto beginTime = std::chrono::steady_clock::now();
     storeRelease(start, true);
-    size_t sec = 0;
-    for (size_t i = 0; i < opt.runSec; i++) {
-        if (opt.verbose) {
-            ::printf("%zu\n", i);
+    const size_t stepMs = usesTimeSeries ? opt.tsIntervalMs : 1000;
+    const size_t endMs = opt.runSec * 1000;
+    for (size_t ms = 0; ms < endMs;) {
+        if (opt.verbose && ms % 1000 == 0) {
+            ::printf("%zu\n", ms / 1000);
         }
-        sleep_ms(1000);
-        sec++;
+        ms = std::min(ms + stepMs, endMs);
+        std::this_thread::sleep_until(beginTime + std::chrono::milliseconds(ms));
+        if (usesTimeSeries) series.sample(ms, pubV);
         if (shouldQuit) break;
     }
     storeRelease(quit, true);
+    const uint64_t endClk = cybozu::time::rdtscp();
+    const auto endTime = std::chrono::steady_clock::now();
     thS.join();
     for (size_t i = 0; i < nrTh; i++) {
         if (opt.verbose) {
@@ -561,11 +751,33 @@ void runExec(const CmdLineOption& opt, SharedData& shared, Worker&& worker, Resu
         }
         res += resV[i];
     }
-    ::printf("%s tps:%.03f %s\n"
-             , opt.str().c_str()
+    std::string latStr;
+    constexpr bool hasLatency =
+        std::is_base_of<Result1, Result>::value || std::is_same<Result2, Result>::value;
+    if constexpr (hasLatency) {
+        if (opt.latSample != 0) {
+            const double us = std::chrono::duration<double, std::micro>(endTime - beginTime).count();
+            latStr = res.latencyStr((endClk - beginClk) / us);
+        }
+    }
+    unused(beginClk, beginTime, endClk, endTime);
+    std::string optStr = opt.str();
+    if constexpr (HasRecordVector<SharedData>::value) {
+        // Partitions are allocated by the workers, so this is known only after the run.
+        optStr += fmtstr(" pageSize:%zu", shared.recV.pageSize());
+    }
+    ::printf("%s tps:%.03f %s%s\n"
+             , optStr.c_str()
              , res.nrCommit() / (double)opt.runSec
-             , res.str().c_str());
+             , res.str().c_str(), latStr.c_str());
+    if constexpr (hasLatency) {
+        if (opt.latSample != 0 && opt.verbose) res.putHistograms(std::cout);
+    }
     ::fflush(::stdout);
+    if (usesTimeSeries) {
+        series.write(opt.tsPath, opt.tsFormat, runId, optStr);
+    }
+    runId++;
 }
 
 
@@ -593,22 +805,48 @@ void backOff(uint64_t& trial_start_ts, size_t retry, Random& rand)
 }
 
 
+/**
+ * NUMA node of each worker to replicate read-only tables.
+ * Empty unless the replicate policy is specified.
+ */
+inline std::vector<uint> getReplicaNumaNodes(const CmdLineOption& opt)
+{
+    if (opt.numaPolicy() != cybozu::numa::Policy::REPLICATE) return {};
+    return getWorkerNumaNodes(opt);
+}
+
+
 template <typename Vec, typename Opt>
 void initRecordVector(Vec& v, const Opt& opt)
 {
-#ifdef USE_PARTITION
+    using namespace cybozu::numa;
+    // The insert workload uses the record table only.
+    if (opt.workload == "insert") return;
+    const Policy policy = opt.numaPolicy();
 #ifdef MUTEX_ON_CACHELINE
-    v.setSizes(opt.nrTh, opt.getNrMuPerTh(), opt.payload, CACHE_LINE_SIZE);
+    const size_t alignment = CACHE_LINE_SIZE;
 #else
-    v.setSizes(opt.nrTh, opt.getNrMuPerTh(), opt.payload);
+    // Some mutexes such as sxq::Mutex require more than the default alignment.
+    const size_t alignment = std::max(sizeof(uintptr_t), alignof(std::remove_reference_t<decltype(v[0])>));
 #endif
+#ifdef USE_PARTITION
+    v.setSizes(opt.nrTh, opt.getNrMuPerTh(), opt.payload, alignment);
+    if (policy != Policy::NONE) v.setNumaPolicy(policy, getWorkerNumaNodes(opt));
+    v.setHugePageMode(opt.hugePageMode());
 #else
-#ifdef MUTEX_ON_CACHELINE
-    v.setPayloadSize(opt.payload, CACHE_LINE_SIZE);
-#else
-    v.setPayloadSize(opt.payload);
-#endif
-    v.resize(opt.getNrMu());
+    if (policy == Policy::LOCAL) {
+        throw cybozu::Exception("initRecordVector: local numa policy requires partition.");
+    }
+    v.setPayloadSize(opt.payload, alignment);
+    v.setHugePageMode(opt.hugePageMode());
+    if (policy == Policy::INTERLEAVE) {
+        // Records are shared by all the workers.
+        MemPolicyScope scope(MPOL_INTERLEAVE, NodeMask(uniqueNodes(getWorkerNumaNodes(opt))));
+        v.resize(opt.getNrMu());
+    } else {
+        // Records are written so they are never replicated.
+        v.resize(opt.getNrMu());
+    }
 #endif
 }
 
@@ -0,0 +1,223 @@
+#include <ctime>
+#include <vector>
+#include <chrono>
+#include <memory>
+#include <unistd.h>
+#include "mvcc.hpp"
+#include "thread_util.hpp"
+#include "random.hpp"
+#include "measure_util.hpp"
+#include "cpuid.hpp"
+#include "vector_payload.hpp"
+#include "cache_line_size.hpp"
+#include "zipf.hpp"
+#include "workload_util.hpp"
+#include "wal.hpp"
+
+
+using Mutex = cybozu::mvcc::Mutex;
+
+std::vector<uint> CpuId_;
+
+struct Shared
+{
+    VectorWithPayload<Mutex> recV;
+    EpochGenerator epochGen;
+    std::unique_ptr<cybozu::mvcc::TimestampAllocator> tsAlloc;
+    std::unique_ptr<cybozu::ebr::EpochReclaimer> reclaimer; // for old versions.
+    cybozu::wal::Logger logger; // used if -log is specified.
+    size_t nrMu;
+    size_t nrTh;
+    size_t longTxSize;
+    size_t nrOp;
+    double wrRatio;
+    size_t nrWr4Long;
+    TxMode shortTxMode;
+    TxMode longTxMode;
+    bool usesBackOff;
+    bool usesRMW;
+    bool nowait;
+    size_t nrTh4LongTx;
+    size_t payload;
+    bool usesZipf;
+    double zipfTheta;
+    double zipfZetan;
+};
+
+
+enum class Mode : bool { S = false, X = true, };
+
+
+Result1 worker2(
+    size_t idx, uint8_t& ready, const bool& start, const bool& quit,
+    bool& shouldQuit, Shared& shared)
+{
+    unused(shouldQuit);
+    cybozu::thread::setThreadAffinity(::pthread_self(), CpuId_[idx]);
+
+    auto& recV = shared.recV;
+    const size_t longTxSize = shared.longTxSize;
+    const size_t nrOp = shared.nrOp;
+    const size_t wrRatio = size_t(shared.wrRatio * (double)SIZE_MAX);
+    const TxMode shortTxMode = shared.shortTxMode;
+    const TxMode longTxMode = shared.longTxMode;
+
+    Result1 res;
+    cybozu::util::Xoroshiro128Plus rand(::time(0), idx);
+    FastZipf fastZipf(rand, shared.zipfTheta, recV.size(), shared.zipfZetan);
+    cybozu::ebr::EpochReclaimer::Local reclaimer(*shared.reclaimer, idx);
+    cybozu::mvcc::LocalSet localSet;
+    std::vector<uint8_t> value(shared.payload);
+
+    const bool isLongTx = longTxSize != 0 && idx < shared.nrTh4LongTx; // starvation setting.
+    const size_t realNrOp = isLongTx ? longTxSize : nrOp;
+    const size_t realNrWr = isLongTx ? shared.nrWr4Long : size_t(shared.wrRatio * (double)nrOp);
+    auto getMode = selectGetModeFunc<decltype(rand), Mode>(isLongTx, shortTxMode, longTxMode);
+    auto getRecordIdx = selectGetRecordIdx<decltype(rand)>(isLongTx, shortTxMode, longTxMode, shared.usesZipf);
+    // Read-only transactions read snapshots.
+    const bool isReadOnly = (isLongTx ? longTxMode : shortTxMode) == USE_READONLY_TX;
+    localSet.init(shared.payload, realNrOp, *shared.tsAlloc, reclaimer, idx);
+    localSet.setNowait(shared.nowait);
+    // Read-only transactions write no log.
+    cybozu::wal::LogBuffer *logBuf =
+        shared.logger.enabled() && !isReadOnly ? &shared.logger.buffer(idx) : nullptr;
+
+    store_release(ready, 1);
+    while (!load_acquire(start)) _mm_pause();
+    while (!load_acquire(quit)) {
+        size_t firstRecIdx = 0;
+        uint64_t t0 = 0;
+        if (shared.usesBackOff) t0 = cybozu::time::rdtscp();
+        auto randState = rand.getState();
+        res.beginTx();
+        for (size_t retry = 0;; retry++) {
+            if (load_acquire(quit)) break; // to quit under starvation.
+            rand.setState(randState);
+            // Try to run transaction.
+            localSet.begin(isReadOnly);
+            uint64_t logEpoch = 0;
+            for (size_t i = 0; i < realNrOp; i++) {
+                size_t key = getRecordIdx(rand, fastZipf, recV.size(), realNrOp, i, firstRecIdx);
+                Mode mode = getMode(rand, realNrOp, realNrWr, wrRatio, i);
+                bool isWrite = (mode == Mode::X);
+
+                auto& item = recV[key];
+                Mutex& mutex = item.value;
+                if (shared.usesRMW || !isWrite) {
+                    localSet.read(mutex, item.payload, &value[0]);
+                }
+                if (isWrite) {
+                    localSet.write(mutex, item.payload, &value[0]);
+                    if (logBuf) logBuf->stage(key, &value[0], shared.payload);
+                }
+            }
+            if (unlikely(!localSet.commit([&]() {
+                        if (logBuf) logEpoch = logBuf->enterCommit();
+                    }))) {
+                goto abort;
+            }
+            if (logBuf) logBuf->commit(logEpoch);
+            res.incCommit(isLongTx);
+            res.addRetryCount(isLongTx, retry);
+            break;
+          abort:
+            localSet.clear();
+            if (logBuf) logBuf->discard();
+            res.incAbort(isLongTx);
+            if (shared.usesBackOff) backOff(t0, retry, rand);
+        }
+    }
+    return res;
+}
+
+
+struct CmdLineOptionPlus : CmdLineOption
+{
+    using base = CmdLineOption;
+
+    int usesBackOff; // 0 or 1.
+    int usesRMW; // 0 or 1.
+    int nowait; // 0 or 1.
+    size_t epochIntervalMs;
+    std::string logPath;
+    int odirect; // 0 or 1.
+
+    CmdLineOptionPlus(const std::string& description) : CmdLineOption(description) {
+        appendOpt(&usesBackOff, 0, "backoff", "[0 or 1]: backoff (0:off, 1:on)");
+        appendOpt(&usesRMW, 1, "rmw", "[0 or 1]: use read-modify-write or normal write (0:w, 1:rmw, default:1)");
+        appendOpt(&nowait, 0, "nowait", "[0 or 1]: use nowait optimization for write lock.");
+        appendOpt(&epochIntervalMs, 1, "epoch", "[ms]: epoch interval. Snapshots are as old as it. (default:1)");
+        appendOpt(&logPath, "", "log", "[path]: redo log file. empty means no logging (default).");
+        appendOpt(&odirect, 0, "odirect", "[0 or 1]: write the redo log with O_DIRECT (default:0).");
+    }
+    std::string str() const {
+        return cybozu::util::formatString(
+            "mode:mvcc %s backoff:%d rmw:%d nowait:%d epoch:%zu log:%d odirect:%d"
+            , base::str().c_str(), usesBackOff ? 1 : 0, usesRMW ? 1 : 0, nowait ? 1 : 0
+            , epochIntervalMs, logPath.empty() ? 0 : 1, odirect ? 1 : 0);
+    }
+};
+
+
+void initShared(Shared& shared, const CmdLineOptionPlus& opt)
+{
+#ifdef USE_PARTITION
+    throw cybozu::Exception("mvcc_bench does not support partition.");
+#else
+    initRecordVector(shared.recV, opt);
+#endif
+    shared.epochGen.setIntervalMs(opt.epochIntervalMs);
+    shared.tsAlloc.reset(new cybozu::mvcc::TimestampAllocator(shared.epochGen, opt.nrTh));
+    shared.reclaimer.reset(new cybozu::ebr::EpochReclaimer(opt.nrTh));
+    shared.longTxSize = opt.longTxSize;
+    shared.nrOp = opt.nrOp;
+    shared.wrRatio = opt.wrRatio;
+    shared.nrWr4Long = opt.nrWr4Long;
+    shared.shortTxMode = TxMode(opt.shortTxMode);
+    shared.longTxMode = TxMode(opt.longTxMode);
+    shared.usesBackOff = opt.usesBackOff ? 1 : 0;
+    shared.usesRMW = opt.usesRMW ? 1 : 0;
+    shared.nowait = opt.nowait ? 1 : 0;
+    shared.nrTh4LongTx = opt.nrTh4LongTx;
+    shared.payload = opt.payload;
+    shared.nrMu = opt.getNrMu();
+    shared.nrTh = opt.nrTh;
+    shared.usesZipf = opt.usesZipf;
+    shared.zipfTheta = opt.zipfTheta;
+    if (shared.usesZipf) {
+        shared.zipfZetan = FastZipf::zeta(opt.getNrMu(), shared.zipfTheta);
+    } else {
+        shared.zipfZetan = 1.0;
+    }
+    if (!opt.logPath.empty()) {
+        shared.logger.open(opt.logPath, opt.nrTh, opt.odirect != 0);
+    }
+}
+
+
+int main(int argc, char *argv[]) try
+{
+    CmdLineOptionPlus opt("mvcc_bench: benchmark with multi-version concurrency control.");
+    opt.parse(argc, argv);
+    setCpuAffinityModeVec(opt.amode, CpuId_);
+
+#ifdef NO_PAYLOAD
+    if (opt.payload != 0) throw cybozu::Exception("payload not supported");
+#endif
+
+    if (opt.workload == "custom") {
+        Shared shared;
+        initShared(shared, opt);
+        for (size_t i = 0; i < opt.nrLoop; i++) {
+            Result1 res;
+            runExec(opt, shared, worker2, res);
+            cybozu::wal::putLogStat(shared.logger);
+        }
+    } else {
+        throw cybozu::Exception("bad workload.") << opt.workload;
+    }
+} catch (std::exception& e) {
+    ::fprintf(::stderr, "exeption: %s\n", e.what());
+} catch (...) {
+    ::fprintf(::stderr, "unknown error\n");
+}
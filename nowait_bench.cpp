@@ -1,3 +1,4 @@
+#include <memory>
 #include "thread_util.hpp"
 #include "random.hpp"
 #include <unistd.h>
@@ -10,6 +11,8 @@
 #include "nowait.hpp"
 #include "zipf.hpp"
 #include "workload_util.hpp"
+#include "tpcc_util.hpp"
+#include "wal.hpp"
 
 
 #ifdef USE_PARTITION
@@ -17,20 +20,32 @@
 #endif
 
 
-using Mutex = cybozu::lock::XSMutex;
-using Lock = cybozu::lock::XSLock;
-using Mode = Mutex::Mode;
+using Mode = cybozu::lock::XSMutex::Mode;
 
 std::vector<uint> CpuId_;
 
 
+/**
+ * Lock: XSLock or BravoLock.
+ */
+template <typename Lock>
 struct Shared
 {
+    using Mutex = typename Lock::Mutex;
+    using LockSet = cybozu::lock::NoWaitLockSetT<Lock>;
+
 #ifdef USE_PARTITION
     PartitionedVectorWithPayload<Mutex> recV;
 #else
     VectorWithPayload<Mutex> recV;
 #endif
+    typename LockSet::Table table; // used by insert workload.
+    std::unique_ptr<cybozu::ebr::EpochReclaimer> reclaimer;
+    size_t insertWindow;
+    tpcc::Db<Mutex> tpcc; // used by tpcc workload.
+    cybozu::wal::Logger logger; // used if -log is specified.
+    size_t nrMu;
+    size_t nrTh;
     size_t longTxSize;
     size_t nrOp;
     double wrRatio;
@@ -44,10 +59,19 @@ struct Shared
     bool usesZipf;
     double zipfTheta;
     double zipfZetan;
+
+    size_t waitCycles; // wait budget of conflicting lock requests. 0 means no-wait.
+    size_t waitAdaptivePct; // 0 means the wait budget is fixed.
+
+    size_t nrHot; // number of hot records whose locks retire early. 0 means disabled.
+    cybozu::bamboo::RetireTable retireTable;
+    SimpleTxIdGenerator txIdGen; // used by retire chains.
 };
 
-Result1 worker2(size_t idx, uint8_t& ready, const bool& start, const bool& quit, bool& shouldQuit, Shared& shared)
+template <typename Lock>
+Result1 worker2(size_t idx, uint8_t& ready, const bool& start, const bool& quit, bool& shouldQuit, Shared<Lock>& shared)
 {
+    using Mutex = typename Lock::Mutex;
     unused(shouldQuit);
     cybozu::thread::setThreadAffinity(::pthread_self(), CpuId_[idx]);
 
@@ -65,7 +89,7 @@ Result1 worker2(size_t idx, uint8_t& ready, const bool& start, const bool& quit,
     Result1 res;
     cybozu::util::Xoroshiro128Plus rand(::time(0), idx);
     FastZipf fastZipf(rand, shared.zipfTheta, recV.size(), shared.zipfZetan);
-    cybozu::lock::NoWaitLockSet lockSet;
+    typename Shared<Lock>::LockSet lockSet;
     std::vector<uint8_t> value(shared.payload);
 
     const bool isLongTx = longTxSize != 0 && idx < shared.nrTh4LongTx; // starvation setting.
@@ -74,20 +98,30 @@ Result1 worker2(size_t idx, uint8_t& ready, const bool& start, const bool& quit,
     auto getMode = selectGetModeFunc<decltype(rand), Mode>(isLongTx, shortTxMode, longTxMode);
     auto getRecordIdx = selectGetRecordIdx<decltype(rand)>(isLongTx, shortTxMode, longTxMode, shared.usesZipf);
     lockSet.init(shared.payload, realNrOp);
+    lockSet.setWaitBudget(shared.waitCycles, shared.waitAdaptivePct);
+    if (shared.nrHot != 0) {
+        shared.retireTable.initOnce(recV, shared.nrHot, shared.payload);
+        lockSet.setRetireTable(shared.retireTable);
+    }
+    cybozu::wal::LogBuffer *logBuf = shared.logger.enabled() ? &shared.logger.buffer(idx) : nullptr;
 
     storeRelease(ready, 1);
     while (!loadAcquire(start)) _mm_pause();
     size_t count = 0; unused(count);
     while (!loadAcquire(quit)) {
+        // The txId is kept in retries to avoid starvation in retire chains.
+        if (shared.nrHot != 0) lockSet.setTxId(shared.txIdGen.get());
         size_t firstRecIdx = 0;
-        uint64_t t0 = -1, t1 = -1, t2 = -1;
+        uint64_t t0 = -1, t1 = -1;
+        res.beginTx();
         log_timestamp_if_necessary_on_tx_start(t0, shared.usesBackOff);
         auto randState = rand.getState();
         for (size_t retry = 0;; retry++) {
             if (unlikely(load_acquire(quit))) break; // to quit under starvation.
             assert(lockSet.empty());
             rand.setState(randState);
-            log_timestamp_if_necessary_on_trial_start(t0, t1, t2, retry, shared.usesBackOff);
+            log_timestamp_if_necessary_on_trial_start(t0, t1, retry, shared.usesBackOff);
+            uint64_t logEpoch = 0;
             for (size_t i = 0; i < realNrOp; i++) {
                 size_t key = getRecordIdx(rand, fastZipf, recV.size(), realNrOp, i, firstRecIdx);
                 Mode mode = getMode(rand, realNrOp, realNrWr, wrRatio, i);
@@ -105,18 +139,20 @@ Result1 worker2(size_t idx, uint8_t& ready, const bool& start, const bool& quit,
                     } else {
                         if (unlikely(!lockSet.write(mutex, item.payload, &value[0]))) goto abort;
                     }
+                    if (logBuf) logBuf->stage(key, &value[0], shared.payload);
                 }
             }
             if (unlikely(!lockSet.blindWriteLockAll())) goto abort;
+            if (logBuf) logEpoch = logBuf->enterCommit();
             lockSet.updateAndUnlock();
-            log_timestamp_if_necessary_on_commit(res, t0, t1, t2);
+            if (logBuf) logBuf->commit(logEpoch);
             res.incCommit(isLongTx);
             res.addRetryCount(isLongTx, retry);
             break; // retry is not required.
 
           abort:
             lockSet.unlock();
-            log_timestamp_if_necessary_on_abort(res, t1, t2);
+            if (logBuf) logBuf->discard();
             res.incAbort(isLongTx);
             if (shared.usesBackOff) backOff(t0, retry, rand);
             // continue
@@ -126,6 +162,161 @@ Result1 worker2(size_t idx, uint8_t& ready, const bool& start, const bool& quit,
 }
 
 
+/**
+ * Insert workload.
+ * Each transaction accesses preloaded records through the index,
+ * inserts a new record, and removes an old record inserted by itself.
+ */
+template <typename Lock>
+Result1 worker3(size_t idx, uint8_t& ready, const bool& start, const bool& quit, bool& shouldQuit, Shared<Lock>& shared)
+{
+    using Mutex = typename Lock::Mutex;
+    unused(shouldQuit);
+    cybozu::thread::setThreadAffinity(::pthread_self(), CpuId_[idx]);
+
+    auto& table = shared.table;
+    const size_t nrMu = shared.nrMu;
+    const size_t nrOp = shared.nrOp;
+    const size_t wrRatio = size_t(shared.wrRatio * (double)SIZE_MAX);
+    const TxMode shortTxMode = shared.shortTxMode;
+
+    Result1 res;
+    cybozu::util::Xoroshiro128Plus rand(::time(0), idx);
+    FastZipf fastZipf(rand, shared.zipfTheta, nrMu, shared.zipfZetan);
+    typename Shared<Lock>::LockSet lockSet;
+    std::vector<uint8_t> value(shared.payload);
+    cybozu::ebr::EpochReclaimer::Local reclaimer(*shared.reclaimer, idx);
+    InsertKeyGen keyGen(nrMu, shared.nrTh, idx, shared.insertWindow);
+
+    const size_t realNrWr = size_t(shared.wrRatio * (double)nrOp);
+    auto getMode = selectGetModeFunc<decltype(rand), Mode>(false, shortTxMode, shortTxMode);
+    auto getRecordIdx = selectGetRecordIdx<decltype(rand)>(false, shortTxMode, shortTxMode, shared.usesZipf);
+    lockSet.init(shared.payload, nrOp + 2);
+    lockSet.setWaitBudget(shared.waitCycles, shared.waitAdaptivePct);
+    lockSet.setReclaimer(reclaimer);
+
+    storeRelease(ready, 1);
+    while (!loadAcquire(start)) _mm_pause();
+    while (!loadAcquire(quit)) {
+        size_t firstRecIdx = 0;
+        uint64_t t0 = -1, t1 = -1;
+        res.beginTx();
+        log_timestamp_if_necessary_on_tx_start(t0, shared.usesBackOff);
+        auto randState = rand.getState();
+        for (size_t retry = 0;; retry++) {
+            if (unlikely(load_acquire(quit))) break; // to quit under starvation.
+            cybozu::ebr::EpochReclaimer::Guard guard(reclaimer);
+            assert(lockSet.empty());
+            rand.setState(randState);
+            log_timestamp_if_necessary_on_trial_start(t0, t1, retry, shared.usesBackOff);
+            for (size_t i = 0; i < nrOp; i++) {
+                size_t key = getRecordIdx(rand, fastZipf, nrMu, nrOp, i, firstRecIdx);
+                Mode mode = getMode(rand, nrOp, realNrWr, wrRatio, i);
+
+                auto& item = *table.index().lookup(key);
+                Mutex& mutex = item.value;
+
+                if (mode == Mode::S) {
+                    if (unlikely(!lockSet.read(mutex, item.payload, &value[0]))) goto abort;
+                } else {
+                    assert(mode == Mode::X);
+                    if (shared.usesRMW) {
+                        if (unlikely(!lockSet.readForUpdate(mutex, item.payload, &value[0]))) goto abort;
+                    }
+                    if (unlikely(!lockSet.write(mutex, item.payload, &value[0]))) goto abort;
+                }
+            }
+            if (unlikely(!lockSet.insert(table, keyGen.newKey(), &value[0]))) goto abort;
+            if (keyGen.shouldRemove()) {
+                if (unlikely(!lockSet.remove(table, keyGen.oldKey()))) goto abort;
+            }
+            if (unlikely(!lockSet.blindWriteLockAll())) goto abort;
+            lockSet.updateAndUnlock();
+            keyGen.commit();
+            res.incCommit(false);
+            res.addRetryCount(false, retry);
+            break; // retry is not required.
+
+          abort:
+            lockSet.unlock();
+            res.incAbort(false);
+            if (shared.usesBackOff) backOff(t0, retry, rand);
+            // continue
+        }
+    }
+    return res;
+}
+
+
+template <typename LockSet>
+struct TpccAccessor
+{
+    using Mutex = typename LockSet::Mutex;
+
+    LockSet& lockSet;
+
+    INLINE bool read(DataWithPayload<Mutex>& rec, void *dst) {
+        return lockSet.read(rec.value, rec.payload, dst);
+    }
+    INLINE bool readForUpdate(DataWithPayload<Mutex>& rec, void *dst) {
+        return lockSet.readForUpdate(rec.value, rec.payload, dst);
+    }
+    INLINE bool write(DataWithPayload<Mutex>& rec, void *src) {
+        return lockSet.write(rec.value, rec.payload, src);
+    }
+};
+
+
+/**
+ * TPC-C subset workload.
+ * The home warehouse of each worker is determined by its index.
+ */
+template <typename Lock>
+Result1 worker4(size_t idx, uint8_t& ready, const bool& start, const bool& quit, bool& shouldQuit, Shared<Lock>& shared)
+{
+    unused(shouldQuit);
+    cybozu::thread::setThreadAffinity(::pthread_self(), CpuId_[idx]);
+
+    auto& db = shared.tpcc;
+    Result1 res;
+    cybozu::util::Xoroshiro128Plus rand(::time(0), idx);
+    tpcc::InputGenerator<decltype(rand)> inputGen(rand, db.nrWh(), idx % db.nrWh());
+    tpcc::Input input;
+
+    typename Shared<Lock>::LockSet lockSet;
+    lockSet.init(tpcc::ROW_SIZE, tpcc::MAX_OL_CNT * 3 + 5);
+    lockSet.setWaitBudget(shared.waitCycles, shared.waitAdaptivePct);
+    TpccAccessor<typename Shared<Lock>::LockSet> acc{lockSet};
+
+    storeRelease(ready, 1);
+    while (!loadAcquire(start)) _mm_pause();
+    while (!loadAcquire(quit)) {
+        inputGen.generate(input);
+        uint64_t t0 = -1, t1 = -1;
+        res.beginTx();
+        log_timestamp_if_necessary_on_tx_start(t0, shared.usesBackOff);
+        for (size_t retry = 0;; retry++) {
+            if (unlikely(load_acquire(quit))) break; // to quit under starvation.
+            assert(lockSet.empty());
+            log_timestamp_if_necessary_on_trial_start(t0, t1, retry, shared.usesBackOff);
+            if (unlikely(!tpcc::run(db, acc, input))) goto abort;
+            if (unlikely(!lockSet.blindWriteLockAll())) goto abort;
+            lockSet.updateAndUnlock();
+            res.incCommit(false);
+            res.addRetryCount(false, retry);
+            break; // retry is not required.
+
+          abort:
+            lockSet.unlock();
+            res.incAbort(false);
+            if (shared.usesBackOff) backOff(t0, retry, rand);
+            // continue
+        }
+    }
+    return res;
+}
+
+
 void runTest()
 {
 #if 0
@@ -197,62 +388,148 @@ void runTest()
 }
 
 
+enum LockTypeType
+{
+    USE_XS = 0,
+    USE_BRAVO = 1,
+};
+
+
 struct CmdLineOptionPlus : CmdLineOption
 {
     using base = CmdLineOption;
 
     int usesBackOff; // 0 or 1.
     int usesRMW; // 0 or 1.
+    size_t insertWindow;
+    std::string logPath;
+    int odirect; // 0 or 1.
+    size_t waitCycles;
+    size_t waitAdaptivePct;
+    size_t nrHot;
+    int lockType;
 
     CmdLineOptionPlus(const std::string& description) : CmdLineOption(description) {
         appendOpt(&usesBackOff, 0, "backoff", "[0 or 1]: backoff 0:off 1:on");
         appendOpt(&usesRMW, 1, "rmw", "[0 or 1]: use read-modify-write or normal write 0:w 1:rmw (default: 1)");
+        appendOpt(&insertWindow, 1000, "iwin", "[num]: number of live inserted records per worker for insert workload (default:1000).");
+        appendOpt(&logPath, "", "log", "[path]: redo log file for custom workload. empty means no logging (default).");
+        appendOpt(&odirect, 0, "odirect", "[0 or 1]: write the redo log with O_DIRECT (default:0).");
+        appendOpt(&waitCycles, 0, "wait", "[cycles]: TSC cycles to wait for a conflicting lock before aborting. 0 means no-wait (default:0).");
+        appendOpt(&waitAdaptivePct, 0, "wait-adaptive", "[pct]: wait budget in percentage of the recent average transaction duration. 0 means the fixed budget by -wait (default:0).");
+        appendOpt(&nrHot, 0, "retire", "[num]: number of hot records from the first one whose locks retire early for custom workload. 0 means disabled (default:0).");
+        appendOpt(&lockType, 0, "lock", "[id]: mutex type (0:xs(default), 1:bravo(reader-biased)).");
     }
     std::string str() const {
         return cybozu::util::formatString(
-            "mode:nowait %s backoff:%d rmw:%d"
-            , base::str().c_str(), usesBackOff ? 1 : 0, usesRMW ? 1 : 0);
+            "mode:nowait %s backoff:%d rmw:%d insertWindow:%zu log:%d odirect:%d wait:%zu waitAdaptive:%zu retire:%zu lock:%s"
+            , base::str().c_str(), usesBackOff ? 1 : 0, usesRMW ? 1 : 0
+            , workload == "insert" ? insertWindow : 0
+            , logPath.empty() ? 0 : 1, odirect ? 1 : 0, waitCycles, waitAdaptivePct, nrHot
+            , lockType == USE_BRAVO ? "bravo" : "xs");
     }
 };
 
 
-int main(int argc, char *argv[]) try
+template <typename Lock>
+void initShared(Shared<Lock>& shared, const CmdLineOptionPlus& opt)
 {
-    CmdLineOptionPlus opt("nowait_bench: benchmark with nowait lock.");
-    opt.parse(argc, argv);
-    setCpuAffinityModeVec(opt.amode, CpuId_);
+    initRecordVector(shared.recV, opt);
+    shared.longTxSize = opt.longTxSize;
+    shared.nrOp = opt.nrOp;
+    shared.wrRatio = opt.wrRatio;
+    shared.nrWr4Long = opt.nrWr4Long;
+    shared.shortTxMode = TxMode(opt.shortTxMode);
+    shared.longTxMode = TxMode(opt.longTxMode);
+    shared.usesBackOff = opt.usesBackOff ? 1 : 0;
+    shared.nrTh4LongTx = opt.nrTh4LongTx;
+    shared.payload = opt.payload;
+    shared.usesRMW = opt.usesRMW != 0;
+    shared.nrMu = opt.getNrMu();
+    shared.nrTh = opt.nrTh;
+    shared.waitCycles = opt.waitCycles;
+    shared.waitAdaptivePct = opt.waitAdaptivePct;
+    shared.nrHot = opt.nrHot;
+    shared.usesZipf = opt.usesZipf;
+    shared.zipfTheta = opt.zipfTheta;
+    if (shared.usesZipf) {
+        shared.zipfZetan = FastZipf::zeta(opt.getNrMu(), shared.zipfTheta);
+    } else {
+        shared.zipfZetan = 1.0;
+    }
+    if (!opt.logPath.empty()) {
+        shared.logger.open(opt.logPath, opt.nrTh, opt.odirect != 0);
+    }
+}
 
-#ifdef NO_PAYLOAD
-    if (opt.payload != 0) throw cybozu::Exception("payload not supported");
-#endif
 
+template <typename Lock>
+void dispatch(const CmdLineOptionPlus& opt)
+{
     if (opt.workload == "custom") {
-        Shared shared;
-        initRecordVector(shared.recV, opt);
-        shared.longTxSize = opt.longTxSize;
-        shared.nrOp = opt.nrOp;
-        shared.wrRatio = opt.wrRatio;
-        shared.nrWr4Long = opt.nrWr4Long;
-        shared.shortTxMode = TxMode(opt.shortTxMode);
-        shared.longTxMode = TxMode(opt.longTxMode);
-        shared.usesBackOff = opt.usesBackOff ? 1 : 0;
-        shared.nrTh4LongTx = opt.nrTh4LongTx;
-        shared.payload = opt.payload;
-        shared.usesRMW = opt.usesRMW != 0;
-        shared.usesZipf = opt.usesZipf;
-        shared.zipfTheta = opt.zipfTheta;
-        if (shared.usesZipf) {
-            shared.zipfZetan = FastZipf::zeta(opt.getNrMu(), shared.zipfTheta);
-        } else {
-            shared.zipfZetan = 1.0;
+        Shared<Lock> shared;
+        initShared(shared, opt);
+        for (size_t i = 0; i < opt.nrLoop; i++) {
+            Result1 res;
+            runExec(opt, shared, worker2<Lock>, res);
+            cybozu::wal::putLogStat(shared.logger);
+        }
+    } else if (opt.workload == "insert") {
+        for (size_t i = 0; i < opt.nrLoop; i++) {
+            // Inserted keys must not remain in the next loop.
+            Shared<Lock> shared;
+            initShared(shared, opt);
+            cybozu::record::initRecordTable(shared.table, opt);
+            shared.reclaimer.reset(new cybozu::ebr::EpochReclaimer(opt.nrTh));
+            shared.insertWindow = opt.insertWindow;
+            Result1 res;
+            runExec(opt, shared, worker3<Lock>, res);
         }
+    } else if (opt.workload == "tpcc") {
+#ifdef NO_PAYLOAD
+        throw cybozu::Exception("tpcc workload requires payload.");
+#endif
+        Shared<Lock> shared;
+        initShared(shared, opt);
+        cybozu::util::Xoroshiro128Plus rand(::time(0));
+        shared.tpcc.init(opt.nrTh, rand, getReplicaNumaNodes(opt)); // a warehouse per worker.
         for (size_t i = 0; i < opt.nrLoop; i++) {
             Result1 res;
-            runExec(opt, shared, worker2, res);
+            runExec(opt, shared, worker4<Lock>, res);
         }
     } else {
         throw cybozu::Exception("bad workload.") << opt.workload;
     }
+}
+
+
+int main(int argc, char *argv[]) try
+{
+    CmdLineOptionPlus opt("nowait_bench: benchmark with nowait lock.");
+    opt.parse(argc, argv);
+    setCpuAffinityModeVec(opt.amode, CpuId_);
+
+#ifdef NO_PAYLOAD
+    if (opt.payload != 0) throw cybozu::Exception("payload not supported");
+#endif
+
+    if (!opt.logPath.empty() && opt.workload != "custom") {
+        throw cybozu::Exception("log is not supported by the workload.") << opt.workload;
+    }
+    if (opt.nrHot != 0 && opt.workload != "custom") {
+        throw cybozu::Exception("retire is not supported by the workload.") << opt.workload;
+    }
+
+    switch (opt.lockType) {
+    case USE_XS:
+        dispatch<cybozu::lock::XSLock>(opt);
+        break;
+    case USE_BRAVO:
+        dispatch<cybozu::lock::BravoLock>(opt);
+        break;
+    default:
+        throw cybozu::Exception("bad lockType") << opt.lockType;
+    }
 } catch (std::exception& e) {
     ::fprintf(::stderr, "exeption: %s\n", e.what());
 } catch (...) {
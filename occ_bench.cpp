@@ -1,6 +1,7 @@
 #include <ctime>
 #include <vector>
 #include <chrono>
+#include <memory>
 #include <unistd.h>
 #include "occ.hpp"
 #include "thread_util.hpp"
@@ -11,6 +12,8 @@
 #include "cache_line_size.hpp"
 #include "zipf.hpp"
 #include "workload_util.hpp"
+#include "tpcc_util.hpp"
+#include "wal.hpp"
 
 
 #ifdef USE_PARTITION
@@ -29,6 +32,13 @@ struct Shared
 #else
     VectorWithPayload<Mutex> recV;
 #endif
+    cybozu::occ::LockSet::OrderedIndex index; // used by scan workload.
+    size_t scanLen; // 0 means point read.
+    cybozu::occ::LockSet::Table table; // used by insert workload.
+    std::unique_ptr<cybozu::ebr::EpochReclaimer> reclaimer;
+    size_t insertWindow;
+    tpcc::Db<Mutex> tpcc; // used by tpcc workload.
+    cybozu::wal::Logger logger; // used if -log is specified.
     size_t longTxSize;
     size_t nrOp;
     double wrRatio;
@@ -38,9 +48,46 @@ struct Shared
     bool usesBackOff;
     bool usesRMW;
     bool nowait;
+    uint32_t hotThreshold; // for MOCC. 0 means off.
+    bool repair;
     size_t nrTh4LongTx;
     size_t payload;
     size_t nrMuPerTh;
+    size_t nrMu;
+    size_t nrTh;
+    bool usesZipf;
+    double zipfTheta;
+    double zipfZetan;
+};
+
+
+/**
+ * For silo mode.
+ */
+struct SiloShared
+{
+    using Mutex = cybozu::occ::SiloLockSet::Mutex;
+
+#ifdef USE_PARTITION
+    PartitionedVectorWithPayload<Mutex> recV;
+#else
+    VectorWithPayload<Mutex> recV;
+#endif
+    EpochGenerator epochGen;
+    std::unique_ptr<cybozu::occ::SiloLockSet::TimestampAllocator> tsAlloc;
+    std::unique_ptr<cybozu::ebr::EpochReclaimer> reclaimer; // for old versions.
+    cybozu::wal::Logger logger; // used if -log is specified.
+    size_t longTxSize;
+    size_t nrOp;
+    double wrRatio;
+    size_t nrWr4Long;
+    TxMode shortTxMode;
+    TxMode longTxMode;
+    bool usesBackOff;
+    bool usesRMW;
+    bool nowait;
+    size_t nrTh4LongTx;
+    size_t payload;
     bool usesZipf;
     double zipfTheta;
     double zipfZetan;
@@ -79,8 +126,13 @@ Result1 worker2(size_t idx, uint8_t& ready, const bool& start, const bool& quit,
     const size_t realNrWr = isLongTx ? shared.nrWr4Long : size_t((double)nrOp * shared.wrRatio);
     auto getMode = selectGetModeFunc<decltype(rand), Mode>(isLongTx, shortTxMode, longTxMode);
     auto getRecordIdx = selectGetRecordIdx<decltype(rand)>(isLongTx, shortTxMode, longTxMode, shared.usesZipf);
+    const size_t scanLen = shared.scanLen;
 
-    lockSet.init(shared.payload, realNrOp);
+    lockSet.init(shared.payload, realNrOp * std::max<size_t>(scanLen, 1));
+    lockSet.setHotThreshold(shared.hotThreshold);
+    // The local value of a write is the value of the last read.
+    if (shared.repair) lockSet.setRepair(cybozu::TxRepair::copy);
+    cybozu::wal::LogBuffer *logBuf = shared.logger.enabled() ? &shared.logger.buffer(idx) : nullptr;
 
     storeRelease(ready, 1);
     while (!load_acquire(start)) _mm_pause();
@@ -89,23 +141,32 @@ Result1 worker2(size_t idx, uint8_t& ready, const bool& start, const bool& quit,
         uint64_t t0 = 0;
         if (shared.usesBackOff) t0 = cybozu::time::rdtscp();
         auto randState = rand.getState();
+        res.beginTx();
         for (size_t retry = 0;; retry++) {
             if (unlikely(load_acquire(quit))) break; // to quit under starvation.
             // Try to run transaction.
             assert(lockSet.empty());
             rand.setState(randState);
+            uint64_t logEpoch = 0;
+            const Mutex *src = nullptr; // the last read record.
             for (size_t i = 0; i < realNrOp; i++) {
                 bool isWrite = bool(getMode(rand, realNrOp, realNrWr, wrRatio, i));
                 size_t key = getRecordIdx(rand, fastZipf, recV.size(), realNrOp, i, firstRecIdx);
 
+                if (!isWrite && scanLen > 0) {
+                    lockSet.scan(shared.index, key, scanLen, &value[0]);
+                    continue;
+                }
                 auto& item = recV[key];
                 Mutex& mutex = item.value;
                 void *payload = item.payload;
                 if (shared.usesRMW || !isWrite) {
                     lockSet.read(mutex, payload, &value[0]);
+                    src = &mutex;
                 }
                 if (isWrite) {
-                    lockSet.write(mutex, payload, &value[0]);
+                    lockSet.write(mutex, payload, &value[0], src);
+                    if (logBuf) logBuf->stage(key, &value[0], shared.payload);
                 }
             }
 
@@ -115,17 +176,20 @@ Result1 worker2(size_t idx, uint8_t& ready, const bool& start, const bool& quit,
             } else {
                 lockSet.lock();
             }
-#if 1
-            if (unlikely(!lockSet.verify())) goto abort;
-#else
-            if (unlikely(!lockSet.verifyWithHealing())) goto abort;
-#endif
+            if (shared.repair) {
+                if (unlikely(!lockSet.verifyWithRepair())) goto abort;
+            } else {
+                if (unlikely(!lockSet.verify())) goto abort;
+            }
+            if (logBuf) logEpoch = logBuf->enterCommit();
             lockSet.updateAndUnlock();
+            if (logBuf) logBuf->commit(logEpoch);
             res.incCommit(isLongTx);
             res.addRetryCount(isLongTx, retry);
             break;
         abort:
             lockSet.clear();
+            if (logBuf) logBuf->discard();
             res.incAbort(isLongTx);
             if (shared.usesBackOff) backOff(t0, retry, rand);
             // continue
@@ -166,6 +230,7 @@ Result1 worker3(size_t idx, uint8_t& ready, const bool& start, const bool& quit,
     auto getMode = selectGetModeFunc<decltype(rand), Mode>(isLongTx, shortTxMode, longTxMode);
 
     lockSet.init(shared.payload, realNrOp);
+    lockSet.setHotThreshold(shared.hotThreshold);
 
     const size_t keyBase = shared.nrMuPerTh * idx;
 
@@ -176,6 +241,7 @@ Result1 worker3(size_t idx, uint8_t& ready, const bool& start, const bool& quit,
         uint64_t t0 = 0;
         if (shared.usesBackOff) t0 = cybozu::time::rdtscp();
         auto randState = rand.getState();
+        res.beginTx();
         for (size_t retry = 0;; retry++) {
             if (load_acquire(quit)) break; // to quit under starvation.
             // Try to run transaction.
@@ -220,6 +286,266 @@ Result1 worker3(size_t idx, uint8_t& ready, const bool& start, const bool& quit,
 }
 
 
+/**
+ * Insert workload.
+ * Each transaction accesses preloaded records through the index,
+ * inserts a new record, and removes an old record inserted by itself.
+ */
+template <bool nowait>
+Result1 worker4(size_t idx, uint8_t& ready, const bool& start, const bool& quit, bool& shouldQuit, Shared& shared)
+{
+    unused(shouldQuit);
+    cybozu::thread::setThreadAffinity(::pthread_self(), CpuId_[idx]);
+
+    auto& table = shared.table;
+    const size_t nrMu = shared.nrMu;
+    const size_t nrOp = shared.nrOp;
+    const size_t wrRatio = size_t(shared.wrRatio * (double)SIZE_MAX);
+    const TxMode shortTxMode = shared.shortTxMode;
+
+    Result1 res;
+    cybozu::util::Xoroshiro128Plus rand(::time(0), idx);
+    FastZipf fastZipf(rand, shared.zipfTheta, nrMu, shared.zipfZetan);
+
+    std::vector<uint8_t> value(shared.payload);
+    cybozu::occ::LockSet lockSet;
+    cybozu::ebr::EpochReclaimer::Local reclaimer(*shared.reclaimer, idx);
+    lockSet.setReclaimer(reclaimer);
+    InsertKeyGen keyGen(nrMu, shared.nrTh, idx, shared.insertWindow);
+
+    const size_t realNrWr = size_t((double)nrOp * shared.wrRatio);
+    auto getMode = selectGetModeFunc<decltype(rand), Mode>(false, shortTxMode, shortTxMode);
+    auto getRecordIdx = selectGetRecordIdx<decltype(rand)>(false, shortTxMode, shortTxMode, shared.usesZipf);
+
+    lockSet.init(shared.payload, nrOp + 2);
+    lockSet.setHotThreshold(shared.hotThreshold);
+
+    storeRelease(ready, 1);
+    while (!load_acquire(start)) _mm_pause();
+    while (!load_acquire(quit)) {
+        size_t firstRecIdx = 0;
+        uint64_t t0 = 0;
+        if (shared.usesBackOff) t0 = cybozu::time::rdtscp();
+        auto randState = rand.getState();
+        res.beginTx();
+        for (size_t retry = 0;; retry++) {
+            if (unlikely(load_acquire(quit))) break; // to quit under starvation.
+            cybozu::ebr::EpochReclaimer::Guard guard(reclaimer);
+            // Try to run transaction.
+            assert(lockSet.empty());
+            rand.setState(randState);
+            for (size_t i = 0; i < nrOp; i++) {
+                bool isWrite = bool(getMode(rand, nrOp, realNrWr, wrRatio, i));
+                size_t key = getRecordIdx(rand, fastZipf, nrMu, nrOp, i, firstRecIdx);
+                auto& item = *table.index().lookup(key);
+                Mutex& mutex = item.value;
+                void *payload = item.payload;
+                if (shared.usesRMW || !isWrite) {
+                    lockSet.read(mutex, payload, &value[0]);
+                }
+                if (isWrite) {
+                    lockSet.write(mutex, payload, &value[0]);
+                }
+            }
+            if (unlikely(!lockSet.insert(table, keyGen.newKey(), &value[0]))) goto abort;
+            if (keyGen.shouldRemove()) {
+                if (unlikely(!lockSet.remove(table, keyGen.oldKey()))) goto abort;
+            }
+
+            // commit phase.
+            if (nowait) {
+                if (unlikely(!lockSet.tryLock())) goto abort;
+            } else {
+                lockSet.lock();
+            }
+            if (unlikely(!lockSet.verify())) goto abort;
+            lockSet.updateAndUnlock();
+            keyGen.commit();
+            res.incCommit(false);
+            res.addRetryCount(false, retry);
+            break;
+        abort:
+            lockSet.clear();
+            res.incAbort(false);
+            if (shared.usesBackOff) backOff(t0, retry, rand);
+            // continue
+        }
+    }
+    return res;
+}
+
+
+/**
+ * Custom workload in silo mode.
+ * Read-only transactions read snapshots.
+ */
+template <bool nowait>
+Result1 worker6(size_t idx, uint8_t& ready, const bool& start, const bool& quit, bool& shouldQuit, SiloShared& shared)
+{
+    using Mutex = SiloShared::Mutex;
+    unused(shouldQuit);
+    cybozu::thread::setThreadAffinity(::pthread_self(), CpuId_[idx]);
+
+    auto& recV = shared.recV;
+#ifdef USE_PARTITION
+    recV.allocate(idx);
+    recV.checkAndWait();
+#endif
+    const size_t longTxSize = shared.longTxSize;
+    const size_t nrOp = shared.nrOp;
+    const size_t wrRatio = size_t(shared.wrRatio * (double)SIZE_MAX);
+    const TxMode shortTxMode = shared.shortTxMode;
+    const TxMode longTxMode = shared.longTxMode;
+
+    Result1 res;
+    cybozu::util::Xoroshiro128Plus rand(::time(0), idx);
+    FastZipf fastZipf(rand, shared.zipfTheta, recV.size(), shared.zipfZetan);
+
+    std::vector<uint8_t> value(shared.payload);
+    cybozu::ebr::EpochReclaimer::Local reclaimer(*shared.reclaimer, idx);
+    cybozu::occ::SiloLockSet lockSet;
+
+    const bool isLongTx = longTxSize != 0 && idx < shared.nrTh4LongTx; // starvation setting.
+    const size_t realNrOp = isLongTx ? longTxSize : nrOp;
+    const size_t realNrWr = isLongTx ? shared.nrWr4Long : size_t((double)nrOp * shared.wrRatio);
+    auto getMode = selectGetModeFunc<decltype(rand), Mode>(isLongTx, shortTxMode, longTxMode);
+    auto getRecordIdx = selectGetRecordIdx<decltype(rand)>(isLongTx, shortTxMode, longTxMode, shared.usesZipf);
+    const bool isReadOnly = (isLongTx ? longTxMode : shortTxMode) == USE_READONLY_TX;
+
+    lockSet.init(shared.payload, realNrOp, *shared.tsAlloc, reclaimer, idx);
+    // Read-only transactions write no log.
+    cybozu::wal::LogBuffer *logBuf =
+        shared.logger.enabled() && !isReadOnly ? &shared.logger.buffer(idx) : nullptr;
+
+    storeRelease(ready, 1);
+    while (!load_acquire(start)) _mm_pause();
+    while (!load_acquire(quit)) {
+        size_t firstRecIdx = 0;
+        uint64_t t0 = 0;
+        if (shared.usesBackOff) t0 = cybozu::time::rdtscp();
+        auto randState = rand.getState();
+        res.beginTx();
+        for (size_t retry = 0;; retry++) {
+            if (unlikely(load_acquire(quit))) break; // to quit under starvation.
+            // Try to run transaction.
+            assert(lockSet.empty());
+            rand.setState(randState);
+            lockSet.begin(isReadOnly);
+            uint64_t logEpoch = 0;
+            for (size_t i = 0; i < realNrOp; i++) {
+                bool isWrite = bool(getMode(rand, realNrOp, realNrWr, wrRatio, i));
+                size_t key = getRecordIdx(rand, fastZipf, recV.size(), realNrOp, i, firstRecIdx);
+
+                auto& item = recV[key];
+                Mutex& mutex = item.value;
+                void *payload = item.payload;
+                if (shared.usesRMW || !isWrite) {
+                    lockSet.read(mutex, payload, &value[0]);
+                }
+                if (isWrite) {
+                    lockSet.write(mutex, payload, &value[0]);
+                    if (logBuf) logBuf->stage(key, &value[0], shared.payload);
+                }
+            }
+
+            // commit phase.
+            if (nowait) {
+                if (unlikely(!lockSet.tryLock())) goto abort;
+            } else {
+                lockSet.lock();
+            }
+            if (unlikely(!lockSet.verify())) goto abort;
+            if (logBuf) logEpoch = logBuf->enterCommit();
+            lockSet.updateAndUnlock();
+            if (logBuf) logBuf->commit(logEpoch);
+            res.incCommit(isLongTx);
+            res.addRetryCount(isLongTx, retry);
+            break;
+        abort:
+            lockSet.clear();
+            if (logBuf) logBuf->discard();
+            res.incAbort(isLongTx);
+            if (shared.usesBackOff) backOff(t0, retry, rand);
+            // continue
+        }
+    }
+    return res;
+}
+
+
+struct TpccAccessor
+{
+    cybozu::occ::LockSet& lockSet;
+
+    INLINE bool read(DataWithPayload<Mutex>& rec, void *dst) {
+        lockSet.read(rec.value, rec.payload, dst);
+        return true;
+    }
+    INLINE bool readForUpdate(DataWithPayload<Mutex>& rec, void *dst) {
+        return read(rec, dst);
+    }
+    INLINE bool write(DataWithPayload<Mutex>& rec, void *src) {
+        lockSet.write(rec.value, rec.payload, src);
+        return true;
+    }
+};
+
+
+/**
+ * TPC-C subset workload.
+ * The home warehouse of each worker is determined by its index.
+ */
+template <bool nowait>
+Result1 worker5(size_t idx, uint8_t& ready, const bool& start, const bool& quit, bool& shouldQuit, Shared& shared)
+{
+    unused(shouldQuit);
+    cybozu::thread::setThreadAffinity(::pthread_self(), CpuId_[idx]);
+
+    auto& db = shared.tpcc;
+    Result1 res;
+    cybozu::util::Xoroshiro128Plus rand(::time(0), idx);
+    tpcc::InputGenerator<decltype(rand)> inputGen(rand, db.nrWh(), idx % db.nrWh());
+    tpcc::Input input;
+
+    cybozu::occ::LockSet lockSet;
+    lockSet.init(tpcc::ROW_SIZE, tpcc::MAX_OL_CNT * 3 + 5);
+    lockSet.setHotThreshold(shared.hotThreshold);
+    TpccAccessor acc{lockSet};
+
+    storeRelease(ready, 1);
+    while (!load_acquire(start)) _mm_pause();
+    while (!load_acquire(quit)) {
+        inputGen.generate(input);
+        uint64_t t0 = 0;
+        if (shared.usesBackOff) t0 = cybozu::time::rdtscp();
+        res.beginTx();
+        for (size_t retry = 0;; retry++) {
+            if (unlikely(load_acquire(quit))) break; // to quit under starvation.
+            assert(lockSet.empty());
+            if (unlikely(!tpcc::run(db, acc, input))) goto abort;
+
+            // commit phase.
+            if (nowait) {
+                if (unlikely(!lockSet.tryLock())) goto abort;
+            } else {
+                lockSet.lock();
+            }
+            if (unlikely(!lockSet.verify())) goto abort;
+            lockSet.updateAndUnlock();
+            res.incCommit(false);
+            res.addRetryCount(false, retry);
+            break;
+        abort:
+            lockSet.clear();
+            res.incAbort(false);
+            if (shared.usesBackOff) backOff(t0, retry, rand);
+            // continue
+        }
+    }
+    return res;
+}
+
+
 void runTest()
 {
 #if 0
@@ -285,16 +611,39 @@ struct CmdLineOptionPlus : CmdLineOption
     int usesBackOff; // 0 or 1.
     int usesRMW; // 0 or 1.
     int nowait; // 0 or 1.
+    size_t scanLen;
+    size_t insertWindow;
+    std::string logPath;
+    int odirect; // 0 or 1.
+    uint32_t hotThreshold;
+    int repair; // 0 or 1.
+    int silo; // 0 or 1.
+    size_t snapshotInterval; // [epochs].
 
     CmdLineOptionPlus(const std::string& description) : CmdLineOption(description) {
         appendOpt(&usesBackOff, 0, "backoff", "[0 or 1]: backoff (0:off, 1:on)");
         appendOpt(&usesRMW, 1, "rmw", "[0 or 1]: use read-modify-write or normal write (0:w, 1:rmw, default:1)");
         appendOpt(&nowait, 0, "nowait", "[0 or 1]: use nowait optimization.");
+        appendOpt(&scanLen, 10, "scan", "[num]: number of records of a range scan for scan workload (default:10).");
+        appendOpt(&insertWindow, 1000, "iwin", "[num]: number of live inserted records per worker for insert workload (default:1000).");
+        appendOpt(&logPath, "", "log", "[path]: redo log file for custom and scan workloads. empty means no logging (default).");
+        appendOpt(&odirect, 0, "odirect", "[0 or 1]: write the redo log with O_DIRECT (default:0).");
+        appendOpt(&hotThreshold, 0, "mocc", "[temperature]: lock records in the read phase if their temperature is >= this (MOCC). "
+                  "temperature is the number of recent verification failures. 0 means off (default:0).");
+        appendOpt(&repair, 0, "repair", "[0 or 1]: repair transactions instead of aborting on verification failure. "
+                  "stale reads are read again and only the writes derived from them are computed again (custom workload only, default:0).");
+        appendOpt(&silo, 0, "silo", "[0 or 1]: use epoch-based commit TIDs and read-only snapshots (custom workload only, default:0).");
+        appendOpt(&snapshotInterval, 10, "snapshot-interval", "[epochs]: snapshot epoch interval in silo mode. an epoch is 1ms (default:10).");
     }
     std::string str() const {
         return cybozu::util::formatString(
-            "mode:silo-occ %s backoff:%d rmw:%d nowait:%d"
-            , base::str().c_str(), usesBackOff ? 1 : 0, usesRMW ? 1 : 0, nowait ? 1 : 0);
+            "mode:silo-occ %s backoff:%d rmw:%d nowait:%d scanLen:%zu insertWindow:%zu log:%d odirect:%d "
+            "mocc:%u repair:%d silo:%d snapshotInterval:%zu"
+            , base::str().c_str(), usesBackOff ? 1 : 0, usesRMW ? 1 : 0, nowait ? 1 : 0
+            , workload == "scan" ? scanLen : 0
+            , workload == "insert" ? insertWindow : 0
+            , logPath.empty() ? 0 : 1, odirect ? 1 : 0
+            , hotThreshold, repair ? 1 : 0, silo ? 1 : 0, silo ? snapshotInterval : 0);
     }
 };
 
@@ -303,6 +652,7 @@ template <typename Opt>
 void initShared(Shared& shared, const Opt& opt)
 {
     initRecordVector(shared.recV, opt);
+    shared.scanLen = 0;
     shared.longTxSize = opt.longTxSize;
     shared.nrOp = opt.nrOp;
     shared.wrRatio = opt.wrRatio;
@@ -312,9 +662,13 @@ void initShared(Shared& shared, const Opt& opt)
     shared.usesBackOff = opt.usesBackOff ? 1 : 0;
     shared.usesRMW = opt.usesRMW ? 1 : 0;
     shared.nowait = opt.nowait ? 1 : 0;
+    shared.hotThreshold = opt.hotThreshold;
+    shared.repair = opt.repair != 0;
     shared.nrTh4LongTx = opt.nrTh4LongTx;
     shared.payload = opt.payload;
     shared.nrMuPerTh = opt.getNrMuPerTh();
+    shared.nrMu = opt.getNrMu();
+    shared.nrTh = opt.nrTh;
     shared.usesZipf = opt.usesZipf;
     shared.zipfTheta = opt.zipfTheta;
     if (opt.usesZipf) {
@@ -322,6 +676,40 @@ void initShared(Shared& shared, const Opt& opt)
     } else {
         shared.zipfZetan = 1.0;
     }
+    if (!opt.logPath.empty()) {
+        shared.logger.open(opt.logPath, opt.nrTh, opt.odirect != 0);
+    }
+}
+
+
+template <typename Opt>
+void initSiloShared(SiloShared& shared, const Opt& opt)
+{
+    initRecordVector(shared.recV, opt);
+    shared.tsAlloc.reset(new cybozu::occ::SiloLockSet::TimestampAllocator(
+                             shared.epochGen, opt.nrTh, opt.snapshotInterval));
+    shared.reclaimer.reset(new cybozu::ebr::EpochReclaimer(opt.nrTh));
+    shared.longTxSize = opt.longTxSize;
+    shared.nrOp = opt.nrOp;
+    shared.wrRatio = opt.wrRatio;
+    shared.nrWr4Long = opt.nrWr4Long;
+    shared.shortTxMode = TxMode(opt.shortTxMode);
+    shared.longTxMode = TxMode(opt.longTxMode);
+    shared.usesBackOff = opt.usesBackOff ? 1 : 0;
+    shared.usesRMW = opt.usesRMW ? 1 : 0;
+    shared.nowait = opt.nowait ? 1 : 0;
+    shared.nrTh4LongTx = opt.nrTh4LongTx;
+    shared.payload = opt.payload;
+    shared.usesZipf = opt.usesZipf;
+    shared.zipfTheta = opt.zipfTheta;
+    if (opt.usesZipf) {
+        shared.zipfZetan = FastZipf::zeta(opt.getNrMu(), shared.zipfTheta);
+    } else {
+        shared.zipfZetan = 1.0;
+    }
+    if (!opt.logPath.empty()) {
+        shared.logger.open(opt.logPath, opt.nrTh, opt.odirect != 0);
+    }
 }
 
 
@@ -335,6 +723,36 @@ void dispatch2(const CmdLineOptionPlus& opt, Shared& shared, Result1& res)
 }
 
 
+void dispatch6(const CmdLineOptionPlus& opt, SiloShared& shared, Result1& res)
+{
+    if (shared.nowait) {
+        runExec(opt, shared, worker6<1>, res);
+    } else {
+        runExec(opt, shared, worker6<0>, res);
+    }
+}
+
+
+void dispatch4(const CmdLineOptionPlus& opt, Shared& shared, Result1& res)
+{
+    if (shared.nowait) {
+        runExec(opt, shared, worker4<1>, res);
+    } else {
+        runExec(opt, shared, worker4<0>, res);
+    }
+}
+
+
+void dispatch5(const CmdLineOptionPlus& opt, Shared& shared, Result1& res)
+{
+    if (shared.nowait) {
+        runExec(opt, shared, worker5<1>, res);
+    } else {
+        runExec(opt, shared, worker5<0>, res);
+    }
+}
+
+
 void dispatch3(const CmdLineOptionPlus& opt, Shared& shared, Result1& res)
 {
     if (shared.nowait) {
@@ -355,12 +773,75 @@ int main(int argc, char *argv[]) try
     if (opt.payload != 0) throw cybozu::Exception("payload not supported");
 #endif
 
-    if (opt.workload == "custom") {
+    if (!opt.logPath.empty() && opt.workload != "custom" && opt.workload != "scan") {
+        throw cybozu::Exception("log is not supported by the workload.") << opt.workload;
+    }
+
+    if (opt.repair && opt.workload != "custom") {
+        throw cybozu::Exception("repair is not supported by the workload.") << opt.workload;
+    }
+    if (opt.repair && (!opt.logPath.empty() || opt.silo)) {
+        // Log records are staged before repair.
+        throw cybozu::Exception("repair is not supported with log or silo mode.");
+    }
+    if (opt.silo && opt.hotThreshold != 0) {
+        throw cybozu::Exception("mocc is not supported in silo mode.");
+    }
+    if (opt.silo && opt.workload != "custom") {
+        throw cybozu::Exception("silo mode is not supported by the workload.") << opt.workload;
+    }
+
+    if (opt.silo) {
+        SiloShared shared;
+        initSiloShared(shared, opt);
+        for (size_t i = 0; i < opt.nrLoop; i++) {
+            Result1 res;
+            dispatch6(opt, shared, res);
+            cybozu::wal::putLogStat(shared.logger);
+        }
+    } else if (opt.workload == "custom") {
         Shared shared;
         initShared(shared, opt);
         for (size_t i = 0; i < opt.nrLoop; i++) {
             Result1 res;
             dispatch2(opt, shared, res);
+            cybozu::wal::putLogStat(shared.logger);
+        }
+    } else if (opt.workload == "scan") {
+#ifdef USE_PARTITION
+        throw cybozu::Exception("scan workload does not support partition.");
+#endif
+        Shared shared;
+        initShared(shared, opt);
+        cybozu::index::build_index_from_vector(shared.index, shared.recV);
+        shared.scanLen = opt.scanLen;
+        for (size_t i = 0; i < opt.nrLoop; i++) {
+            Result1 res;
+            dispatch2(opt, shared, res);
+            cybozu::wal::putLogStat(shared.logger);
+        }
+    } else if (opt.workload == "insert") {
+        for (size_t i = 0; i < opt.nrLoop; i++) {
+            // Inserted keys must not remain in the next loop.
+            Shared shared;
+            initShared(shared, opt);
+            cybozu::record::initRecordTable(shared.table, opt);
+            shared.reclaimer.reset(new cybozu::ebr::EpochReclaimer(opt.nrTh));
+            shared.insertWindow = opt.insertWindow;
+            Result1 res;
+            dispatch4(opt, shared, res);
+        }
+    } else if (opt.workload == "tpcc") {
+#ifdef NO_PAYLOAD
+        throw cybozu::Exception("tpcc workload requires payload.");
+#endif
+        Shared shared;
+        initShared(shared, opt);
+        cybozu::util::Xoroshiro128Plus rand(::time(0));
+        shared.tpcc.init(opt.nrTh, rand, getReplicaNumaNodes(opt)); // a warehouse per worker.
+        for (size_t i = 0; i < opt.nrLoop; i++) {
+            Result1 res;
+            dispatch5(opt, shared, res);
         }
     } else if (opt.workload == "local") {
         Shared shared;
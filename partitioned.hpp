@@ -6,6 +6,7 @@
 #include "vector_payload.hpp"
 #include "arch.hpp"
 #include "div.hpp"
+#include "numa.hpp"
 
 
 template <typename T>
@@ -21,8 +22,13 @@ class PartitionedVectorWithPayload
     size_t payloadSize_;
     size_t alignmentSize_;
     size_t totalSize_;
+    cybozu::numa::Policy numaPolicy_;
+    std::vector<uint> numaNodes_; // numa node of each partition.
+    cybozu::hugepage::Mode hugePageMode_;
 public:
-    PartitionedVectorWithPayload() = default;
+    PartitionedVectorWithPayload()
+        : numaPolicy_(cybozu::numa::Policy::NONE), hugePageMode_(cybozu::hugepage::Mode::OFF) {
+    }
     void setSizes(size_t nrNode, size_t sizePerNode, size_t payloadSize, size_t alignmentSize = sizeof(uintptr_t)) {
         vv_.resize(nrNode);
         nrNode_ = nrNode;
@@ -31,6 +37,21 @@ public:
         alignmentSize_ = alignmentSize;
         totalSize_ = nrNode * sizePerNode;
     }
+    /*
+     * nodes: numa node of each partition.
+     * Without calling this, partitions rely on first touch.
+     */
+    void setNumaPolicy(cybozu::numa::Policy policy, const std::vector<uint>& nodes) {
+        if (nodes.size() != vv_.size()) {
+            throw cybozu::Exception("PartitionedVectorWithPayload::setNumaPolicy: bad nodes size")
+                << nodes.size() << vv_.size();
+        }
+        numaPolicy_ = policy;
+        numaNodes_ = nodes;
+    }
+    void setHugePageMode(cybozu::hugepage::Mode mode) {
+        hugePageMode_ = mode;
+    }
     /*
      * Each worker thread must call this to allocate memory
      * at its appropriate numa node.
@@ -41,11 +62,30 @@ public:
         VecPtr& v = vv_[nodeId];
         // This will be reused.
         if (!v) {
+            using namespace cybozu::numa;
+            std::unique_ptr<MemPolicyScope> scope;
+            if (numaPolicy_ == Policy::INTERLEAVE) {
+                scope.reset(new MemPolicyScope(MPOL_INTERLEAVE, NodeMask(uniqueNodes(numaNodes_))));
+            } else if (numaPolicy_ == Policy::LOCAL || numaPolicy_ == Policy::REPLICATE) {
+                scope.reset(new MemPolicyScope(numaNodes_[nodeId]));
+            }
             v.reset(new Vec());
+            v->setHugePageMode(hugePageMode_);
             v->setPayloadSize(payloadSize_, alignmentSize_);
             v->resize(sizePerNode_);
         }
     }
+    /*
+     * Smallest page size granted to the allocated partitions.
+     */
+    size_t pageSize() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        size_t size = 0;
+        for (const VecPtr& v : vv_) {
+            if (v && (size == 0 || v->pageSize() < size)) size = v->pageSize();
+        }
+        return size == 0 ? cybozu::hugepage::basePageSize() : size;
+    }
     DataWithPayload<T>& operator[](size_t pos) {
         size_t nodeId, posInNode;
         getRealPos(pos, nodeId, posInNode);
@@ -61,8 +101,8 @@ public:
         return (*v)[posInNode];
     }
     size_t size() const {
-        assert(nrNode_ = vv_.size());
-        assert(nrNode * sizePerNode_ == totalSize_);
+        assert(nrNode_ == vv_.size());
+        assert(nrNode_ * sizePerNode_ == totalSize_);
         return totalSize_;
     }
 
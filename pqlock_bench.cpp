@@ -12,7 +12,7 @@
 
 enum class LockType : uint8_t
 {
-    PQSpin, PQPosix, PQMcs1, PQMcs2, PQMcs3, PQ1993, PQ1997,
+    PQSpin, PQPosix, PQMcs1, PQMcs2, PQMcs3, PQ1993, PQ1997, PQBucket,
 };
 
 
@@ -26,6 +26,7 @@ const char *getPQLockName(LockType lkType)
         {LockType::PQMcs3,  "pqmcs3"},
         {LockType::PQ1993,  "pq1993"},
         {LockType::PQ1997,  "pq1997"},
+        {LockType::PQBucket, "pqbucket"},
     };
     const size_t nr = sizeof(table) / sizeof(table[0]);
 
@@ -39,6 +40,67 @@ const char *getPQLockName(LockType lkType)
 const std::vector<uint> CpuId_ = getCpuIdList(CpuAffinityMode::CORE);
 
 
+/**
+ * Priorities are divided into classes by their top bits.
+ * Class 0 is the most prior.
+ */
+constexpr size_t PRI_CLASS_BITS = 2;
+constexpr size_t NR_PRI_CLASSES = size_t(1) << PRI_CLASS_BITS;
+
+INLINE size_t getPriClass(uint32_t pri)
+{
+    return pri >> (32 - PRI_CLASS_BITS);
+}
+
+
+/**
+ * Wait time, hold time, and priority inversions of each lock acquisition.
+ * Priority inversion: a more prior requester is waiting when a lock is acquired.
+ * The hold time includes the check of the inversion.
+ */
+struct LockStat
+{
+    Histogram waitH[NR_PRI_CLASSES];
+    Histogram holdH;
+    size_t nrInversion;
+
+    LockStat() : waitH(), holdH(), nrInversion(0) {}
+    void operator+=(const LockStat& rhs) {
+        for (size_t i = 0; i < NR_PRI_CLASSES; i++) waitH[i].merge(rhs.waitH[i]);
+        holdH.merge(rhs.holdH);
+        nrInversion += rhs.nrInversion;
+    }
+    /**
+     * clkPerUs: rdtscp clocks per microsecond.
+     */
+    std::string str(double clkPerUs) const {
+        std::string s;
+        for (size_t i = 0; i < NR_PRI_CLASSES; i++) {
+            const Histogram& h = waitH[i];
+            s += cybozu::util::formatString(
+                " wait%zu_n:%" PRIu64 " wait%zu_p50:%.2f wait%zu_p99:%.2f wait%zu_max:%.2f"
+                , i, h.count
+                , i, h.percentile(0.50) / clkPerUs
+                , i, h.percentile(0.99) / clkPerUs
+                , i, h.max / clkPerUs);
+        }
+        s += cybozu::util::formatString(
+            " hold_p50:%.2f hold_p99:%.2f hold_max:%.2f inversion:%zu"
+            , holdH.percentile(0.50) / clkPerUs
+            , holdH.percentile(0.99) / clkPerUs
+            , holdH.max / clkPerUs
+            , nrInversion);
+        return s;
+    }
+    void putHistograms(std::ostream& os) const {
+        for (size_t i = 0; i < NR_PRI_CLASSES; i++) {
+            os << "WAIT_HISTOGRAM_" << i << "\n" << waitH[i];
+        }
+        os << "HOLD_HISTOGRAM\n" << holdH;
+    }
+};
+
+
 struct Resource
 {
     struct CacheLine {
@@ -58,7 +120,7 @@ struct Resource
 
 template <typename PQLock, typename TxIdGen>
 size_t worker(size_t idx, bool& start, bool& quit, std::vector<typename PQLock::Mutex>& muV,
-              std::vector<Resource>& resV, TxIdGen& txIdGen)
+              std::vector<Resource>& resV, TxIdGen& txIdGen, LockStat& stat)
 {
     cybozu::thread::setThreadAffinity(::pthread_self(), CpuId_[idx]);
     cybozu::util::Xoroshiro128Plus rand(::time(0), idx);
@@ -88,6 +150,7 @@ size_t worker(size_t idx, bool& start, bool& quit, std::vector<typename PQLock::
         const uint32_t txId = rand();
 #endif
 
+        const uint64_t t0 = cybozu::time::rdtscp();
 #if 0
         for (size_t i = 0; i < muIdV.size(); i++) {
             lockV.emplace_back();
@@ -95,6 +158,8 @@ size_t worker(size_t idx, bool& start, bool& quit, std::vector<typename PQLock::
         }
 #else
         PQLock lk0(&muV[muIdV[0]], txId);
+        const uint64_t t1 = cybozu::time::rdtscp();
+        if (lk0.getTopPriorityInWaitQueue() < txId) stat.nrInversion++;
 #if 0
         PQLock lk1(&muV[muIdV[1]], txId);
         PQLock lk2(&muV[muIdV[2]], txId);
@@ -116,6 +181,9 @@ size_t worker(size_t idx, bool& start, bool& quit, std::vector<typename PQLock::
 #endif
 
         c++;
+        const uint64_t t2 = cybozu::time::rdtscp();
+        stat.waitH[getPriClass(txId)].add(t1 - t0);
+        stat.holdH.add(t2 - t1);
 #if 0
         lockV.clear();
 #else
@@ -141,6 +209,7 @@ void runExecT(size_t nrRes, size_t nrTh, size_t runSec, bool verbose, LockType l
     bool start = false, quit = false;
     cybozu::thread::ThreadRunnerSet thS;
     std::vector<size_t> cV(nrTh);
+    std::vector<LockStat> statV(nrTh);
     for (size_t i = 0; i < nrTh; i++) {
         thS.add([&,i]() {
 #if 1
@@ -148,18 +217,22 @@ void runExecT(size_t nrRes, size_t nrTh, size_t runSec, bool verbose, LockType l
 #else
             SimpleTxIdGenerator &localGen = txIdGen;
 #endif
-            cV[i] = worker<PQLock>(i, start, quit, muV, resV, localGen);
+            cV[i] = worker<PQLock>(i, start, quit, muV, resV, localGen, statV[i]);
         });
     }
     thS.start();
+    const uint64_t beginClk = cybozu::time::rdtscp();
+    const auto beginTime = std::chrono::steady_clock::now();
     start = true;
     for (size_t i = 0; i < runSec; i++) {
         if (verbose) {
-            ::printf("%zu %u\n", i, txIdGen.sniff());
+            ::printf("%zu %" PRIu64 "\n", i, uint64_t(txIdGen.sniff()));
         }
         sleep_ms(1000);
     }
     quit = true;
+    const uint64_t endClk = cybozu::time::rdtscp();
+    const auto endTime = std::chrono::steady_clock::now();
     thS.join();
 #if 0
     size_t dummyAlloc = 0, dummyFree = 0;
@@ -170,14 +243,19 @@ void runExecT(size_t nrRes, size_t nrTh, size_t runSec, bool verbose, LockType l
     ::printf("total dummy alloc %zu free %zu\n", dummyAlloc, dummyFree);
 #endif
     size_t total = 0;
+    LockStat stat;
     for (size_t i = 0; i < nrTh; i++) {
         if (verbose) {
             ::printf("worker %zu count %zu\n", i, cV[i]);
         }
         total += cV[i];
+        stat += statV[i];
     }
-    ::printf("mode:%s  mutex:%zu  concurrency:%zu  ops:%.03f  total:%zu\n"
-             , getPQLockName(lkType), nrRes, nrTh, total / (double)runSec, total);
+    const double us = std::chrono::duration<double, std::micro>(endTime - beginTime).count();
+    ::printf("mode:%s  mutex:%zu  concurrency:%zu  ops:%.03f  total:%zu%s\n"
+             , getPQLockName(lkType), nrRes, nrTh, total / (double)runSec, total
+             , stat.str((endClk - beginClk) / us).c_str());
+    if (verbose) stat.putHistograms(std::cout);
     ::fflush(::stdout);
 }
 
@@ -206,6 +284,9 @@ void runExec(size_t nrRes, size_t nrTh, size_t runSec, bool verbose, LockType lk
     case LockType::PQ1997:
         runExecT<cybozu::lock::PQ1997Lock>(nrRes, nrTh, runSec, verbose, lkType);
         break;
+    case LockType::PQBucket:
+        runExecT<cybozu::lock::PQBucketLock>(nrRes, nrTh, runSec, verbose, lkType);
+        break;
     default:
         throw std::runtime_error("no such lock type.");
     }
@@ -223,7 +304,7 @@ int main() try
 {
 #if 1
     const std::vector<LockType> lkTypeV = {
-        //LockType::PQSpin, LockType::PQPosix, LockType::PQMcs1, LockType::PQMcs2, LockType::PQMcs3, LockType::PQ1993, LockType::PQ1997,
+        //LockType::PQSpin, LockType::PQPosix, LockType::PQMcs1, LockType::PQMcs2, LockType::PQMcs3, LockType::PQ1993, LockType::PQ1997, LockType::PQBucket,
         LockType::PQMcs3,
     };
     const std::vector<size_t> nrResV = {
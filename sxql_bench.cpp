@@ -0,0 +1,349 @@
+#include <unistd.h>
+#include <cstring>
+#include "thread_util.hpp"
+#include "random.hpp"
+#include "cpuid.hpp"
+#include "measure_util.hpp"
+#include "lock.hpp"
+#include "sxql.hpp"
+#include "allocator.hpp"
+#include "arch.hpp"
+#include "vector_payload.hpp"
+#include "cache_line_size.hpp"
+#include "zipf.hpp"
+#include "workload_util.hpp"
+
+
+#ifdef USE_PARTITION
+#include "partitioned.hpp"
+#endif
+
+
+std::vector<uint> CpuId_;
+
+
+/**
+ * Record lock operations.
+ * SXQLock takes the mutex pointer while XSLock takes the reference.
+ */
+INLINE void lockRecord(cybozu::lock::SXQLock& lk, cybozu::lock::SXQLock::Mutex& mutex, cybozu::lock::SXQLock::Mode mode)
+{
+    lk.lock(&mutex, mode);
+}
+INLINE bool tryLockRecord(cybozu::lock::SXQLock& lk, cybozu::lock::SXQLock::Mutex& mutex, cybozu::lock::SXQLock::Mode mode)
+{
+    return lk.tryLock(&mutex, mode);
+}
+INLINE void lockRecord(cybozu::lock::XSLock& lk, cybozu::lock::XSMutex& mutex, cybozu::lock::XSLock::Mode mode)
+{
+    lk.lock(mutex, mode);
+}
+INLINE bool tryLockRecord(cybozu::lock::XSLock& lk, cybozu::lock::XSMutex& mutex, cybozu::lock::XSLock::Mode mode)
+{
+    return lk.tryLock(mutex, mode);
+}
+
+
+/**
+ * 2PL lock set.
+ * Lock objects are pooled per thread and reused by all the transactions,
+ * so the queue nodes of SXQLock are allocated only at initialization.
+ * Writes are deferred to the commit and just overwrite the records with the local value.
+ */
+template <typename Lock>
+class TxLockSet
+{
+public:
+    using Mutex = typename Lock::Mutex;
+    using Mode = typename Lock::Mode;
+private:
+    std::vector<Lock> lockV_; // pool.
+    size_t nrLocks_; // lockV_[0, nrLocks_) are locked.
+    SingleThreadUnorderedMap<uintptr_t, size_t> index_; // mutex address --> index in lockV_. used by no-wait.
+    std::vector<void*> writeV_; // payload addresses to write.
+    size_t payload_;
+public:
+    TxLockSet() : lockV_(), nrLocks_(0), index_(), writeV_(), payload_(0) {}
+
+    void init(size_t payload, size_t nrOp) {
+        payload_ = payload;
+        lockV_.resize(nrOp);
+        writeV_.reserve(nrOp);
+    }
+    bool empty() const { return nrLocks_ == 0 && writeV_.empty(); }
+
+    /**
+     * No-wait acquisition: a lock failure requires abort.
+     */
+    INLINE bool tryLock(Mutex& mutex, Mode mode) {
+        std::pair<decltype(index_.begin()), bool> ret = index_.emplace(uintptr_t(&mutex), nrLocks_);
+        if (ret.second) {
+            if (unlikely(!tryLockRecord(allocLock(), mutex, mode))) {
+                index_.erase(ret.first);
+                nrLocks_--;
+                return false;
+            }
+            return true;
+        }
+        Lock& lk = lockV_[ret.first->second];
+        if (mode == Mode::X && lk.mode() == Mode::S) return lk.tryUpgrade();
+        return true;
+    }
+    /**
+     * Ordered acquisition: call this in the mutex order without duplication.
+     */
+    INLINE void lock(Mutex& mutex, Mode mode) {
+        lockRecord(allocLock(), mutex, mode);
+    }
+    /**
+     * Call these with the corresponding lock.
+     */
+    INLINE void read(const void *payload, void *dst) {
+        copyValue(dst, payload);
+    }
+    INLINE void write(void *payload) {
+        writeV_.push_back(payload);
+    }
+    INLINE void updateAndUnlock(const void *src) {
+        for (void *payload : writeV_) copyValue(payload, src);
+        unlock();
+    }
+    INLINE void unlock() {
+        for (size_t i = 0; i < nrLocks_; i++) lockV_[i].unlock();
+        nrLocks_ = 0;
+        index_.clear();
+        writeV_.clear();
+    }
+private:
+    INLINE Lock& allocLock() {
+        assert(nrLocks_ < lockV_.size()); // records in a transaction are at most nrOp.
+        return lockV_[nrLocks_++];
+    }
+    INLINE void copyValue(void *dst, const void *src) {
+#ifndef NO_PAYLOAD
+        ::memcpy(dst, src, payload_);
+#else
+        unused(dst); unused(src);
+#endif
+    }
+};
+
+
+enum class AcqMode : uint8_t
+{
+    NO_WAIT = 0, // in the access order without waiting.
+    ORDERED = 1, // in the key order with waiting after sorting the whole access plan.
+};
+
+
+template <typename Lock>
+struct Shared
+{
+    using Mutex = typename Lock::Mutex;
+#ifdef USE_PARTITION
+    PartitionedVectorWithPayload<Mutex> recV;
+#else
+    VectorWithPayload<Mutex> recV;
+#endif
+    size_t longTxSize;
+    size_t nrOp;
+    double wrRatio;
+    size_t nrWr4Long;
+    TxMode shortTxMode;
+    TxMode longTxMode;
+    size_t nrTh4LongTx;
+    size_t payload;
+    bool usesRMW;
+    bool usesBackOff;
+    AcqMode acqMode;
+    bool usesZipf;
+    double zipfTheta;
+    double zipfZetan;
+};
+
+
+template <typename Lock>
+Result1 worker(size_t idx, uint8_t& ready, const bool& start, const bool& quit, bool& shouldQuit, Shared<Lock>& shared)
+{
+    using Mode = typename Lock::Mode;
+
+    unused(shouldQuit);
+    cybozu::thread::setThreadAffinity(::pthread_self(), CpuId_[idx]);
+
+    auto& recV = shared.recV;
+#ifdef USE_PARTITION
+    recV.allocate(idx);
+    recV.checkAndWait();
+#endif
+    const size_t longTxSize = shared.longTxSize;
+    const size_t wrRatio = size_t(shared.wrRatio * (double)SIZE_MAX);
+    const TxMode shortTxMode = shared.shortTxMode;
+    const TxMode longTxMode = shared.longTxMode;
+    const bool isOrdered = shared.acqMode == AcqMode::ORDERED;
+
+    Result1 res;
+    cybozu::util::Xoroshiro128Plus rand(::time(0), idx);
+    FastZipf fastZipf(rand, shared.zipfTheta, recV.size(), shared.zipfZetan);
+
+    TxLockSet<Lock> lockSet;
+    std::vector<uint8_t> value(shared.payload);
+
+    const bool isLongTx = longTxSize != 0 && idx < shared.nrTh4LongTx; // starvation setting.
+    const size_t realNrOp = isLongTx ? longTxSize : shared.nrOp;
+    auto getMode = selectGetModeFunc<decltype(rand), Mode>(isLongTx, shortTxMode, longTxMode);
+    auto getRecordIdx = selectGetRecordIdx<decltype(rand)>(isLongTx, shortTxMode, longTxMode, shared.usesZipf);
+    AccessInfoVec aiV(realNrOp);
+    lockSet.init(shared.payload, realNrOp);
+
+    store_release(ready, 1);
+    while (!load_acquire(start)) _mm_pause();
+    while (!load_acquire(quit)) {
+        // The whole access plan is fixed before the first trial.
+        fillAccessInfoVec(rand, fastZipf, getMode, getRecordIdx, recV.size(), wrRatio, aiV);
+        if (isOrdered) std::sort(aiV.begin(), aiV.end());
+
+        uint64_t t0 = -1, t1 = -1;
+        res.beginTx();
+        log_timestamp_if_necessary_on_tx_start(t0, shared.usesBackOff);
+        for (size_t retry = 0;; retry++) {
+            if (unlikely(load_acquire(quit))) break; // to quit under starvation.
+            assert(lockSet.empty());
+            log_timestamp_if_necessary_on_trial_start(t0, t1, retry, shared.usesBackOff);
+            if (isOrdered) {
+                // Accesses to the same record are adjacent in aiV.
+                // The lock mode is X if one of them is a write.
+                for (size_t i = 0; i < aiV.size();) {
+                    const size_t key = aiV[i].key;
+                    bool isWrite = false;
+                    size_t j = i;
+                    for (; j < aiV.size() && aiV[j].key == key; j++) isWrite |= aiV[j].is_write;
+                    lockSet.lock(recV[key].value, isWrite ? Mode::X : Mode::S);
+                    i = j;
+                }
+            }
+            for (const AccessInfo& ai : aiV) {
+                auto& item = recV[ai.key];
+                const Mode mode = ai.is_write ? Mode::X : Mode::S;
+                if (!isOrdered && unlikely(!lockSet.tryLock(item.value, mode))) goto abort;
+                if (mode == Mode::S || shared.usesRMW) {
+                    lockSet.read(item.payload, &value[0]);
+                }
+                if (mode == Mode::X) {
+                    lockSet.write(item.payload);
+                }
+            }
+            lockSet.updateAndUnlock(&value[0]);
+            res.incCommit(isLongTx);
+            res.addRetryCount(isLongTx, retry);
+            break; // retry is not required.
+
+          abort:
+            assert(!isOrdered);
+            lockSet.unlock();
+            res.incAbort(isLongTx);
+            if (shared.usesBackOff) backOff(t0, retry, rand);
+            // continue
+        }
+    }
+    return res;
+}
+
+
+struct CmdLineOptionPlus : CmdLineOption
+{
+    using base = CmdLineOption;
+
+    int lockType;
+    int acqMode;
+    int usesRMW; // 0 or 1.
+    int usesBackOff; // 0 or 1.
+
+    CmdLineOptionPlus(const std::string& description) : CmdLineOption(description) {
+        appendOpt(&lockType, 0, "lock", "[id]: record lock type (0:sxql, 1:xs, default:0)");
+        appendOpt(&acqMode, 0, "acq", "[id]: lock acquisition (0:no-wait, 1:ordered(sorted access plan with waiting), default:0)");
+        appendOpt(&usesRMW, 1, "rmw", "[0 or 1]: use read-modify-write or normal write 0:w 1:rmw (default: 1)");
+        appendOpt(&usesBackOff, 0, "backoff", "[0 or 1]: backoff on abort (no-wait only) 0:off 1:on");
+    }
+    std::string str() const {
+        return cybozu::util::formatString(
+            "mode:sxql %s lock:%s acq:%s rmw:%d backoff:%d"
+            , base::str().c_str()
+            , lockType == USE_SXQL ? "sxql" : "xs"
+            , acqMode == int(AcqMode::ORDERED) ? "ordered" : "no-wait"
+            , usesRMW ? 1 : 0, usesBackOff ? 1 : 0);
+    }
+
+    enum : int {
+        USE_SXQL = 0,
+        USE_XS = 1,
+    };
+};
+
+
+template <typename Lock>
+void dispatch1(const CmdLineOptionPlus& opt)
+{
+    Shared<Lock> shared;
+    initRecordVector(shared.recV, opt);
+    shared.longTxSize = opt.longTxSize;
+    shared.nrOp = opt.nrOp;
+    shared.wrRatio = opt.wrRatio;
+    shared.nrWr4Long = opt.nrWr4Long;
+    shared.shortTxMode = TxMode(opt.shortTxMode);
+    shared.longTxMode = TxMode(opt.longTxMode);
+    shared.nrTh4LongTx = opt.nrTh4LongTx;
+    shared.payload = opt.payload;
+    shared.usesRMW = opt.usesRMW != 0;
+    shared.usesBackOff = opt.usesBackOff != 0;
+    shared.acqMode = AcqMode(opt.acqMode);
+    shared.usesZipf = opt.usesZipf;
+    shared.zipfTheta = opt.zipfTheta;
+    if (shared.usesZipf) {
+        shared.zipfZetan = FastZipf::zeta(opt.getNrMu(), shared.zipfTheta);
+    } else {
+        shared.zipfZetan = 1.0;
+    }
+    for (size_t i = 0; i < opt.nrLoop; i++) {
+        Result1 res;
+        runExec(opt, shared, worker<Lock>, res);
+    }
+}
+
+
+void dispatch0(const CmdLineOptionPlus& opt)
+{
+    switch (opt.lockType) {
+    case CmdLineOptionPlus::USE_SXQL:
+        dispatch1<cybozu::lock::SXQLock>(opt);
+        break;
+    case CmdLineOptionPlus::USE_XS:
+        dispatch1<cybozu::lock::XSLock>(opt);
+        break;
+    default:
+        throw cybozu::Exception("bad lockType") << opt.lockType;
+    }
+}
+
+
+int main(int argc, char *argv[]) try
+{
+    CmdLineOptionPlus opt("sxql_bench: benchmark with 2PL using SXQL (shared exclusive queuing lock).");
+    opt.parse(argc, argv);
+    setCpuAffinityModeVec(opt.amode, CpuId_);
+
+#ifdef NO_PAYLOAD
+    if (opt.payload != 0) throw cybozu::Exception("payload not supported");
+#endif
+    if (opt.acqMode != int(AcqMode::NO_WAIT) && opt.acqMode != int(AcqMode::ORDERED)) {
+        throw cybozu::Exception("bad acqMode") << opt.acqMode;
+    }
+    if (opt.workload != "custom") {
+        throw cybozu::Exception("bad workload.") << opt.workload;
+    }
+    dispatch0(opt);
+
+} catch (std::exception& e) {
+    ::fprintf(::stderr, "exeption: %s\n", e.what());
+} catch (...) {
+    ::fprintf(::stderr, "unknown error\n");
+}
@@ -0,0 +1,235 @@
+#include <cstring>
+#include "bamboo.hpp"
+#include "nowait.hpp"
+#include "wait_die.hpp"
+#include "vector_payload.hpp"
+#include "tx_util.hpp"
+#include "transfer_test_util.hpp"
+#include "cybozu/test.hpp"
+
+
+using namespace cybozu::bamboo;
+
+
+CYBOZU_TEST_AUTO(retire_chain_test)
+{
+    uint64_t val = 10;
+    RetireChain chain(&val, sizeof(val));
+    WoundFlag f1, f2;
+    Tx t1{1, &f1}, t2{2, &f2};
+    uint64_t v1, v2;
+
+    CYBOZU_TEST_EQUAL(chain.tryAcquire(t1, &v1), RetireChain::ACQUIRED);
+    CYBOZU_TEST_EQUAL(v1, 10);
+    CYBOZU_TEST_EQUAL(chain.tryAcquire(t2, &v2), RetireChain::BUSY);
+
+    // t2 reads the dirty value after t1 retires.
+    v1++;
+    CYBOZU_TEST_ASSERT(chain.retire(t1, &v1));
+    CYBOZU_TEST_EQUAL(val, 11);
+    // t1 can write again while no one follows it.
+    CYBOZU_TEST_ASSERT(chain.tryReacquire(t1));
+    CYBOZU_TEST_EQUAL(chain.tryAcquire(t2, &v2), RetireChain::BUSY);
+    CYBOZU_TEST_ASSERT(chain.retire(t1, &v1));
+    CYBOZU_TEST_EQUAL(chain.tryAcquire(t2, &v2), RetireChain::ACQUIRED);
+    CYBOZU_TEST_EQUAL(v2, 11);
+    CYBOZU_TEST_ASSERT(!chain.tryReacquire(t1));
+    CYBOZU_TEST_ASSERT(chain.retire(t2, nullptr));
+    CYBOZU_TEST_ASSERT(!chain.tryMarkCommitting(t2)); // t1 is the head.
+
+    // t2 aborts in a cascade.
+    chain.abort(t1);
+    CYBOZU_TEST_EQUAL(val, 10);
+    CYBOZU_TEST_ASSERT(f2.is_wounded());
+    CYBOZU_TEST_ASSERT(!chain.retire(t2, nullptr));
+    chain.abort(t2); // nothing to do.
+    f2.reset();
+
+    // The older one wounds the younger one to append itself.
+    CYBOZU_TEST_EQUAL(chain.tryAcquire(t2, &v2), RetireChain::ACQUIRED);
+    v2 = 20;
+    CYBOZU_TEST_ASSERT(chain.retire(t2, &v2));
+    CYBOZU_TEST_EQUAL(chain.tryAcquire(t1, &v1), RetireChain::ACQUIRED);
+    CYBOZU_TEST_EQUAL(v1, 10);
+    CYBOZU_TEST_ASSERT(f2.is_wounded());
+    CYBOZU_TEST_ASSERT(!f1.is_wounded());
+    CYBOZU_TEST_ASSERT(chain.retire(t1, nullptr));
+    CYBOZU_TEST_ASSERT(chain.waitForHead(t1));
+    CYBOZU_TEST_ASSERT(chain.tryMarkCommitting(t1));
+    chain.commit(t1);
+    CYBOZU_TEST_EQUAL(val, 10);
+
+    // A committing one is not wounded.
+    f1.reset(); f2.reset();
+    CYBOZU_TEST_EQUAL(chain.tryAcquire(t2, &v2), RetireChain::ACQUIRED);
+    CYBOZU_TEST_ASSERT(chain.retire(t2, nullptr));
+    CYBOZU_TEST_ASSERT(chain.tryMarkCommitting(t2));
+    CYBOZU_TEST_EQUAL(chain.tryAcquire(t1, &v1), RetireChain::ACQUIRED);
+    CYBOZU_TEST_ASSERT(!f2.is_wounded());
+    chain.commit(t2);
+    CYBOZU_TEST_ASSERT(chain.retire(t1, nullptr));
+    CYBOZU_TEST_ASSERT(chain.tryMarkCommitting(t1));
+    chain.commit(t1);
+}
+
+
+/**
+ * Retirement and cascading aborts through lock sets.
+ */
+template <typename LockSet>
+void testRetire()
+{
+    using Mutex = typename LockSet::Mutex;
+    VectorWithPayload<Mutex> recV;
+    initTransferRecords(recV, 1);
+    auto& item = recV[0];
+    auto loadValue = [&]() {
+        uint64_t v;
+        ::memcpy(&v, item.payload, sizeof(uint64_t));
+        return v;
+    };
+    RetireTable table;
+    table.initOnce(recV, 1, sizeof(uint64_t));
+    LockSet t1, t2;
+    t1.init(sizeof(uint64_t), 1);
+    t1.setRetireTable(table);
+    t2.init(sizeof(uint64_t), 1);
+    t2.setRetireTable(table);
+    uint64_t v1, v2;
+
+    // t2 reads the value t1 has written but not committed yet.
+    t1.setTxId(1);
+    t2.setTxId(2);
+    CYBOZU_TEST_ASSERT(t1.readForUpdate(item.value, item.payload, &v1));
+    v1++;
+    CYBOZU_TEST_ASSERT(t1.write(item.value, item.payload, &v1));
+    CYBOZU_TEST_EQUAL(loadValue(), TRANSFER_INITIAL_VALUE + 1);
+    CYBOZU_TEST_ASSERT(t2.readForUpdate(item.value, item.payload, &v2));
+    CYBOZU_TEST_EQUAL(v2, TRANSFER_INITIAL_VALUE + 1);
+
+    // t1 aborts, so does t2 in a cascade.
+    t1.unlock();
+    CYBOZU_TEST_EQUAL(loadValue(), TRANSFER_INITIAL_VALUE);
+    v2++;
+    CYBOZU_TEST_ASSERT(!t2.write(item.value, item.payload, &v2));
+    t2.unlock();
+    CYBOZU_TEST_ASSERT(t1.empty());
+    CYBOZU_TEST_ASSERT(t2.empty());
+
+    // The retry of t2 commits after t1 commits.
+    CYBOZU_TEST_ASSERT(t1.readForUpdate(item.value, item.payload, &v1));
+    v1++;
+    CYBOZU_TEST_ASSERT(t1.write(item.value, item.payload, &v1));
+    CYBOZU_TEST_ASSERT(t2.readForUpdate(item.value, item.payload, &v2));
+    v2++;
+    CYBOZU_TEST_ASSERT(t2.write(item.value, item.payload, &v2));
+    CYBOZU_TEST_ASSERT(t1.blindWriteLockAll());
+    t1.updateAndUnlock();
+    CYBOZU_TEST_ASSERT(t2.blindWriteLockAll());
+    t2.updateAndUnlock();
+    CYBOZU_TEST_EQUAL(loadValue(), TRANSFER_INITIAL_VALUE + 2);
+
+    // An older transaction wounds the younger one ahead of it in the chain.
+    t1.setTxId(4);
+    t2.setTxId(3);
+    CYBOZU_TEST_ASSERT(t1.readForUpdate(item.value, item.payload, &v1));
+    v1++;
+    CYBOZU_TEST_ASSERT(t1.write(item.value, item.payload, &v1));
+    CYBOZU_TEST_ASSERT(t2.readForUpdate(item.value, item.payload, &v2));
+    CYBOZU_TEST_EQUAL(v2, TRANSFER_INITIAL_VALUE + 2);
+    CYBOZU_TEST_ASSERT(!t1.blindWriteLockAll());
+    t1.unlock();
+    CYBOZU_TEST_ASSERT(t2.blindWriteLockAll());
+    t2.updateAndUnlock();
+    CYBOZU_TEST_EQUAL(loadValue(), TRANSFER_INITIAL_VALUE + 2);
+    CYBOZU_TEST_ASSERT(t1.empty());
+    CYBOZU_TEST_ASSERT(t2.empty());
+}
+
+
+CYBOZU_TEST_AUTO(nowait_retire_cascade_test)
+{
+    testRetire<cybozu::lock::NoWaitLockSet>();
+}
+
+
+CYBOZU_TEST_AUTO(wound_wait_retire_cascade_test)
+{
+    testRetire<cybozu::wait_die::LockSet<cybozu::wait_die::WoundWaitLock4> >();
+}
+
+
+struct Shared
+{
+    RetireTable table;
+    SimpleTxIdGenerator txIdGen;
+};
+
+
+template <typename LockSet>
+struct Worker
+{
+    using Mutex = typename LockSet::Mutex;
+
+    Shared& shared;
+    LockSet lockSet;
+
+    Worker(Shared& shared0, size_t) : shared(shared0), lockSet() {
+        lockSet.init(sizeof(uint64_t), 5);
+        lockSet.setRetireTable(shared.table);
+    }
+    void beginTx() { lockSet.setTxId(shared.txIdGen.get()); }
+    void begin(bool) {}
+    bool read(Mutex& mutex, void *sharedVal, uint64_t& v) { return lockSet.read(mutex, sharedVal, &v); }
+    bool readForUpdate(Mutex& mutex, void *sharedVal, uint64_t& v) {
+        return lockSet.readForUpdate(mutex, sharedVal, &v);
+    }
+    bool write(Mutex& mutex, void *sharedVal, uint64_t v) { return lockSet.write(mutex, sharedVal, &v); }
+    bool commit() {
+        if (!lockSet.blindWriteLockAll()) return false;
+        lockSet.updateAndUnlock();
+        return true;
+    }
+    void abort() { lockSet.unlock(); }
+    bool empty() const { return lockSet.empty(); }
+};
+
+
+/**
+ * Transfer between records where the first two are hot.
+ */
+template <typename LockSet>
+void testTransferHot()
+{
+    TransferParam param;
+    param.nrRec = 5;
+    param.nrHot = 2;
+    param.nrTx = 300;
+    VectorWithPayload<typename LockSet::Mutex> recV;
+    initTransferRecords(recV, param.nrRec);
+    Shared shared;
+    shared.table.initOnce(recV, param.nrHot, sizeof(uint64_t));
+    CYBOZU_TEST_EQUAL(shared.table.size(), param.nrHot);
+    testTransfer<Worker<LockSet> >(recV, shared, param);
+}
+
+
+CYBOZU_TEST_AUTO(nowait_retire_test)
+{
+    testTransferHot<cybozu::lock::NoWaitLockSet>();
+}
+
+
+CYBOZU_TEST_AUTO(wound_wait_retire_test)
+{
+    testTransferHot<cybozu::wait_die::LockSet<cybozu::wait_die::WoundWaitLock4> >();
+}
+
+
+CYBOZU_TEST_AUTO(wait_die_retire_rejected)
+{
+    cybozu::wait_die::LockSet<cybozu::wait_die::WaitDieLock4> lockSet;
+    lockSet.init(sizeof(uint64_t), 1);
+    RetireTable table;
+    CYBOZU_TEST_EXCEPTION(lockSet.setRetireTable(table), cybozu::Exception);
+}
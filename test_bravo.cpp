@@ -0,0 +1,178 @@
+#include <thread>
+#include <vector>
+#include <cstring>
+#include "bravo.hpp"
+#include "nowait.hpp"
+#include "vector_payload.hpp"
+#include "sleep.hpp"
+#include "transfer_test_util.hpp"
+#include "cybozu/test.hpp"
+
+
+using namespace cybozu::lock;
+
+
+CYBOZU_TEST_AUTO(bias_test)
+{
+    BravoMutex m;
+    BravoLock r0, r1, w;
+    CYBOZU_TEST_ASSERT(!m.isBiased());
+
+    // The first slow reader enables the bias.
+    CYBOZU_TEST_ASSERT(r0.read_trylock(m));
+    CYBOZU_TEST_ASSERT(!r0.isFastPath());
+    CYBOZU_TEST_ASSERT(m.isBiased());
+    r0.unlock();
+
+    // Readers take the fast path.
+    CYBOZU_TEST_ASSERT(r0.read_trylock(m));
+    CYBOZU_TEST_ASSERT(r0.isFastPath());
+
+    // A writer revokes the bias and gives up.
+    CYBOZU_TEST_ASSERT(!w.write_trylock(m));
+    CYBOZU_TEST_ASSERT(!m.isBiased());
+
+    // Readers take the slow path during the inhibition.
+    CYBOZU_TEST_ASSERT(r1.read_trylock(m));
+    CYBOZU_TEST_ASSERT(!r1.isFastPath());
+    CYBOZU_TEST_ASSERT(!r1.tryUpgrade()); // r0 exists.
+    r0.unlock();
+    CYBOZU_TEST_ASSERT(r1.tryUpgrade());
+    CYBOZU_TEST_ASSERT(!r0.read_trylock(m));
+    r1.unlock();
+
+    // The bias is enabled again by a slow reader after the inhibition.
+    sleep_ms(10);
+    CYBOZU_TEST_ASSERT(r0.read_trylock(m));
+    CYBOZU_TEST_ASSERT(m.isBiased());
+    r0.unlock();
+    CYBOZU_TEST_ASSERT(r0.read_trylock(m));
+    CYBOZU_TEST_ASSERT(r0.isFastPath());
+
+    // A fast reader upgrades.
+    CYBOZU_TEST_ASSERT(r0.tryUpgrade());
+    CYBOZU_TEST_ASSERT(r0.mode() == BravoMutex::Mode::X);
+    CYBOZU_TEST_ASSERT(!r1.read_trylock(m));
+    r0.unlock();
+    CYBOZU_TEST_ASSERT(w.write_trylock(m));
+    w.unlock();
+}
+
+
+CYBOZU_TEST_AUTO(blocking_test)
+{
+    const size_t nrTh = 4, nrLoop = 3000;
+    BravoMutex m;
+    uint64_t v[2] = {0, 0};
+    size_t nrBad = 0;
+
+    std::vector<std::thread> th_v;
+    for (size_t i = 0; i < nrTh; i++) {
+        th_v.emplace_back([&,i]() {
+            for (size_t j = 0; j < nrLoop; j++) {
+                if ((i + j) % 4 == 0) {
+                    BravoLock lk(m, BravoMutex::Mode::X);
+                    v[0]++; v[1]++;
+                } else {
+                    BravoLock lk(m, BravoMutex::Mode::S);
+                    if (load(v[0]) != load(v[1])) nrBad++;
+                }
+            }
+        });
+    }
+    for (std::thread& th : th_v) th.join();
+    CYBOZU_TEST_EQUAL(nrBad, 0);
+    CYBOZU_TEST_EQUAL(v[0], nrTh * nrLoop / 4);
+}
+
+
+/**
+ * A blocking writer revokes the bias while fast-path readers are published.
+ * It waits for all of them, and new readers can not enter meanwhile.
+ */
+CYBOZU_TEST_AUTO(revoke_test)
+{
+    const size_t nrReader = 2;
+    BravoMutex m;
+    BravoLock r;
+    CYBOZU_TEST_ASSERT(r.read_trylock(m));
+    r.unlock();
+    CYBOZU_TEST_ASSERT(m.isBiased());
+
+    size_t nrPublished = 0;
+    size_t nrReleased = 0; // reader i releases the lock if i < nrReleased.
+    bool acquired = false;
+    std::vector<std::thread> th_v;
+    for (size_t i = 0; i < nrReader; i++) {
+        th_v.emplace_back([&,i]() {
+            BravoLock lk;
+            CYBOZU_TEST_ASSERT(lk.read_trylock(m));
+            CYBOZU_TEST_ASSERT(lk.isFastPath());
+            fetch_add(nrPublished, 1);
+            while (load_acquire(nrReleased) <= i) sleep_ms(1);
+            lk.unlock();
+        });
+    }
+    while (load_acquire(nrPublished) < nrReader) sleep_ms(1);
+    std::thread writer([&]() {
+        BravoLock lk(m, BravoMutex::Mode::X);
+        store_release(acquired, true);
+    });
+    while (m.isBiased()) sleep_ms(1);
+
+    for (size_t i = 0; i < nrReader; i++) {
+        sleep_ms(10);
+        CYBOZU_TEST_ASSERT(!load_acquire(acquired));
+        CYBOZU_TEST_ASSERT(!r.read_trylock(m));
+        store_release(nrReleased, i + 1);
+    }
+    writer.join();
+    CYBOZU_TEST_ASSERT(acquired);
+    for (std::thread& th : th_v) th.join();
+
+    // The bias is inhibited for a while after the revocation.
+    CYBOZU_TEST_ASSERT(r.read_trylock(m));
+    CYBOZU_TEST_ASSERT(!r.isFastPath());
+    r.unlock();
+}
+
+
+struct Worker
+{
+    using Mutex = BravoNoWaitLockSet::Mutex;
+
+    BravoNoWaitLockSet lockSet;
+
+    Worker(int, size_t) : lockSet() {
+        lockSet.init(sizeof(uint64_t), 10);
+    }
+    void beginTx() {}
+    void begin(bool) {}
+    bool read(Mutex& mutex, void *sharedVal, uint64_t& v) { return lockSet.read(mutex, sharedVal, &v); }
+    bool readForUpdate(Mutex& mutex, void *sharedVal, uint64_t& v) {
+        return lockSet.readForUpdate(mutex, sharedVal, &v);
+    }
+    bool write(Mutex& mutex, void *sharedVal, uint64_t v) { return lockSet.write(mutex, sharedVal, &v); }
+    bool commit() {
+        if (!lockSet.blindWriteLockAll()) return false;
+        lockSet.updateAndUnlock();
+        return true;
+    }
+    void abort() { lockSet.unlock(); }
+    bool empty() const { return lockSet.empty(); }
+};
+
+
+/**
+ * Transfer between records with the no-wait lock set.
+ * The first read of a writer may take the fast path and upgrade later.
+ */
+CYBOZU_TEST_AUTO(nowait_transfer_test)
+{
+    TransferParam param;
+    param.upgrade = true;
+    VectorWithPayload<Worker::Mutex> recV;
+    initTransferRecords(recV, param.nrRec);
+    int shared = 0;
+    testTransfer<Worker>(recV, shared, param);
+}
@@ -0,0 +1,89 @@
+#include <thread>
+#include <vector>
+#include "lock.hpp"
+#include "leis_lock.hpp"
+#include "cybozu/test.hpp"
+
+
+using namespace cybozu::lock;
+
+
+CYBOZU_TEST_AUTO(try_lock_test)
+{
+    using Lock = CohortMcsSpinlock;
+    Lock::Mutex mutex;
+    Lock lk0, lk1, lk2;
+
+    setNumaNode(0);
+    CYBOZU_TEST_ASSERT(lk0.try_lock(mutex));
+    CYBOZU_TEST_ASSERT(!lk1.try_lock(mutex)); // the local queue is not empty.
+    setNumaNode(1);
+    CYBOZU_TEST_ASSERT(!lk2.try_lock(mutex)); // the global lock is held.
+    lk0.unlock();
+    CYBOZU_TEST_ASSERT(lk2.try_lock(mutex));
+    setNumaNode(0);
+    CYBOZU_TEST_ASSERT(!lk1.try_lock(mutex));
+    lk2.unlock();
+    CYBOZU_TEST_ASSERT(lk1.try_lock(mutex));
+    lk1.unlock();
+}
+
+
+/**
+ * Threads are spread over the nodes including ones beyond MAX_NODES.
+ */
+CYBOZU_TEST_AUTO(counter_test)
+{
+    using Lock = CohortMcsSpinlock;
+    const size_t nrTh = 6, nrLoop = 3000;
+    for (size_t nrNodes : {1, 2, 6}) {
+        Lock::Mutex mutex;
+        size_t counter = 0;
+        std::vector<std::thread> th_v;
+        for (size_t i = 0; i < nrTh; i++) {
+            th_v.emplace_back([&,i]() {
+                setNumaNode(i % nrNodes);
+                for (size_t j = 0; j < nrLoop; j++) {
+                    Lock lk(mutex);
+                    counter++;
+                }
+            });
+        }
+        for (std::thread& th : th_v) th.join();
+        CYBOZU_TEST_EQUAL(counter, nrTh * nrLoop);
+        CYBOZU_TEST_EQUAL(mutex.global, 0u);
+        for (size_t i = 0; i < Lock::MAX_NODES; i++) {
+            CYBOZU_TEST_ASSERT(mutex.tail[i] == nullptr);
+        }
+    }
+}
+
+
+CYBOZU_TEST_AUTO(leis_lock_test)
+{
+    using Lock = LockWithCohort;
+    using Mode = Lock::Mode;
+    const size_t nrTh = 4, nrLoop = 3000;
+    Lock::Mutex mutex;
+    uint64_t v[2] = {0, 0};
+    size_t nrBad = 0;
+
+    std::vector<std::thread> th_v;
+    for (size_t i = 0; i < nrTh; i++) {
+        th_v.emplace_back([&,i]() {
+            setNumaNode(i % 2);
+            for (size_t j = 0; j < nrLoop; j++) {
+                if ((i + j) % 2 == 0) {
+                    Lock lk(mutex, Mode::X);
+                    v[0]++; v[1]++;
+                } else {
+                    Lock lk(mutex, Mode::S);
+                    if (load(v[0]) != load(v[1])) fetch_add(nrBad, 1);
+                }
+            }
+        });
+    }
+    for (std::thread& th : th_v) th.join();
+    CYBOZU_TEST_EQUAL(nrBad, 0);
+    CYBOZU_TEST_EQUAL(v[0], nrTh * nrLoop / 2);
+}
@@ -0,0 +1,252 @@
+#include <thread>
+#include <vector>
+#include <cstring>
+#include "deadlock.hpp"
+#include "vector_payload.hpp"
+#include "tx_util.hpp"
+#include "transfer_test_util.hpp"
+#include "cybozu/test.hpp"
+
+
+using namespace cybozu::deadlock;
+
+
+CYBOZU_TEST_AUTO(mutex_test)
+{
+    Mutex m;
+    Holder h0, h1;
+    h0.workerId = 0;
+    h1.workerId = 1;
+    std::vector<uint32_t> ids;
+    auto holders = [&]() {
+        ids.clear();
+        m.forEachHolder([&](uint32_t id) { ids.push_back(id); });
+        return ids.size();
+    };
+
+    CYBOZU_TEST_ASSERT(m.tryLock(h0, Mode::S));
+    CYBOZU_TEST_ASSERT(m.tryLock(h1, Mode::S));
+    CYBOZU_TEST_EQUAL(holders(), 2);
+    CYBOZU_TEST_ASSERT(!m.tryUpgrade(h0));
+    m.unlock(h1);
+    CYBOZU_TEST_EQUAL(holders(), 1);
+    CYBOZU_TEST_ASSERT(m.tryUpgrade(h0));
+    CYBOZU_TEST_ASSERT(!m.tryLock(h1, Mode::S));
+    CYBOZU_TEST_ASSERT(!m.tryLock(h1, Mode::X));
+    m.unlock(h0);
+    CYBOZU_TEST_EQUAL(holders(), 0);
+    CYBOZU_TEST_ASSERT(m.mode == Mode::Invalid);
+    CYBOZU_TEST_ASSERT(m.tryLock(h1, Mode::X));
+    CYBOZU_TEST_EQUAL(holders(), 1);
+    CYBOZU_TEST_EQUAL(ids[0], 1u);
+    m.unlock(h1);
+}
+
+
+CYBOZU_TEST_AUTO(detector_test)
+{
+    for (VictimPolicy policy : {YOUNGEST, LEAST_WORK}) {
+        Detector detector(3, policy);
+        Mutex m0, m1;
+        Holder h0, h1;
+        h0.workerId = 0;
+        h1.workerId = 1;
+        CYBOZU_TEST_ASSERT(m0.tryLock(h0, Mode::X));
+        CYBOZU_TEST_ASSERT(m1.tryLock(h1, Mode::X));
+        Slot& s0 = detector.slot(0);
+        Slot& s1 = detector.slot(1);
+        s0.txId = 1;
+        s1.txId = 2;
+
+        // no cycle.
+        s0.beginWait(m1, 5);
+        CYBOZU_TEST_EQUAL(detector.detectOnce(), 0);
+
+        // worker 0 and 1 wait for each other.
+        s1.beginWait(m0, 1);
+        CYBOZU_TEST_EQUAL(detector.detectOnce(), 1);
+        // worker 1 is younger and holds fewer locks.
+        CYBOZU_TEST_ASSERT(!s0.victim.is_wounded());
+        CYBOZU_TEST_ASSERT(s1.victim.is_wounded());
+        s1.endWait();
+        s1.victim.reset();
+        m1.unlock(h1);
+        CYBOZU_TEST_EQUAL(detector.detectOnce(), 0);
+        s0.endWait();
+        m0.unlock(h0);
+        CYBOZU_TEST_EQUAL(detector.nrVictims(), 1);
+    }
+
+    // The oldest one is chosen if it holds the fewest locks.
+    Detector detector(2, LEAST_WORK);
+    Mutex m0, m1;
+    Holder h0, h1;
+    h0.workerId = 0;
+    h1.workerId = 1;
+    CYBOZU_TEST_ASSERT(m0.tryLock(h0, Mode::S));
+    CYBOZU_TEST_ASSERT(m1.tryLock(h1, Mode::S));
+    detector.slot(0).txId = 1;
+    detector.slot(1).txId = 2;
+    detector.slot(0).beginWait(m1, 1);
+    detector.slot(1).beginWait(m0, 3);
+    CYBOZU_TEST_EQUAL(detector.detectOnce(), 1);
+    CYBOZU_TEST_ASSERT(detector.slot(0).victim.is_wounded());
+    CYBOZU_TEST_ASSERT(!detector.slot(1).victim.is_wounded());
+    m0.unlock(h0);
+    m1.unlock(h1);
+}
+
+
+CYBOZU_TEST_AUTO(resolve_test)
+{
+    VectorWithPayload<Mutex> recV;
+    recV.setPayloadSize(sizeof(uint64_t));
+    recV.resize(2);
+    Detector detector(2, YOUNGEST, 10);
+    detector.start();
+    SimpleTxIdGenerator txIdGen;
+    size_t nrLocked = 0;
+    std::vector<size_t> nrAbort(2, 0);
+
+    // Worker i locks record i, and then record 1 - i after both have locked the first ones.
+    std::vector<std::thread> th_v;
+    for (size_t i = 0; i < 2; i++) {
+        th_v.emplace_back([&,i]() {
+            LockSet lockSet;
+            lockSet.init(sizeof(uint64_t), 2, detector, i);
+            lockSet.setTxId(txIdGen.get());
+            for (;;) {
+                uint64_t v;
+                if (lockSet.readForUpdate(recV[i].value, recV[i].payload, &v)) {
+                    if (nrAbort[i] == 0) {
+                        __atomic_fetch_add(&nrLocked, 1, __ATOMIC_ACQ_REL);
+                        while (load_acquire(nrLocked) < 2) _mm_pause();
+                    }
+                    if (lockSet.readForUpdate(recV[1 - i].value, recV[1 - i].payload, &v) &&
+                        lockSet.blindWriteLockAll()) {
+                        lockSet.updateAndUnlock();
+                        break;
+                    }
+                }
+                lockSet.unlock();
+                nrAbort[i]++;
+            }
+        });
+    }
+    for (std::thread& th : th_v) th.join();
+    detector.stop();
+    CYBOZU_TEST_EQUAL(detector.nrVictims(), 1);
+    CYBOZU_TEST_EQUAL(nrAbort[0] + nrAbort[1], 1);
+}
+
+
+/**
+ * Workers 0, 1 and 2 wait for each other in a cycle,
+ * and worker 3 waits for worker 0 out of the cycle.
+ */
+CYBOZU_TEST_AUTO(cycle_victim_test)
+{
+    struct Case {
+        VictimPolicy policy;
+        size_t nrLocks[3];
+        uint32_t victim;
+    };
+    const Case caseV[] = {
+        // worker 3 is the youngest, but only members of the cycle can break it.
+        {YOUNGEST, {1, 1, 1}, 1},
+        {LEAST_WORK, {3, 4, 2}, 2},
+        {LEAST_WORK, {2, 2, 2}, 1}, // the youngest one among the least work.
+    };
+    for (const Case& c : caseV) {
+        Detector detector(4, c.policy);
+        Mutex m[3];
+        Holder h[3];
+        const uint64_t txIdV[] = {2, 5, 1, 9};
+        for (uint32_t i = 0; i < 4; i++) detector.slot(i).txId = txIdV[i];
+        for (uint32_t i = 0; i < 3; i++) {
+            h[i].workerId = i;
+            CYBOZU_TEST_ASSERT(m[i].tryLock(h[i], Mode::X));
+        }
+        detector.slot(3).beginWait(m[0], 0);
+        detector.slot(0).beginWait(m[1], c.nrLocks[0]);
+        detector.slot(1).beginWait(m[2], c.nrLocks[1]);
+        CYBOZU_TEST_EQUAL(detector.detectOnce(), 0);
+        detector.slot(2).beginWait(m[0], c.nrLocks[2]);
+        CYBOZU_TEST_EQUAL(detector.detectOnce(), 1);
+        for (uint32_t i = 0; i < 4; i++) {
+            CYBOZU_TEST_EQUAL(detector.slot(i).victim.is_wounded(), i == c.victim);
+        }
+        // The victim is not chosen again until it aborts.
+        CYBOZU_TEST_EQUAL(detector.detectOnce(), 0);
+
+        // The victim aborts and the others proceed.
+        Slot& s = detector.slot(c.victim);
+        s.endWait();
+        m[c.victim].unlock(h[c.victim]);
+        s.victim.reset();
+        CYBOZU_TEST_EQUAL(detector.detectOnce(), 0);
+        for (uint32_t i = 0; i < 4; i++) {
+            if (i != c.victim) detector.slot(i).endWait();
+        }
+        for (uint32_t i = 0; i < 3; i++) {
+            if (i != c.victim) m[i].unlock(h[i]);
+        }
+        CYBOZU_TEST_EQUAL(detector.nrVictims(), 1);
+    }
+}
+
+
+struct Shared
+{
+    Detector detector;
+    SimpleTxIdGenerator txIdGen;
+
+    explicit Shared(size_t nrTh) : detector(nrTh, YOUNGEST, 10), txIdGen() {}
+};
+
+
+struct Worker
+{
+    using Mutex = cybozu::deadlock::Mutex;
+
+    Shared& shared;
+    LockSet lockSet;
+
+    Worker(Shared& shared0, size_t idx) : shared(shared0), lockSet() {
+        lockSet.init(sizeof(uint64_t), 10, shared.detector, idx);
+    }
+    void beginTx() { lockSet.setTxId(shared.txIdGen.get()); }
+    void begin(bool) {}
+    bool read(Mutex& mutex, void *sharedVal, uint64_t& v) { return lockSet.read(mutex, sharedVal, &v); }
+    bool readForUpdate(Mutex& mutex, void *sharedVal, uint64_t& v) {
+        return lockSet.readForUpdate(mutex, sharedVal, &v);
+    }
+    bool write(Mutex& mutex, void *sharedVal, uint64_t v) { return lockSet.write(mutex, sharedVal, &v); }
+    bool commit() {
+        if (!lockSet.blindWriteLockAll()) return false;
+        lockSet.updateAndUnlock();
+        return true;
+    }
+    void abort() { lockSet.unlock(); }
+    bool empty() const { return lockSet.empty(); }
+};
+
+
+/**
+ * Transfer between two records locked in random order, which causes deadlocks.
+ */
+CYBOZU_TEST_AUTO(transfer_test)
+{
+    TransferParam param;
+    param.nrTx = 300;
+    param.upgrade = true;
+    VectorWithPayload<Mutex> recV;
+    initTransferRecords(recV, param.nrRec);
+    Shared shared(param.nrWriter + param.nrReader);
+    shared.detector.start();
+    testTransfer<Worker>(recV, shared, param);
+    shared.detector.stop();
+    for (size_t i = 0; i < param.nrRec; i++) {
+        CYBOZU_TEST_ASSERT(recV[i].value.mode == Mode::Invalid);
+    }
+}
@@ -0,0 +1,90 @@
+#include <vector>
+#include "epoch_reclaimer.hpp"
+#include "record_table.hpp"
+#include "thread_util.hpp"
+#include "cybozu/test.hpp"
+
+
+using Reclaimer = cybozu::ebr::EpochReclaimer;
+
+size_t nrFreed_ = 0;
+
+void countFree(void *p)
+{
+    nrFreed_++;
+    delete static_cast<uint64_t*>(p);
+}
+
+
+CYBOZU_TEST_AUTO(test_epoch)
+{
+    nrFreed_ = 0;
+    Reclaimer rec(2);
+    Reclaimer::Local l0(rec, 0), l1(rec, 1);
+
+    l1.enter(); // l1 stays in the current epoch.
+    {
+        Reclaimer::Guard guard(l0);
+        l0.retire(new uint64_t(0), countFree);
+    }
+    for (size_t i = 0; i < 10; i++) l0.collect();
+    CYBOZU_TEST_EQUAL(nrFreed_, 0);
+    CYBOZU_TEST_EQUAL(l0.nrRetired(), 1);
+
+    l1.leave();
+    for (size_t i = 0; i < 10; i++) l0.collect();
+    CYBOZU_TEST_EQUAL(nrFreed_, 1);
+    CYBOZU_TEST_EQUAL(l0.nrRetired(), 0);
+
+    l0.retire(new uint64_t(1), countFree);
+    CYBOZU_TEST_EXCEPTION(Reclaimer::Local(rec, 2), cybozu::Exception);
+}
+
+
+struct Mutex
+{
+    uint64_t obj;
+    bool absent;
+};
+
+
+CYBOZU_TEST_AUTO(test_record_table)
+{
+    using Table = cybozu::record::RecordTable<Mutex>;
+    using Record = Table::Record;
+    Table table;
+    table.setPayloadSize(16);
+    table.load(100);
+    Reclaimer reclaimer(4);
+
+    const size_t nrTh = 4;
+    const size_t nr = 10000;
+    cybozu::thread::ThreadRunnerSet thS;
+    for (size_t i = 0; i < nrTh; i++) {
+        thS.add([&,i]() {
+            Reclaimer::Local local(reclaimer, i);
+            cybozu::record::RemovedRecords<Table> removed;
+            for (size_t j = 0; j < nr; j++) {
+                Reclaimer::Guard guard(local);
+                // all the workers share the keys.
+                const uint64_t key = 100 + j;
+                Record& r = table.get_or_insert(key, [](Mutex& m) { m.absent = true; });
+                if (!r.value.absent) throw std::runtime_error("must be absent.");
+                if (table.index().lookup(key) == nullptr) continue; // removed by others.
+                removed.add(table, key, r);
+                removed.add(table, key, r); // duplicated.
+                removed.unlink(local, [](const Record&) { return true; });
+            }
+        });
+    }
+    thS.start();
+    CYBOZU_TEST_ASSERT(thS.join().empty());
+    for (size_t i = 0; i < 100; i++) {
+        Record *r = table.index().lookup(i);
+        CYBOZU_TEST_ASSERT(r != nullptr);
+        CYBOZU_TEST_ASSERT(!r->value.absent);
+    }
+    for (size_t i = 100; i < 100 + nr; i++) {
+        CYBOZU_TEST_ASSERT(table.index().lookup(i) == nullptr);
+    }
+}
@@ -0,0 +1,61 @@
+#include <unordered_map>
+#include "flat_index.hpp"
+#include "random.hpp"
+#include "cybozu/test.hpp"
+
+
+CYBOZU_TEST_AUTO(flat_index1)
+{
+    cybozu::FlatIndex idx;
+    CYBOZU_TEST_ASSERT(idx.empty());
+    CYBOZU_TEST_ASSERT(idx.find(0x1000) == idx.end());
+
+    idx[0x1000] = 1;
+    idx[0x1080] = 2;
+    CYBOZU_TEST_EQUAL(idx.size(), 2);
+    CYBOZU_TEST_EQUAL(idx.find(0x1000)->second, 1);
+    CYBOZU_TEST_EQUAL(idx.find(0x1080)->second, 2);
+    CYBOZU_TEST_ASSERT(idx.find(0x1100) == idx.end());
+
+    // overwrite.
+    idx[0x1000] = 3;
+    CYBOZU_TEST_EQUAL(idx.size(), 2);
+    CYBOZU_TEST_EQUAL(idx.find(0x1000)->second, 3);
+
+    idx.clear();
+    CYBOZU_TEST_ASSERT(idx.empty());
+    CYBOZU_TEST_ASSERT(idx.find(0x1000) == idx.end());
+    idx[0x1080] = 4;
+    CYBOZU_TEST_EQUAL(idx.size(), 1);
+    CYBOZU_TEST_EQUAL(idx.find(0x1080)->second, 4);
+    CYBOZU_TEST_ASSERT(idx.find(0x1000) == idx.end());
+}
+
+
+CYBOZU_TEST_AUTO(flat_index_random)
+{
+    cybozu::util::Xoroshiro128Plus rand(0);
+    cybozu::FlatIndex idx;
+    std::unordered_map<uintptr_t, size_t> ans;
+    for (size_t loop = 0; loop < 100; loop++) {
+        // mutex-like addresses with growing sets.
+        const size_t n = rand() % 10000 + 1;
+        for (size_t i = 0; i < n; i++) {
+            const uintptr_t key = (rand() % 100000 + 1) * 64;
+            idx[key] = i;
+            ans[key] = i;
+        }
+        CYBOZU_TEST_EQUAL(idx.size(), ans.size());
+        for (const auto& p : ans) {
+            auto it = idx.find(p.first);
+            CYBOZU_TEST_ASSERT(it != idx.end());
+            CYBOZU_TEST_EQUAL(it->second, p.second);
+        }
+        for (size_t i = 0; i < 1000; i++) {
+            const uintptr_t key = (rand() % 100000 + 1) * 64;
+            CYBOZU_TEST_EQUAL(idx.find(key) != idx.end(), ans.count(key) != 0);
+        }
+        idx.clear();
+        ans.clear();
+    }
+}
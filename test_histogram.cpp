@@ -5,32 +5,66 @@
 CYBOZU_TEST_AUTO(histogram1)
 {
     Histogram h;
+    CYBOZU_TEST_ASSERT(h.empty());
+    CYBOZU_TEST_EQUAL(h.percentile(0.5), 0);
 
-    CYBOZU_TEST_EQUAL(h[0], 0);
-    h.add(0);
-    CYBOZU_TEST_EQUAL(h[0], 1);
+    // Small values are counted exactly.
+    for (uint64_t v = 0; v < Histogram::HALF * 2; v++) {
+        CYBOZU_TEST_EQUAL(Histogram::toIdx(v), v);
+        h.add(v);
+        CYBOZU_TEST_EQUAL(h[v], 1);
+    }
+    CYBOZU_TEST_EQUAL(h.count, Histogram::HALF * 2);
 
-    CYBOZU_TEST_EQUAL(h[1], 0);
-    h.add(1);
-    CYBOZU_TEST_EQUAL(h[1], 1);
+    const size_t idx = Histogram::toIdx(1000);
+    CYBOZU_TEST_EQUAL(h[idx], 0);
+    h.add(1000);
+    CYBOZU_TEST_EQUAL(h[idx], 1);
+    CYBOZU_TEST_ASSERT(Histogram::lowest(idx) <= 1000);
+    CYBOZU_TEST_ASSERT(Histogram::highest(idx) >= 1000);
 
-    CYBOZU_TEST_EQUAL(h[2], 0);
-    h.add(2);
-    CYBOZU_TEST_EQUAL(h[2], 1);
-    h.add(3);
-    CYBOZU_TEST_EQUAL(h[2], 2);
+    h.add(uint64_t(-1));
+    CYBOZU_TEST_EQUAL(h[Histogram::HISTOGRAM_SIZE - 1], 1);
+    CYBOZU_TEST_EQUAL(h.max, uint64_t(-1));
 
-    CYBOZU_TEST_EQUAL(h[3], 0);
-    h.add(4);
-    CYBOZU_TEST_EQUAL(h[3], 1);
+    std::cout << h;
+}
 
-    CYBOZU_TEST_EQUAL(h[4], 0);
-    h.add(8);
-    CYBOZU_TEST_EQUAL(h[4], 1);
 
-    CYBOZU_TEST_EQUAL(h[64], 0);
-    h.add(size_t(-1));
-    CYBOZU_TEST_EQUAL(h[64], 1);
+CYBOZU_TEST_AUTO(histogram_buckets)
+{
+    // Buckets are contiguous and the relative error is bounded.
+    for (size_t i = 1; i < Histogram::HISTOGRAM_SIZE; i++) {
+        CYBOZU_TEST_EQUAL(Histogram::lowest(i), Histogram::highest(i - 1) + 1);
+        CYBOZU_TEST_EQUAL(Histogram::toIdx(Histogram::lowest(i)), i);
+        CYBOZU_TEST_EQUAL(Histogram::toIdx(Histogram::highest(i)), i);
+        const uint64_t lo = Histogram::lowest(i), hi = Histogram::highest(i);
+        CYBOZU_TEST_ASSERT((hi - lo) <= lo / (Histogram::HALF - 1));
+    }
+    CYBOZU_TEST_EQUAL(Histogram::highest(Histogram::HISTOGRAM_SIZE - 1), uint64_t(-1));
+}
 
-    std::cout << h;
+
+CYBOZU_TEST_AUTO(histogram_percentile)
+{
+    Histogram h0, h1;
+    for (uint64_t v = 1; v <= 10000; v++) {
+        (v % 2 == 0 ? h0 : h1).add(v * 10);
+    }
+    h0.merge(h1);
+    CYBOZU_TEST_EQUAL(h0.count, 10000);
+    CYBOZU_TEST_EQUAL(h0.max, 100000);
+    CYBOZU_TEST_EQUAL(h0.percentile(1.0), 100000);
+
+    const double qs[] = {0.5, 0.99, 0.999};
+    for (double q : qs) {
+        const double expected = q * 100000;
+        const double p = h0.percentile(q);
+        CYBOZU_TEST_ASSERT(p >= expected);
+        CYBOZU_TEST_ASSERT(p <= expected * (1.0 + 1.0 / (Histogram::HALF - 1)));
+    }
+
+    Histogram empty;
+    h1.merge(empty);
+    CYBOZU_TEST_EQUAL(h1.count, 5000);
 }
@@ -0,0 +1,207 @@
+#include <vector>
+#include "occ.hpp"
+#include "vector_payload.hpp"
+#include "transfer_test_util.hpp"
+#include "cybozu/test.hpp"
+
+
+using LockSet = cybozu::occ::LockSet;
+using Mutex = cybozu::occ::OccMutex;
+
+
+CYBOZU_TEST_AUTO(test_temperature)
+{
+    Mutex mutex;
+    const uint32_t now = cybozu::occ::Temperature::now();
+    CYBOZU_TEST_EQUAL(mutex.temperature(now), 0u);
+    mutex.heatUp(now);
+    mutex.heatUp(now);
+    CYBOZU_TEST_EQUAL(mutex.temperature(now), 2u);
+    // halved per period.
+    CYBOZU_TEST_EQUAL(mutex.temperature(now + 1), 1u);
+    CYBOZU_TEST_EQUAL(mutex.temperature(now + 2), 0u);
+}
+
+
+bool isLocked(const Mutex& mutex)
+{
+    return mutex.load().locked;
+}
+
+
+/**
+ * Hot records are locked in the read phase, and cold ones are read optimistically.
+ */
+CYBOZU_TEST_AUTO(test_hot_lock)
+{
+    VectorWithPayload<Mutex> recV;
+    initTransferRecords(recV, 2);
+    auto& cold = recV[0];
+    auto& hot = recV[1];
+    // The temperature is halved at most once until the transaction begins.
+    const uint32_t now = cybozu::occ::Temperature::now();
+    for (size_t i = 0; i < 4; i++) hot.value.heatUp(now);
+
+    LockSet lockSet, other;
+    lockSet.init(sizeof(uint64_t), 2);
+    lockSet.setHotThreshold(2);
+    other.init(sizeof(uint64_t), 2);
+
+    uint64_t v0, v1;
+    lockSet.read(cold.value, cold.payload, &v0);
+    CYBOZU_TEST_ASSERT(!isLocked(cold.value));
+    lockSet.read(hot.value, hot.payload, &v1);
+    CYBOZU_TEST_ASSERT(isLocked(hot.value));
+
+    // Other transactions can not write the hot record until the end.
+    other.write(hot.value, hot.payload, &v1);
+    CYBOZU_TEST_ASSERT(!other.tryLock());
+    other.clear();
+    lockSet.clear();
+    CYBOZU_TEST_ASSERT(!isLocked(hot.value));
+
+    // The lock of the read phase is taken over by the write-lock phase.
+    lockSet.read(hot.value, hot.payload, &v1);
+    CYBOZU_TEST_ASSERT(isLocked(hot.value));
+    v1++;
+    lockSet.write(hot.value, hot.payload, &v1);
+    lockSet.lock();
+    CYBOZU_TEST_ASSERT(lockSet.verify());
+    lockSet.updateAndUnlock();
+    CYBOZU_TEST_ASSERT(lockSet.empty());
+    CYBOZU_TEST_ASSERT(!isLocked(hot.value));
+    ::memcpy(&v1, hot.payload, sizeof(uint64_t));
+    CYBOZU_TEST_EQUAL(v1, TRANSFER_INITIAL_VALUE + 1);
+}
+
+
+/**
+ * Locks of hot records only read are held until the commit,
+ * so writers can not invalidate them before the verification.
+ */
+CYBOZU_TEST_AUTO(test_hot_read_lock_held)
+{
+    VectorWithPayload<Mutex> recV;
+    initTransferRecords(recV, 2);
+    auto& hot = recV[0];
+    auto& cold = recV[1];
+    const uint32_t now = cybozu::occ::Temperature::now();
+    for (size_t i = 0; i < 4; i++) hot.value.heatUp(now);
+
+    LockSet lockSet, other;
+    lockSet.init(sizeof(uint64_t), 2);
+    lockSet.setHotThreshold(2);
+    other.init(sizeof(uint64_t), 2);
+
+    uint64_t v0, v1;
+    lockSet.read(hot.value, hot.payload, &v0);
+    CYBOZU_TEST_ASSERT(isLocked(hot.value));
+    lockSet.read(cold.value, cold.payload, &v1);
+    v1 += v0;
+    lockSet.write(cold.value, cold.payload, &v1);
+    lockSet.lock();
+    CYBOZU_TEST_ASSERT(isLocked(hot.value));
+
+    other.write(hot.value, hot.payload, &v0);
+    CYBOZU_TEST_ASSERT(!other.tryLock());
+    other.clear();
+
+    CYBOZU_TEST_ASSERT(lockSet.verify());
+    lockSet.updateAndUnlock();
+    CYBOZU_TEST_ASSERT(lockSet.empty());
+    CYBOZU_TEST_ASSERT(!isLocked(hot.value));
+    CYBOZU_TEST_ASSERT(!isLocked(cold.value));
+    ::memcpy(&v1, cold.payload, sizeof(uint64_t));
+    CYBOZU_TEST_EQUAL(v1, TRANSFER_INITIAL_VALUE * 2);
+}
+
+
+/**
+ * A record that failed the verification is locked in the retry
+ * even if it is not hot yet (retrospective lock list).
+ */
+CYBOZU_TEST_AUTO(test_retrospective_lock)
+{
+    VectorWithPayload<Mutex> recV;
+    initTransferRecords(recV, 1);
+    auto& item = recV[0];
+
+    LockSet lockSet, other;
+    lockSet.init(sizeof(uint64_t), 1);
+    lockSet.setHotThreshold(100);
+    other.init(sizeof(uint64_t), 1);
+
+    uint64_t v;
+    lockSet.read(item.value, item.payload, &v);
+    CYBOZU_TEST_ASSERT(!isLocked(item.value));
+    v++;
+    other.write(item.value, item.payload, &v);
+    other.lock();
+    CYBOZU_TEST_ASSERT(other.verify());
+    other.updateAndUnlock();
+
+    const uint32_t before = item.value.temperature(cybozu::occ::Temperature::now());
+    lockSet.lock();
+    CYBOZU_TEST_ASSERT(!lockSet.verify());
+    CYBOZU_TEST_ASSERT(item.value.temperature(cybozu::occ::Temperature::now()) > before);
+    lockSet.clear();
+
+    // The retry reads the record under the lock, so it never fails again.
+    lockSet.read(item.value, item.payload, &v);
+    CYBOZU_TEST_ASSERT(isLocked(item.value));
+    CYBOZU_TEST_EQUAL(v, TRANSFER_INITIAL_VALUE + 1);
+    lockSet.lock();
+    CYBOZU_TEST_ASSERT(lockSet.verify());
+    lockSet.updateAndUnlock();
+    CYBOZU_TEST_ASSERT(!isLocked(item.value));
+
+    // The list is forgotten after the commit.
+    lockSet.read(item.value, item.payload, &v);
+    CYBOZU_TEST_ASSERT(!isLocked(item.value));
+    lockSet.clear();
+}
+
+
+struct Worker
+{
+    using Mutex = ::Mutex;
+
+    LockSet lockSet;
+
+    Worker(int, size_t) : lockSet() {
+        lockSet.init(sizeof(uint64_t), 2);
+        lockSet.setHotThreshold(1);
+    }
+    void beginTx() {}
+    void begin(bool) {}
+    bool read(Mutex& mutex, void *sharedVal, uint64_t& v) {
+        lockSet.read(mutex, sharedVal, &v);
+        return true;
+    }
+    bool readForUpdate(Mutex& mutex, void *sharedVal, uint64_t& v) { return read(mutex, sharedVal, v); }
+    bool write(Mutex& mutex, void *sharedVal, uint64_t v) {
+        lockSet.write(mutex, sharedVal, &v);
+        return true;
+    }
+    bool commit() {
+        lockSet.lock();
+        if (!lockSet.verify()) return false;
+        lockSet.updateAndUnlock();
+        return true;
+    }
+    void abort() { lockSet.clear(); }
+    bool empty() const { return lockSet.empty(); }
+};
+
+
+CYBOZU_TEST_AUTO(test_transfer)
+{
+    TransferParam param;
+    param.nrReader = 2;
+    param.nrTx = 500;
+    param.yield = true;
+    VectorWithPayload<Mutex> recV;
+    initTransferRecords(recV, param.nrRec);
+    int shared = 0;
+    testTransfer<Worker>(recV, shared, param);
+}
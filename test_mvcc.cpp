@@ -0,0 +1,114 @@
+#include <vector>
+#include "mvcc.hpp"
+#include "vector_payload.hpp"
+#include "sleep.hpp"
+#include "transfer_test_util.hpp"
+#include "cybozu/test.hpp"
+
+
+using namespace cybozu::mvcc;
+using Reclaimer = cybozu::ebr::EpochReclaimer;
+
+
+size_t chainLength(const Mutex& mutex)
+{
+    size_t n = 0;
+    for (const Version *v = mutex.older; v != nullptr; v = v->next) n++;
+    return n;
+}
+
+
+CYBOZU_TEST_AUTO(test_snapshot)
+{
+    VectorWithPayload<Mutex> recV;
+    recV.setPayloadSize(sizeof(uint64_t));
+    recV.resize(1);
+    auto& item = recV[0];
+    ::memset(item.payload, 0, sizeof(uint64_t));
+
+    EpochGenerator epochGen;
+    TimestampAllocator tsAlloc(epochGen, 2);
+    Reclaimer reclaimer(2);
+    Reclaimer::Local l0(reclaimer, 0), l1(reclaimer, 1);
+    LocalSet writer, reader;
+    writer.init(sizeof(uint64_t), 1, tsAlloc, l0, 0);
+    reader.init(sizeof(uint64_t), 1, tsAlloc, l1, 1);
+
+    uint64_t v = 1;
+    writer.begin(false);
+    writer.write(item.value, item.payload, &v);
+    CYBOZU_TEST_ASSERT(writer.commit());
+    sleep_ms(10); // the snapshot will include the write.
+
+    reader.begin(true);
+    for (uint64_t i = 2; i < 100; i++) {
+        writer.begin(false);
+        writer.read(item.value, item.payload, &v);
+        CYBOZU_TEST_EQUAL(v, i - 1);
+        v = i;
+        writer.write(item.value, item.payload, &v);
+        CYBOZU_TEST_ASSERT(writer.commit());
+        if (i % 10 == 0) sleep_ms(2);
+    }
+    reader.read(item.value, item.payload, &v);
+    CYBOZU_TEST_EQUAL(v, 1);
+    CYBOZU_TEST_ASSERT(reader.commit());
+
+    // Versions are unlinked after the snapshot finished.
+    sleep_ms(10);
+    for (size_t i = 0; i < 10; i++) {
+        writer.begin(false);
+        writer.write(item.value, item.payload, &v);
+        CYBOZU_TEST_ASSERT(writer.commit());
+    }
+    CYBOZU_TEST_ASSERT(chainLength(item.value) <= 1);
+}
+
+
+struct Shared
+{
+    EpochGenerator epochGen;
+    TimestampAllocator tsAlloc;
+    Reclaimer reclaimer;
+
+    explicit Shared(size_t nrTh) : epochGen(), tsAlloc(epochGen, nrTh), reclaimer(nrTh) {}
+};
+
+
+struct Worker
+{
+    using Mutex = cybozu::mvcc::Mutex;
+
+    Reclaimer::Local local;
+    LocalSet localSet;
+
+    Worker(Shared& shared, size_t idx) : local(shared.reclaimer, idx), localSet() {
+        localSet.init(sizeof(uint64_t), 2, shared.tsAlloc, local, idx);
+    }
+    void beginTx() {}
+    void begin(bool readOnly) { localSet.begin(readOnly); }
+    bool read(Mutex& mutex, void *sharedVal, uint64_t& v) {
+        localSet.read(mutex, sharedVal, &v);
+        return true;
+    }
+    bool readForUpdate(Mutex& mutex, void *sharedVal, uint64_t& v) { return read(mutex, sharedVal, v); }
+    bool write(Mutex& mutex, void *sharedVal, uint64_t v) {
+        localSet.write(mutex, sharedVal, &v);
+        return true;
+    }
+    bool commit() { return localSet.commit(); }
+    void abort() { localSet.clear(); }
+    bool empty() const { return localSet.empty(); }
+};
+
+
+CYBOZU_TEST_AUTO(test_transfer)
+{
+    TransferParam param;
+    param.nrReader = 2;
+    param.nrTx = 20000;
+    VectorWithPayload<Mutex> recV;
+    initTransferRecords(recV, param.nrRec);
+    Shared shared(param.nrWriter + param.nrReader);
+    testTransfer<Worker>(recV, shared, param);
+}
@@ -0,0 +1,118 @@
+#include <thread>
+#include <cstring>
+#include "nowait.hpp"
+#include "vector_payload.hpp"
+#include "time.hpp"
+#include "sleep.hpp"
+#include "cybozu/test.hpp"
+
+
+using LockSet = cybozu::lock::NoWaitLockSet;
+using Mutex = LockSet::Mutex;
+
+
+CYBOZU_TEST_AUTO(bounded_wait_test)
+{
+    VectorWithPayload<Mutex> recV;
+    recV.setPayloadSize(sizeof(uint64_t));
+    recV.resize(1);
+    ::memset(recV[0].payload, 0, sizeof(uint64_t));
+    Mutex& mutex = recV[0].value;
+    uint64_t v;
+
+    LockSet lockSet;
+    lockSet.init(sizeof(uint64_t), 1);
+    mutex.write_lock();
+
+    // no-wait.
+    CYBOZU_TEST_ASSERT(!lockSet.read(mutex, recV[0].payload, &v));
+    lockSet.unlock();
+
+    // It gives up after the budget.
+    const uint64_t budget = 100000;
+    lockSet.setWaitBudget(budget);
+    const uint64_t t0 = cybozu::time::rdtscp();
+    CYBOZU_TEST_ASSERT(!lockSet.read(mutex, recV[0].payload, &v));
+    CYBOZU_TEST_ASSERT(cybozu::time::rdtscp() - t0 >= budget);
+    lockSet.unlock();
+
+    // It gets the lock released in the budget.
+    lockSet.setWaitBudget(UINT64_MAX);
+    std::thread th([&]() {
+        sleep_ms(10);
+        mutex.write_unlock();
+    });
+    CYBOZU_TEST_ASSERT(lockSet.readForUpdate(mutex, recV[0].payload, &v));
+    v++;
+    CYBOZU_TEST_ASSERT(lockSet.write(mutex, recV[0].payload, &v));
+    CYBOZU_TEST_ASSERT(lockSet.blindWriteLockAll());
+    lockSet.updateAndUnlock();
+    th.join();
+    ::memcpy(&v, recV[0].payload, sizeof(uint64_t));
+    CYBOZU_TEST_EQUAL(v, 1);
+}
+
+
+/**
+ * Bounded waits use the steps of the wait policy. park is the same as yield.
+ */
+CYBOZU_TEST_AUTO(bounded_wait_policy_test)
+{
+    using namespace cybozu::wait_policy;
+    VectorWithPayload<Mutex> recV;
+    recV.setPayloadSize(sizeof(uint64_t));
+    recV.resize(1);
+    Mutex& mutex = recV[0].value;
+    uint64_t v;
+
+    LockSet lockSet;
+    lockSet.init(sizeof(uint64_t), 1);
+    for (const auto& p : policyTable_) {
+        policy_ = p.first;
+        mutex.write_lock();
+        const uint64_t budget = 1000000;
+        lockSet.setWaitBudget(budget);
+        const uint64_t t0 = cybozu::time::rdtscp();
+        CYBOZU_TEST_ASSERT(!lockSet.read(mutex, recV[0].payload, &v));
+        CYBOZU_TEST_ASSERT(cybozu::time::rdtscp() - t0 >= budget);
+        lockSet.unlock();
+
+        lockSet.setWaitBudget(UINT64_MAX);
+        std::thread th([&]() {
+            sleep_ms(10);
+            mutex.write_unlock();
+        });
+        CYBOZU_TEST_ASSERT(lockSet.read(mutex, recV[0].payload, &v));
+        lockSet.unlock();
+        th.join();
+    }
+    policy_ = Policy::SPIN;
+}
+
+
+CYBOZU_TEST_AUTO(adaptive_wait_test)
+{
+    VectorWithPayload<Mutex> recV;
+    recV.setPayloadSize(sizeof(uint64_t));
+    recV.resize(1);
+    Mutex& mutex = recV[0].value;
+    uint64_t v;
+
+    LockSet lockSet;
+    lockSet.init(sizeof(uint64_t), 1);
+    lockSet.setWaitBudget(100, 50);
+    CYBOZU_TEST_EQUAL(lockSet.getWaitBudget(), 100); // before the first commit.
+
+    CYBOZU_TEST_ASSERT(lockSet.read(mutex, recV[0].payload, &v));
+    sleep_ms(1);
+    CYBOZU_TEST_ASSERT(lockSet.blindWriteLockAll());
+    lockSet.updateAndUnlock();
+    // Half of 1ms is much more than 100 cycles.
+    CYBOZU_TEST_ASSERT(lockSet.getWaitBudget() > 100);
+
+    // Aborted transactions do not change the average.
+    const uint64_t budget = lockSet.getWaitBudget();
+    CYBOZU_TEST_ASSERT(lockSet.read(mutex, recV[0].payload, &v));
+    lockSet.unlock();
+    CYBOZU_TEST_EQUAL(lockSet.getWaitBudget(), budget);
+}
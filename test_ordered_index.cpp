@@ -0,0 +1,185 @@
+#include <vector>
+#include <algorithm>
+#include <random>
+#include "ordered_index.hpp"
+#include "thread_util.hpp"
+#include "cybozu/test.hpp"
+
+
+using Index = cybozu::index::BTree<uint64_t>;
+
+
+CYBOZU_TEST_AUTO(test_insert_lookup)
+{
+    Index index;
+    const size_t nr = 100000;
+    std::vector<uint64_t> v(nr);
+    for (size_t i = 0; i < nr; i++) v[i] = i;
+
+    std::mt19937_64 rand(0);
+    std::vector<uint64_t> keys(v);
+    std::shuffle(keys.begin(), keys.end(), rand);
+    for (uint64_t key : keys) {
+        CYBOZU_TEST_ASSERT(index.insert(key * 2, &v[key]));
+    }
+    CYBOZU_TEST_ASSERT(!index.insert(0, &v[0]));
+    for (size_t i = 0; i < nr; i++) {
+        CYBOZU_TEST_EQUAL(index.lookup(i * 2), &v[i]);
+        CYBOZU_TEST_ASSERT(index.lookup(i * 2 + 1) == nullptr);
+    }
+}
+
+
+CYBOZU_TEST_AUTO(test_scan)
+{
+    Index index;
+    const size_t nr = 10000;
+    std::vector<uint64_t> v(nr);
+    for (size_t i = 0; i < nr; i++) {
+        v[i] = i;
+        index.insert(i * 2, &v[i]);
+    }
+    Index::ScanBuffer buf;
+    index.scan(101, 100, buf);
+    CYBOZU_TEST_EQUAL(buf.size(), 100);
+    for (size_t i = 0; i < buf.size(); i++) {
+        CYBOZU_TEST_EQUAL(buf[i].first, 102 + i * 2);
+        CYBOZU_TEST_EQUAL(*buf[i].second, 51 + i);
+    }
+    buf.clear();
+    index.scan(nr * 2 - 10, 100, buf);
+    CYBOZU_TEST_EQUAL(buf.size(), 5);
+}
+
+
+CYBOZU_TEST_AUTO(test_node_set)
+{
+    Index index;
+    const size_t nr = 1000;
+    std::vector<uint64_t> v(nr);
+    for (size_t i = 0; i < nr; i++) {
+        v[i] = i;
+        index.insert(i * 2, &v[i]);
+    }
+    Index::ScanBuffer buf;
+    cybozu::index::NodeSet ns;
+    index.scan(500, 10, buf, &ns);
+    CYBOZU_TEST_ASSERT(!ns.empty());
+    CYBOZU_TEST_ASSERT(ns.validate());
+    index.insert(2000, &v[0]); // out of the scanned leaves.
+    CYBOZU_TEST_ASSERT(ns.validate());
+    index.insert(505, &v[0]); // phantom.
+    CYBOZU_TEST_ASSERT(!ns.validate());
+}
+
+
+CYBOZU_TEST_AUTO(test_concurrent_insert)
+{
+    Index index;
+    const size_t nrTh = 4;
+    const size_t nrPerTh = 100000;
+    std::vector<uint64_t> v(nrTh * nrPerTh);
+    cybozu::thread::ThreadRunnerSet thS;
+    for (size_t i = 0; i < nrTh; i++) {
+        thS.add([&,i]() {
+            for (size_t j = 0; j < nrPerTh; j++) {
+                const size_t key = j * nrTh + i;
+                v[key] = key;
+                index.insert(key, &v[key]);
+                if (j % 16 == 0) {
+                    Index::ScanBuffer buf;
+                    index.scan(key / 2, 32, buf);
+                    for (size_t k = 1; k < buf.size(); k++) {
+                        if (buf[k - 1].first >= buf[k].first) throw std::runtime_error("bad order.");
+                    }
+                }
+            }
+        });
+    }
+    thS.start();
+    CYBOZU_TEST_ASSERT(thS.join().empty());
+    for (size_t i = 0; i < v.size(); i++) {
+        CYBOZU_TEST_EQUAL(index.lookup(i), &v[i]);
+    }
+    Index::ScanBuffer buf;
+    index.scan(0, v.size(), buf);
+    CYBOZU_TEST_EQUAL(buf.size(), v.size());
+}
+
+
+CYBOZU_TEST_AUTO(test_concurrent_insert_lookup)
+{
+    // Small nodes make a deep tree with frequent splits of inner nodes.
+    using SmallIndex = cybozu::index::BTree<uint64_t, uint64_t, 128>;
+    SmallIndex index;
+    const size_t nrInsTh = 2;
+    const size_t nrLookupTh = 2;
+    const size_t nr = 200000;
+    std::vector<uint64_t> v(nr * 2);
+    for (size_t i = 0; i < v.size(); i++) v[i] = i;
+    // Odd keys exist from the beginning; even keys are inserted concurrently.
+    for (size_t i = 1; i < v.size(); i += 2) index.insert(i, &v[i]);
+
+    std::atomic<size_t> nrDone(0);
+    cybozu::thread::ThreadRunnerSet thS;
+    for (size_t i = 0; i < nrInsTh; i++) {
+        thS.add([&,i]() {
+            for (size_t j = i; j < nr; j += nrInsTh) {
+                const size_t key = j * 2;
+                if (!index.insert(key, &v[key])) throw std::runtime_error("insert failed.");
+            }
+            nrDone++;
+        });
+    }
+    for (size_t i = 0; i < nrLookupTh; i++) {
+        thS.add([&,i]() {
+            std::mt19937_64 rand(i);
+            while (nrDone.load() < nrInsTh) {
+                for (size_t k = 0; k < 1000; k++) {
+                    const size_t key = (rand() % nr) * 2 + 1;
+                    if (index.lookup(key) != &v[key]) throw std::runtime_error("existing key not found.");
+                }
+            }
+        });
+    }
+    thS.start();
+    CYBOZU_TEST_ASSERT(thS.join().empty());
+    for (size_t i = 0; i < v.size(); i++) {
+        CYBOZU_TEST_EQUAL(index.lookup(i), &v[i]);
+    }
+}
+
+
+CYBOZU_TEST_AUTO(test_remove)
+{
+    Index index;
+    const size_t nr = 10000;
+    std::vector<uint64_t> v(nr);
+    for (size_t i = 0; i < nr; i++) {
+        v[i] = i;
+        index.insert(i, &v[i]);
+    }
+    Index::ScanBuffer buf;
+    cybozu::index::NodeSet ns;
+    index.scan(100, 10, buf, &ns);
+    CYBOZU_TEST_ASSERT(!index.remove(105, &v[0])); // value mismatch.
+    CYBOZU_TEST_ASSERT(ns.validate());
+    CYBOZU_TEST_ASSERT(index.remove(105, &v[105]));
+    CYBOZU_TEST_ASSERT(!ns.validate());
+    CYBOZU_TEST_ASSERT(!index.remove(105, &v[105]));
+    for (size_t i = 0; i < nr; i += 2) {
+        CYBOZU_TEST_ASSERT(index.remove(i, &v[i]));
+    }
+    for (size_t i = 0; i < nr; i++) {
+        if (i % 2 == 0 || i == 105) {
+            CYBOZU_TEST_ASSERT(index.lookup(i) == nullptr);
+        } else {
+            CYBOZU_TEST_EQUAL(index.lookup(i), &v[i]);
+        }
+    }
+    CYBOZU_TEST_ASSERT(index.insert(105, &v[105]));
+    CYBOZU_TEST_EQUAL(index.lookup(105), &v[105]);
+    buf.clear();
+    index.scan(0, nr, buf);
+    CYBOZU_TEST_EQUAL(buf.size(), nr / 2);
+}
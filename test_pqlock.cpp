@@ -0,0 +1,85 @@
+#include <thread>
+#include <vector>
+#include "pqlock.hpp"
+#include "sleep.hpp"
+#include "cybozu/test.hpp"
+
+
+using namespace cybozu::lock;
+
+
+CYBOZU_TEST_AUTO(bucket_counter_test)
+{
+    using Lock = PQBucketLock;
+    const size_t nrTh = 4, nrLoop = 3000;
+    Lock::Mutex mutex;
+    size_t counter = 0;
+
+    std::vector<std::thread> th_v;
+    for (size_t i = 0; i < nrTh; i++) {
+        th_v.emplace_back([&,i]() {
+            for (size_t j = 0; j < nrLoop; j++) {
+                // Priorities over all the buckets.
+                Lock lk(&mutex, uint32_t((i * nrLoop + j) << (Lock::EPOCH_BITS - 2)));
+                counter++;
+            }
+        });
+    }
+    for (std::thread& th : th_v) th.join();
+    CYBOZU_TEST_EQUAL(counter, nrTh * nrLoop);
+    CYBOZU_TEST_EQUAL(mutex.state, 0u);
+}
+
+
+size_t getNrWaiters(const PQBucketLock::Mutex& mutex)
+{
+    size_t n = 0;
+    for (const auto& bucket : mutex.buckets) {
+        for (auto *p = load(bucket.in); p; p = load(p->next)) n++;
+        for (auto *p = bucket.out; p; p = p->next) n++;
+    }
+    return n;
+}
+
+
+/**
+ * The order is exact among the buckets and FIFO in a bucket.
+ */
+CYBOZU_TEST_AUTO(bucket_order_test)
+{
+    using Lock = PQBucketLock;
+    auto epoch = [](uint32_t e) { return e << Lock::EPOCH_BITS; };
+    Lock::Mutex mutex;
+    Lock lk(&mutex, epoch(5));
+    CYBOZU_TEST_EQUAL(lk.getTopPriorityInWaitQueue(), UINT32_MAX);
+
+    std::vector<uint32_t> order;
+    std::vector<std::thread> th_v;
+    const uint32_t priV[] = {epoch(9), epoch(3) + 1, epoch(6), epoch(3)};
+    for (uint32_t pri : priV) {
+        th_v.emplace_back([&,pri]() {
+            Lock lk1(&mutex, pri);
+            order.push_back(pri);
+        });
+        // Wait for the waiter to be queued.
+        while (getNrWaiters(mutex) < th_v.size()) sleep_ms(1);
+    }
+    CYBOZU_TEST_EQUAL(lk.getTopPriorityInWaitQueue(), epoch(3) + 1);
+    lk.unlock();
+    for (std::thread& th : th_v) th.join();
+
+    const std::vector<uint32_t> expected = {epoch(3) + 1, epoch(3), epoch(6), epoch(9)};
+    CYBOZU_TEST_ASSERT(order == expected);
+    CYBOZU_TEST_EQUAL(mutex.state, 0u);
+}
+
+
+CYBOZU_TEST_AUTO(bucket_move_test)
+{
+    using Lock = PQBucketLock;
+    Lock::Mutex mutex;
+    Lock lk0(&mutex, 0);
+    Lock lk1(std::move(lk0));
+    lk1.unlock();
+    CYBOZU_TEST_EQUAL(mutex.state, 0u);
+}
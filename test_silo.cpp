@@ -0,0 +1,160 @@
+#include <vector>
+#include "occ.hpp"
+#include "vector_payload.hpp"
+#include "sleep.hpp"
+#include "transfer_test_util.hpp"
+#include "cybozu/test.hpp"
+
+
+using LockSet = cybozu::occ::SiloLockSet;
+using Mutex = LockSet::Mutex;
+using TidWord = LockSet::TidWord;
+using Reclaimer = cybozu::ebr::EpochReclaimer;
+
+
+CYBOZU_TEST_AUTO(test_commit_tid)
+{
+    VectorWithPayload<Mutex> recV;
+    recV.setPayloadSize(sizeof(uint64_t));
+    recV.resize(2);
+    for (size_t i = 0; i < 2; i++) ::memset(recV[i].payload, 0, sizeof(uint64_t));
+
+    EpochGenerator epochGen;
+    LockSet::TimestampAllocator tsAlloc(epochGen, 1);
+    Reclaimer reclaimer(1);
+    Reclaimer::Local local(reclaimer, 0);
+    LockSet lockSet;
+    lockSet.init(sizeof(uint64_t), 2, tsAlloc, local, 0);
+
+    uint64_t v = 0;
+    TidWord prev = 0;
+    for (size_t i = 0; i < 100; i++) {
+        lockSet.begin(false);
+        lockSet.read(recV[0].value, recV[0].payload, &v);
+        v++;
+        lockSet.write(recV[i % 2].value, recV[i % 2].payload, &v);
+        lockSet.lock();
+        CYBOZU_TEST_ASSERT(lockSet.verify());
+        lockSet.updateAndUnlock();
+        CYBOZU_TEST_ASSERT(lockSet.empty());
+
+        // TIDs of a worker increase and are in the current epoch or before.
+        const TidWord tid = recV[i % 2].value.load();
+        CYBOZU_TEST_ASSERT(!tid.lock);
+        CYBOZU_TEST_ASSERT(uint64_t(tid) > uint64_t(prev));
+        CYBOZU_TEST_ASSERT(tid.epoch <= tsAlloc.get());
+        prev = tid;
+    }
+}
+
+
+/**
+ * A read-only transaction reads the versions of its snapshot epoch
+ * while writers overwrite the record in later epochs.
+ */
+CYBOZU_TEST_AUTO(test_snapshot)
+{
+    VectorWithPayload<Mutex> recV;
+    recV.setPayloadSize(sizeof(uint64_t));
+    recV.resize(1);
+    auto& item = recV[0];
+    ::memset(item.payload, 0, sizeof(uint64_t));
+
+    EpochGenerator epochGen;
+    LockSet::TimestampAllocator tsAlloc(epochGen, 2, 4);
+    Reclaimer reclaimer(2);
+    Reclaimer::Local l0(reclaimer, 0), l1(reclaimer, 1);
+    LockSet writer, reader;
+    writer.init(sizeof(uint64_t), 1, tsAlloc, l0, 0);
+    reader.init(sizeof(uint64_t), 1, tsAlloc, l1, 1);
+    auto update = [&](uint64_t v) {
+        writer.begin(false);
+        writer.write(item.value, item.payload, &v);
+        writer.lock();
+        CYBOZU_TEST_ASSERT(writer.verify());
+        writer.updateAndUnlock();
+    };
+
+    update(1);
+    sleep_ms(20); // the snapshot will include the write.
+    reader.begin(true);
+    for (uint64_t i = 2; i < 100; i++) {
+        update(i);
+        if (i % 10 == 0) sleep_ms(2);
+    }
+    // The newest version is not visible, and no validation is required.
+    uint64_t v;
+    reader.read(item.value, item.payload, &v);
+    CYBOZU_TEST_EQUAL(v, 1);
+    reader.lock();
+    CYBOZU_TEST_ASSERT(reader.verify());
+    reader.updateAndUnlock();
+    CYBOZU_TEST_ASSERT(reader.empty());
+
+    // A later snapshot sees the last write.
+    sleep_ms(20);
+    reader.begin(true);
+    reader.read(item.value, item.payload, &v);
+    CYBOZU_TEST_EQUAL(v, 99);
+    reader.updateAndUnlock();
+
+    // A read-write transaction always reads the newest version.
+    writer.begin(false);
+    writer.read(item.value, item.payload, &v);
+    CYBOZU_TEST_EQUAL(v, 99);
+    writer.clear();
+}
+
+
+struct Shared
+{
+    EpochGenerator epochGen;
+    LockSet::TimestampAllocator tsAlloc;
+    Reclaimer reclaimer;
+
+    explicit Shared(size_t nrTh) : epochGen(), tsAlloc(epochGen, nrTh, 4), reclaimer(nrTh) {}
+};
+
+
+struct Worker
+{
+    using Mutex = LockSet::Mutex;
+
+    Reclaimer::Local local;
+    LockSet lockSet;
+
+    Worker(Shared& shared, size_t idx) : local(shared.reclaimer, idx), lockSet() {
+        lockSet.init(sizeof(uint64_t), 2, shared.tsAlloc, local, idx);
+    }
+    void beginTx() {}
+    void begin(bool readOnly) { lockSet.begin(readOnly); }
+    bool read(Mutex& mutex, void *sharedVal, uint64_t& v) {
+        lockSet.read(mutex, sharedVal, &v);
+        return true;
+    }
+    bool readForUpdate(Mutex& mutex, void *sharedVal, uint64_t& v) { return read(mutex, sharedVal, v); }
+    bool write(Mutex& mutex, void *sharedVal, uint64_t v) {
+        lockSet.write(mutex, sharedVal, &v);
+        return true;
+    }
+    bool commit() {
+        lockSet.lock();
+        if (!lockSet.verify()) return false;
+        lockSet.updateAndUnlock();
+        return true;
+    }
+    void abort() { lockSet.clear(); }
+    bool empty() const { return lockSet.empty(); }
+};
+
+
+CYBOZU_TEST_AUTO(test_transfer)
+{
+    TransferParam param;
+    param.nrReader = 2;
+    param.nrTx = 20000;
+    VectorWithPayload<Mutex> recV;
+    initTransferRecords(recV, param.nrRec);
+    Shared shared(param.nrWriter + param.nrReader);
+    testTransfer<Worker>(recV, shared, param);
+}
@@ -0,0 +1,123 @@
+#include <vector>
+#include "soa_read_set.hpp"
+#include "occ.hpp"
+#include "tictoc.hpp"
+#include "vector_payload.hpp"
+#include "random.hpp"
+#include "cybozu/test.hpp"
+
+
+template <typename Word>
+void testFindMismatch()
+{
+    cybozu::util::Xoroshiro128Plus rand(0);
+    for (size_t loop = 0; loop < 100; loop++) {
+        const size_t n = rand() % 300;
+        std::vector<Word> words(n);
+        cybozu::SoaReadSet<Word> soa;
+        std::vector<size_t> bad;
+        for (size_t i = 0; i < n; i++) {
+            words[i] = Word(rand());
+            const Word mask = rand() % 4 == 0 ? 0 : Word(rand()) | 1;
+            Word exp = words[i];
+            if (rand() % 64 == 0) {
+                exp ^= Word(rand()) | 1; // the lowest bit differs at least.
+                if (mask != 0) bad.push_back(i);
+            }
+            soa.add(&words[i], exp, mask);
+        }
+        CYBOZU_TEST_EQUAL(soa.size(), n);
+        size_t i = 0;
+        for (size_t b : bad) {
+            i = soa.findMismatch(i);
+            CYBOZU_TEST_EQUAL(i, b);
+            i++;
+        }
+        CYBOZU_TEST_EQUAL(soa.findMismatch(i), n);
+    }
+}
+
+
+CYBOZU_TEST_AUTO(find_mismatch)
+{
+    testFindMismatch<uint32_t>();
+    testFindMismatch<uint64_t>();
+}
+
+
+/**
+ * Large read sets are verified in batch.
+ * stale: index of the record updated by another worker. -1 means none.
+ */
+template <typename Mutex, typename Func>
+bool runLargeTx(int stale, Func&& commit)
+{
+    const size_t nrRec = 200;
+    VectorWithPayload<Mutex> recV;
+    recV.setPayloadSize(sizeof(uint64_t));
+    recV.resize(nrRec);
+    return commit(recV, stale);
+}
+
+
+CYBOZU_TEST_AUTO(occ_verify_batch)
+{
+    using Mutex = cybozu::occ::OccMutex;
+    auto commit = [](VectorWithPayload<Mutex>& recV, int stale) {
+        cybozu::occ::LockSet lockSet;
+        lockSet.init(sizeof(uint64_t), recV.size());
+        uint64_t v = 0;
+        for (size_t i = 0; i < recV.size(); i++) {
+            lockSet.read(recV[i].value, recV[i].payload, &v);
+        }
+        for (size_t i = 0; i < recV.size(); i += 10) {
+            lockSet.write(recV[i].value, recV[i].payload, &v);
+        }
+        if (stale >= 0) {
+            cybozu::occ::OccMutexData md = recV[stale].value.load();
+            md.version++;
+            recV[stale].value.store(md);
+        }
+        lockSet.lock();
+        const bool ret = lockSet.verify();
+        if (ret) {
+            lockSet.updateAndUnlock();
+        } else {
+            lockSet.clear();
+        }
+        return ret;
+    };
+    CYBOZU_TEST_ASSERT(runLargeTx<Mutex>(-1, commit));
+    CYBOZU_TEST_ASSERT(!runLargeTx<Mutex>(10, commit)); // in the write set.
+    CYBOZU_TEST_ASSERT(!runLargeTx<Mutex>(111, commit));
+    CYBOZU_TEST_ASSERT(!runLargeTx<Mutex>(199, commit));
+}
+
+
+CYBOZU_TEST_AUTO(tictoc_validate_batch)
+{
+    using Mutex = cybozu::tictoc::Mutex;
+    auto commit = [](VectorWithPayload<Mutex>& recV, int stale) {
+        cybozu::tictoc::LocalSet localSet;
+        localSet.init(sizeof(uint64_t), recV.size());
+        uint64_t v = 0;
+        for (size_t i = 0; i < recV.size(); i++) {
+            localSet.read(recV[i].value, recV[i].payload, &v);
+        }
+        for (size_t i = 0; i < recV.size(); i += 10) {
+            localSet.write(recV[i].value, recV[i].payload, &v);
+        }
+        if (stale >= 0) {
+            cybozu::tictoc::TsWord tsw = recV[stale].value.load();
+            tsw.wts++;
+            recV[stale].value.store_release(tsw);
+        }
+        const bool ret = localSet.preCommit();
+        if (!ret) localSet.clear();
+        return ret;
+    };
+    CYBOZU_TEST_ASSERT(runLargeTx<Mutex>(-1, commit));
+    CYBOZU_TEST_ASSERT(!runLargeTx<Mutex>(10, commit)); // in the write set.
+    CYBOZU_TEST_ASSERT(!runLargeTx<Mutex>(111, commit));
+    CYBOZU_TEST_ASSERT(!runLargeTx<Mutex>(199, commit));
+}
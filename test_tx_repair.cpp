@@ -0,0 +1,113 @@
+#include <vector>
+#include <thread>
+#include "occ.hpp"
+#include "tictoc.hpp"
+#include "vector_payload.hpp"
+#include "thread_util.hpp"
+#include "random.hpp"
+#include "cybozu/test.hpp"
+
+
+/**
+ * The local value of a write is the value read plus one.
+ */
+void increment(void *dst, const void *src, size_t size)
+{
+    uint64_t v;
+    ::memcpy(&v, src, size);
+    v++;
+    ::memcpy(dst, &v, size);
+}
+
+
+/**
+ * Each transaction increments two records.
+ * Lost updates occur if repaired writes are not computed again.
+ */
+template <typename Mutex, typename Func>
+void testCounter(Func&& runTx)
+{
+    const size_t nrRec = 4;
+    const size_t nrTh = 4;
+    const size_t nrTx = 2000;
+    VectorWithPayload<Mutex> recV;
+    recV.setPayloadSize(sizeof(uint64_t));
+    recV.resize(nrRec);
+    for (size_t i = 0; i < nrRec; i++) ::memset(recV[i].payload, 0, sizeof(uint64_t));
+
+    cybozu::thread::ThreadRunnerSet thS;
+    for (size_t i = 0; i < nrTh; i++) {
+        thS.add([&,i]() {
+            cybozu::util::Xoroshiro128Plus rand(i);
+            runTx(recV, rand, nrTx);
+        });
+    }
+    thS.start();
+    CYBOZU_TEST_ASSERT(thS.join().empty());
+    uint64_t sum = 0;
+    for (size_t i = 0; i < nrRec; i++) {
+        uint64_t v;
+        ::memcpy(&v, recV[i].payload, sizeof(uint64_t));
+        sum += v;
+    }
+    CYBOZU_TEST_EQUAL(sum, nrTh * nrTx * 2);
+}
+
+
+CYBOZU_TEST_AUTO(occ_repair)
+{
+    using Mutex = cybozu::occ::OccMutex;
+    testCounter<Mutex>([](VectorWithPayload<Mutex>& recV, cybozu::util::Xoroshiro128Plus& rand, size_t nrTx) {
+        cybozu::occ::LockSet lockSet;
+        lockSet.init(sizeof(uint64_t), 2);
+        lockSet.setRepair(increment);
+        for (size_t j = 0; j < nrTx; j++) {
+            const size_t k0 = rand() % recV.size();
+            const size_t k1 = (k0 + 1 + rand() % (recV.size() - 1)) % recV.size();
+            for (;;) {
+                for (size_t k : {k0, k1}) {
+                    Mutex& mutex = recV[k].value;
+                    uint64_t v;
+                    lockSet.read(mutex, recV[k].payload, &v);
+                    std::this_thread::yield();
+                    increment(&v, &v, sizeof(v));
+                    lockSet.write(mutex, recV[k].payload, &v, &mutex);
+                }
+                lockSet.lock();
+                if (lockSet.verifyWithRepair()) {
+                    lockSet.updateAndUnlock();
+                    break;
+                }
+                lockSet.clear();
+            }
+            CYBOZU_TEST_ASSERT(lockSet.empty());
+        }
+    });
+}
+
+
+CYBOZU_TEST_AUTO(tictoc_repair)
+{
+    using Mutex = cybozu::tictoc::Mutex;
+    testCounter<Mutex>([](VectorWithPayload<Mutex>& recV, cybozu::util::Xoroshiro128Plus& rand, size_t nrTx) {
+        cybozu::tictoc::LocalSet localSet;
+        localSet.init(sizeof(uint64_t), 2);
+        localSet.setRepair(increment);
+        for (size_t j = 0; j < nrTx; j++) {
+            const size_t k0 = rand() % recV.size();
+            const size_t k1 = (k0 + 1 + rand() % (recV.size() - 1)) % recV.size();
+            for (;;) {
+                for (size_t k : {k0, k1}) {
+                    Mutex& mutex = recV[k].value;
+                    uint64_t v;
+                    localSet.read(mutex, recV[k].payload, &v);
+                    std::this_thread::yield();
+                    increment(&v, &v, sizeof(v));
+                    localSet.write(mutex, recV[k].payload, &v, &mutex);
+                }
+                if (localSet.preCommit()) break;
+                localSet.clear();
+            }
+        }
+    });
+}
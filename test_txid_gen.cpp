@@ -0,0 +1,92 @@
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include "tx_util.hpp"
+#include "wait_die.hpp"
+#include "cybozu/test.hpp"
+
+
+CYBOZU_TEST_AUTO(tsc_txid_test)
+{
+    using Gen = TscTxIdGenerator<>;
+    const uint64_t base = cybozu::time::rdtscp();
+    Gen g0(0, base), g1(5, base);
+    const size_t nrLoop = 100000;
+    Gen::Id prev = g0.get();
+    for (size_t i = 0; i < nrLoop; i++) {
+        const Gen::Id id = g0.get();
+        CYBOZU_TEST_ASSERT(prev < id);
+        CYBOZU_TEST_EQUAL(id % 1024, 0u);
+        prev = id;
+    }
+    CYBOZU_TEST_EQUAL(g1.get() % 1024, 5u);
+    CYBOZU_TEST_EXCEPTION(Gen(1023, base), cybozu::Exception);
+}
+
+
+CYBOZU_TEST_AUTO(tsc_txid_follows_clock)
+{
+    using Gen = TscTxIdGenerator<>;
+    const uint64_t base = cybozu::time::rdtscp();
+    Gen g0(0, base), g1(1, base);
+    const size_t nrLoop = 100000;
+    for (size_t i = 0; i < nrLoop; i++) {
+        // The time part is between the ticks before and after, however fast TxIds are taken.
+        const uint64_t t0 = g0.tick();
+        const Gen::Id id = g0.get();
+        const uint64_t t1 = g0.tick();
+        const uint64_t t = id >> Gen::TimeShift;
+        CYBOZU_TEST_ASSERT(t0 <= t && t <= t1);
+    }
+    // An older TxId of a busy worker is smaller than a newer one of an idle worker.
+    const Gen::Id id0 = g0.get();
+    const uint64_t t = g0.tick();
+    while (g1.tick() <= t) _mm_pause();
+    CYBOZU_TEST_ASSERT(id0 < g1.get());
+}
+
+
+CYBOZU_TEST_AUTO(tsc_txid32_test)
+{
+    using Gen = TscTxIdGenerator32<>;
+    static_assert(std::is_same<Gen::Id, cybozu::wait_die::TxId>::value);
+    const uint64_t base = cybozu::time::rdtscp();
+    Gen g0(0, base), g1(5, base);
+    const size_t nrLoop = 100000;
+    Gen::Id prev = g0.get();
+    for (size_t i = 0; i < nrLoop; i++) {
+        // No wraparound within the loop.
+        const Gen::Id id = g0.get();
+        CYBOZU_TEST_ASSERT(prev < id);
+        CYBOZU_TEST_EQUAL(id % 256, 0u);
+        prev = id;
+    }
+    CYBOZU_TEST_EQUAL(g1.get() % 256, 5u);
+    CYBOZU_TEST_EXCEPTION(Gen(255, base), cybozu::Exception);
+}
+
+
+CYBOZU_TEST_AUTO(counting_network_txid_test)
+{
+    using Gen = CountingNetworkTxIdGenerator<>;
+    const size_t nrTh = 4, nrLoop = 10000;
+    cybozu::util::CountingNetwork8 cn;
+    std::vector<std::vector<TxId> > idVV(nrTh);
+    std::vector<std::thread> th_v;
+    for (size_t i = 0; i < nrTh; i++) {
+        th_v.emplace_back([&,i]() {
+            Gen gen(cn, i);
+            for (size_t j = 0; j < nrLoop; j++) idVV[i].push_back(gen.get());
+        });
+    }
+    for (std::thread& th : th_v) th.join();
+
+    // All the values in [0, nrTh * nrLoop) are generated once.
+    std::vector<TxId> idV;
+    for (const std::vector<TxId>& v : idVV) idV.insert(idV.end(), v.begin(), v.end());
+    std::sort(idV.begin(), idV.end());
+    for (size_t i = 0; i < idV.size(); i++) {
+        CYBOZU_TEST_EQUAL(idV[i], i);
+    }
+}
@@ -3,6 +3,7 @@
 #include <cstring>
 #include <sstream>
 #include "wait_die.hpp"
+#include "vector_payload.hpp"
 #include "random.hpp"
 #include "tx_util.hpp"
 #include "sleep.hpp"
@@ -276,7 +277,7 @@ void worker(size_t idx, size_t max_id, uint64_t seed, bool& quit,
     data.reset(idx, max_id, nr_lines);
 
     while (!load_acquire(quit)) {
-        TxId tx_id = epochTxIdGen.get();
+        cybozu::wait_die::TxId tx_id = epochTxIdGen.get();
         if ((rand() & 0xff) < 0x80) {
             size_t retry = 0;
             for (; retry < max_retry; retry++) {
@@ -346,3 +347,143 @@ CYBOZU_TEST_AUTO(read_write_lock_test)
 #endif
     test_read_write_lock<WaitDieLock>(4096 / CACHE_LINE_SIZE, 64, 1000, 100000);
 }
+
+
+/**
+ * WoundWaitLock4 test.
+ */
+CYBOZU_TEST_AUTO(wound_wait_mutex_test)
+{
+    WoundWaitLock4::Mutex mutex;
+    WoundFlag flag10, flag20, flag30;
+    Request req10(10, RequestType::READ_LOCK, &flag10);
+    {
+        WoundWaitLock4 lk;
+        CYBOZU_TEST_ASSERT(lk.writeLock(mutex, 20, flag20));
+
+        // Younger requests wait without wounding.
+        Request req30(30, RequestType::WRITE_LOCK, &flag30);
+        mutex.do_request_async(req30);
+        CYBOZU_TEST_ASSERT(!flag20.is_wounded());
+
+        // Older requests wound younger holders.
+        mutex.do_request_async(req10);
+        CYBOZU_TEST_ASSERT(flag20.is_wounded());
+        CYBOZU_TEST_ASSERT(!flag30.is_wounded());
+
+        // A waiting request leaves the queue by cancel.
+        Request cancel30(30, RequestType::CANCEL, &flag30);
+        cancel30.target = &req30;
+        CYBOZU_TEST_ASSERT(mutex.do_request(cancel30));
+        CYBOZU_TEST_EQUAL(req30.local_spin_wait(), Message::FAILED);
+        const Header h0 = mutex.load_header();
+        CYBOZU_TEST_EQUAL(h0.tx_id, 20U);
+        CYBOZU_TEST_EQUAL(h0.write_requests, 0U);
+    }
+    // The older request is granted after the wounded holder unlocks.
+    CYBOZU_TEST_EQUAL(req10.local_spin_wait(), Message::SUCCEEDED);
+    {
+        const Header h0 = mutex.load_header();
+        CYBOZU_TEST_EQUAL(h0.tx_id, 10U);
+        CYBOZU_TEST_EQUAL(h0.readers, 1U);
+    }
+    {
+        // Younger readers share the lock without wounding.
+        WoundWaitLock4 lk;
+        CYBOZU_TEST_ASSERT(lk.readLock(mutex, 30, flag30));
+        CYBOZU_TEST_ASSERT(!flag10.is_wounded());
+        CYBOZU_TEST_ASSERT(!lk.upgrade());
+    }
+    {
+        Request req(10, RequestType::UPGRADE, &flag10);
+        CYBOZU_TEST_ASSERT(mutex.do_request(req));
+        CYBOZU_TEST_ASSERT(mutex.load_header().is_write_locked());
+    }
+    {
+        Request req(10, RequestType::WRITE_UNLOCK, &flag10);
+        CYBOZU_TEST_ASSERT(mutex.do_request(req));
+        const Header h0 = mutex.load_header();
+        CYBOZU_TEST_ASSERT(h0.is_unlocked());
+        CYBOZU_TEST_EQUAL(h0.tx_id, MAX_TXID);
+    }
+}
+
+
+/**
+ * Transfer transactions with LockSet<WoundWaitLock4>.
+ * Worker 0 runs long transactions that read all the records.
+ * Each transaction keeps its tx_id over retries so it will not starve.
+ */
+CYBOZU_TEST_AUTO(wound_wait_lock_set_test)
+{
+    using WLockSet = LockSet<WoundWaitLock4>;
+    using WMutex = WLockSet::Mutex;
+    const size_t nrRec = 10, nrTh = 4, nrTx = 300;
+    const uint64_t initial = 1000;
+
+    VectorWithPayload<WMutex> recV;
+    recV.setPayloadSize(sizeof(uint64_t));
+    recV.resize(nrRec);
+    for (size_t i = 0; i < nrRec; i++) {
+        ::memcpy(recV[i].payload, &initial, sizeof(uint64_t));
+    }
+    SimpleTxIdGenerator txIdGen;
+    std::vector<size_t> nrBad(nrTh, 0);
+
+    std::vector<std::thread> th_v;
+    for (size_t i = 0; i < nrTh; i++) {
+        th_v.emplace_back([&,i]() {
+            WLockSet lockSet;
+            lockSet.init(sizeof(uint64_t), nrRec);
+            cybozu::util::Xoroshiro128Plus rand(i);
+            for (size_t j = 0; j < nrTx; j++) {
+                lockSet.setTxId(txIdGen.get());
+                for (;;) {
+                    if (i == 0) {
+                        uint64_t sum = 0;
+                        bool ok = true;
+                        for (size_t k = 0; k < nrRec && ok; k++) {
+                            uint64_t v;
+                            ok = lockSet.read(recV[k].value, recV[k].payload, &v);
+                            sum += v;
+                        }
+                        if (ok && lockSet.blindWriteLockAll()) {
+                            if (sum != initial * nrRec) nrBad[i]++;
+                            lockSet.updateAndUnlock();
+                            break;
+                        }
+                    } else {
+                        const size_t k0 = rand() % nrRec;
+                        const size_t k1 = (k0 + 1 + rand() % (nrRec - 1)) % nrRec;
+                        uint64_t v0, v1;
+                        if (lockSet.readForUpdate(recV[k0].value, recV[k0].payload, &v0) &&
+                            lockSet.readForUpdate(recV[k1].value, recV[k1].payload, &v1)) {
+                            if (v0 > 0) {
+                                v0--; v1++;
+                            }
+                            if (lockSet.write(recV[k0].value, recV[k0].payload, &v0) &&
+                                lockSet.write(recV[k1].value, recV[k1].payload, &v1) &&
+                                lockSet.blindWriteLockAll()) {
+                                lockSet.updateAndUnlock();
+                                break;
+                            }
+                        }
+                    }
+                    lockSet.unlock();
+                }
+            }
+        });
+    }
+    for (std::thread& th : th_v) th.join();
+    for (size_t i = 0; i < nrTh; i++) {
+        CYBOZU_TEST_EQUAL(nrBad[i], 0);
+    }
+    uint64_t sum = 0;
+    for (size_t i = 0; i < nrRec; i++) {
+        uint64_t v;
+        ::memcpy(&v, recV[i].payload, sizeof(uint64_t));
+        sum += v;
+        CYBOZU_TEST_ASSERT(recV[i].value.load_header().is_unlocked());
+    }
+    CYBOZU_TEST_EQUAL(sum, initial * nrRec);
+}
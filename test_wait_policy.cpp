@@ -0,0 +1,114 @@
+#include <thread>
+#include <vector>
+#include "wait_policy.hpp"
+#include "lock.hpp"
+#include "occ.hpp"
+#include "tictoc.hpp"
+#include "sleep.hpp"
+#include "cybozu/test.hpp"
+
+
+using namespace cybozu::wait_policy;
+
+
+CYBOZU_TEST_AUTO(parse_test)
+{
+    for (const auto& p : policyTable_) {
+        CYBOZU_TEST_ASSERT(parsePolicy(p.second) == p.first);
+        CYBOZU_TEST_EQUAL(std::string(policyToStr(p.first)), p.second);
+    }
+    CYBOZU_TEST_EXCEPTION(parsePolicy("sleep"), cybozu::Exception);
+}
+
+
+/**
+ * Increment a counter with nrTh threads in each policy.
+ * Lock: lock(mutex), unlock().
+ */
+template <typename Mutex, typename LockFunc, typename UnlockFunc>
+void testCounter(LockFunc&& lockF, UnlockFunc&& unlockF)
+{
+    const size_t nrTh = 4, nrLoop = 3000;
+    for (const auto& p : policyTable_) {
+        policy_ = p.first;
+        Mutex mutex;
+        size_t counter = 0;
+        std::vector<std::thread> th_v;
+        for (size_t i = 0; i < nrTh; i++) {
+            th_v.emplace_back([&]() {
+                for (size_t j = 0; j < nrLoop; j++) {
+                    auto lk = lockF(mutex);
+                    counter++;
+                    unlockF(lk);
+                }
+            });
+        }
+        for (std::thread& th : th_v) th.join();
+        CYBOZU_TEST_EQUAL(counter, nrTh * nrLoop);
+    }
+    policy_ = Policy::SPIN;
+}
+
+
+CYBOZU_TEST_AUTO(xs_mutex_test)
+{
+    using Mutex = cybozu::lock::XSMutex;
+    testCounter<Mutex>(
+        [](Mutex& m) { m.write_lock(); return &m; },
+        [](Mutex* m) { m->write_unlock(); });
+    // S --> X
+    testCounter<Mutex>(
+        [](Mutex& m) {
+            for (;;) {
+                m.read_lock();
+                if (m.tryUpgrade()) return &m;
+                m.read_unlock();
+            }
+        },
+        [](Mutex* m) { m->write_unlock(); });
+}
+
+
+CYBOZU_TEST_AUTO(occ_lock_test)
+{
+    using Mutex = cybozu::occ::OccMutex;
+    using Lock = cybozu::occ::OccLock;
+    testCounter<Mutex>(
+        [](Mutex& m) { return std::make_unique<Lock>(&m); },
+        [](std::unique_ptr<Lock>& lk) { lk->unlock(true); });
+}
+
+
+CYBOZU_TEST_AUTO(tictoc_lock_test)
+{
+    using Mutex = cybozu::tictoc::Mutex;
+    using Lock = cybozu::tictoc::Lock;
+    testCounter<Mutex>(
+        [](Mutex& m) {
+            std::unique_ptr<Lock> lk(new Lock());
+            lk->lock(m);
+            return lk;
+        },
+        [](std::unique_ptr<Lock>& lk) { lk->unlock(); });
+}
+
+
+CYBOZU_TEST_AUTO(park_wakeup_test)
+{
+    // The waiter must be parked before the unlock.
+    policy_ = Policy::PARK;
+    cybozu::lock::XSMutex mutex;
+    mutex.write_lock();
+    bool locked = false;
+    std::thread th([&]() {
+        mutex.write_lock();
+        store_release(locked, true);
+        mutex.write_unlock();
+    });
+    sleep_ms(100);
+    CYBOZU_TEST_ASSERT(!load_acquire(locked));
+    mutex.write_unlock();
+    th.join();
+    CYBOZU_TEST_ASSERT(locked);
+    policy_ = Policy::SPIN;
+}
@@ -1,6 +1,7 @@
 #include <ctime>
 #include <vector>
 #include <chrono>
+#include <memory>
 #include <unistd.h>
 #include "tictoc.hpp"
 #include "thread_util.hpp"
@@ -11,6 +12,8 @@
 #include "cache_line_size.hpp"
 #include "zipf.hpp"
 #include "workload_util.hpp"
+#include "tpcc_util.hpp"
+#include "wal.hpp"
 
 
 #ifdef USE_PARTITION
@@ -29,6 +32,15 @@ struct Shared
 #else
     VectorWithPayload<Mutex> recV;
 #endif
+    cybozu::tictoc::LocalSet::OrderedIndex index; // used by scan workload.
+    size_t scanLen; // 0 means point read.
+    cybozu::tictoc::LocalSet::Table table; // used by insert workload.
+    std::unique_ptr<cybozu::ebr::EpochReclaimer> reclaimer;
+    size_t insertWindow;
+    tpcc::Db<Mutex> tpcc; // used by tpcc workload.
+    cybozu::wal::Logger logger; // used if -log is specified.
+    size_t nrMu;
+    size_t nrTh;
     size_t longTxSize;
     size_t nrOp;
     double wrRatio;
@@ -39,6 +51,7 @@ struct Shared
     bool usesRMW;
     cybozu::tictoc::NoWaitMode nowait_mode;
     bool do_preemptive_verify;
+    bool repair;
     size_t nrTh4LongTx;
     size_t payload;
     bool usesZipf;
@@ -100,9 +113,13 @@ TicTocResult worker2(
     const size_t realNrWr = isLongTx ? shared.nrWr4Long : size_t(shared.wrRatio * (double)nrOp);
     auto getMode = selectGetModeFunc<decltype(rand), Mode>(isLongTx, shortTxMode, longTxMode);
     auto getRecordIdx = selectGetRecordIdx<decltype(rand)>(isLongTx, shortTxMode, longTxMode, shared.usesZipf);
-    localSet.init(shared.payload, realNrOp);
+    const size_t scanLen = shared.scanLen;
+    localSet.init(shared.payload, realNrOp * std::max<size_t>(scanLen, 1));
     localSet.setNowait(shared.nowait_mode);
     localSet.set_do_preemptive_verify(shared.do_preemptive_verify);
+    // The local value of a write is the value of the last read.
+    if (shared.repair) localSet.setRepair(cybozu::TxRepair::copy);
+    cybozu::wal::LogBuffer *logBuf = shared.logger.enabled() ? &shared.logger.buffer(idx) : nullptr;
 
     store_release(ready, 1);
     while (!load_acquire(start)) _mm_pause();
@@ -112,32 +129,45 @@ TicTocResult worker2(
         uint64_t t0 = 0;
         if (shared.usesBackOff) t0 = cybozu::time::rdtscp();
         auto randState = rand.getState();
+        res.beginTx();
         for (size_t retry = 0;; retry++) {
             if (load_acquire(quit)) break; // to quit under starvation.
             rand.setState(randState);
             // Try to run transaction.
+            uint64_t logEpoch = 0;
+            const Mutex *src = nullptr; // the last read record.
             for (size_t i = 0; i < realNrOp; i++) {
                 size_t key = getRecordIdx(rand, fastZipf, recV.size(), realNrOp, i, firstRecIdx);
                 Mode mode = getMode(rand, realNrOp, realNrWr, wrRatio, i);
                 bool isWrite = (mode == Mode::X);
 
+                if (!isWrite && scanLen > 0) {
+                    localSet.scan(shared.index, key, scanLen, &value[0]);
+                    continue;
+                }
                 auto& item = recV[key];
                 Mutex& mutex = item.value;
                 if (shared.usesRMW || !isWrite) {
                     localSet.read(mutex, item.payload, &value[0]);
+                    src = &mutex;
                 }
                 if (isWrite) {
-                    localSet.write(mutex, item.payload, &value[0]);
+                    localSet.write(mutex, item.payload, &value[0], src);
+                    if (logBuf) logBuf->stage(key, &value[0], shared.payload);
                 }
             }
-            if (unlikely(!localSet.preCommit())) {
+            if (unlikely(!localSet.preCommit([&]() {
+                        if (logBuf) logEpoch = logBuf->enterCommit();
+                    }))) {
                 goto abort;
             }
+            if (logBuf) logBuf->commit(logEpoch);
             res.incCommit(isLongTx);
             res.addRetryCount(isLongTx, retry);
             break;
           abort:
             localSet.clear();
+            if (logBuf) logBuf->discard();
             res.incAbort(isLongTx);
             if (shared.usesBackOff) backOff(t0, retry, rand);
         }
@@ -153,6 +183,159 @@ TicTocResult worker2(
 }
 
 
+/**
+ * Insert workload.
+ * Each transaction accesses preloaded records through the index,
+ * inserts a new record, and removes an old record inserted by itself.
+ */
+TicTocResult worker3(
+    size_t idx, uint8_t& ready, const bool& start, const bool& quit,
+    bool& shouldQuit, Shared& shared)
+{
+    unused(shouldQuit);
+    cybozu::thread::setThreadAffinity(::pthread_self(), CpuId_[idx]);
+
+    auto& table = shared.table;
+    const size_t nrMu = shared.nrMu;
+    const size_t nrOp = shared.nrOp;
+    const size_t wrRatio = size_t(shared.wrRatio * (double)SIZE_MAX);
+    const TxMode shortTxMode = shared.shortTxMode;
+
+    TicTocResult res;
+    cybozu::util::Xoroshiro128Plus rand(::time(0), idx);
+    FastZipf fastZipf(rand, shared.zipfTheta, nrMu, shared.zipfZetan);
+    cybozu::tictoc::LocalSet localSet;
+    std::vector<uint8_t> value(shared.payload);
+    cybozu::ebr::EpochReclaimer::Local reclaimer(*shared.reclaimer, idx);
+    InsertKeyGen keyGen(nrMu, shared.nrTh, idx, shared.insertWindow);
+
+    const size_t realNrWr = size_t(shared.wrRatio * (double)nrOp);
+    auto getMode = selectGetModeFunc<decltype(rand), Mode>(false, shortTxMode, shortTxMode);
+    auto getRecordIdx = selectGetRecordIdx<decltype(rand)>(false, shortTxMode, shortTxMode, shared.usesZipf);
+    localSet.init(shared.payload, nrOp + 2);
+    localSet.setNowait(shared.nowait_mode);
+    localSet.set_do_preemptive_verify(shared.do_preemptive_verify);
+    localSet.setReclaimer(reclaimer);
+
+    store_release(ready, 1);
+    while (!load_acquire(start)) _mm_pause();
+    while (!load_acquire(quit)) {
+        size_t firstRecIdx = 0;
+        uint64_t t0 = 0;
+        if (shared.usesBackOff) t0 = cybozu::time::rdtscp();
+        auto randState = rand.getState();
+        res.beginTx();
+        for (size_t retry = 0;; retry++) {
+            if (load_acquire(quit)) break; // to quit under starvation.
+            cybozu::ebr::EpochReclaimer::Guard guard(reclaimer);
+            rand.setState(randState);
+            // Try to run transaction.
+            for (size_t i = 0; i < nrOp; i++) {
+                size_t key = getRecordIdx(rand, fastZipf, nrMu, nrOp, i, firstRecIdx);
+                Mode mode = getMode(rand, nrOp, realNrWr, wrRatio, i);
+                bool isWrite = (mode == Mode::X);
+
+                auto& item = *table.index().lookup(key);
+                Mutex& mutex = item.value;
+                if (shared.usesRMW || !isWrite) {
+                    localSet.read(mutex, item.payload, &value[0]);
+                }
+                if (isWrite) {
+                    localSet.write(mutex, item.payload, &value[0]);
+                }
+            }
+            if (unlikely(!localSet.insert(table, keyGen.newKey(), &value[0]))) goto abort;
+            if (keyGen.shouldRemove()) {
+                if (unlikely(!localSet.remove(table, keyGen.oldKey()))) goto abort;
+            }
+            if (unlikely(!localSet.preCommit())) {
+                goto abort;
+            }
+            keyGen.commit();
+            res.incCommit(false);
+            res.addRetryCount(false, retry);
+            break;
+          abort:
+            localSet.clear();
+            res.incAbort(false);
+            if (shared.usesBackOff) backOff(t0, retry, rand);
+        }
+    }
+    res.nr_preemptive_aborts =
+        cybozu::tictoc::get_thread_local_monitor_data().nr_preemptive_aborts;
+    return res;
+}
+
+
+struct TpccAccessor
+{
+    cybozu::tictoc::LocalSet& localSet;
+
+    INLINE bool read(DataWithPayload<Mutex>& rec, void *dst) {
+        localSet.read(rec.value, rec.payload, dst);
+        return true;
+    }
+    INLINE bool readForUpdate(DataWithPayload<Mutex>& rec, void *dst) {
+        return read(rec, dst);
+    }
+    INLINE bool write(DataWithPayload<Mutex>& rec, void *src) {
+        localSet.write(rec.value, rec.payload, src);
+        return true;
+    }
+};
+
+
+/**
+ * TPC-C subset workload.
+ * The home warehouse of each worker is determined by its index.
+ */
+TicTocResult worker4(
+    size_t idx, uint8_t& ready, const bool& start, const bool& quit,
+    bool& shouldQuit, Shared& shared)
+{
+    unused(shouldQuit);
+    cybozu::thread::setThreadAffinity(::pthread_self(), CpuId_[idx]);
+
+    auto& db = shared.tpcc;
+    TicTocResult res;
+    cybozu::util::Xoroshiro128Plus rand(::time(0), idx);
+    tpcc::InputGenerator<decltype(rand)> inputGen(rand, db.nrWh(), idx % db.nrWh());
+    tpcc::Input input;
+
+    cybozu::tictoc::LocalSet localSet;
+    localSet.init(tpcc::ROW_SIZE, tpcc::MAX_OL_CNT * 3 + 5);
+    localSet.setNowait(shared.nowait_mode);
+    localSet.set_do_preemptive_verify(shared.do_preemptive_verify);
+    TpccAccessor acc{localSet};
+
+    store_release(ready, 1);
+    while (!load_acquire(start)) _mm_pause();
+    while (!load_acquire(quit)) {
+        inputGen.generate(input);
+        uint64_t t0 = 0;
+        if (shared.usesBackOff) t0 = cybozu::time::rdtscp();
+        res.beginTx();
+        for (size_t retry = 0;; retry++) {
+            if (load_acquire(quit)) break; // to quit under starvation.
+            if (unlikely(!tpcc::run(db, acc, input))) goto abort;
+            if (unlikely(!localSet.preCommit())) {
+                goto abort;
+            }
+            res.incCommit(false);
+            res.addRetryCount(false, retry);
+            break;
+          abort:
+            localSet.clear();
+            res.incAbort(false);
+            if (shared.usesBackOff) backOff(t0, retry, rand);
+        }
+    }
+    res.nr_preemptive_aborts =
+        cybozu::tictoc::get_thread_local_monitor_data().nr_preemptive_aborts;
+    return res;
+}
+
+
 void runTest()
 {
 #if 0
@@ -222,18 +405,31 @@ struct CmdLineOptionPlus : CmdLineOption
     int usesRMW; // 0 or 1.
     int nowait;  // 0, 1, or 2.
     bool do_preemptive_verify;
+    size_t scanLen;
+    size_t insertWindow;
+    std::string logPath;
+    int odirect; // 0 or 1.
+    int repair; // 0 or 1.
 
     CmdLineOptionPlus(const std::string& description) : CmdLineOption(description) {
         appendOpt(&usesBackOff, 0, "backoff", "[0 or 1]: backoff (0:off, 1:on)");
         appendOpt(&usesRMW, 1, "rmw", "[0 or 1]: use read-modify-write or normal write (0:w, 1:rmw, default:1)");
         appendOpt(&nowait, 0, "nowait", "[0, 1, or 2]: use nowait optimization for write lock.");
         appendOpt(&do_preemptive_verify, 0, "preverify", "[0 or 1]: use preemptive verify.");
+        appendOpt(&scanLen, 10, "scan", "[num]: number of records of a range scan for scan workload (default:10).");
+        appendOpt(&insertWindow, 1000, "iwin", "[num]: number of live inserted records per worker for insert workload (default:1000).");
+        appendOpt(&logPath, "", "log", "[path]: redo log file for custom and scan workloads. empty means no logging (default).");
+        appendOpt(&odirect, 0, "odirect", "[0 or 1]: write the redo log with O_DIRECT (default:0).");
+        appendOpt(&repair, 0, "repair", "[0 or 1]: repair transactions instead of aborting on validation failure. "
+                  "stale reads are read again and only the writes derived from them are computed again (custom workload only, default:0).");
     }
     std::string str() const {
         return cybozu::util::formatString(
-            "mode:tictoc %s backoff:%d rmw:%d nowait:%d preverify:%d"
+            "mode:tictoc %s backoff:%d rmw:%d nowait:%d preverify:%d scanLen:%zu insertWindow:%zu log:%d odirect:%d repair:%d"
             , base::str().c_str(), usesBackOff ? 1 : 0, usesRMW ? 1 : 0, nowait
-            , int(do_preemptive_verify));
+            , int(do_preemptive_verify), workload == "scan" ? scanLen : 0
+            , workload == "insert" ? insertWindow : 0
+            , logPath.empty() ? 0 : 1, odirect ? 1 : 0, repair ? 1 : 0);
     }
 
     cybozu::tictoc::NoWaitMode nowait_mode() const {
@@ -251,6 +447,38 @@ struct CmdLineOptionPlus : CmdLineOption
 };
 
 
+void initShared(Shared& shared, const CmdLineOptionPlus& opt)
+{
+    initRecordVector(shared.recV, opt);
+    shared.scanLen = 0;
+    shared.longTxSize = opt.longTxSize;
+    shared.nrOp = opt.nrOp;
+    shared.wrRatio = opt.wrRatio;
+    shared.nrWr4Long = opt.nrWr4Long;
+    shared.shortTxMode = TxMode(opt.shortTxMode);
+    shared.longTxMode = TxMode(opt.longTxMode);
+    shared.usesBackOff = opt.usesBackOff ? 1 : 0;
+    shared.usesRMW = opt.usesRMW ? 1 : 0;
+    shared.nowait_mode = opt.nowait_mode();
+    shared.do_preemptive_verify = opt.do_preemptive_verify;
+    shared.repair = opt.repair != 0;
+    shared.nrTh4LongTx = opt.nrTh4LongTx;
+    shared.payload = opt.payload;
+    shared.nrMu = opt.getNrMu();
+    shared.nrTh = opt.nrTh;
+    shared.usesZipf = opt.usesZipf;
+    shared.zipfTheta = opt.zipfTheta;
+    if (shared.usesZipf) {
+        shared.zipfZetan = FastZipf::zeta(opt.getNrMu(), shared.zipfTheta);
+    } else {
+        shared.zipfZetan = 1.0;
+    }
+    if (!opt.logPath.empty()) {
+        shared.logger.open(opt.logPath, opt.nrTh, opt.odirect != 0);
+    }
+}
+
+
 int main(int argc, char *argv[]) try
 {
     CmdLineOptionPlus opt("tictoc_bench: benchmark with tictoc.");
@@ -261,31 +489,54 @@ int main(int argc, char *argv[]) try
     if (opt.payload != 0) throw cybozu::Exception("payload not supported");
 #endif
 
-    if (opt.workload == "custom") {
+    if (!opt.logPath.empty() && opt.workload != "custom" && opt.workload != "scan") {
+        throw cybozu::Exception("log is not supported by the workload.") << opt.workload;
+    }
+    if (opt.repair && opt.workload != "custom") {
+        throw cybozu::Exception("repair is not supported by the workload.") << opt.workload;
+    }
+    if (opt.repair && !opt.logPath.empty()) {
+        // Log records are staged before repair.
+        throw cybozu::Exception("repair is not supported with log.");
+    }
+
+    if (opt.workload == "custom" || opt.workload == "scan") {
         Shared shared;
-        initRecordVector(shared.recV, opt);
-        shared.longTxSize = opt.longTxSize;
-        shared.nrOp = opt.nrOp;
-        shared.wrRatio = opt.wrRatio;
-        shared.nrWr4Long = opt.nrWr4Long;
-        shared.shortTxMode = TxMode(opt.shortTxMode);
-        shared.longTxMode = TxMode(opt.longTxMode);
-        shared.usesBackOff = opt.usesBackOff ? 1 : 0;
-        shared.usesRMW = opt.usesRMW ? 1 : 0;
-        shared.nowait_mode = opt.nowait_mode();
-        shared.do_preemptive_verify = opt.do_preemptive_verify;
-        shared.nrTh4LongTx = opt.nrTh4LongTx;
-        shared.payload = opt.payload;
-        shared.usesZipf = opt.usesZipf;
-        shared.zipfTheta = opt.zipfTheta;
-        if (shared.usesZipf) {
-            shared.zipfZetan = FastZipf::zeta(opt.getNrMu(), shared.zipfTheta);
-        } else {
-            shared.zipfZetan = 1.0;
+        initShared(shared, opt);
+        if (opt.workload == "scan") {
+#ifdef USE_PARTITION
+            throw cybozu::Exception("scan workload does not support partition.");
+#endif
+            cybozu::index::build_index_from_vector(shared.index, shared.recV);
+            shared.scanLen = opt.scanLen;
         }
         for (size_t i = 0; i < opt.nrLoop; i++) {
             TicTocResult res;
             runExec(opt, shared, worker2, res);
+            cybozu::wal::putLogStat(shared.logger);
+        }
+    } else if (opt.workload == "insert") {
+        for (size_t i = 0; i < opt.nrLoop; i++) {
+            // Inserted keys must not remain in the next loop.
+            Shared shared;
+            initShared(shared, opt);
+            cybozu::record::initRecordTable(shared.table, opt);
+            shared.reclaimer.reset(new cybozu::ebr::EpochReclaimer(opt.nrTh));
+            shared.insertWindow = opt.insertWindow;
+            TicTocResult res;
+            runExec(opt, shared, worker3, res);
+        }
+    } else if (opt.workload == "tpcc") {
+#ifdef NO_PAYLOAD
+        throw cybozu::Exception("tpcc workload requires payload.");
+#endif
+        Shared shared;
+        initShared(shared, opt);
+        cybozu::util::Xoroshiro128Plus rand(::time(0));
+        shared.tpcc.init(opt.nrTh, rand, getReplicaNumaNodes(opt)); // a warehouse per worker.
+        for (size_t i = 0; i < opt.nrLoop; i++) {
+            TicTocResult res;
+            runExec(opt, shared, worker4, res);
         }
     } else {
         throw cybozu::Exception("bad workload.") << opt.workload;
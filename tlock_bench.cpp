@@ -49,7 +49,7 @@ struct TxInfo
 
 enum PQLockType
 {
-    // (0:none, 1:pqspin, 2:pqposix, 3:pqmcs1, 4:pqmcs2, 5:pq1993, 6:pq1997, 7:pqmcs3)");
+    // (0:none, 1:pqspin, 2:pqposix, 3:pqmcs1, 4:pqmcs2, 5:pq1993, 6:pq1997, 7:pqmcs3, 8:pqbucket)");
     USE_PQNoneLock = 0,
     USE_PQSpinLock = 1,
     USE_PQPosixLock = 2,
@@ -58,6 +58,7 @@ enum PQLockType
     USE_PQ1993Lock = 5,
     USE_PQ1997Lock = 6, // buggy.
     USE_PQMcsLock3 = 7,
+    USE_PQBucketLock = 8,
 };
 
 //using PQLock = cybozu::lock::PQNoneLock;
@@ -68,6 +69,7 @@ enum PQLockType
 //using PQLock = cybozu::lock::PQ1993Lock;
 //using PQLock = cybozu::lock::PQ1997Lock;
 //using PQLock = cybozu::lock::PQMcsLock3;
+//using PQLock = cybozu::lock::PQBucketLock;
 
 
 template <typename PQLock>
@@ -365,6 +367,7 @@ Result1 tWorker(size_t idx, uint8_t& ready, const bool& start, const bool& quit,
             throw cybozu::Exception("bad txIdGenType") << txIdGenType;
         }
 
+        res.beginTx();
         for (size_t retry = 0;; retry++) {
             if (loadAcquire(quit)) break; // to quit under starvation.
             assert(writeLocks.empty());
@@ -588,6 +591,7 @@ Result1 readWorker(size_t idx, const bool& start, const bool& quit, bool& should
 
         const uint32_t txId = txIdGen.get();
 
+        res.beginTx();
         for (size_t retry = 0;; retry++) {
             if (quit) break; // to quit under starvation.
             //bool abort = false;
@@ -734,6 +738,7 @@ Result1 iWorker(size_t idx, const bool& start, const bool& quit, bool& shouldQui
         }
         //::printf("worker %zu priId: %" PRIx64 "\n", idx, priId);
 
+        res.beginTx();
         for (size_t retry = 0;; retry++) {
             if (quit) break; // to quit under starvation.
             assert(writeLocks.empty());
@@ -922,6 +927,7 @@ Result1 iWorker2(size_t idx, uint8_t& ready, const bool& start, const bool& quit
         lockSet.setPriorityId(priId);
 
         size_t firstRecIdx;
+        res.beginTx();
         for (size_t retry = 0;; retry++) {
             if (loadAcquire(quit)) break; // to quit under starvation.
 
@@ -1130,7 +1136,7 @@ struct CmdLineOptionPlus : CmdLineOption
     CmdLineOptionPlus(const std::string& description) : CmdLineOption(description) {
         appendOpt(&modeStr, "trlock", "mode", "[mode]: specify mode in trlock, trlock-occ, trlock-hybrid.");
         appendOpt(&txIdGenType, 0, "txid-gen", "[id]: txid gen method (0:sclable, 1:bulk, 2:simple)");
-        appendOpt(&pqLockType, 0, "pqlock", "[id]: pqlock type (0:none, 1:pqspin, 2:pqposix, 3:pqmcs1, 4:pqmcs2, 5:pq1993, 6:pq1997, 7:pqmcs3)");
+        appendOpt(&pqLockType, 0, "pqlock", "[id]: pqlock type (0:none, 1:pqspin, 2:pqposix, 3:pqmcs1, 4:pqmcs2, 5:pq1993, 6:pq1997, 7:pqmcs3, 8:pqbucket)");
     }
     std::string str() const {
         return cybozu::util::formatString("mode:%s ", modeStr.c_str()) +
@@ -1249,6 +1255,9 @@ void dispatch0(CmdLineOptionPlus& opt)
     case USE_PQMcsLock3:
         dispatch1<cybozu::lock::PQMcsLock3>(opt);
         break;
+    case USE_PQBucketLock:
+        dispatch1<cybozu::lock::PQBucketLock>(opt);
+        break;
     default:
         throw cybozu::Exception("bad pqLockType") << opt.pqLockType;
     }
@@ -0,0 +1,526 @@
+#pragma once
+/**
+ * TPC-C subset workload: NewOrder, Payment and OrderStatus.
+ *
+ * Transactions access records through an accessor so that
+ * the same logic runs on any concurrency control protocol.
+ * Accessor must have the following member functions,
+ * which return false if the transaction must abort:
+ *   bool read(DataWithPayload<Mutex>& rec, void *dst);
+ *   bool readForUpdate(DataWithPayload<Mutex>& rec, void *dst);
+ *   bool write(DataWithPayload<Mutex>& rec, void *src);
+ *
+ * Simplifications from the specification:
+ *   - All the tables are VectorWithPayload and every row has ROW_SIZE bytes,
+ *     because lock sets copy values of a fixed size.
+ *   - Orders, new-orders and order-lines of a district are ring buffers
+ *     of NR_ORDER_SLOT_PER_DIST orders, so NewOrder writes existing records.
+ *   - A customer row keeps its last order id instead of a secondary index,
+ *     so NewOrder also updates the customer row.
+ *   - Customers are always selected by id.
+ *   - The item table is read-only, so it can be replicated per NUMA node.
+ *     History table, item-not-found rollback of NewOrder, Delivery and StockLevel are omitted.
+ *   - Numbers are stored as integers (money in cents, rates in 1/10000).
+ */
+#include <cinttypes>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include "cybozu/exception.hpp"
+#include "vector_payload.hpp"
+#include "cache_line_size.hpp"
+#include "inline.hpp"
+#include "util.hpp"
+#include "numa.hpp"
+
+
+namespace tpcc {
+
+
+const size_t NR_DIST_PER_WH = 10;
+const size_t NR_CUST_PER_DIST = 3000;
+const size_t NR_ITEM = 100000;
+const size_t NR_ORDER_SLOT_PER_DIST = 256;
+const size_t MIN_OL_CNT = 5;
+const size_t MAX_OL_CNT = 15;
+const size_t ROW_SIZE = 64;
+
+/*
+ * Transaction mix in percentage.
+ * OrderStatus takes the rest including the shares of Delivery and StockLevel.
+ */
+const size_t NEW_ORDER_PCT = 45;
+const size_t PAYMENT_PCT = 43;
+
+
+struct Warehouse
+{
+    uint64_t ytd;
+    uint32_t tax;
+};
+
+struct District
+{
+    uint64_t ytd;
+    uint32_t tax;
+    uint32_t next_o_id;
+};
+
+struct Customer
+{
+    int64_t balance;
+    uint64_t ytd_payment;
+    uint32_t payment_cnt;
+    uint32_t discount;
+    uint32_t last_o_id; // 0 means no order.
+};
+
+struct Item
+{
+    uint32_t price;
+};
+
+struct Stock
+{
+    uint64_t ytd;
+    uint32_t quantity;
+    uint32_t order_cnt;
+    uint32_t remote_cnt;
+};
+
+struct Order
+{
+    uint32_t o_id;
+    uint32_t c_id;
+    uint32_t ol_cnt;
+    uint32_t all_local;
+};
+
+struct NewOrder
+{
+    uint32_t o_id;
+};
+
+struct OrderLine
+{
+    uint64_t amount;
+    uint32_t o_id;
+    uint32_t i_id;
+    uint32_t supply_w_id;
+    uint32_t quantity;
+};
+
+
+/**
+ * Local buffer of a row.
+ */
+struct Row
+{
+    alignas(sizeof(uint64_t)) uint8_t data[ROW_SIZE];
+
+    template <typename T>
+    INLINE T& as() {
+        static_assert(sizeof(T) <= ROW_SIZE);
+        return *reinterpret_cast<T*>(&data[0]);
+    }
+    INLINE void clear() { ::memset(data, 0, ROW_SIZE); }
+};
+
+
+enum class TxType : uint8_t
+{
+    NEW_ORDER = 0, PAYMENT = 1, ORDER_STATUS = 2,
+};
+
+
+/**
+ * Transaction input. It is generated once and used for retries.
+ * All ids are 0-origin.
+ * Fields not used by a transaction type are left zero.
+ */
+struct Input
+{
+    TxType type{};
+    uint32_t w_id = 0;
+    uint32_t d_id = 0;
+    uint32_t c_w_id = 0;
+    uint32_t c_d_id = 0;
+    uint32_t c_id = 0;
+    uint32_t ol_cnt = 0;
+    uint32_t amount = 0; // for Payment.
+    struct {
+        uint32_t i_id;
+        uint32_t supply_w_id;
+        uint32_t quantity;
+    } items[MAX_OL_CNT] = {};
+};
+
+
+template <typename Mutex>
+class Db
+{
+public:
+    using Vec = VectorWithPayload<Mutex>;
+    using Rec = DataWithPayload<Mutex>;
+
+    Vec warehouse;
+    Vec district;
+    Vec customer;
+    Vec item;
+    Vec stock;
+    Vec order;
+    Vec newOrder;
+    Vec orderLine;
+
+private:
+    size_t nrWh_;
+    std::vector<std::unique_ptr<Vec> > itemReplica_;
+    std::vector<Vec*> itemOfWh_; // item table used by each warehouse.
+
+public:
+    Db() : nrWh_(0) {}
+
+    /**
+     * itemNodes: numa node of each warehouse to replicate the item table.
+     *            empty means no replication.
+     */
+    template <typename Random>
+    void init(size_t nrWh, Random& rand, const std::vector<uint>& itemNodes = {}) {
+        if (nrWh == 0) throw cybozu::Exception("tpcc::Db:nrWh must not be 0.");
+        nrWh_ = nrWh;
+        const size_t nrDist = nrWh * NR_DIST_PER_WH;
+        const size_t nrOrder = nrDist * NR_ORDER_SLOT_PER_DIST;
+        setSize(warehouse, nrWh);
+        setSize(district, nrDist);
+        setSize(customer, nrDist * NR_CUST_PER_DIST);
+        setSize(item, NR_ITEM);
+        setSize(stock, nrWh * NR_ITEM);
+        setSize(order, nrOrder);
+        setSize(newOrder, nrOrder);
+        setSize(orderLine, nrOrder * MAX_OL_CNT);
+
+        for (Rec& rec : warehouse) {
+            Warehouse& w = get<Warehouse>(rec);
+            w.ytd = 30000000;
+            w.tax = rand() % 2001;
+        }
+        for (Rec& rec : district) {
+            District& d = get<District>(rec);
+            d.ytd = 3000000;
+            d.tax = rand() % 2001;
+            d.next_o_id = 1;
+        }
+        for (Rec& rec : customer) {
+            Customer& c = get<Customer>(rec);
+            c.balance = -1000;
+            c.ytd_payment = 1000;
+            c.discount = rand() % 5001;
+        }
+        for (Rec& rec : item) {
+            get<Item>(rec).price = 100 + rand() % 9901;
+        }
+        for (Rec& rec : stock) {
+            get<Stock>(rec).quantity = 10 + rand() % 91;
+        }
+        // Order tables are zero-cleared, where o_id 0 means empty.
+
+        itemOfWh_.assign(nrWh, &item);
+        if (!itemNodes.empty()) replicateItems(itemNodes);
+    }
+    size_t nrWh() const { return nrWh_; }
+
+    INLINE Rec& getWarehouse(uint32_t w_id) { return warehouse[w_id]; }
+    INLINE Rec& getDistrict(uint32_t w_id, uint32_t d_id) {
+        return district[distIdx(w_id, d_id)];
+    }
+    INLINE Rec& getCustomer(uint32_t w_id, uint32_t d_id, uint32_t c_id) {
+        return customer[distIdx(w_id, d_id) * NR_CUST_PER_DIST + c_id];
+    }
+    INLINE Rec& getItem(uint32_t w_id, uint32_t i_id) { return (*itemOfWh_[w_id])[i_id]; }
+    INLINE Rec& getStock(uint32_t w_id, uint32_t i_id) {
+        return stock[w_id * NR_ITEM + i_id];
+    }
+    INLINE Rec& getOrder(uint32_t w_id, uint32_t d_id, uint32_t o_id) {
+        return order[orderIdx(w_id, d_id, o_id)];
+    }
+    INLINE Rec& getNewOrder(uint32_t w_id, uint32_t d_id, uint32_t o_id) {
+        return newOrder[orderIdx(w_id, d_id, o_id)];
+    }
+    INLINE Rec& getOrderLine(uint32_t w_id, uint32_t d_id, uint32_t o_id, uint32_t ol_number) {
+        return orderLine[orderIdx(w_id, d_id, o_id) * MAX_OL_CNT + ol_number];
+    }
+
+private:
+    void replicateItems(const std::vector<uint>& itemNodes) {
+        if (itemNodes.size() != nrWh_) {
+            throw cybozu::Exception("tpcc::Db:bad itemNodes size") << itemNodes.size() << nrWh_;
+        }
+        for (uint node : cybozu::numa::uniqueNodes(itemNodes)) {
+            Vec *v;
+            {
+                cybozu::numa::MemPolicyScope scope(node);
+                itemReplica_.emplace_back(new Vec());
+                v = itemReplica_.back().get();
+                setSize(*v, NR_ITEM);
+            }
+            for (size_t i = 0; i < NR_ITEM; i++) {
+                ::memcpy(&(*v)[i].payload[0], &item[i].payload[0], ROW_SIZE);
+            }
+            for (size_t w_id = 0; w_id < nrWh_; w_id++) {
+                if (itemNodes[w_id] == node) itemOfWh_[w_id] = v;
+            }
+        }
+    }
+    void setSize(Vec& vec, size_t nr) {
+#ifdef MUTEX_ON_CACHELINE
+        vec.setPayloadSize(ROW_SIZE, CACHE_LINE_SIZE);
+#else
+        vec.setPayloadSize(ROW_SIZE);
+#endif
+        vec.resize(nr);
+    }
+    template <typename T>
+    static T& get(Rec& rec) {
+        return *reinterpret_cast<T*>(&rec.payload[0]);
+    }
+    INLINE size_t distIdx(uint32_t w_id, uint32_t d_id) const {
+        return w_id * NR_DIST_PER_WH + d_id;
+    }
+    INLINE size_t orderIdx(uint32_t w_id, uint32_t d_id, uint32_t o_id) const {
+        return distIdx(w_id, d_id) * NR_ORDER_SLOT_PER_DIST + o_id % NR_ORDER_SLOT_PER_DIST;
+    }
+};
+
+
+/**
+ * Input generator of a worker.
+ * The home warehouse of the worker is given.
+ */
+template <typename Random>
+class InputGenerator
+{
+    Random& rand_;
+    uint32_t nrWh_;
+    uint32_t homeWh_;
+
+    // C constants of NURand.
+    static constexpr uint32_t C_CUST = 259;
+    static constexpr uint32_t C_ITEM = 7911;
+
+public:
+    InputGenerator(Random& rand, size_t nrWh, size_t homeWh)
+        : rand_(rand), nrWh_(nrWh), homeWh_(homeWh) {
+    }
+    INLINE void generate(Input& in) {
+        in = Input(); // the input of the previous transaction may be given.
+        const size_t pct = uniform(0, 99);
+        in.w_id = homeWh_;
+        in.d_id = uniform(0, NR_DIST_PER_WH - 1);
+        in.c_id = nurand(1023, 0, NR_CUST_PER_DIST - 1, C_CUST);
+        if (pct < NEW_ORDER_PCT) {
+            generateNewOrder(in);
+        } else if (pct < NEW_ORDER_PCT + PAYMENT_PCT) {
+            generatePayment(in);
+        } else {
+            in.type = TxType::ORDER_STATUS;
+        }
+    }
+
+private:
+    INLINE uint32_t uniform(uint32_t lo, uint32_t hi) {
+        return lo + rand_() % (hi - lo + 1);
+    }
+    INLINE uint32_t nurand(uint32_t a, uint32_t lo, uint32_t hi, uint32_t c) {
+        return (((uniform(0, a) | uniform(lo, hi)) + c) % (hi - lo + 1)) + lo;
+    }
+    INLINE uint32_t otherWh() {
+        if (nrWh_ == 1) return homeWh_;
+        const uint32_t w = uniform(0, nrWh_ - 2);
+        return w < homeWh_ ? w : w + 1;
+    }
+    INLINE void generateNewOrder(Input& in) {
+        in.type = TxType::NEW_ORDER;
+        in.ol_cnt = uniform(MIN_OL_CNT, MAX_OL_CNT);
+        for (size_t i = 0; i < in.ol_cnt; i++) {
+            // Items of an order are distinct.
+            uint32_t i_id;
+            bool found;
+            do {
+                i_id = nurand(8191, 0, NR_ITEM - 1, C_ITEM);
+                found = false;
+                for (size_t j = 0; j < i; j++) {
+                    if (in.items[j].i_id == i_id) {
+                        found = true;
+                        break;
+                    }
+                }
+            } while (found);
+            in.items[i].i_id = i_id;
+            in.items[i].supply_w_id = uniform(0, 99) == 0 ? otherWh() : homeWh_;
+            in.items[i].quantity = uniform(1, 10);
+        }
+    }
+    INLINE void generatePayment(Input& in) {
+        in.type = TxType::PAYMENT;
+        if (uniform(0, 99) < 85) {
+            in.c_w_id = homeWh_;
+            in.c_d_id = in.d_id;
+        } else {
+            in.c_w_id = otherWh();
+            in.c_d_id = uniform(0, NR_DIST_PER_WH - 1);
+        }
+        in.amount = uniform(100, 500000);
+    }
+};
+
+
+/*
+ * Values read by optimistic protocols may be inconsistent among records
+ * before verification, so values used as indexes are clamped.
+ */
+
+
+template <typename Mutex, typename Accessor>
+INLINE bool runNewOrder(Db<Mutex>& db, Accessor& acc, const Input& in)
+{
+    Row row;
+    if (unlikely(!acc.read(db.getWarehouse(in.w_id), row.data))) return false;
+    const uint32_t w_tax = row.as<Warehouse>().tax;
+
+    auto& distRec = db.getDistrict(in.w_id, in.d_id);
+    if (unlikely(!acc.readForUpdate(distRec, row.data))) return false;
+    District& dist = row.as<District>();
+    const uint32_t d_tax = dist.tax;
+    const uint32_t o_id = dist.next_o_id;
+    dist.next_o_id++;
+    if (unlikely(!acc.write(distRec, row.data))) return false;
+
+    auto& custRec = db.getCustomer(in.w_id, in.d_id, in.c_id);
+    if (unlikely(!acc.readForUpdate(custRec, row.data))) return false;
+    Customer& cust = row.as<Customer>();
+    const uint32_t discount = cust.discount;
+    cust.last_o_id = o_id;
+    if (unlikely(!acc.write(custRec, row.data))) return false;
+
+    bool allLocal = true;
+    for (size_t i = 0; i < in.ol_cnt; i++) {
+        if (in.items[i].supply_w_id != in.w_id) allLocal = false;
+    }
+    row.clear();
+    Order& order = row.as<Order>();
+    order.o_id = o_id;
+    order.c_id = in.c_id;
+    order.ol_cnt = in.ol_cnt;
+    order.all_local = allLocal;
+    if (unlikely(!acc.write(db.getOrder(in.w_id, in.d_id, o_id), row.data))) return false;
+    row.clear();
+    row.as<NewOrder>().o_id = o_id;
+    if (unlikely(!acc.write(db.getNewOrder(in.w_id, in.d_id, o_id), row.data))) return false;
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < in.ol_cnt; i++) {
+        const uint32_t i_id = in.items[i].i_id;
+        const uint32_t supply_w_id = in.items[i].supply_w_id;
+        const uint32_t quantity = in.items[i].quantity;
+
+        if (unlikely(!acc.read(db.getItem(in.w_id, i_id), row.data))) return false;
+        const uint32_t price = row.as<Item>().price;
+
+        auto& stockRec = db.getStock(supply_w_id, i_id);
+        if (unlikely(!acc.readForUpdate(stockRec, row.data))) return false;
+        Stock& stock = row.as<Stock>();
+        if (stock.quantity >= quantity + 10) {
+            stock.quantity -= quantity;
+        } else {
+            stock.quantity = stock.quantity + 91 - quantity;
+        }
+        stock.ytd += quantity;
+        stock.order_cnt++;
+        if (supply_w_id != in.w_id) stock.remote_cnt++;
+        if (unlikely(!acc.write(stockRec, row.data))) return false;
+
+        row.clear();
+        OrderLine& ol = row.as<OrderLine>();
+        ol.amount = uint64_t(quantity) * price;
+        ol.o_id = o_id;
+        ol.i_id = i_id;
+        ol.supply_w_id = supply_w_id;
+        ol.quantity = quantity;
+        total += ol.amount;
+        if (unlikely(!acc.write(db.getOrderLine(in.w_id, in.d_id, o_id, i), row.data))) return false;
+    }
+    // The total amount is only computed as the specification.
+    total = total * (10000 - discount) / 10000 * (10000 + w_tax + d_tax) / 10000;
+    unused(total);
+    return true;
+}
+
+
+template <typename Mutex, typename Accessor>
+INLINE bool runPayment(Db<Mutex>& db, Accessor& acc, const Input& in)
+{
+    Row row;
+    auto& whRec = db.getWarehouse(in.w_id);
+    if (unlikely(!acc.readForUpdate(whRec, row.data))) return false;
+    row.as<Warehouse>().ytd += in.amount;
+    if (unlikely(!acc.write(whRec, row.data))) return false;
+
+    auto& distRec = db.getDistrict(in.w_id, in.d_id);
+    if (unlikely(!acc.readForUpdate(distRec, row.data))) return false;
+    row.as<District>().ytd += in.amount;
+    if (unlikely(!acc.write(distRec, row.data))) return false;
+
+    auto& custRec = db.getCustomer(in.c_w_id, in.c_d_id, in.c_id);
+    if (unlikely(!acc.readForUpdate(custRec, row.data))) return false;
+    Customer& cust = row.as<Customer>();
+    cust.balance -= in.amount;
+    cust.ytd_payment += in.amount;
+    cust.payment_cnt++;
+    if (unlikely(!acc.write(custRec, row.data))) return false;
+    return true;
+}
+
+
+template <typename Mutex, typename Accessor>
+INLINE bool runOrderStatus(Db<Mutex>& db, Accessor& acc, const Input& in)
+{
+    Row row;
+    if (unlikely(!acc.read(db.getCustomer(in.w_id, in.d_id, in.c_id), row.data))) return false;
+    const uint32_t o_id = row.as<Customer>().last_o_id;
+    if (o_id == 0) return true;
+
+    if (unlikely(!acc.read(db.getOrder(in.w_id, in.d_id, o_id), row.data))) return false;
+    const Order& order = row.as<Order>();
+    // The slot may have been reused by a newer order.
+    if (order.o_id != o_id) return true;
+    const uint32_t ol_cnt = std::min<uint32_t>(order.ol_cnt, MAX_OL_CNT);
+    for (uint32_t i = 0; i < ol_cnt; i++) {
+        if (unlikely(!acc.read(db.getOrderLine(in.w_id, in.d_id, o_id, i), row.data))) return false;
+    }
+    return true;
+}
+
+
+/**
+ * Run the transaction logic.
+ * RETURN:
+ *   false if the transaction must abort.
+ *   You must commit or abort the transaction by the protocol after this.
+ */
+template <typename Mutex, typename Accessor>
+INLINE bool run(Db<Mutex>& db, Accessor& acc, const Input& in)
+{
+    switch (in.type) {
+    case TxType::NEW_ORDER:
+        return runNewOrder(db, acc, in);
+    case TxType::PAYMENT:
+        return runPayment(db, acc, in);
+    case TxType::ORDER_STATUS:
+        return runOrderStatus(db, acc, in);
+    default:
+        BUG();
+    }
+}
+
+
+} // namespace tpcc
@@ -0,0 +1,134 @@
+#pragma once
+/**
+ * Bank transfer test shared by the concurrency control tests.
+ *
+ * Writers move 1 from a record to another one and readers sum all the records.
+ * Committed readers must see the initial total, and so must the records at the end.
+ *
+ * Worker adapts a protocol to the test. It must have:
+ *   using Mutex: mutex type of the records.
+ *   Worker(Shared& shared, size_t idx): shared is the argument of testTransfer().
+ *   void beginTx(): called at the beginning of each transaction, not each trial.
+ *   void begin(bool readOnly): called at the beginning of each trial.
+ *   bool read(Mutex&, void *sharedVal, uint64_t& v)
+ *   bool readForUpdate(Mutex&, void *sharedVal, uint64_t& v)
+ *   bool write(Mutex&, void *sharedVal, uint64_t v)
+ *   bool commit()
+ *   void abort(): called after read, write or commit returned false.
+ *   bool empty() const: true after commit and abort.
+ */
+#include <thread>
+#include <vector>
+#include <cstring>
+#include "vector_payload.hpp"
+#include "random.hpp"
+#include "cybozu/test.hpp"
+
+
+struct TransferParam
+{
+    size_t nrRec = 10;
+    size_t nrHot = 0; // if non-zero, the source record is one of the first nrHot records.
+    size_t nrWriter = 3;
+    size_t nrReader = 1;
+    size_t nrTx = 1000; // per worker.
+    bool upgrade = false; // read the source record and upgrade it after locking the destination.
+    bool yield = false; // yield between reads to interleave the workers on few cpus.
+};
+
+
+constexpr uint64_t TRANSFER_INITIAL_VALUE = 1000;
+
+
+template <typename Mutex>
+void initTransferRecords(VectorWithPayload<Mutex>& recV, size_t nrRec)
+{
+    recV.setPayloadSize(sizeof(uint64_t));
+    recV.resize(nrRec);
+    for (size_t i = 0; i < nrRec; i++) {
+        ::memcpy(recV[i].payload, &TRANSFER_INITIAL_VALUE, sizeof(uint64_t));
+    }
+}
+
+
+/**
+ * Returns false if the trial must abort.
+ */
+template <typename Worker>
+bool runTransferTx(Worker& w, VectorWithPayload<typename Worker::Mutex>& recV,
+                   const TransferParam& param, bool isReader, cybozu::util::Xoroshiro128Plus& rand,
+                   size_t& nrBad)
+{
+    const size_t nrRec = param.nrRec;
+    w.begin(isReader);
+    if (isReader) {
+        uint64_t sum = 0;
+        for (size_t k = 0; k < nrRec; k++) {
+            uint64_t v;
+            if (!w.read(recV[k].value, recV[k].payload, v)) return false;
+            sum += v;
+            if (param.yield && k % 4 == 0) std::this_thread::yield();
+        }
+        if (!w.commit()) return false;
+        if (sum != TRANSFER_INITIAL_VALUE * nrRec) nrBad++;
+        return true;
+    }
+    const size_t k0 = rand() % (param.nrHot == 0 ? nrRec : param.nrHot);
+    const size_t k1 = (k0 + 1 + rand() % (nrRec - 1)) % nrRec;
+    auto& r0 = recV[k0];
+    auto& r1 = recV[k1];
+    uint64_t v0, v1;
+    if (param.upgrade) {
+        if (!w.read(r0.value, r0.payload, v0)) return false;
+        if (param.yield) std::this_thread::yield();
+        if (!w.readForUpdate(r1.value, r1.payload, v1)) return false;
+        if (!w.readForUpdate(r0.value, r0.payload, v0)) return false;
+    } else {
+        if (!w.readForUpdate(r0.value, r0.payload, v0)) return false;
+        if (param.yield) std::this_thread::yield();
+        if (!w.readForUpdate(r1.value, r1.payload, v1)) return false;
+    }
+    if (v0 > 0) {
+        v0--; v1++;
+    }
+    return w.write(r0.value, r0.payload, v0) && w.write(r1.value, r1.payload, v1) && w.commit();
+}
+
+
+/**
+ * The first param.nrWriter workers are writers and the others are readers.
+ * recV must be initialized by initTransferRecords().
+ */
+template <typename Worker, typename Shared>
+void testTransfer(VectorWithPayload<typename Worker::Mutex>& recV, Shared& shared, const TransferParam& param)
+{
+    const size_t nrTh = param.nrWriter + param.nrReader;
+    std::vector<size_t> nrBad(nrTh, 0);
+
+    std::vector<std::thread> th_v;
+    for (size_t i = 0; i < nrTh; i++) {
+        th_v.emplace_back([&,i]() {
+            Worker w(shared, i);
+            cybozu::util::Xoroshiro128Plus rand(i);
+            const bool isReader = i >= param.nrWriter;
+            for (size_t j = 0; j < param.nrTx; j++) {
+                w.beginTx();
+                while (!runTransferTx(w, recV, param, isReader, rand, nrBad[i])) {
+                    w.abort();
+                }
+                CYBOZU_TEST_ASSERT(w.empty());
+            }
+        });
+    }
+    for (std::thread& th : th_v) th.join();
+    for (size_t i = 0; i < nrTh; i++) {
+        CYBOZU_TEST_EQUAL(nrBad[i], 0);
+    }
+    uint64_t sum = 0;
+    for (size_t i = 0; i < param.nrRec; i++) {
+        uint64_t v;
+        ::memcpy(&v, recV[i].payload, sizeof(uint64_t));
+        sum += v;
+    }
+    CYBOZU_TEST_EQUAL(sum, TRANSFER_INITIAL_VALUE * param.nrRec);
+}
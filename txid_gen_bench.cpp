@@ -1,6 +1,7 @@
 #include <ctime>
 #include <vector>
 #include <chrono>
+#include <type_traits>
 #include "thread_util.hpp"
 #include "random.hpp"
 #include "tx_util.hpp"
@@ -57,7 +58,7 @@ void runExec(size_t nrTh, uint8_t allocBits, size_t nrTxIdGen, size_t runSec, bo
     start = true;
     for (size_t i = 0; i < runSec; i++) {
         if (verbose) {
-            ::printf("%zu %u\n", i, txIdGen[0].sniff());
+            ::printf("%zu %" PRIu64 "\n", i, uint64_t(txIdGen[0].sniff()));
         }
         sleep_ms(1000);
     }
@@ -76,6 +77,100 @@ void runExec(size_t nrTh, uint8_t allocBits, size_t nrTxIdGen, size_t runSec, bo
 }
 
 
+enum class LocalGenType : uint8_t
+{
+    TSC = 0,
+    COUNTING_NETWORK = 1,
+};
+
+
+const char* localGenTypeToStr(LocalGenType type)
+{
+    switch (type) {
+    case LocalGenType::TSC: return "tsc";
+    case LocalGenType::COUNTING_NETWORK: return "cn";
+    }
+    return "unknown";
+}
+
+
+/**
+ * Each worker has its own generator.
+ */
+template <typename LocalGen>
+size_t worker3(size_t idx, bool& start, bool& quit, LocalGen& gen)
+{
+    cybozu::thread::setThreadAffinity(::pthread_self(), CpuId_[idx]);
+    size_t c = 0;
+    size_t total = 0;
+    // Loads must be atomic because gen.get() may not have any memory barrier.
+    while (!load_acquire(start)) _mm_pause();
+    while (!load_acquire(quit)) {
+        total += gen.get();
+        c++;
+    }
+    unused(total);
+    return c;
+}
+
+
+template <typename LocalGen, typename MakeGen>
+void runExec3Detail(LocalGenType type, size_t nrTh, size_t runSec, bool verbose, MakeGen&& makeGen)
+{
+    bool start = false;
+    bool quit = false;
+
+    cybozu::thread::ThreadRunnerSet thS;
+    std::vector<size_t> cV(nrTh);
+    for (size_t i = 0; i < nrTh; i++) {
+        thS.add([&,i]() {
+                LocalGen gen = makeGen(i);
+                cV[i] = worker3(i, start, quit, gen);
+            });
+    }
+    thS.start();
+    start = true;
+    for (size_t i = 0; i < runSec; i++) {
+        if (verbose) {
+            ::printf("%zu\n", i);
+        }
+        sleep_ms(1000);
+    }
+    quit = true;
+    thS.join();
+    size_t total = 0;
+    for (size_t i = 0; i < nrTh; i++) {
+        if (verbose) {
+            ::printf("worker %zu count %zu\n", i, cV[i]);
+        }
+        total += cV[i];
+    }
+    ::printf("txidgen %s  concurrency %zu  total %zu  throughput %.03f tps\n"
+             , localGenTypeToStr(type), nrTh, total, total / (double)runSec);
+    ::fflush(::stdout);
+}
+
+
+void runExec3(LocalGenType type, size_t nrTh, size_t runSec, bool verbose)
+{
+    switch (type) {
+    case LocalGenType::TSC: {
+        // The layout is chosen by the size of TxId.
+        using Gen = std::conditional_t<sizeof(TxId) == sizeof(uint64_t), TscTxIdGenerator<>, TscTxIdGenerator32<> >;
+        const uint64_t base = cybozu::time::rdtscp();
+        runExec3Detail<Gen>(type, nrTh, runSec, verbose, [&](size_t idx) { return Gen(idx, base); });
+        break;
+    }
+    case LocalGenType::COUNTING_NETWORK: {
+        using Gen = CountingNetworkTxIdGenerator<>;
+        cybozu::util::CountingNetwork8 cn;
+        runExec3Detail<Gen>(type, nrTh, runSec, verbose, [&](size_t idx) { return Gen(cn, idx); });
+        break;
+    }
+    }
+}
+
+
 size_t worker2(size_t idx, bool& start, bool& quit)
 {
     unused(idx);
@@ -127,12 +222,23 @@ void runExec2(size_t nrTh, size_t runSec, bool verbose)
 }
 
 
-int main()
+int main() try
 {
+    // The skew check is required once before using TscTxIdGenerator.
+    // The other generators are measured even if the counters are not usable.
+    bool usesTsc = true;
+    try {
+        ::printf("tsc skew %" PRIu64 " clocks\n", TscTxIdGenerator<>::checkTsc(CpuId_));
+    } catch (std::exception& e) {
+        ::printf("tsc runs are skipped: %s\n", e.what());
+        usesTsc = false;
+    }
 #if 1
     for (size_t nrTh = 1; nrTh <= 32; nrTh++) {
         for (size_t i = 0; i < 10; i++) {
             runExec(nrTh, 0, 1, 10, false);
+            if (usesTsc) runExec3(LocalGenType::TSC, nrTh, 10, false);
+            runExec3(LocalGenType::COUNTING_NETWORK, nrTh, 10, false);
         }
     }
 #endif
@@ -170,4 +276,8 @@ int main()
 #if 0
     runExec2(12, 10, true);
 #endif
+} catch (std::exception& e) {
+    ::fprintf(::stderr, "exeption: %s\n", e.what());
+} catch (...) {
+    ::fprintf(::stderr, "unknown error\n");
 }
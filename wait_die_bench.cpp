@@ -1,3 +1,4 @@
+#include <memory>
 #include "thread_util.hpp"
 #include "random.hpp"
 #include <unistd.h>
@@ -7,6 +8,8 @@
 #include "vector_payload.hpp"
 #include "zipf.hpp"
 #include "workload_util.hpp"
+#include "tpcc_util.hpp"
+#include "wal.hpp"
 
 #include "wait_die.hpp"
 #include "tx_util.hpp"
@@ -40,6 +43,13 @@ struct Shared
 #else
     VectorWithPayload<Mutex> recV;
 #endif
+    typename LockTypes<Lock>::LockSet::Table table; // used by insert workload.
+    std::unique_ptr<cybozu::ebr::EpochReclaimer> reclaimer;
+    size_t insertWindow;
+    tpcc::Db<Mutex> tpcc; // used by tpcc workload.
+    cybozu::wal::Logger logger; // used if -log is specified.
+    size_t nrMu;
+    size_t nrTh;
     size_t longTxSize;
     size_t nrOp;
     double wrRatio;
@@ -58,11 +68,33 @@ struct Shared
     GlobalTxIdGenerator globalTxIdGen;
     SimpleTxIdGenerator simpleTxIdGen;
 
-    Shared() : globalTxIdGen(5, 10) {}
+    size_t nrHot; // number of hot records whose locks retire early. 0 means disabled.
+    cybozu::bamboo::RetireTable retireTable;
+
+    Shared() : globalTxIdGen(5, 10), nrHot(0) {}
     //Shared() : globalTxIdGen(7, 5) {}
 };
 
 
+template <int txIdGenType, typename Lock>
+INLINE uint64_t getTxId(
+    PriorityIdGenerator<12>& priIdGen, TxIdGenerator& localTxIdGen,
+    EpochTxIdGenerator<9, 2>& epochTxIdGen, Shared<Lock>& shared, bool isLongTx)
+{
+    if (txIdGenType == SCALABLE_TXID_GEN) {
+        return priIdGen.get(isLongTx ? 0 : 1);
+    } else if (txIdGenType == BULK_TXID_GEN) {
+        return localTxIdGen.get();
+    } else if (txIdGenType == SIMPLE_TXID_GEN) {
+        return shared.simpleTxIdGen.get();
+    } else if (txIdGenType == EPOCH_TXID_GEN) {
+        return epochTxIdGen.get();
+    } else {
+        throw cybozu::Exception("bad txIdGenType") << txIdGenType;
+    }
+}
+
+
 template <int txIdGenType, typename Lock>
 Result1 worker2(
     size_t idx, uint8_t& ready, const bool& start, const bool& quit, bool& shouldQuit,
@@ -105,33 +137,30 @@ Result1 worker2(
     auto getRecordIdx = selectGetRecordIdx<decltype(rand)>(isLongTx, shortTxMode, longTxMode, shared.usesZipf);
 
     lockSet.init(shared.payload, realNrOp);
+    if (shared.nrHot != 0) {
+        shared.retireTable.initOnce(recV, shared.nrHot, shared.payload);
+        lockSet.setRetireTable(shared.retireTable);
+    }
+    cybozu::wal::LogBuffer *logBuf = shared.logger.enabled() ? &shared.logger.buffer(idx) : nullptr;
 
     store_release(ready, 1);
     while (!load_acquire(start)) _mm_pause();
     size_t count = 0; unused(count);
     while (likely(!load_acquire(quit))) {
-        uint64_t txId;
-        if (txIdGenType == SCALABLE_TXID_GEN) {
-            txId = priIdGen.get(isLongTx ? 0 : 1);
-        } else if (txIdGenType == BULK_TXID_GEN) {
-            txId = localTxIdGen.get();
-        } else if (txIdGenType == SIMPLE_TXID_GEN) {
-            txId = shared.simpleTxIdGen.get();
-        } else if (txIdGenType == EPOCH_TXID_GEN) {
-            txId = epochTxIdGen.get();
-        } else {
-            throw cybozu::Exception("bad txIdGenType") << txIdGenType;
-        }
+        const uint64_t txId = getTxId<txIdGenType>(
+            priIdGen, localTxIdGen, epochTxIdGen, shared, isLongTx);
         lockSet.setTxId(txId);
         size_t firstRecIdx;
-        uint64_t t0 = -1, t1 = -1, t2 = -1; // -1 for debug.
+        uint64_t t0 = -1, t1 = -1; // -1 for debug.
+        res.beginTx();
         log_timestamp_if_necessary_on_tx_start(t0, shared.usesBackOff);
         auto randState = rand.getState();
         for (size_t retry = 0;; retry++) {
             if (unlikely(load_acquire(quit))) break; // to quit under starvation.
             assert(lockSet.empty());
             rand.setState(randState);
-            log_timestamp_if_necessary_on_trial_start(t0, t1, t2, retry, shared.usesBackOff);
+            log_timestamp_if_necessary_on_trial_start(t0, t1, retry, shared.usesBackOff);
+            uint64_t logEpoch = 0;
             for (size_t i = 0; i < realNrOp; i++) {
                 size_t key = getRecordIdx(rand, fastZipf, recV.size(), realNrOp, i, firstRecIdx);
                 Mode mode = getMode(rand, realNrOp, realNrWr, wrRatio, i);
@@ -148,18 +177,20 @@ Result1 worker2(
                     } else {
                         if (unlikely(!lockSet.write(mutex, item.payload, &value[0]))) goto abort;
                     }
+                    if (logBuf) logBuf->stage(key, &value[0], shared.payload);
                 }
             }
             if (unlikely(!lockSet.blindWriteLockAll())) goto abort;
+            if (logBuf) logEpoch = logBuf->enterCommit();
             lockSet.updateAndUnlock();
-            log_timestamp_if_necessary_on_commit(res, t0, t1, t2);
+            if (logBuf) logBuf->commit(logEpoch);
             res.incCommit(isLongTx);
             res.addRetryCount(isLongTx, retry);
             break; // retry is not required.
 
           abort:
             lockSet.unlock();
-            log_timestamp_if_necessary_on_abort(res, t1, t2);
+            if (logBuf) logBuf->discard();
             res.incAbort(isLongTx);
             if (shared.usesBackOff) backOff(t1, retry, rand);
             // continue
@@ -169,6 +200,184 @@ Result1 worker2(
 }
 
 
+/**
+ * Insert workload.
+ * Each transaction accesses preloaded records through the index,
+ * inserts a new record, and removes an old record inserted by itself.
+ */
+template <int txIdGenType, typename Lock>
+Result1 worker4(
+    size_t idx, uint8_t& ready, const bool& start, const bool& quit, bool& shouldQuit,
+    Shared<Lock>& shared)
+{
+    using LockSet = typename LockTypes<Lock>::LockSet;
+    using Mutex = typename LockTypes<Lock>::Mutex;
+    using Mode = typename LockTypes<Lock>::Mode;
+
+    unused(shouldQuit);
+    cybozu::thread::setThreadAffinity(::pthread_self(), CpuId_[idx]);
+
+    auto& table = shared.table;
+    const size_t nrMu = shared.nrMu;
+    const size_t nrOp = shared.nrOp;
+    const size_t wrRatio = size_t(shared.wrRatio * (double)SIZE_MAX);
+    const TxMode shortTxMode = shared.shortTxMode;
+
+    Result1 res;
+    cybozu::util::Xoroshiro128Plus rand(::time(0), idx);
+    FastZipf fastZipf(rand, shared.zipfTheta, nrMu, shared.zipfZetan);
+
+    LockSet lockSet;
+    std::vector<uint8_t> value(shared.payload);
+    cybozu::ebr::EpochReclaimer::Local reclaimer(*shared.reclaimer, idx);
+    InsertKeyGen keyGen(nrMu, shared.nrTh, idx, shared.insertWindow);
+
+    PriorityIdGenerator<12> priIdGen;
+    priIdGen.init(idx + 1);
+    TxIdGenerator localTxIdGen(&shared.globalTxIdGen);
+    EpochTxIdGenerator<9, 2> epochTxIdGen(idx + 1, epochGen_);
+    const size_t realNrWr = size_t(shared.wrRatio * (double)nrOp);
+    auto getMode = selectGetModeFunc<decltype(rand), Mode>(false, shortTxMode, shortTxMode);
+    auto getRecordIdx = selectGetRecordIdx<decltype(rand)>(false, shortTxMode, shortTxMode, shared.usesZipf);
+
+    lockSet.init(shared.payload, nrOp + 2);
+    lockSet.setReclaimer(reclaimer);
+
+    store_release(ready, 1);
+    while (!load_acquire(start)) _mm_pause();
+    while (likely(!load_acquire(quit))) {
+        const uint64_t txId = getTxId<txIdGenType>(
+            priIdGen, localTxIdGen, epochTxIdGen, shared, false);
+        lockSet.setTxId(txId);
+        size_t firstRecIdx;
+        uint64_t t0 = -1, t1 = -1; // -1 for debug.
+        res.beginTx();
+        log_timestamp_if_necessary_on_tx_start(t0, shared.usesBackOff);
+        auto randState = rand.getState();
+        for (size_t retry = 0;; retry++) {
+            if (unlikely(load_acquire(quit))) break; // to quit under starvation.
+            cybozu::ebr::EpochReclaimer::Guard guard(reclaimer);
+            assert(lockSet.empty());
+            rand.setState(randState);
+            log_timestamp_if_necessary_on_trial_start(t0, t1, retry, shared.usesBackOff);
+            for (size_t i = 0; i < nrOp; i++) {
+                size_t key = getRecordIdx(rand, fastZipf, nrMu, nrOp, i, firstRecIdx);
+                Mode mode = getMode(rand, nrOp, realNrWr, wrRatio, i);
+
+                auto& item = *table.index().lookup(key);
+                Mutex& mutex = item.value;
+                if (mode == Mode::S) {
+                    if (unlikely(!lockSet.read(mutex, item.payload, &value[0]))) goto abort;
+                } else {
+                    assert(mode == Mode::X);
+                    if (shared.usesRMW) {
+                        if (unlikely(!lockSet.readForUpdate(mutex, item.payload, &value[0]))) goto abort;
+                    }
+                    if (unlikely(!lockSet.write(mutex, item.payload, &value[0]))) goto abort;
+                }
+            }
+            if (unlikely(!lockSet.insert(table, keyGen.newKey(), &value[0]))) goto abort;
+            if (keyGen.shouldRemove()) {
+                if (unlikely(!lockSet.remove(table, keyGen.oldKey()))) goto abort;
+            }
+            if (unlikely(!lockSet.blindWriteLockAll())) goto abort;
+            lockSet.updateAndUnlock();
+            keyGen.commit();
+            res.incCommit(false);
+            res.addRetryCount(false, retry);
+            break; // retry is not required.
+
+          abort:
+            lockSet.unlock();
+            res.incAbort(false);
+            if (shared.usesBackOff) backOff(t1, retry, rand);
+            // continue
+        }
+    }
+    return res;
+}
+
+
+template <typename LockSet>
+struct TpccAccessor
+{
+    using Mutex = typename LockSet::Mutex;
+
+    LockSet& lockSet;
+
+    INLINE bool read(DataWithPayload<Mutex>& rec, void *dst) {
+        return lockSet.read(rec.value, rec.payload, dst);
+    }
+    INLINE bool readForUpdate(DataWithPayload<Mutex>& rec, void *dst) {
+        return lockSet.readForUpdate(rec.value, rec.payload, dst);
+    }
+    INLINE bool write(DataWithPayload<Mutex>& rec, void *src) {
+        return lockSet.write(rec.value, rec.payload, src);
+    }
+};
+
+
+/**
+ * TPC-C subset workload.
+ * The home warehouse of each worker is determined by its index.
+ */
+template <int txIdGenType, typename Lock>
+Result1 worker5(
+    size_t idx, uint8_t& ready, const bool& start, const bool& quit, bool& shouldQuit,
+    Shared<Lock>& shared)
+{
+    using LockSet = typename LockTypes<Lock>::LockSet;
+
+    unused(shouldQuit);
+    cybozu::thread::setThreadAffinity(::pthread_self(), CpuId_[idx]);
+
+    auto& db = shared.tpcc;
+    Result1 res;
+    cybozu::util::Xoroshiro128Plus rand(::time(0), idx);
+    tpcc::InputGenerator<decltype(rand)> inputGen(rand, db.nrWh(), idx % db.nrWh());
+    tpcc::Input input;
+
+    LockSet lockSet;
+    lockSet.init(tpcc::ROW_SIZE, tpcc::MAX_OL_CNT * 3 + 5);
+    TpccAccessor<LockSet> acc{lockSet};
+
+    PriorityIdGenerator<12> priIdGen;
+    priIdGen.init(idx + 1);
+    TxIdGenerator localTxIdGen(&shared.globalTxIdGen);
+    EpochTxIdGenerator<9, 2> epochTxIdGen(idx + 1, epochGen_);
+
+    store_release(ready, 1);
+    while (!load_acquire(start)) _mm_pause();
+    while (likely(!load_acquire(quit))) {
+        const uint64_t txId = getTxId<txIdGenType>(
+            priIdGen, localTxIdGen, epochTxIdGen, shared, false);
+        lockSet.setTxId(txId);
+        inputGen.generate(input);
+        uint64_t t0 = -1, t1 = -1; // -1 for debug.
+        res.beginTx();
+        log_timestamp_if_necessary_on_tx_start(t0, shared.usesBackOff);
+        for (size_t retry = 0;; retry++) {
+            if (unlikely(load_acquire(quit))) break; // to quit under starvation.
+            assert(lockSet.empty());
+            log_timestamp_if_necessary_on_trial_start(t0, t1, retry, shared.usesBackOff);
+            if (unlikely(!tpcc::run(db, acc, input))) goto abort;
+            if (unlikely(!lockSet.blindWriteLockAll())) goto abort;
+            lockSet.updateAndUnlock();
+            res.incCommit(false);
+            res.addRetryCount(false, retry);
+            break; // retry is not required.
+
+          abort:
+            lockSet.unlock();
+            res.incAbort(false);
+            if (shared.usesBackOff) backOff(t1, retry, rand);
+            // continue
+        }
+    }
+    return res;
+}
+
+
 /**
  * Long transactions with several transaction sizes.
  */
@@ -243,6 +452,7 @@ Result2 worker3(
         const uint64_t txId = epochTxIdGen.get();
 #endif
         lockSet.setTxId(txId);
+        res.beginTx();
         uint64_t t0;
         if (shared.usesBackOff) t0 = cybozu::time::rdtscp();
         auto randState = rand.getState();
@@ -288,6 +498,16 @@ Result2 worker3(
 }
 
 
+enum LockType
+{
+    // (0:cas-only, 1:naive, 2:fair, 3:wound-wait)
+    USE_CAS_ONLY = 0,
+    USE_NAIVE = 1,
+    USE_FAIR = 2,
+    USE_WOUND_WAIT = 3,
+};
+
+
 struct CmdLineOptionPlus : CmdLineOption
 {
     using base = CmdLineOption;
@@ -297,32 +517,34 @@ struct CmdLineOptionPlus : CmdLineOption
     size_t writePct;
     int usesRMW; // 0 or 1.
     int lockType;
+    size_t insertWindow;
+    std::string logPath;
+    int odirect; // 0 or 1.
+    size_t nrHot;
 
     CmdLineOptionPlus(const std::string& description) : CmdLineOption(description) {
         appendOpt(&txIdGenType, 3, "txid-gen", "[id]: txid gen method (0:sclable, 1:bulk, 2:simple, 3:epoch(default))");
         appendOpt(&usesBackOff, 0, "backoff", "[0 or 1]: backoff 0:off(default) 1:on");
         appendOpt(&usesRMW, 1, "rmw", "[0 or 1]: use read-modify-write or normal write 0:w 1:rmw (default: 1)");
         appendOpt(&writePct, 50, "writepct", "[pct]: write percentage (0 to 100) for custom3 workload.");
-        appendOpt(&lockType, 2, "lock", "[id]: locking protocol type (0:cas-only, 1:naive, 2:fair(default)).");
+        appendOpt(&lockType, 2, "lock", "[id]: locking protocol type (0:cas-only, 1:naive, 2:fair(default), 3:wound-wait).");
+        appendOpt(&insertWindow, 1000, "iwin", "[num]: number of live inserted records per worker for insert workload (default:1000).");
+        appendOpt(&logPath, "", "log", "[path]: redo log file for custom workload. empty means no logging (default).");
+        appendOpt(&odirect, 0, "odirect", "[0 or 1]: write the redo log with O_DIRECT (default:0).");
+        appendOpt(&nrHot, 0, "retire", "[num]: number of hot records from the first one whose locks retire early for custom workload. 0 means disabled (default:0). This requires -lock 3.");
     }
     std::string str() const {
         return cybozu::util::formatString(
-            "mode:wait-die %s txidGenType:%d backoff:%d writePct:%zu rmw:%d lock:%d"
+            "mode:%s %s txidGenType:%d backoff:%d writePct:%zu rmw:%d lock:%d insertWindow:%zu log:%d odirect:%d retire:%zu"
+            , lockType == USE_WOUND_WAIT ? "wound-wait" : "wait-die"
             , base::str().c_str(), txIdGenType, usesBackOff ? 1 : 0
-            , writePct, usesRMW ? 1 : 0, lockType);
+            , writePct, usesRMW ? 1 : 0, lockType
+            , workload == "insert" ? insertWindow : 0
+            , logPath.empty() ? 0 : 1, odirect ? 1 : 0, nrHot);
     }
 };
 
 
-enum LockType
-{
-    // (0:cas-only, 1:naive, 2:fair)
-    USE_CAS_ONLY = 0,
-    USE_NAIVE = 1,
-    USE_FAIR = 2,
-};
-
-
 template <int TxIdGenType, typename Lock>
 void dispatch3(CmdLineOptionPlus& opt)
 {
@@ -338,6 +560,9 @@ void dispatch3(CmdLineOptionPlus& opt)
     shared.nrTh4LongTx = opt.nrTh4LongTx;
     shared.usesRMW = opt.usesRMW != 0;
     shared.payload = opt.payload;
+    shared.nrMu = opt.getNrMu();
+    shared.nrTh = opt.nrTh;
+    shared.nrHot = opt.nrHot;
     shared.usesZipf = opt.usesZipf;
     shared.zipfTheta = opt.zipfTheta;
     if (shared.usesZipf) {
@@ -347,7 +572,25 @@ void dispatch3(CmdLineOptionPlus& opt)
     }
 
     Result1 res;
-    runExec(opt, shared, worker2<TxIdGenType, Lock>, res);
+    if (opt.workload == "insert") {
+        cybozu::record::initRecordTable(shared.table, opt);
+        shared.reclaimer.reset(new cybozu::ebr::EpochReclaimer(opt.nrTh));
+        shared.insertWindow = opt.insertWindow;
+        runExec(opt, shared, worker4<TxIdGenType, Lock>, res);
+    } else if (opt.workload == "tpcc") {
+#ifdef NO_PAYLOAD
+        throw cybozu::Exception("tpcc workload requires payload.");
+#endif
+        cybozu::util::Xoroshiro128Plus rand(::time(0));
+        shared.tpcc.init(opt.nrTh, rand, getReplicaNumaNodes(opt)); // a warehouse per worker.
+        runExec(opt, shared, worker5<TxIdGenType, Lock>, res);
+    } else {
+        if (!opt.logPath.empty()) {
+            shared.logger.open(opt.logPath, opt.nrTh, opt.odirect != 0);
+        }
+        runExec(opt, shared, worker2<TxIdGenType, Lock>, res);
+        cybozu::wal::putLogStat(shared.logger);
+    }
     epochGen_.reset();
 }
 
@@ -365,6 +608,9 @@ void dispatch2(CmdLineOptionPlus& opt)
     case USE_FAIR:
         dispatch3<TxIdGenType, cybozu::wait_die::WaitDieLock4>(opt);
         break;
+    case USE_WOUND_WAIT:
+        dispatch3<TxIdGenType, cybozu::wait_die::WoundWaitLock4>(opt);
+        break;
     default:
         throw cybozu::Exception("bad lockType") << opt.lockType;
     }
@@ -402,7 +648,20 @@ int main(int argc, char *argv[]) try
     if (opt.payload != 0) throw cybozu::Exception("payload not supported");
 #endif
 
-    if (opt.workload == "custom") {
+    if (!opt.logPath.empty() && opt.workload != "custom") {
+        throw cybozu::Exception("log is not supported by the workload.") << opt.workload;
+    }
+    if (opt.nrHot != 0) {
+        if (opt.workload != "custom") {
+            throw cybozu::Exception("retire is not supported by the workload.") << opt.workload;
+        }
+        if (opt.lockType != USE_WOUND_WAIT) {
+            // Waiting for the earlier transactions in retire chains may deadlock with wait-die.
+            throw cybozu::Exception("retire requires wound-wait (-lock 3).") << opt.lockType;
+        }
+    }
+
+    if (opt.workload == "custom" || opt.workload == "insert" || opt.workload == "tpcc") {
         for (size_t i = 0; i < opt.nrLoop; i++) {
             dispatch1(opt);
         }
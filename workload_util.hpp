@@ -347,3 +347,38 @@ INLINE void fillAccessInfoVec(
         ai.is_write = (getMode(rand, nrOp, nrWr, wrRatio, i) == Mode::X);
     }
 }
+
+
+/**
+ * Keys of insert workload (like order entry).
+ * Each worker inserts new keys above the preloaded range [0, base).
+ * Keys of workers are interleaved so that they are inserted into the same leaves.
+ * After the worker has more than window live keys,
+ * each transaction also removes the oldest one to keep the table size.
+ */
+class InsertKeyGen
+{
+    uint64_t base_;
+    uint64_t nrTh_;
+    uint64_t idx_;
+    uint64_t head_; // next sequence number to insert.
+    uint64_t tail_; // oldest live sequence number.
+    uint64_t window_;
+
+public:
+    InsertKeyGen(uint64_t base, size_t nrTh, size_t idx, size_t window)
+        : base_(base), nrTh_(nrTh), idx_(idx), head_(0), tail_(0), window_(window) {
+    }
+    INLINE uint64_t newKey() const { return toKey(head_); }
+    INLINE bool shouldRemove() const { return head_ - tail_ >= window_; }
+    INLINE uint64_t oldKey() const { return toKey(tail_); }
+    /**
+     * Call this after the transaction committed.
+     */
+    INLINE void commit() {
+        if (shouldRemove()) tail_++;
+        head_++;
+    }
+private:
+    INLINE uint64_t toKey(uint64_t seq) const { return base_ + seq * nrTh_ + idx_; }
+};